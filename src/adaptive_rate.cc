@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cmath>
+#include "adaptive_rate.h"
+
+using namespace std;
+
+adaptive_rate::adaptive_rate (const adaptive_rate_config &config, uint32_t base_period_ms)
+	: config(config), base_period_ms(base_period_ms), period_ms(base_period_ms)
+{
+	this->config.min_period_ms = max<uint32_t> (min (config.min_period_ms, base_period_ms), 1);
+}
+
+bool adaptive_rate::is_active() const
+{
+	return config.enabled;
+}
+
+void adaptive_rate::reset (double now)
+{
+	period_ms = base_period_ms;
+	unstable = overloaded = last_unstable = last_overloaded = 0;
+	last_update = now;
+	last_incident = now - config.hold_ms / 1000.;
+	tokens = config.budget * config.budget_window_s;
+}
+
+void adaptive_rate::add_feedback (uint8_t flags)
+{
+	if (flags & FEEDBACK_FLAG_UNSTABLE)
+		unstable++;
+
+	if (flags & FEEDBACK_FLAG_OVERLOADED)
+		overloaded++;
+}
+
+uint32_t adaptive_rate::update (double now)
+{
+	double dt = now - last_update;
+	last_update = now;
+
+	/* The bucket fills at the budget's rate and drains at the current one */
+	if (config.budget > 0)
+	{
+		tokens += dt * (config.budget - 1000. / period_ms);
+		tokens = min (tokens, config.budget * config.budget_window_s);
+	}
+
+	/* Back off from overloaded slaves first. Otherwise rise fast on
+	 * instability and return slowly, once all slaves were stable for the
+	 * hold time. */
+	uint32_t p = period_ms;
+
+	if (overloaded)
+	{
+		p = min (p * 2, base_period_ms);
+	}
+	else if (unstable)
+	{
+		p = max (p / 4, config.min_period_ms);
+		last_incident = now;
+	}
+	else if (now - last_incident >= config.hold_ms / 1000.)
+	{
+		p = min (p * 2, base_period_ms);
+	}
+
+	/* With the bucket empty, at most the budget's rate */
+	if (config.budget > 0 && tokens <= 0)
+		p = max (p, min ((uint32_t) ceil (1000. / config.budget), base_period_ms));
+
+	period_ms = p;
+
+	last_unstable = unstable;
+	last_overloaded = overloaded;
+	unstable = overloaded = 0;
+
+	return period_ms;
+}
+
+uint32_t adaptive_rate::get_period_ms() const
+{
+	return period_ms;
+}
+
+uint32_t adaptive_rate::get_unstable() const
+{
+	return last_unstable;
+}
+
+uint32_t adaptive_rate::get_overloaded() const
+{
+	return last_overloaded;
+}
+
+double adaptive_rate::get_budget_left() const
+{
+	if (config.budget <= 0)
+		return 1;
+
+	return max (tokens, 0.) / (config.budget * config.budget_window_s);
+}
@@ -0,0 +1,92 @@
+#ifndef __ADAPTIVE_RATE_H
+#define __ADAPTIVE_RATE_H
+
+/** Adaptation of the master's pulse rate to the slaves' condition. Slaves
+ * which see their jitter or frequency error rise, or which lose pulses, tell
+ * the master with a feedback message. The master shortens its pulse period
+ * quickly while slaves are unstable, and returns to the configured period
+ * once they were stable for a while; overloaded slaves make it back off right
+ * away. A token bucket bounds the average rate. */
+
+#include <cstdint>
+#include "protocol.h"
+
+struct adaptive_rate_config
+{
+	bool enabled = false;
+
+	/* Shortest pulse period in ms, i.e. the highest rate */
+	uint32_t min_period_ms = 10;
+
+	/* Pulses per second the master may send on average over
+	 * `budget_window_s`, 0 for no limit */
+	double budget = 0;
+	double budget_window_s = 600;
+
+	/* Slaves assess their condition and the master adapts its rate at this
+	 * interval */
+	uint32_t interval_ms = 1000;
+
+	/* Slaves are unstable if the jitter of the last 10 detrended samples
+	 * exceeds that of the last 100 by this factor, or if the frequency error
+	 * changed by more than `drift_threshold_ppb` within an interval (0 to
+	 * ignore the frequency, whose estimate is noisy at high jitter) */
+	double jitter_threshold = 3;
+	double drift_threshold_ppb = 0;
+
+	/* Slaves are overloaded if they lose more than this fraction of the
+	 * pulses */
+	double max_loss = 0.01;
+
+	/* Time without unstable slaves after which the master backs off */
+	uint32_t hold_ms = 60000;
+};
+
+class adaptive_rate
+{
+protected:
+	adaptive_rate_config config;
+	uint32_t base_period_ms;
+	uint32_t period_ms;
+
+	/* Feedback of the current interval, and counts of the last one */
+	uint32_t unstable = 0;
+	uint32_t overloaded = 0;
+	uint32_t last_unstable = 0;
+	uint32_t last_overloaded = 0;
+
+	double last_update = 0;
+	double last_incident = 0;
+
+	/* Pulses the master may send above the budget */
+	double tokens = 0;
+
+public:
+	adaptive_rate (const adaptive_rate_config &config, uint32_t base_period_ms);
+
+	bool is_active() const;
+
+	/** Start over at the configured period, e.g. on becoming master.
+	 * @param now Monotonic time in seconds */
+	void reset (double now);
+
+	/** Account a slave's feedback message of the current interval */
+	void add_feedback (uint8_t flags);
+
+	/** Adapt the period to the feedback since the last call; to be called
+	 * every `interval_ms`.
+	 * @returns The pulse period in ms */
+	uint32_t update (double now);
+
+	uint32_t get_period_ms() const;
+
+	/** @returns The number of unstable resp. overloaded slaves of the last
+	 * interval */
+	uint32_t get_unstable() const;
+	uint32_t get_overloaded() const;
+
+	/** @returns The fraction of the budget's bucket left, 1 without budget */
+	double get_budget_left() const;
+};
+
+#endif /* __ADAPTIVE_RATE_H */
@@ -0,0 +1,34 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "alloc_audit.h"
+
+using namespace std;
+
+static atomic<uint64_t> allocation_count;
+
+uint64_t get_allocation_count()
+{
+	return allocation_count.load (memory_order_relaxed);
+}
+
+/* The array and nothrow forms of libstdc++ call these. */
+void *operator new (size_t size)
+{
+	allocation_count.fetch_add (1, memory_order_relaxed);
+
+	if (void *p = malloc (size ? size : 1))
+		return p;
+
+	throw bad_alloc();
+}
+
+void operator delete (void *p) noexcept
+{
+	free (p);
+}
+
+void operator delete (void *p, size_t size) noexcept
+{
+	free (p);
+}
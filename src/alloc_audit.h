@@ -0,0 +1,14 @@
+#ifndef __ALLOC_AUDIT_H
+#define __ALLOC_AUDIT_H
+
+/** Counting of heap allocations, to verify that the steady state of the
+ * measurement does not allocate. The global operator new is replaced to count
+ * them; C library allocations (e.g. by stdio) are not counted. */
+
+#include <cstdint>
+
+/** @returns The number of allocations through operator new since the program
+ * started */
+uint64_t get_allocation_count();
+
+#endif /* __ALLOC_AUDIT_H */
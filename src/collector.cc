@@ -0,0 +1,160 @@
+#include <cmath>
+#include <cstring>
+#include <cinttypes>
+#include <algorithm>
+#include <vector>
+#include "collector.h"
+
+using namespace std;
+
+/* Number of nodes listed individually */
+static constexpr size_t DISPLAYED_NODES = 10;
+
+collector::collector (shared_ptr<system_services::provider> prov)
+	:
+		prov(prov),
+		display(prov),
+		display_timer(prov->register_timer (
+					[this]() { update_display(); }, 1000))
+{
+	frame_subscriber = prov->add_frame_subscriber (
+			[this](const ethernet_frame &frame) { receive_frame (frame); });
+
+	system_services::frame_filter filter;
+	filter.message_types.push_back ({ MSG_DEVIATION_SUMMARY, DEVIATION_SUMMARY_SIZE, {} });
+	prov->set_frame_filter (filter);
+
+	update_display();
+}
+
+void collector::receive_frame (const ethernet_frame &frame)
+{
+	if (frame.ether_type != ETHER_TYPE_CLOCK_JITTER ||
+			get_message_type (frame) != MSG_DEVIATION_SUMMARY)
+	{
+		return;
+	}
+
+	auto o = deviation_summary_message::from_frame (frame);
+	if (!o)
+		return;
+
+	/* Before anything else, as the sender's timestamp is compared to it */
+	auto tai = prov->get_tai();
+
+	auto &msg = *o;
+	auto &n = nodes[mac_to_uint64 (msg.src)];
+
+	memcpy (n.addr, msg.src, sizeof(n.addr));
+	memcpy (n.master, msg.master, sizeof(n.master));
+	n.interval_ms = msg.interval_ms;
+	n.last_seen = prov->get_monotonic_time();
+
+	n.total.merge (msg.summary);
+	n.last_interval = msg.summary;
+	fleet.merge (msg.summary);
+
+	/* The mean deviation is the master's offset minus the slave's */
+	auto &sm = msg.summary;
+	if (sm.count)
+	{
+		solver.add_measurement (mac_to_uint64 (msg.src), mac_to_uint64 (msg.master),
+				sm.mean(), sm.stddev() / sqrt (sm.count), (double) n.last_seen);
+
+		/* The send time is a second, single sample measurement of the
+		 * sender against our own clock, with the jitter of the sender's
+		 * samples as uncertainty. It closes a cycle through each master
+		 * with more than one slave. */
+		if (msg.tai_timestamp)
+		{
+			int64_t local_ns = ((int64_t) tai.seconds - prov->get_utc_offset()) * 1000000000 +
+				tai.nanoseconds;
+			int64_t remote_ns = (int64_t) *msg.tai_timestamp -
+				(int64_t) msg.utc_offset * 1000000000;
+
+			solver.add_measurement (mac_to_uint64 (prov->get_own_mac_address()),
+					mac_to_uint64 (msg.src), (remote_ns - local_ns) * 1e-9,
+					sm.stddev(), (double) n.last_seen);
+		}
+	}
+
+	summaries_received++;
+}
+
+void collector::update_display()
+{
+	auto now = prov->get_monotonic_time();
+
+	solver.solve (now);
+	solve_time = prov->get_monotonic_time() - now;
+
+	/* Nodes are stale if they missed three summaries */
+	size_t stale = 0;
+	vector<const node*> active;
+	active.reserve (nodes.size());
+
+	for (auto &[key, n] : nodes)
+	{
+		if (now - n.last_seen > 3 * n.interval_ms / 1000.)
+			stale++;
+		else
+			active.push_back (&n);
+	}
+
+	/* List the nodes with the largest deviations in the last interval */
+	auto worst = [](const node *n) {
+		return max (fabs(n->last_interval.min), fabs(n->last_interval.max));
+	};
+
+	size_t displayed = min (active.size(), DISPLAYED_NODES);
+	partial_sort (active.begin(), active.begin() + displayed, active.end(),
+			[&worst](const node *a, const node *b) { return worst(a) > worst(b); });
+
+	display.begin();
+
+	display.printf ("c - %zu nodes (%zu stale), %" PRIu64 " summaries received\n",
+			nodes.size(), stale, summaries_received);
+
+	display.printf ("  fleet: n = %" PRIu64 ", mean = %es, stddev = %es,\n"
+			"         min = %es, max = %es,\n"
+			"         p1 = %es, p50 = %es, p99 = %es\n",
+			fleet.count, fleet.mean(), fleet.stddev(), fleet.min, fleet.max,
+			fleet.quantile(0.01), fleet.quantile(0.5), fleet.quantile(0.99));
+
+	display.printf ("  offsets: %zu nodes, %zu links (%zu outliers), residual rms = %.2f sigma,\n"
+			"           %u iterations in %.1fms",
+			solver.get_node_count(), solver.get_link_count(), solver.get_outliers(),
+			solver.get_rms(), solver.get_iterations(), solve_time * 1e3);
+
+	auto largest = solver.get_largest_offset();
+	if (largest)
+	{
+		mac_addr_t addr;
+		uint64_to_mac (largest->first, addr);
+
+		display.printf (", largest: %02x:%02x:%02x:%02x:%02x:%02x = %es",
+				(int) addr[0], (int) addr[1], (int) addr[2],
+				(int) addr[3], (int) addr[4], (int) addr[5], largest->second);
+	}
+
+	display.printf ("\n  %-17s %-17s %12s %12s %12s %12s %12s\n",
+			"node", "master", "mean", "stddev", "max |dev|", "p99 |dev|", "offset");
+
+	for (size_t i = 0; i < displayed; i++)
+	{
+		auto n = active[i];
+		auto &s = n->last_interval;
+
+		display.printf ("  %02x:%02x:%02x:%02x:%02x:%02x %02x:%02x:%02x:%02x:%02x:%02x "
+				"%12e %12e %12e %12e %12e\n",
+				(int) n->addr[0], (int) n->addr[1], (int) n->addr[2],
+				(int) n->addr[3], (int) n->addr[4], (int) n->addr[5],
+				(int) n->master[0], (int) n->master[1], (int) n->master[2],
+				(int) n->master[3], (int) n->master[4], (int) n->master[5],
+				s.mean(), s.stddev(), worst(n),
+				max (fabs(s.quantile(0.01)), fabs(s.quantile(0.99))),
+				solver.get_offset (mac_to_uint64 (n->addr)).value_or (NAN));
+	}
+
+	display.end();
+}
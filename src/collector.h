@@ -0,0 +1,51 @@
+#ifndef __COLLECTOR_H
+#define __COLLECTOR_H
+
+/** The collector gathers the deviation summaries which slaves send
+ * periodically and merges them into fleet-wide distributions. It does not take
+ * part in the master election. */
+
+#include <map>
+#include "system_services.h"
+#include "screen.h"
+#include "summary.h"
+#include "offset_solver.h"
+
+class collector
+{
+private:
+	std::shared_ptr<system_services::provider> prov;
+	screen display;
+
+	/* The state kept per node is of constant size */
+	struct node
+	{
+		mac_addr_t addr;
+		mac_addr_t master;
+		uint32_t interval_ms;
+		system_services::linear_time last_seen;
+
+		deviation_summary total;
+		deviation_summary last_interval;
+	};
+
+	std::map<uint64_t, node> nodes;
+	deviation_summary fleet;
+	uint64_t summaries_received = 0;
+
+	/* Consistent offsets of all nodes from the slave - master links and the
+	 * summaries' send times */
+	offset_solver solver;
+	double solve_time = 0;
+
+	system_services::provider::frame_subscriber_registration frame_subscriber;
+	void receive_frame (const ethernet_frame &frame);
+
+	system_services::provider::timer_registration display_timer;
+	void update_display();
+
+public:
+	collector (std::shared_ptr<system_services::provider> prov);
+};
+
+#endif /* __COLLECTOR_H */
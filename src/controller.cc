@@ -1,8 +1,11 @@
 #include <cmath>
+#include <algorithm>
 #include <cstring>
+#include <cerrno>
 #include <cinttypes>
+#include <cstdio>
 #include <arpa/inet.h>
-#include <functional>
+#include "errno_exception.h"
 #include "controller.h"
 
 using namespace std;
@@ -21,6 +24,16 @@ int cmp_mac_addrs (unsigned const char a[], unsigned const char b[])
 	return 0;
 }
 
+/* Snapshot layout: magic, version, TAI and monotonic time of writing, own
+ * address, followed by the state as written by `save_snapshot` */
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x534a4344;
+static constexpr uint32_t SNAPSHOT_VERSION = 2;
+
+/* With scheduled launch, the pulse timer runs this long plus the lead time
+ * before the period's boundaries, at most half a period. It covers the main
+ * loop's latency, which is mostly below 2ms. */
+static constexpr uint64_t LAUNCH_MARGIN_NS = 5000000;
+
 uint16_t days_in_year (uint16_t year)
 {
 	if (year % 4 == 0)
@@ -39,78 +52,639 @@ uint16_t days_in_year (uint16_t year)
 	return 365;
 }
 
-controller::controller (shared_ptr<system_services::provider> prov)
+controller::controller (shared_ptr<system_services::provider> prov,
+		const controller_config &config)
 	:
 		prov(prov),
+		config(config),
+		display(prov),
 		master_alive_timer(prov->register_timer (
-					bind (&controller::master_alive_handler, this), 1500))
+					[this]() { master_alive_handler(); },
+					liveness_check_period (master_period))),
+		pulse_period_ms(config.pulse_period_ms),
+		rate(config.adaptive, config.pulse_period_ms),
+		filter(config.filter),
+		stability(config.pulse_period_ms / 1000.),
+		spectrum(config.spectrum),
+		probe(config.probe),
+		host_attribution(config.probe)
 {
+	if (config.launch_lead_us && !prov->enable_launch_time())
+		throw errno_exception ("scheduled launch", EOPNOTSUPP);
+
+	if (config.deviation_log.size())
+	{
+		deviation_log = fopen (config.deviation_log.c_str(), "ab");
+		if (!deviation_log)
+			throw errno_exception ("fopen(" + config.deviation_log + ")", errno);
+	}
+
+	if (config.history_path.size())
+		history.emplace (config.history_path, config.history);
+
+	if (config.shm_name.size())
+		shared.emplace (config.shm_name);
+
 	frame_subscriber = prov->add_frame_subscriber (
-			bind (&controller::receive_frame, this, placeholders::_1));
+			[this](const ethernet_frame &frame) { receive_frame (frame); });
+
+	if (config.summary_interval_ms)
+	{
+		summary_timer = prov->register_timer (
+				[this]() { summary_sender(); }, config.summary_interval_ms);
+	}
+
+	if (rate.is_active())
+	{
+		adaptive_timer = prov->register_timer (
+				[this]() { adaptive_rate_handler(); }, config.adaptive.interval_ms);
+	}
+
+	if (probe.is_active())
+	{
+		probe_timer = prov->register_timer (
+				[this]() { drain_probe(); }, probe.get_drain_period_ms());
+	}
 
 	/* Start in slave mode */
 	is_master = false;
-	memset (lowest_mac_pulse_received, 0xff, sizeof (lowest_mac_pulse_received));
+	memcpy (lowest_mac_pulse_received, BROADCAST_MAC_ADDR, sizeof (lowest_mac_pulse_received));
+	memcpy (lowest_mac_discovered, BROADCAST_MAC_ADDR, sizeof (lowest_mac_discovered));
+	started = time_last_pulse_received = prov->get_monotonic_time();
+
+	if (config.snapshot_path.size())
+	{
+		snapshot_tmp_path = config.snapshot_path + ".tmp";
+		load_snapshot();
+
+		snapshot.start_worker (config.snapshot_path, snapshot_tmp_path);
+
+		snapshot_timer = prov->register_timer (
+				[this]() { save_snapshot(); }, config.snapshot_interval_ms);
+	}
+
+	update_frame_filter();
+
+	/* Ask for the master. If none answers within the discovery window, the
+	 * starting node with the lowest address becomes master. */
+	if (config.discovery_window_ms)
+	{
+		discovering = true;
+		discovery_timer = prov->register_timer (
+				[this]() { discovery_timeout(); }, config.discovery_window_ms);
+
+		send_discovery_message (MSG_DISCOVERY_REQUEST);
+	}
+
 	update_display();
 
-	/* The first handler call will be in 1.5s, and will make us master if none
-	 * has been discovered so far. */
+	/* If no master is discovered within the liveness deadline (and our
+	 * backoff), we will become master. */
+}
+
+controller::~controller()
+{
+	if (deviation_log)
+		fclose (deviation_log);
+
+	if (history)
+	{
+		try
+		{
+			history->flush();
+			history->sync();
+		}
+		catch (exception &e)
+		{
+			fprintf (stderr, "Error: %s\n", e.what());
+		}
+	}
+
+	if (config.snapshot_path.size())
+	{
+		/* The last snapshot is written before exiting */
+		snapshot.stop_worker();
+
+		try
+		{
+			if (build_snapshot())
+				snapshot.write_file (config.snapshot_path, snapshot_tmp_path);
+		}
+		catch (exception &e)
+		{
+			fprintf (stderr, "Error: %s\n", e.what());
+		}
+	}
+}
+
+/** Hand the snapshot to the writer's thread, such that the pulses are not
+ * delayed by the disk. Failures are reported but do not stop the node. */
+void controller::save_snapshot()
+{
+	try
+	{
+		string msg;
+		if (snapshot.take_error (msg))
+			fprintf (stderr, "Error: %s\n", msg.c_str());
+
+		if (build_snapshot() && !snapshot.write_async())
+			fprintf (stderr, "Skipping a snapshot, the previous one is still being written\n");
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "Error: %s\n", e.what());
+	}
+}
+
+/** Put the statistics and the master's identity into the snapshot. The
+ * buffer is kept, hence this does not allocate in the steady state.
+ * @returns false if there is nothing to keep yet */
+bool controller::build_snapshot()
+{
+	/* Nothing to keep before the first sample */
+	if (drift.get_count() == 0)
+		return false;
+
+	auto tai = prov->get_tai();
+
+	snapshot.clear();
+	snapshot.put (SNAPSHOT_MAGIC);
+	snapshot.put (SNAPSHOT_VERSION);
+	snapshot.put<uint64_t> (tai.seconds * 1000000000 + tai.nanoseconds);
+	snapshot.put<double> (prov->get_monotonic_time());
+	snapshot.put (prov->get_own_mac_address());
+
+	snapshot.put (lowest_mac_pulse_received);
+	snapshot.put (master_period);
+	snapshot.put (pulses_received);
+	snapshot.put (pulses_lost);
+	snapshot.put (pulses_duplicated);
+	snapshot.put (pulses_reordered);
+	snapshot.put (utc_offset_mismatches);
+	snapshot.put (failovers);
+	snapshot.put (last_failover_gap);
+	snapshot.put (max_failover_gap);
+
+	snapshot.put (deviation_stats);
+	snapshot.put (filtered_stats);
+	snapshot.put (residual_stats);
+	filter.save (snapshot);
+	drift.save (snapshot);
+	stability.save (snapshot);
+	return true;
+}
+
+/** Restore the state from the snapshot file if it is recent, was written on
+ * the same interface and matches our configuration.
+ * @returns true if the state was restored */
+bool controller::load_snapshot()
+{
+	auto ignore = [this](const char *reason) {
+		prov->printf ("Ignoring snapshot %s: %s\n", config.snapshot_path.c_str(), reason);
+		return false;
+	};
+
+	snapshot_reader r;
+	if (!r.read_file (config.snapshot_path))
+		return false;
+
+	uint32_t magic, version;
+	uint64_t saved_tai_ns;
+	double saved_monotonic;
+	mac_addr_t mac;
+
+	if (!r.get (magic) || !r.get (version) || magic != SNAPSHOT_MAGIC ||
+			version != SNAPSHOT_VERSION || !r.get (saved_tai_ns) ||
+			!r.get (saved_monotonic) || !r.get (mac))
+	{
+		return ignore ("unknown format");
+	}
+
+	if (cmp_mac_addrs (mac, prov->get_own_mac_address()) != 0)
+		return ignore ("written on another interface");
+
+	auto tai = prov->get_tai();
+	double age = ((int64_t) (tai.seconds * 1000000000 + tai.nanoseconds) -
+			(int64_t) saved_tai_ns) * 1e-9;
+
+	if (age < 0 || age > config.snapshot_max_age_s)
+		return ignore ("too old");
+
+	/* The drift estimator's times are monotonic times, which do not survive
+	 * a reboot. Move them such that the snapshot was taken `age` ago. */
+	double time_shift = (double) prov->get_monotonic_time() - age - saved_monotonic;
+
+	/* Load into copies, such that a damaged snapshot leaves our state alone */
+	mac_addr_t master;
+	double period;
+	uint64_t counters[6];
+	double gaps[2];
+	windowed_statistics ds, fs, rs;
+	auto f = filter;
+	auto d = drift;
+	auto st = stability;
+
+	if (!r.get (master) || !r.get (period) || !r.get (counters) || !r.get (gaps) ||
+			!r.get (ds) || !r.get (fs) || !r.get (rs) || !f.load (r) ||
+			!d.load (r, time_shift) || !st.load (r) || !r.at_end())
+	{
+		return ignore ("damaged or written with another configuration");
+	}
+
+	memcpy (lowest_mac_pulse_received, master, sizeof (master));
+	set_master_period (period);
+
+	pulses_received = counters[0];
+	pulses_lost = counters[1];
+	pulses_duplicated = counters[2];
+	pulses_reordered = counters[3];
+	utc_offset_mismatches = counters[4];
+	failovers = counters[5];
+	last_failover_gap = gaps[0];
+	max_failover_gap = gaps[1];
+
+	deviation_stats = ds;
+	filtered_stats = fs;
+	residual_stats = rs;
+	filter = f;
+	drift = d;
+	stability = st;
+
+	prov->printf ("Restored the state from snapshot %s (%.1fs old)\n",
+			config.snapshot_path.c_str(), age);
+	return true;
 }
 
 
 void controller::master_alive_handler()
 {
-	if (is_master)
+	if (is_master || discovering)
 		return;
 
-	/* If no master was discovered yet, make ourselves master. */
-	if (cmp_mac_addrs (lowest_mac_pulse_received, (unsigned char*) "\xff\xff\xff\xff\xff\xff") == 0)
+	/* A master is assumed to be lost if it missed one pulse by half a period.
+	 * */
+	auto silence = prov->get_monotonic_time() - time_last_pulse_received;
+	double deadline = 1.5 * master_period;
+
+	if (silence < deadline)
+		return;
+
+	/* Forget the master, such that any node with a lower address than ours
+	 * is accepted as new one. */
+	if (cmp_mac_addrs (lowest_mac_pulse_received, BROADCAST_MAC_ADDR) != 0)
+	{
+		memcpy (lost_master, lowest_mac_pulse_received, sizeof (lost_master));
+		memcpy (lowest_mac_pulse_received, BROADCAST_MAC_ADDR, sizeof (lowest_mac_pulse_received));
+		sequence_valid = false;
+		failover_start = time_last_pulse_received;
+		update_frame_filter();
+		update_display ();
+	}
+
+	/* If no other node took over in the meantime, make ourselves master. */
+	if (silence >= deadline + takeover_backoff())
 	{
 		enable_master_mode();
 		update_display ();
+	}
+}
+
+/** The time to wait after the master's deadline before taking over. It is
+ * ranked by the distance of our address to the lost master's on a logarithmic
+ * scale. This orders the nodes like `cmp_mac_addrs`, such that usually the
+ * node with the lowest address takes over first and the others see its pulse
+ * before their backoff expires, instead of all nodes starting to send at
+ * once; and it still spreads nodes whose addresses only differ in the lowest
+ * bits, as those of one vendor do. */
+double controller::takeover_backoff()
+{
+	uint64_t own = mac_to_uint64 (prov->get_own_mac_address());
+	uint64_t master = mac_to_uint64 (lost_master);
+	double rank = own > master ? log2 ((double) (own - master)) / 48 : 0;
+
+	return master_period * (0.1 + 0.8 * rank);
+}
+
+/** The liveness check runs a few times per pulse period to detect a lost
+ * master quickly.
+ * @returns The period of the check in ms */
+uint32_t controller::liveness_check_period (double pulse_period)
+{
+	uint32_t period = pulse_period * 1000 / 8;
+	return period > 0 ? period : 1;
+}
+
+/** Measure the time from the last pulse of a lost master until we have a new
+ * master (or are master). */
+void controller::failover_completed()
+{
+	if (!failover_start)
 		return;
+
+	double gap = prov->get_monotonic_time() - *failover_start;
+	failover_start = nullopt;
+
+	failovers++;
+	last_failover_gap = gap;
+	max_failover_gap = max (max_failover_gap, gap);
+}
+
+/** Measure the time from starting until the first sample or until we became
+ * master. */
+void controller::startup_completed()
+{
+	if (startup_latency)
+		return;
+
+	startup_latency = prov->get_monotonic_time() - started;
+}
+
+/** Broadcast a discovery request or answer one. Masters include their time,
+ * such that the requester can take a sample right away. */
+void controller::send_discovery_message (uint16_t type)
+{
+	discovery_message msg;
+	msg.type = type;
+	msg.is_master = is_master;
+
+	if (is_master)
+	{
+		auto tai = prov->get_tai();
+
+		msg.pulse_period_us = pulse_period_ms * 1000;
+		msg.tai_timestamp = tai.seconds * 1000000000 + tai.nanoseconds;
+		msg.utc_offset = prov->get_utc_offset();
 	}
 
-	/* If the last signal we got from the choosen master is more than 1.5
-	 * seconds in the past, question if it is still active. */
-	if (prov->get_monotonic_time() - time_last_pulse_received >= 1.5)
+	prov->send_frame (msg.to_frame());
+}
+
+void controller::receive_discovery_message (const ethernet_frame &frame)
+{
+	/* Take the local time before anything else */
+	auto tai = prov->get_tai();
+
+	auto o = discovery_message::from_frame (frame);
+	if (!o)
+		return;
+
+	auto &msg = *o;
+	auto &own_mac = prov->get_own_mac_address();
+
+	if (cmp_mac_addrs (msg.src, own_mac) == 0)
+		return;
+
+	if (msg.type == MSG_DISCOVERY_REQUEST && (is_master || discovering))
+		send_discovery_message (MSG_DISCOVERY_ANNOUNCE);
+
+	if (!discovering)
+		return;
+
+	/* A master with a lower address than ours is followed right away, and its
+	 * answer yields the first sample. All other nodes are candidates for the
+	 * election. */
+	if (msg.type != MSG_DISCOVERY_ANNOUNCE || !msg.is_master ||
+			cmp_mac_addrs (msg.src, own_mac) > 0)
 	{
-		memset (lowest_mac_pulse_received, 0xff, sizeof (lowest_mac_pulse_received));
-		update_display ();
+		if (cmp_mac_addrs (msg.src, lowest_mac_discovered) < 0)
+			memcpy (lowest_mac_discovered, msg.src, sizeof (msg.src));
+
+		return;
+	}
+
+	discovering = false;
+	discovery_timer = nullopt;
+
+	memcpy (lowest_mac_pulse_received, msg.src, sizeof (msg.src));
+	sequence_valid = false;
+	update_frame_filter();
+
+	time_last_pulse_received = prov->get_monotonic_time();
+	set_master_period (msg.pulse_period_us * 1e-6);
+
+	take_host_latency();
+	update_statistics (time_last_pulse_received,
+			compute_deviation_v2 (msg.tai_timestamp, msg.utc_offset, tai));
+
+	update_display();
+}
+
+/** No master answered our discovery request in time. The starting node with
+ * the lowest address takes over right away, the others wait for its first
+ * pulse. */
+void controller::discovery_timeout()
+{
+	discovering = false;
+	discovery_timer = nullopt;
+
+	if (cmp_mac_addrs (lowest_mac_pulse_received, BROADCAST_MAC_ADDR) == 0 &&
+			cmp_mac_addrs (prov->get_own_mac_address(), lowest_mac_discovered) < 0)
+	{
+		enable_master_mode();
 	}
+
+	update_display();
 }
 
 /** Send a time signal pulse with the current time. */
 void controller::time_signal_sender()
 {
-	last_pulse_sent_time = prov->get_utc();
+	auto tai = prov->get_tai();
+	uint64_t now = tai.seconds * 1000000000 + tai.nanoseconds;
+
+	auto uptime = prov->get_monotonic_time() - master_since;
+	uint64_t uptime_ns = uptime.seconds * 1000000000 + uptime.nanoseconds;
 
 	time_signal_pulse pulse;
-	pulse.year       = last_pulse_sent_time.year;
-	pulse.day        = last_pulse_sent_time.day_of_year;
-	pulse.second     = last_pulse_sent_time.second_of_day;
-	pulse.nanosecond = last_pulse_sent_time.nanosecond;
+	pulse.tai_timestamp = now;
+
+	if (config.launch_lead_us)
+	{
+		/* Launch at the first boundary of the period which leaves the kernel
+		 * the lead time. A run of the timer right after the one of
+		 * `enable_master_mode` finds that boundary taken. */
+		uint64_t period = pulse_period_ms * 1000000ULL;
+		uint64_t launch = (now + config.launch_lead_us * 1000ULL + period - 1) / period * period;
+
+		if (launch <= last_launch)
+			return;
 
-	prov->send_frame (pulse.to_frame());
+		if (last_launch && period == last_launch_period && launch > last_launch + period)
+			launch_slips += (launch - last_launch) / period - 1;
 
+		last_launch = launch;
+		last_launch_period = period;
+
+		pulse.tai_timestamp = launch;
+		uptime_ns += launch - now;
+	}
+
+	pulse.sequence = next_sequence++;
+	pulse.utc_offset = prov->get_utc_offset();
+	pulse.pulse_period_us = pulse_period_ms * 1000;
+	pulse.base_period_us = config.pulse_period_ms * 1000;
+	pulse.master_uptime_ns = uptime_ns;
+
+	auto frame = pulse.to_frame();
+	if (config.launch_lead_us)
+		frame.launch_time = pulse.tai_timestamp;
+
+	prov->send_frame (frame);
+
+	last_pulse_sent_time = prov->get_utc();
 	update_display();
 }
 
+/** Register the timer of the pulses. With scheduled launch it runs the lead
+ * time plus a margin for the main loop's latency before the period's
+ * boundaries, such that frames are not queued much earlier than needed. */
+void controller::register_pulse_timer()
+{
+	auto handler = [this]() { time_signal_sender(); };
 
-void controller::receive_frame (const ethernet_frame &frame)
+	if (!config.launch_lead_us)
+	{
+		time_signal_timer = prov->register_timer (handler, pulse_period_ms);
+		return;
+	}
+
+	uint64_t period = pulse_period_ms * 1000000ULL;
+	uint64_t ahead = config.launch_lead_us * 1000ULL + min (LAUNCH_MARGIN_NS, period / 2);
+
+	auto tai = prov->get_tai();
+	uint64_t now = tai.seconds * 1000000000 + tai.nanoseconds;
+	uint64_t next_run = (now + ahead + period - 1) / period * period - ahead;
+
+	time_signal_timer = prov->register_delayed_timer (
+			handler, pulse_period_ms, (next_run - now) / 1000);
+}
+
+/** Send the summary of the deviations since the last one to collectors. */
+void controller::summary_sender()
+{
+	if (!is_master && interval_summary.count > 0)
+	{
+		deviation_summary_message msg;
+		memcpy (msg.master, lowest_mac_pulse_received, sizeof (msg.master));
+		msg.interval_ms = config.summary_interval_ms;
+		msg.summary = interval_summary;
+
+		auto tai = prov->get_tai();
+		msg.tai_timestamp = tai.seconds * 1000000000 + tai.nanoseconds;
+		msg.utc_offset = prov->get_utc_offset();
+
+		prov->send_frame (msg.to_frame());
+	}
+
+	interval_summary.clear();
+}
+
+void controller::adaptive_rate_handler()
 {
-	if (frame.ether_type != 0x88b6)
+	if (!is_master)
+	{
+		send_feedback();
 		return;
+	}
 
-	if (ntohs(*((uint16_t*) frame.data + 0)) != 0x0133)
+	uint32_t period = rate.update (prov->get_monotonic_time());
+	if (period == pulse_period_ms)
 		return;
 
-	receive_pulse (frame);
+	/* Slaves follow the period announced in the pulses */
+	pulse_period_ms = period;
+	register_pulse_timer();
+
+	update_display();
+}
+
+/** Assess our condition over the last interval and tell the master if it
+ * should send faster (unstable) or slower (overloaded). Stable slaves stay
+ * silent. */
+void controller::send_feedback()
+{
+	uint64_t received = pulses_received - feedback_received;
+	uint64_t lost = pulses_lost - feedback_lost;
+	feedback_received = pulses_received;
+	feedback_lost = pulses_lost;
+
+	/* The frequency is only compared once the drift estimator's window is
+	 * filled */
+	double frequency = drift.get_count() >= 100 ? drift.get_frequency_ppb() : NAN;
+	double frequency_change = fabs (frequency - feedback_frequency);
+	feedback_frequency = frequency;
+
+	feedback_flags = 0;
+
+	if (cmp_mac_addrs (lowest_mac_pulse_received, BROADCAST_MAC_ADDR) == 0 ||
+			drift.get_count() < 100)
+	{
+		return;
+	}
+
+	auto &ac = config.adaptive;
+	auto &rs = residual_stats;
+
+	if (rs.delta_10_bar() > ac.jitter_threshold * rs.delta_100_bar() ||
+			(ac.drift_threshold_ppb > 0 && frequency_change > ac.drift_threshold_ppb))
+	{
+		feedback_flags |= FEEDBACK_FLAG_UNSTABLE;
+	}
+
+	if (lost > ac.max_loss * (received + lost))
+		feedback_flags |= FEEDBACK_FLAG_OVERLOADED;
+
+	if (!feedback_flags)
+		return;
+
+	pulse_feedback_message msg;
+	memcpy (msg.master, lowest_mac_pulse_received, sizeof (msg.master));
+	msg.flags = feedback_flags;
+	msg.jitter = rs.delta_10_bar();
+	msg.baseline_jitter = rs.delta_100_bar();
+	msg.frequency_change = isnan (frequency_change) ? 0 : frequency_change;
+
+	prov->send_frame (msg.to_frame());
+}
+
+void controller::receive_feedback (const ethernet_frame &frame)
+{
+	if (!is_master || !rate.is_active())
+		return;
+
+	auto o = pulse_feedback_message::from_frame (frame);
+	if (!o || cmp_mac_addrs (o->master, prov->get_own_mac_address()) != 0)
+		return;
+
+	rate.add_feedback (o->flags);
+}
+
+
+void controller::receive_frame (const ethernet_frame &frame)
+{
+	if (frame.ether_type != ETHER_TYPE_CLOCK_JITTER)
+		return;
+
+	auto type = get_message_type (frame);
+
+	if (type == MSG_TIME_SIGNAL_PULSE_V1 || type == MSG_TIME_SIGNAL_PULSE_V2)
+		receive_pulse (frame);
+	else if (type == MSG_DISCOVERY_REQUEST || type == MSG_DISCOVERY_ANNOUNCE)
+		receive_discovery_message (frame);
+	else if (type == MSG_PULSE_FEEDBACK)
+		receive_feedback (frame);
 }
 
 void controller::receive_pulse (const ethernet_frame &frame)
 {
-	auto utc = prov->get_utc();
+	/* Take the local time before anything else */
+	system_services::linear_time tai;
+	system_services::calendar_time utc;
+
+	if (get_message_type (frame) == MSG_TIME_SIGNAL_PULSE_V2)
+		tai = prov->get_tai();
+	else
+		utc = prov->get_utc();
 
 	auto o = time_signal_pulse::from_frame (frame);
 	if (!o)
@@ -126,6 +700,8 @@ void controller::receive_pulse (const ethernet_frame &frame)
 		{
 			disable_master_mode ();
 			memcpy (lowest_mac_pulse_received, pulse.src, sizeof (pulse.src));
+			sequence_valid = false;
+			update_frame_filter();
 		}
 	}
 
@@ -133,44 +709,227 @@ void controller::receive_pulse (const ethernet_frame &frame)
 	if (cmp_mac_addrs (pulse.src, lowest_mac_pulse_received) == 0)
 	{
 		time_last_pulse_received = prov->get_monotonic_time();
+		pulses_received++;
+		failover_completed();
+
+		if (discovering)
+		{
+			discovering = false;
+			discovery_timer = nullopt;
+		}
+
+		/* Follow the master's pulse period; version 1 masters send once a
+		 * second. */
+		set_master_period (pulse.pulse_period_us ? *pulse.pulse_period_us * 1e-6 : 1.);
+		set_stability_interval (pulse.base_period_us ? *pulse.base_period_us * 1e-6 : master_period);
+
+		/* Duplicated and stale pulses do not yield a new sample */
+		if (pulse.version == 2 && !check_sequence (pulse))
+		{
+			update_display ();
+			return;
+		}
 
 		last_pulse_received_time.year          = pulse.year;
 		last_pulse_received_time.day_of_year   = pulse.day;
 		last_pulse_received_time.second_of_day = pulse.second;
 		last_pulse_received_time.nanosecond    = pulse.nanosecond;
 
-		int32_t diff_days = 0;
+		double new_deviation;
 
-		/* Different years */
-		if (utc.year < pulse.year)
+		if (pulse.version == 2)
 		{
-			for (uint16_t y = utc.year; y < pulse.year; y++)
-				diff_days += days_in_year (y);
+			if (prov->get_utc_offset() != pulse.utc_offset)
+				utc_offset_mismatches++;
+
+			new_deviation = compute_deviation_v2 (pulse.tai_timestamp, pulse.utc_offset, tai);
 		}
-		else if (utc.year > pulse.year)
+		else
 		{
-			for (uint16_t y = pulse.year; y < utc.year; y++)
-				diff_days -= days_in_year(y);
+			new_deviation = compute_deviation_v1 (pulse, utc);
 		}
 
-		/* Different days (start from 0) */
-		diff_days += (int32_t) pulse.day - utc.day_of_year;
+		take_host_latency();
+		update_statistics (time_last_pulse_received, new_deviation);
+	}
+
+	update_display ();
+}
 
-		/* Different seconds */
-		double diff_seconds = (double) pulse.second - utc.second_of_day;
+void controller::drain_probe()
+{
+	pending_host_latency = fmax (pending_host_latency, probe.drain());
+}
 
-		/* Different nanoseconds */
-		double diff_nanoseconds = ((double) pulse.nanosecond - utc.nanosecond) * 1e-9;
+void controller::take_host_latency()
+{
+	drain_probe();
+	sample_host_latency = pending_host_latency;
+	pending_host_latency = NAN;
+}
+
+/** Classify a v2 pulse's sequence number with respect to the last one
+ * received from the same master.
+ * @returns true if the pulse is new and shall be used as sample */
+bool controller::check_sequence (const time_signal_pulse &pulse)
+{
+	/* Pulses older than this are assumed to stem from a restarted master */
+	const uint64_t reorder_window = 64;
 
-		/* Overall difference */
-		double new_deviation = diff_days * 86400. + diff_seconds + diff_nanoseconds;
+	uint64_t sequence = pulse.sequence;
+
+	/* Another master counts on its own. A restarted master starts its
+	 * sequence and uptime over: its pulses are newer than the last one but
+	 * have a lower uptime, while reordered ones are older. */
+	if (sequence_valid)
+	{
+		if (cmp_mac_addrs (pulse.src, sequence_master) != 0)
+			sequence_valid = false;
 
-		update_statistics (new_deviation);
+		if (pulse.master_uptime_ns && last_master_uptime &&
+				*pulse.master_uptime_ns < *last_master_uptime &&
+				pulse.tai_timestamp > last_sequence_tai)
+		{
+			sequence_valid = false;
+		}
 	}
 
-	update_display ();
+	auto accept = [&]() {
+		last_sequence = sequence;
+		last_master_uptime = pulse.master_uptime_ns;
+		last_sequence_tai = pulse.tai_timestamp;
+		return true;
+	};
+
+	if (!sequence_valid)
+	{
+		sequence_valid = true;
+		memcpy (sequence_master, pulse.src, sizeof (sequence_master));
+		return accept();
+	}
+
+	if (sequence == last_sequence)
+	{
+		pulses_duplicated++;
+		return false;
+	}
+
+	if (sequence > last_sequence)
+	{
+		pulses_lost += sequence - last_sequence - 1;
+		return accept();
+	}
+
+	if (last_sequence - sequence <= reorder_window)
+	{
+		/* This pulse was counted as lost when its successor arrived */
+		pulses_reordered++;
+		if (pulses_lost > 0)
+			pulses_lost--;
+
+		return false;
+	}
+
+	/* The master restarted its sequence without telling its uptime */
+	return accept();
+}
+
+/** Use the master's base period as sampling interval of the stability
+ * analysis. The samples taken at another interval are dropped. */
+void controller::set_stability_interval (double tau0)
+{
+	if (tau0 <= 0 || tau0 == stability.get_tau (0))
+		return;
+
+	stability.reset (tau0);
+	stability_skipped = 0;
+}
+
+void controller::set_master_period (double period)
+{
+	if (period <= 0 || period == master_period)
+		return;
+
+	master_period = period;
+	master_alive_timer = prov->register_timer (
+			[this]() { master_alive_handler(); },
+			liveness_check_period (master_period));
+}
+
+/** Compare in UTC, so that the deviation does not depend on whether both hosts
+ * know the current TAI - UTC offset. */
+double controller::compute_deviation_v2 (uint64_t tai_timestamp, int16_t utc_offset,
+		const system_services::linear_time &tai)
+{
+	int16_t local_utc_offset = prov->get_utc_offset();
+
+	int64_t local_ns = ((int64_t) tai.seconds - local_utc_offset) * 1000000000 + tai.nanoseconds;
+	int64_t remote_ns = (int64_t) tai_timestamp - (int64_t) utc_offset * 1000000000;
+
+	return (remote_ns - local_ns) * 1e-9;
 }
 
+double controller::compute_deviation_v1 (
+		const time_signal_pulse &pulse, const system_services::calendar_time &utc)
+{
+	int32_t diff_days = 0;
+
+	/* Different years */
+	if (utc.year < pulse.year)
+	{
+		for (uint16_t y = utc.year; y < pulse.year; y++)
+			diff_days += days_in_year (y);
+	}
+	else if (utc.year > pulse.year)
+	{
+		for (uint16_t y = pulse.year; y < utc.year; y++)
+			diff_days -= days_in_year(y);
+	}
+
+	/* Different days (start from 0) */
+	diff_days += (int32_t) pulse.day - utc.day_of_year;
+
+	/* Different seconds */
+	double diff_seconds = (double) pulse.second - utc.second_of_day;
+
+	/* Different nanoseconds */
+	double diff_nanoseconds = ((double) pulse.nanosecond - utc.nanosecond) * 1e-9;
+
+	/* Overall difference */
+	return diff_days * 86400. + diff_seconds + diff_nanoseconds;
+}
+
+void controller::update_frame_filter()
+{
+	/* Accept pulses from the current master and from all nodes that would
+	 * take over from it, i.e. those with lower addresses. As master, ours is
+	 * the limit. Without master, all pulses are accepted. */
+	optional<uint64_t> max_src;
+
+	if (config.filter_by_master)
+	{
+		if (is_master)
+			max_src = mac_to_uint64 (prov->get_own_mac_address());
+		else if (cmp_mac_addrs (lowest_mac_pulse_received, BROADCAST_MAC_ADDR) != 0)
+			max_src = mac_to_uint64 (lowest_mac_pulse_received);
+	}
+
+	if (frame_filter_set && max_src == filtered_master)
+		return;
+
+	system_services::frame_filter filter;
+	filter.message_types.push_back ({ MSG_TIME_SIGNAL_PULSE_V1, PULSE_V1_SIZE, max_src });
+	filter.message_types.push_back ({ MSG_TIME_SIGNAL_PULSE_V2, PULSE_V2_HEADER_SIZE, max_src });
+	filter.message_types.push_back ({ MSG_DISCOVERY_REQUEST, DISCOVERY_SIZE, nullopt });
+	filter.message_types.push_back ({ MSG_DISCOVERY_ANNOUNCE, DISCOVERY_SIZE, nullopt });
+
+	if (rate.is_active())
+		filter.message_types.push_back ({ MSG_PULSE_FEEDBACK, PULSE_FEEDBACK_SIZE, nullopt });
+
+	prov->set_frame_filter (filter);
+	filtered_master = max_src;
+	frame_filter_set = true;
+}
 
 void controller::enable_master_mode()
 {
@@ -179,8 +938,18 @@ void controller::enable_master_mode()
 
 	is_master = true;
 	last_pulse_sent_time = system_services::calendar_time();
-	time_signal_timer = prov->register_timer (
-				bind (&controller::time_signal_sender, this), 1000);
+	master_since = prov->get_monotonic_time();
+	update_frame_filter();
+
+	rate.reset (master_since);
+	pulse_period_ms = rate.get_period_ms();
+	last_launch = 0;
+	register_pulse_timer();
+
+	/* Send the first pulse right away to keep the gap short */
+	failover_completed();
+	startup_completed();
+	time_signal_sender();
 }
 
 void controller::disable_master_mode()
@@ -191,72 +960,148 @@ void controller::disable_master_mode()
 	is_master = false;
 	time_signal_timer = nullopt;
 
-	memset (lowest_mac_pulse_received, 0xff, sizeof (lowest_mac_pulse_received));
+	memcpy (lowest_mac_pulse_received, BROADCAST_MAC_ADDR, sizeof (lowest_mac_pulse_received));
 	time_last_pulse_received = prov->get_monotonic_time();
 	last_pulse_received_time = system_services::calendar_time();
 }
 
-void controller::update_statistics (double new_deviation)
+void controller::update_statistics (double t, double new_deviation)
 {
-	/* Update stored deviations */
-	for (int i = 99; i > 0; i--)
+	startup_completed();
+	deviation_stats.update (new_deviation);
+
+	if (filter.is_active())
 	{
-		deviations[i] = deviations[i - 1];
+		auto filtered = filter.update (new_deviation);
+		if (filtered)
+			filtered_stats.update (*filtered);
 	}
 
-	deviations[0] = new_deviation;
+	double residual = drift.update (t, new_deviation);
+
+	if (!isnan (sample_host_latency) && ++probe_samples > 100)
+	{
+		host_attribution.add (sample_host_latency,
+				fabs (residual - residual_stats.mu_100()), residual_stats.delta_100_bar());
+	}
 
-	/* Compute mu */
-	mu_10 = mu_100 = 0;
+	residual_stats.update (residual);
 
-	for (int i = 0; i < 10; i++)
-		mu_10 += deviations[i];
+	/* Keep the sampling interval while the master runs k times faster */
+	unsigned skip = max (lround (stability.get_tau (0) / master_period), 1l) - 1;
 
-	for (int i = 0; i < 100; i++)
-		mu_100 += deviations[i];
+	if (stability_skipped >= skip)
+	{
+		stability.update (new_deviation);
+		stability_skipped = 0;
+	}
+	else
+	{
+		stability_skipped++;
+	}
 
-	mu_10 /= 10;
-	mu_100 /= 100;
+	spectrum.update (new_deviation, master_period);
+	interval_summary.add (new_deviation);
 
-	/* Compute delta */
-	delta_10_max = delta_100_max = delta_10_bar = delta_100_bar = 0;
+	if (deviation_log)
+		fwrite (&new_deviation, sizeof(new_deviation), 1, deviation_log);
 
-	for (int i = 0; i < 10; i++)
+	if (history)
 	{
-		auto delta = fabs(deviations[i] - mu_10);
-		delta_10_max = delta_10_max > delta ? delta_10_max : delta;
-		delta_10_bar += delta;
+		auto tai = prov->get_tai();
+		history->append ((int64_t) tai.seconds * 1000000 + tai.nanoseconds / 1000,
+				new_deviation);
 	}
+}
+
+/** Copy the state to the shared memory segment. Readers never block us, they
+ * retry if they raced with an update. */
+void controller::publish_statistics()
+{
+	auto &s = shared->begin();
+
+	auto &own_mac = prov->get_own_mac_address();
+	memcpy (s.own_mac, own_mac, sizeof(s.own_mac));
+	memcpy (s.master_mac, is_master ? own_mac : lowest_mac_pulse_received,
+			sizeof(s.master_mac));
+	s.is_master = is_master;
+	s.filter_active = filter.is_active();
+
+	auto tai = prov->get_tai();
+	auto now = prov->get_monotonic_time();
+	s.tai_ns = tai.seconds * 1000000000 + tai.nanoseconds;
+	s.monotonic_ns = now.seconds * 1000000000 + now.nanoseconds;
+	s.master_period = master_period;
 
-	delta_10_bar /= 10;
+	s.deviation = deviation_stats;
+	s.filtered = filtered_stats;
+	s.residual = residual_stats;
 
-	for (int i = 0; i < 100; i++)
+	s.offset = drift.get_offset();
+	s.frequency_ppb = drift.get_frequency_ppb();
+
+	s.tau0 = stability.get_tau (0);
+	s.octaves = min (stability.get_octaves(), shared_statistics::MAX_OCTAVES);
+	for (unsigned k = 0; k < s.octaves; k++)
 	{
-		auto delta = fabs(deviations[i] - mu_100);
-		delta_100_max = delta_100_max > delta ? delta_100_max : delta;
-		delta_100_bar += delta;
+		s.adev[k] = stability.get_adev (k);
+		s.tdev[k] = stability.get_tdev (k);
 	}
 
-	delta_100_bar /= 100;
+	s.pulses_sent = next_sequence;
+	s.pulses_received = pulses_received;
+	s.pulses_lost = pulses_lost;
+	s.pulses_duplicated = pulses_duplicated;
+	s.pulses_reordered = pulses_reordered;
+	s.utc_offset_mismatches = utc_offset_mismatches;
+	s.outliers_rejected = filter.get_rejected();
+
+	s.failovers = failovers;
+	s.last_failover_gap = last_failover_gap;
+	s.max_failover_gap = max_failover_gap;
+	s.startup_latency = startup_latency.value_or (NAN);
+
+	shared->end();
 }
 
 void controller::update_display()
 {
+	if (shared)
+		publish_statistics();
+
+	display.begin();
+
 	if (is_master)
 	{
-		prov->printf ("\033[2K\033[1F\033[2K\033[1F\033[2K\033[1F\033[0K"
-				"m - %" PRIu16 ":%" PRIu16 ":%" PRIu32 ":%" PRIu32 "\n\n\n",
+		display.printf ("m - %" PRIu16 ":%" PRIu16 ":%" PRIu32 ":%" PRIu32 ", sequence %" PRIu64
+				", startup = %.3fs",
 				last_pulse_sent_time.year,
 				last_pulse_sent_time.day_of_year,
 				last_pulse_sent_time.second_of_day,
-				last_pulse_sent_time.nanosecond);
+				last_pulse_sent_time.nanosecond,
+				next_sequence, startup_latency.value_or (NAN));
 
-		prov->flush();
+		if (config.launch_lead_us)
+		{
+			display.printf (",\n  launch = %" PRIu64 ".%09" PRIu64 " TAI, lead = %" PRIu32
+					"us, slips = %" PRIu64 ", dropped = %" PRIu64,
+					last_launch / 1000000000, last_launch % 1000000000,
+					config.launch_lead_us, launch_slips, prov->get_dropped_launches());
+		}
+
+		if (rate.is_active())
+		{
+			display.printf (",\n  period = %" PRIu32 "ms, %" PRIu32 " unstable, %" PRIu32
+					" overloaded slaves, budget left = %.0f%%",
+					pulse_period_ms, rate.get_unstable(), rate.get_overloaded(),
+					rate.get_budget_left() * 100);
+		}
+
+		display.end();
 	}
 	else
 	{
-		prov->printf ("\033[2K\033[1F\033[2K\033[1F\033[2K\033[1F\033[0K"
-				"s [%02x:%02x:%02x:%02x:%02x:%02x] - "
+		display.printf ("s [%02x:%02x:%02x:%02x:%02x:%02x] - "
 				"%" PRIu16 ":%" PRIu16 ":%" PRIu32 ":%" PRIu32 "\n",
 				(int) lowest_mac_pulse_received[0], (int) lowest_mac_pulse_received[1],
 				(int) lowest_mac_pulse_received[2], (int) lowest_mac_pulse_received[3],
@@ -266,13 +1111,107 @@ void controller::update_display()
 				last_pulse_received_time.second_of_day,
 				last_pulse_received_time.nanosecond);
 
-		prov->printf ("  current deviation: %es, mu_10 = %es, mu_100 = %es,\n",
-				deviations[0], mu_10, mu_100);
+		auto &ds = deviation_stats;
+		display.printf ("  current deviation: %es, mu_10 = %es, mu_100 = %es,\n",
+				ds.current(), ds.mu_10(), ds.mu_100());
+
+		display.printf ("  delta_10_max = %es, delta_100_max = %es,\n"
+				"  delta_10_bar = %es, delta_100_bar = %es,\n",
+				ds.delta_10_max(), ds.delta_100_max(), ds.delta_10_bar(), ds.delta_100_bar());
+
+		if (filter.is_active())
+		{
+			static const char *const estimator_names[] = { "none", "median", "lucky" };
+			auto &fc = filter.get_config();
+			auto &fs = filtered_stats;
+
+			display.printf ("  filtered (%s of %zu, %" PRIu64 " outliers rejected): "
+					"current = %es, mu_10 = %es, mu_100 = %es,\n"
+					"  filtered delta_10_max = %es, delta_100_max = %es,\n"
+					"  filtered delta_10_bar = %es, delta_100_bar = %es,\n",
+					estimator_names[(int) fc.est], fc.window, filter.get_rejected(),
+					fs.current(), fs.mu_10(), fs.mu_100(),
+					fs.delta_10_max(), fs.delta_100_max(), fs.delta_10_bar(), fs.delta_100_bar());
+		}
+
+		/* Jitter with the clocks' drift removed */
+		auto &rs = residual_stats;
+		display.printf ("  offset = %es, frequency = %+.3fppb,\n"
+				"  detrended delta_10_max = %es, delta_100_max = %es,\n"
+				"  detrended delta_10_bar = %es, delta_100_bar = %es,\n",
+				drift.get_offset(), drift.get_frequency_ppb(),
+				rs.delta_10_max(), rs.delta_100_max(), rs.delta_10_bar(), rs.delta_100_bar());
+
+		display.printf ("  adev (tau = %gs ... %gs):", stability.get_tau(0),
+				stability.get_tau(stability.get_octaves() - 1));
+
+		for (unsigned k = 0; k < stability.get_octaves(); k++)
+			display.printf (" %.1e", stability.get_adev(k));
+
+		display.printf (",\n  tdev [s]:");
+
+		for (unsigned k = 0; k < stability.get_octaves(); k++)
+			display.printf (" %.1e", stability.get_tdev(k));
+
+		display.printf (",\n");
+
+		if (spectrum.is_active())
+		{
+			spectrum.get_result (spectrum_result);
+			auto &sr = spectrum_result;
+
+			if (sr.analyses == 0)
+			{
+				display.printf ("  periods: collecting %u samples,\n",
+						spectrum.get_config().window);
+			}
+			else
+			{
+				display.printf ("  periods (%.0fs window, noise %.1es, %.1fms):",
+						sr.duration, sr.noise_floor, sr.compute_time * 1e3);
+
+				for (unsigned i = 0; i < sr.peak_count; i++)
+					display.printf (" %.4gs = %.1es", sr.peaks[i].period, sr.peaks[i].amplitude);
+
+				display.printf (sr.peak_count ? ",\n" : " none,\n");
+			}
+		}
+
+		if (probe.is_active())
+		{
+			auto &ha = host_attribution;
+
+			display.printf ("  host latency = %.0fus, max = %.0fus, wakeups = %" PRIu64
+					", overruns = %" PRIu64 ",\n"
+					"  host latency > %gus: %" PRIu64 " of %" PRIu64 " samples, %" PRIu64
+					" of %" PRIu64 " outliers, correlation = %.2f,\n",
+					sample_host_latency * 1e6, probe.get_max_latency() * 1e6,
+					probe.get_wakeups(), probe.get_overruns(),
+					probe.get_config().threshold_us, ha.get_host_samples(), ha.get_samples(),
+					ha.get_host_outliers(), ha.get_outliers(), ha.get_correlation());
+		}
+
+		if (rate.is_active())
+		{
+			static const char *const conditions[] = {
+				"stable", "unstable", "overloaded", "unstable and overloaded"
+			};
+
+			display.printf ("  master period = %gms, condition = %s,\n",
+					master_period * 1e3, conditions[feedback_flags & 3]);
+		}
+
+		display.printf ("  startup = %.3fs, failovers = %" PRIu64 ", last gap = %.3fs, "
+				"max gap = %.3fs,\n",
+				startup_latency.value_or (NAN), failovers, last_failover_gap,
+				max_failover_gap);
 
-		prov->printf ("  delta_10_max = %es, delta_100_max = %es,\n"
-				"  delta_10_bar = %es, delta_100_bar = %es",
-				delta_10_max, delta_100_max, delta_10_bar, delta_100_bar);
+		display.printf ("  pulses received = %" PRIu64 ", lost = %" PRIu64
+				", duplicated = %" PRIu64 ", reordered = %" PRIu64
+				", utc offset mismatches = %" PRIu64,
+				pulses_received, pulses_lost, pulses_duplicated,
+				pulses_reordered, utc_offset_mismatches);
 
-		prov->flush();
+		display.end();
 	}
 }
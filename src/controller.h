@@ -4,26 +4,163 @@
 /** The controller which sends and receives frames, and therefore initiates
  * jitter calculations */
 
+#include <cmath>
+#include <cstdio>
 #include <optional>
+#include <string>
 #include "system_services.h"
+#include "screen.h"
+#include "statistics.h"
+#include "drift_estimator.h"
+#include "stability_analysis.h"
+#include "summary.h"
+#include "sample_filter.h"
+#include "snapshot.h"
+#include "timeseries_store.h"
+#include "shared_statistics.h"
+#include "spectral_analysis.h"
+#include "adaptive_rate.h"
+#include "latency_probe.h"
+
+/* Configuration of the controller */
+struct controller_config
+{
+	/* If not empty, each deviation sample is appended to this file as native
+	 * double, for later analysis. */
+	std::string deviation_log;
+
+	/* Period of the time signal in master mode */
+	uint32_t pulse_period_ms = 1000;
+
+	/* Interval at which slaves send deviation summaries to collectors, 0 to
+	 * disable them */
+	uint32_t summary_interval_ms = 10000;
+
+	/* Filtering of the samples; the filtered statistics are shown next to the
+	 * raw ones. */
+	sample_filter_config filter;
+
+	/* Let the provider drop time signal pulses from nodes with higher
+	 * addresses than the current master's early, e.g. in the kernel */
+	bool filter_by_master = false;
+
+	/* Time a starting node waits for the master to answer its discovery
+	 * request, 0 to wait for pulses only */
+	uint32_t discovery_window_ms = 10;
+
+	/* If not empty, the statistics and the master's identity are saved to
+	 * this file at `snapshot_interval_ms` and on exit, and restored on
+	 * startup if the snapshot is at most `snapshot_max_age_s` old and was
+	 * written on the same interface. */
+	std::string snapshot_path;
+	uint32_t snapshot_interval_ms = 10000;
+	uint32_t snapshot_max_age_s = 300;
+
+	/* If not empty, the deviation history is stored compressed with 1 s,
+	 * 1 min and 1 h rollups in files starting with this path. */
+	std::string history_path;
+	timeseries_store_config history;
+
+	/* If not empty, the state is published in the POSIX shared memory
+	 * segment of this name (e.g. /distributed_clock_jitter) for local
+	 * monitoring agents. */
+	std::string shm_name;
+
+	/* Spectral analysis of the deviation in a worker thread, which reports
+	 * the dominant periods */
+	spectral_config spectrum;
+
+	/* Let slaves send feedback about their condition and, as master, adapt
+	 * the pulse period to it between `adaptive.min_period_ms` and
+	 * `pulse_period_ms` */
+	adaptive_rate_config adaptive;
+
+	/* Let masters launch each pulse at the first boundary of the pulse period
+	 * that is at least this far ahead, scheduled by the kernel (SO_TXTIME),
+	 * and carry that time in the pulse; 0 to send pulses immediately */
+	uint32_t launch_lead_us = 0;
+
+	/* Measure the host's wakeup latency in a separate thread and attribute
+	 * outliers of the deviation to it */
+	latency_probe_config probe;
+};
 
 class controller
 {
 private:
 	std::shared_ptr<system_services::provider> prov;
+	controller_config config;
+	screen display;
 
 	/* The controller has two states: Master or slave. */
 	bool is_master;
 
+	/* Pulse period of the current master in seconds */
+	double master_period = 1;
+
 	/* A timer to determine if the master is alive */
 	system_services::provider::timer_registration master_alive_timer;
 	void master_alive_handler();
 
+	double takeover_backoff();
+	static uint32_t liveness_check_period (double pulse_period);
+
+	/* Failover convergence: the time from the last pulse of a lost master to
+	 * the first pulse of the next one */
+	std::optional<system_services::linear_time> failover_start;
+	uint64_t failovers = 0;
+	double last_failover_gap = 0;
+	double max_failover_gap = 0;
+
+	void failover_completed();
+
+	/* Discovery of the master at startup. Starting nodes with a lower
+	 * address than ours which answered our request are remembered for the
+	 * election. */
+	bool discovering = false;
+	mac_addr_t lowest_mac_discovered;
+	std::optional<system_services::provider::timer_registration> discovery_timer;
+
+	void send_discovery_message (uint16_t type);
+	void receive_discovery_message (const ethernet_frame &frame);
+	void discovery_timeout();
+
+	/* Startup latency: the time from starting until the first sample was
+	 * taken or we became master */
+	system_services::linear_time started;
+	std::optional<double> startup_latency;
+
+	void startup_completed();
+
 	/* A timer for sending the time signal if the controller is in master mode
 	 * */
 	std::optional<system_services::provider::timer_registration> time_signal_timer;
 	void time_signal_sender();
+	void register_pulse_timer();
+	uint32_t pulse_period_ms;
 	system_services::calendar_time last_pulse_sent_time;
+	system_services::linear_time master_since;
+	uint64_t next_sequence = 0;
+
+	/* Scheduled launch: planned time of the last pulse in ns since the TAI
+	 * epoch, its period, and boundaries missed because the sender ran late */
+	uint64_t last_launch = 0;
+	uint64_t last_launch_period = 0;
+	uint64_t launch_slips = 0;
+
+	/* Adaptive pulse rate. Slaves assess their condition every interval and
+	 * report it if it is not stable; masters adapt their period. */
+	adaptive_rate rate;
+	std::optional<system_services::provider::timer_registration> adaptive_timer;
+	void adaptive_rate_handler();
+
+	double feedback_frequency = NAN;
+	uint64_t feedback_received = 0;
+	uint64_t feedback_lost = 0;
+	uint8_t feedback_flags = 0;
+
+	void send_feedback();
+	void receive_feedback (const ethernet_frame &frame);
 
 	/* Receive ethernet frames */
 	system_services::provider::frame_subscriber_registration frame_subscriber;
@@ -32,8 +169,37 @@ private:
 
 	mac_addr_t lowest_mac_pulse_received;
 	system_services::linear_time time_last_pulse_received;
+
+	/* The master before the last loss, which ranks the takeover backoff */
+	mac_addr_t lost_master = {};
 	system_services::calendar_time last_pulse_received_time;
 
+	/* Sequence number tracking of version 2 pulses from the chosen master,
+	 * and the master's uptime and timestamp of the last new pulse */
+	bool sequence_valid = false;
+	uint64_t last_sequence = 0;
+	mac_addr_t sequence_master = {};
+	std::optional<uint64_t> last_master_uptime;
+	uint64_t last_sequence_tai = 0;
+
+	bool check_sequence (const time_signal_pulse &pulse);
+
+	/* Follow a new master's pulse period */
+	void set_master_period (double period);
+	void set_stability_interval (double tau0);
+
+	/* Compute the deviation of the local clock from a pulse's time */
+	double compute_deviation_v1 (const time_signal_pulse &pulse,
+			const system_services::calendar_time &utc);
+
+	double compute_deviation_v2 (uint64_t tai_timestamp, int16_t utc_offset,
+			const system_services::linear_time &tai);
+
+	/* Tell the provider which frames we need */
+	std::optional<uint64_t> filtered_master;
+	bool frame_filter_set = false;
+	void update_frame_filter();
+
 	/* Switch to master mode */
 	void enable_master_mode();
 
@@ -42,31 +208,89 @@ private:
 
 	/* Statistics */
 	/* Positive deviation means the local clock is behind the master's clock. */
-	double deviations[100] = { 0 };
+	windowed_statistics deviation_stats;
+
+	/* Statistics of the robustly filtered samples */
+	sample_filter filter;
+	windowed_statistics filtered_stats;
+
+	/* Offset and frequency error of the local clock, and the statistics of
+	 * the deviation with that trend removed. */
+	drift_estimator drift;
+	windowed_statistics residual_stats;
+
+	/* Allan deviation and TDEV over the deviation series. Its sampling
+	 * interval is the master's base period; samples of a master which adapts
+	 * its rate are decimated to it. */
+	stability_analyzer stability;
+	unsigned stability_skipped = 0;
+
+	/* Periodic disturbances; the last result is kept if the worker is busy
+	 * publishing a new one */
+	spectral_analyzer spectrum;
+	spectral_result spectrum_result;
+
+	/* Host wakeup latency. Each sample is tagged with its maximum since the
+	 * previous sample, which is correlated with the detrended deviation once
+	 * its window is filled. */
+	latency_probe probe;
+	latency_attribution host_attribution;
+	double sample_host_latency = NAN;
+	uint64_t probe_samples = 0;
+
+	/* The ring is drained periodically in any role, such that it does not
+	 * overrun while no samples are taken; this is the maximum drained since
+	 * the last sample. */
+	std::optional<system_services::provider::timer_registration> probe_timer;
+	double pending_host_latency = NAN;
+
+	void drain_probe();
+
+	/* Tag the next sample with the worst wakeup latency since the previous
+	 * one */
+	void take_host_latency();
+
+	FILE *deviation_log = nullptr;
+	std::optional<timeseries_store> history;
+
+	/* The deviations since the last summary was sent to collectors */
+	deviation_summary interval_summary;
+	std::optional<system_services::provider::timer_registration> summary_timer;
+	void summary_sender();
+
+	/* Pulse counters. Lost, duplicated and reordered pulses can only be
+	 * detected with version 2 pulses. */
+	uint64_t pulses_received = 0;
+	uint64_t pulses_lost = 0;
+	uint64_t pulses_duplicated = 0;
+	uint64_t pulses_reordered = 0;
+
+	/* Pulses whose master had a different TAI - UTC offset than we have,
+	 * i.e. around leap seconds */
+	uint64_t utc_offset_mismatches = 0;
 
-	/* Statistics on the deviation */
-	/* Moving window average over the last 10 resp. 100 measurements */
-	double mu_10 = 0;
-	double mu_100 = 0;
+	void update_statistics (double t, double new_deviation);
 
-	/* Maximum deviation (jitter, deviation from average deviation ;-)) from the
-	 * corresponding moving window average over the last 10 resp. 100
-	 * measurements */
-	double delta_10_max = 0;
-	double delta_100_max = 0;
+	/* Warm restart */
+	std::string snapshot_tmp_path;
+	snapshot_writer snapshot;
+	std::optional<system_services::provider::timer_registration> snapshot_timer;
 
-	/* Moving window average deviation (jitter) from the corresponding moving
-	 * window average over the last 10 resp. 100 measurements */
-	double delta_10_bar = 0;
-	double delta_100_bar = 0;
+	void save_snapshot();
+	bool build_snapshot();
+	bool load_snapshot();
 
-	void update_statistics (double new_deviation);
+	/* Publication of the state in shared memory */
+	std::optional<shared_statistics_writer> shared;
+	void publish_statistics();
 
 	/* Update the displayed values */
 	void update_display();
 
 public:
-	controller (std::shared_ptr<system_services::provider> prov);
+	controller (std::shared_ptr<system_services::provider> prov,
+			const controller_config &config = controller_config());
+	~controller();
 };
 
 #endif /* __CONTROLLER_H */
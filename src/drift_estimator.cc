@@ -0,0 +1,136 @@
+#include "drift_estimator.h"
+
+using namespace std;
+
+drift_estimator::drift_estimator (size_t window)
+	: window(window >= 2 ? window : 2), times(this->window), values(this->window)
+{
+}
+
+void drift_estimator::recompute_sums()
+{
+	/* Use the oldest sample in the window as new reference */
+	t_ref = times[count < window ? 0 : next];
+
+	sum_t = sum_tt = sum_x = sum_tx = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		double t = times[i] - t_ref;
+		double x = values[i];
+
+		sum_t += t;
+		sum_tt += t * t;
+		sum_x += x;
+		sum_tx += t * x;
+	}
+
+	since_recompute = 0;
+}
+
+void drift_estimator::fit()
+{
+	double n = count;
+	double det = n * sum_tt - sum_t * sum_t;
+
+	if (count < 2 || det <= 0)
+	{
+		frequency = 0;
+		offset = sum_x / n;
+		return;
+	}
+
+	frequency = (n * sum_tx - sum_t * sum_x) / det;
+	double intercept = (sum_x - frequency * sum_t) / n;
+	offset = intercept + frequency * (t_last - t_ref);
+}
+
+double drift_estimator::update (double t, double x)
+{
+	if (count == 0)
+		t_ref = t;
+
+	/* Remove the oldest sample if the window is full */
+	if (count == window)
+	{
+		double t_old = times[next] - t_ref;
+		double x_old = values[next];
+
+		sum_t -= t_old;
+		sum_tt -= t_old * t_old;
+		sum_x -= x_old;
+		sum_tx -= t_old * x_old;
+	}
+	else
+	{
+		count++;
+	}
+
+	times[next] = t;
+	values[next] = x;
+	next = (next + 1) % window;
+	t_last = t;
+
+	if (++since_recompute >= window)
+	{
+		recompute_sums();
+	}
+	else
+	{
+		double tr = t - t_ref;
+
+		sum_t += tr;
+		sum_tt += tr * tr;
+		sum_x += x;
+		sum_tx += tr * x;
+	}
+
+	fit();
+	return x - offset;
+}
+
+double drift_estimator::get_offset() const
+{
+	return offset;
+}
+
+double drift_estimator::get_frequency_ppb() const
+{
+	return frequency * 1e9;
+}
+
+void drift_estimator::save (snapshot_writer &w) const
+{
+	w.put_vector (times);
+	w.put_vector (values);
+	w.put (next);
+	w.put (count);
+	w.put (t_last);
+}
+
+bool drift_estimator::load (snapshot_reader &r, double time_shift)
+{
+	if (!r.get_vector (times) || !r.get_vector (values) ||
+			!r.get (next) || !r.get (count) || !r.get (t_last))
+	{
+		return false;
+	}
+
+	if (next >= window || count > window || count == 0)
+		return false;
+
+	for (size_t i = 0; i < count; i++)
+		times[i] += time_shift;
+
+	t_last += time_shift;
+
+	/* The sums are recomputed from the window */
+	recompute_sums();
+	fit();
+	return true;
+}
+
+size_t drift_estimator::get_count() const
+{
+	return count;
+}
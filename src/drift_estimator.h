@@ -0,0 +1,72 @@
+#ifndef __DRIFT_ESTIMATOR_H
+#define __DRIFT_ESTIMATOR_H
+
+/** Online estimation of a clock's offset and frequency error from a series of
+ * deviation samples */
+
+#include <cstddef>
+#include <vector>
+#include "snapshot.h"
+
+/* Fits a line to the samples of a sliding window by least squares. The sums
+ * the fit is computed from are updated incrementally, hence each sample costs
+ * O(1) regardless of the window size. To bound the accumulated rounding error
+ * they are recomputed from the window once it has been replaced completely,
+ * which amortizes to O(1), too. */
+class drift_estimator
+{
+protected:
+	size_t window;
+
+	/* Ring buffer of the samples in the window */
+	std::vector<double> times;
+	std::vector<double> values;
+	size_t next = 0;
+	size_t count = 0;
+	size_t since_recompute = 0;
+
+	/* Times in the sums are relative to this reference to keep their
+	 * magnitude small. */
+	double t_ref = 0;
+
+	double sum_t = 0;
+	double sum_tt = 0;
+	double sum_x = 0;
+	double sum_tx = 0;
+
+	/* Current fit x(t) = offset + frequency * (t - t_last) */
+	double t_last = 0;
+	double offset = 0;
+	double frequency = 0;
+
+	void recompute_sums();
+	void fit();
+
+public:
+	drift_estimator (size_t window = 100);
+
+	/** Add a sample.
+	 * @param t Local (monotonic) time of the sample in seconds
+	 * @param x The deviation in seconds
+	 * @returns The sample's residual after removing the trend */
+	double update (double t, double x);
+
+	/** @returns The estimated deviation at the time of the last sample in
+	 * seconds */
+	double get_offset() const;
+
+	/** @returns The estimated frequency error in parts per billion. A positive
+	 * value means that the local clock runs slower than the master's clock. */
+	double get_frequency_ppb() const;
+
+	size_t get_count() const;
+
+	/** Save resp. restore the window. Loading fails if the window size
+	 * differs.
+	 * @param time_shift Added to the restored times, to continue with a
+	 * 		different time base */
+	void save (snapshot_writer &w) const;
+	bool load (snapshot_reader &r, double time_shift);
+};
+
+#endif /* __DRIFT_ESTIMATOR_H */
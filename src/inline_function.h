@@ -0,0 +1,144 @@
+#ifndef __INLINE_FUNCTION_H
+#define __INLINE_FUNCTION_H
+
+/** A replacement for std::function which stores the callable inside the
+ * object instead of on the heap. Callables which do not fit are rejected at
+ * compile time. */
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <typename Signature, size_t Capacity = 32>
+class inline_function;
+
+template <typename R, typename... Args, size_t Capacity>
+class inline_function<R(Args...), Capacity>
+{
+protected:
+	enum class operation
+	{
+		copy,
+		move,
+		destroy
+	};
+
+	alignas(std::max_align_t) unsigned char storage[Capacity];
+
+	R (*invoke_fn)(void *f, Args... args) = nullptr;
+	void (*manage_fn)(operation op, void *dst, void *src) = nullptr;
+
+	template <typename F>
+	static R invoke (void *f, Args... args)
+	{
+		return (*static_cast<F*>(f))(std::forward<Args>(args)...);
+	}
+
+	template <typename F>
+	static void manage (operation op, void *dst, void *src)
+	{
+		switch (op)
+		{
+		case operation::copy:
+			new (dst) F(*static_cast<const F*>(src));
+			break;
+
+		case operation::move:
+			new (dst) F(std::move(*static_cast<F*>(src)));
+			break;
+
+		case operation::destroy:
+			static_cast<F*>(dst)->~F();
+			break;
+		}
+	}
+
+	void assign (operation op, const inline_function &o)
+	{
+		if (o.manage_fn)
+			o.manage_fn (op, storage, const_cast<unsigned char*>(o.storage));
+
+		invoke_fn = o.invoke_fn;
+		manage_fn = o.manage_fn;
+	}
+
+	void reset()
+	{
+		if (manage_fn)
+			manage_fn (operation::destroy, storage, nullptr);
+
+		invoke_fn = nullptr;
+		manage_fn = nullptr;
+	}
+
+public:
+	inline_function()
+	{}
+
+	inline_function (std::nullptr_t)
+	{}
+
+	template <typename F, typename = std::enable_if_t<
+		!std::is_same_v<std::decay_t<F>, inline_function>>>
+	inline_function (F &&f)
+	{
+		using T = std::decay_t<F>;
+
+		static_assert (sizeof(T) <= Capacity, "callable too large for inline_function");
+		static_assert (alignof(T) <= alignof(std::max_align_t), "callable overaligned");
+
+		new (storage) T(std::forward<F>(f));
+		invoke_fn = &invoke<T>;
+		manage_fn = &manage<T>;
+	}
+
+	inline_function (const inline_function &o)
+	{
+		assign (operation::copy, o);
+	}
+
+	inline_function (inline_function &&o)
+	{
+		assign (operation::move, o);
+	}
+
+	inline_function& operator= (const inline_function &o)
+	{
+		if (this != &o)
+		{
+			reset();
+			assign (operation::copy, o);
+		}
+
+		return *this;
+	}
+
+	inline_function& operator= (inline_function &&o)
+	{
+		if (this != &o)
+		{
+			reset();
+			assign (operation::move, o);
+		}
+
+		return *this;
+	}
+
+	~inline_function()
+	{
+		reset();
+	}
+
+	R operator() (Args... args) const
+	{
+		return invoke_fn (const_cast<unsigned char*>(storage), std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const
+	{
+		return invoke_fn;
+	}
+};
+
+#endif /* __INLINE_FUNCTION_H */
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "errno_exception.h"
+#include "latency_probe.h"
+
+using namespace std;
+
+latency_probe::latency_probe (const latency_probe_config &config)
+	: config(config)
+{
+	if (!is_active())
+		return;
+
+	worker = thread ([this]() { run(); });
+
+	if (config.priority > 0)
+	{
+		struct sched_param p = {};
+		p.sched_priority = config.priority;
+
+		int err = pthread_setschedparam (worker.native_handle(), SCHED_FIFO, &p);
+		if (err)
+		{
+			stop();
+			throw errno_exception ("pthread_setschedparam(SCHED_FIFO)", err);
+		}
+	}
+}
+
+latency_probe::~latency_probe()
+{
+	stop();
+}
+
+void latency_probe::stop()
+{
+	if (!worker.joinable())
+		return;
+
+	{
+		lock_guard<mutex> l(stop_m);
+		stopping = true;
+	}
+
+	stop_cv.notify_one();
+	worker.join();
+}
+
+bool latency_probe::is_active() const
+{
+	return config.interval_us > 0;
+}
+
+const latency_probe_config &latency_probe::get_config() const
+{
+	return config;
+}
+
+uint32_t latency_probe::get_drain_period_ms() const
+{
+	return max<uint64_t> ((uint64_t) config.interval_us * RING_SIZE / 4 / 1000, 1);
+}
+
+void latency_probe::run()
+{
+	const int64_t interval = config.interval_us * 1000LL;
+	uint32_t carry = 0;
+
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	int64_t deadline = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	/* The steady clock is CLOCK_MONOTONIC; waiting for the absolute deadline
+	 * on a condition variable sleeps on a high resolution timer like
+	 * clock_nanosleep, but lets stop() wake us. */
+	unique_lock<mutex> l(stop_m);
+
+	for (;;)
+	{
+		deadline += interval;
+
+		if (stop_cv.wait_until (l, chrono::steady_clock::time_point (chrono::nanoseconds (deadline)),
+					[this]() { return stopping; }))
+			return;
+
+		clock_gettime (CLOCK_MONOTONIC, &ts);
+		int64_t now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		uint32_t latency = min<int64_t> (max<int64_t> (now - deadline, 0), UINT32_MAX);
+
+		/* Deadlines which passed while we slept are skipped; the latency
+		 * already shows them. */
+		if (now - deadline >= interval)
+			deadline += (now - deadline) / interval * interval;
+
+		uint64_t h = head.load (memory_order_relaxed);
+		if (h - tail.load (memory_order_acquire) < RING_SIZE)
+		{
+			ring[h & (RING_SIZE - 1)] = max (latency, carry);
+			head.store (h + 1, memory_order_release);
+			carry = 0;
+		}
+		else
+		{
+			carry = max (latency, carry);
+			overruns.fetch_add (1, memory_order_relaxed);
+		}
+	}
+}
+
+double latency_probe::drain()
+{
+	uint64_t t = tail.load (memory_order_relaxed);
+	uint64_t h = head.load (memory_order_acquire);
+
+	if (t == h)
+		return NAN;
+
+	uint32_t m = 0;
+	wakeups += h - t;
+
+	for (; t != h; t++)
+		m = max (m, ring[t & (RING_SIZE - 1)]);
+
+	tail.store (t, memory_order_release);
+
+	max_latency_ns = max (max_latency_ns, m);
+	return m * 1e-9;
+}
+
+uint64_t latency_probe::get_wakeups() const
+{
+	return wakeups;
+}
+
+uint64_t latency_probe::get_overruns() const
+{
+	return overruns.load (memory_order_relaxed);
+}
+
+double latency_probe::get_max_latency() const
+{
+	return max_latency_ns * 1e-9;
+}
+
+
+latency_attribution::latency_attribution (const latency_probe_config &config)
+	: config(config)
+{
+}
+
+void latency_attribution::add (double latency, double deviation, double mean_abs_deviation)
+{
+	samples++;
+
+	double dl = latency - mean_latency;
+	mean_latency += dl / samples;
+
+	double dd = deviation - mean_deviation;
+	mean_deviation += dd / samples;
+
+	m2_latency += dl * (latency - mean_latency);
+	m2_deviation += dd * (deviation - mean_deviation);
+	co_moment += dl * (deviation - mean_deviation);
+
+	bool host = latency > config.threshold_us * 1e-6;
+	if (host)
+		host_samples++;
+
+	if (deviation > config.outlier_factor * mean_abs_deviation)
+	{
+		outliers++;
+		if (host)
+			host_outliers++;
+	}
+}
+
+uint64_t latency_attribution::get_samples() const
+{
+	return samples;
+}
+
+uint64_t latency_attribution::get_outliers() const
+{
+	return outliers;
+}
+
+uint64_t latency_attribution::get_host_outliers() const
+{
+	return host_outliers;
+}
+
+uint64_t latency_attribution::get_host_samples() const
+{
+	return host_samples;
+}
+
+double latency_attribution::get_correlation() const
+{
+	if (m2_latency <= 0 || m2_deviation <= 0)
+		return NAN;
+
+	return co_moment / sqrt (m2_latency * m2_deviation);
+}
@@ -0,0 +1,132 @@
+#ifndef __LATENCY_PROBE_H
+#define __LATENCY_PROBE_H
+
+/** A host wakeup latency probe like cyclictest: a thread sleeps until
+ * absolute CLOCK_MONOTONIC deadlines and records how late it woke up in a
+ * lock-free single producer, single consumer ring. The controller drains the
+ * ring with each pulse, which tags the sample with the host's worst latency
+ * since the previous one, and correlates it with the deviation's outliers.
+ * Outliers which coincide with high host latency were likely caused by the
+ * local host rather than by the network or the master. */
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+struct latency_probe_config
+{
+	/* Interval between two wakeups in us, 0 disables the probe */
+	uint32_t interval_us = 0;
+
+	/* SCHED_FIFO priority of the probe's thread, 0 to keep SCHED_OTHER like
+	 * the controller's */
+	int priority = 0;
+
+	/* Samples whose host latency exceeds this are attributed to the host */
+	double threshold_us = 100;
+
+	/* Samples whose detrended deviation differs from the mean of the last
+	 * 100 by more than k times their mean absolute deviation are outliers */
+	double outlier_factor = 4;
+};
+
+class latency_probe
+{
+protected:
+	/* A power of two. If the controller does not drain the ring in time,
+	 * the probe keeps the maximum of the latencies which did not fit and
+	 * stores it once there is room. */
+	static constexpr uint64_t RING_SIZE = 8192;
+
+	latency_probe_config config;
+
+	/* Latencies in ns; the probe's thread writes at head, the controller reads
+	 * at tail */
+	uint32_t ring[RING_SIZE];
+	alignas(64) std::atomic<uint64_t> head { 0 };
+	alignas(64) std::atomic<uint64_t> tail { 0 };
+	std::atomic<uint64_t> overruns { 0 };
+
+	/* stop() wakes the probe's thread rather than waiting for its deadline */
+	std::mutex stop_m;
+	std::condition_variable stop_cv;
+	bool stopping = false;
+
+	/* Controller: the latencies drained so far */
+	uint64_t wakeups = 0;
+	uint32_t max_latency_ns = 0;
+
+	std::thread worker;
+
+	void run();
+	void stop();
+
+public:
+	latency_probe (const latency_probe_config &config = latency_probe_config());
+	~latency_probe();
+
+	latency_probe (const latency_probe&) = delete;
+	latency_probe &operator= (const latency_probe&) = delete;
+
+	bool is_active() const;
+	const latency_probe_config &get_config() const;
+
+	/** @returns The period in ms at which the ring should be drained, a
+	 * quarter of the time the probe takes to fill it */
+	uint32_t get_drain_period_ms() const;
+
+	/** Take the latencies recorded since the last call, without blocking or
+	 * allocating.
+	 * @returns Their maximum in seconds, NaN if there were none */
+	double drain();
+
+	/** Counts of the drained latencies, of wakeups whose latency did not fit
+	 * into the ring, and the maximum latency in seconds */
+	uint64_t get_wakeups() const;
+	uint64_t get_overruns() const;
+	double get_max_latency() const;
+};
+
+/** Correlation of the samples' host latency with their deviation from the
+ * moving average */
+class latency_attribution
+{
+protected:
+	latency_probe_config config;
+
+	/* Pearson correlation by Welford's method */
+	uint64_t samples = 0;
+	double mean_latency = 0;
+	double mean_deviation = 0;
+	double m2_latency = 0;
+	double m2_deviation = 0;
+	double co_moment = 0;
+
+	uint64_t outliers = 0;
+	uint64_t host_outliers = 0;
+	uint64_t host_samples = 0;
+
+public:
+	latency_attribution (const latency_probe_config &config = latency_probe_config());
+
+	/** Add a sample with the host latency in seconds, its absolute deviation
+	 * from the moving average and that average's mean absolute deviation */
+	void add (double latency, double deviation, double mean_abs_deviation);
+
+	uint64_t get_samples() const;
+
+	/** @returns The number of outliers and of those with high host latency */
+	uint64_t get_outliers() const;
+	uint64_t get_host_outliers() const;
+
+	/** @returns The number of samples with high host latency */
+	uint64_t get_host_samples() const;
+
+	/** @returns The correlation coefficient of host latency and absolute
+	 * deviation, NaN without variation */
+	double get_correlation() const;
+};
+
+#endif /* __LATENCY_PROBE_H */
@@ -0,0 +1,144 @@
+#include <cerrno>
+#include "errno_exception.h"
+#include "linux_clock_comparison.h"
+
+using namespace std;
+
+/* Reads per measurement of a clock's reading cost */
+static constexpr unsigned COST_READS = 64;
+
+clock_comparison::clock_pair::clock_pair (clockid_t clock, const char *name)
+	: clock(clock), name(name)
+{
+}
+
+clock_comparison::clock_comparison (unsigned brackets)
+	: ref_clock(CLOCK_MONOTONIC_RAW), brackets(brackets ? brackets : 1)
+{
+	pairs.emplace_back (CLOCK_REALTIME, "realtime");
+	pairs.emplace_back (CLOCK_TAI, "tai");
+	pairs.emplace_back (CLOCK_MONOTONIC, "monotonic");
+
+	costs.push_back ({ CLOCK_MONOTONIC_RAW, "monotonic_raw", {} });
+	costs.push_back ({ CLOCK_MONOTONIC, "monotonic", {} });
+	costs.push_back ({ CLOCK_REALTIME, "realtime", {} });
+	costs.push_back ({ CLOCK_TAI, "tai", {} });
+}
+
+int64_t clock_comparison::read_clock (clockid_t clock)
+{
+	struct timespec ts;
+
+	if (clock_gettime (clock, &ts) < 0)
+		throw errno_exception ("clock_gettime", errno);
+
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int64_t clock_comparison::bracketed_read (clockid_t clock, int64_t &offset)
+{
+	int64_t best_width = INT64_MAX;
+
+	for (unsigned i = 0; i < brackets; i++)
+	{
+		auto before = read_clock (ref_clock);
+		auto t = read_clock (clock);
+		auto after = read_clock (ref_clock);
+
+		if (after - before < best_width)
+		{
+			best_width = after - before;
+			offset = t - (before + best_width / 2);
+		}
+	}
+
+	return best_width;
+}
+
+double clock_comparison::measure_cost (clockid_t clock)
+{
+	auto start = read_clock (ref_clock);
+
+	for (unsigned i = 0; i < COST_READS; i++)
+		read_clock (clock);
+
+	auto end = read_clock (ref_clock);
+	return (double) (end - start) / COST_READS;
+}
+
+void clock_comparison::sample()
+{
+	auto now = read_clock (ref_clock);
+	if (samples == 0)
+		t0 = now;
+
+	double t = (now - t0) * 1e-9;
+
+	for (auto &p : pairs)
+	{
+		int64_t offset = 0;
+		auto width = bracketed_read (p.clock, offset);
+
+		if (samples == 0)
+			p.offset0 = offset;
+
+		double x = (offset - p.offset0) * 1e-9;
+
+		p.offset_stats.update (x);
+		p.residual_stats.update (p.drift.update (t, x));
+		p.bracket_width.add (width * 1e-9);
+	}
+
+	for (auto &c : costs)
+		c.cost.add (measure_cost (c.clock) * 1e-9);
+
+	samples++;
+}
+
+unsigned clock_comparison::print (FILE *f) const
+{
+	unsigned lines = 0;
+
+	fprintf (f, "%llu samples, reference clock monotonic_raw\n",
+			(unsigned long long) samples);
+	lines++;
+
+	for (auto &p : pairs)
+	{
+		auto &os = p.offset_stats;
+		auto &rs = p.residual_stats;
+
+		fprintf (f, "  %s: offset change = %es, slew = %+.3fppb, bracket = %.0fns\n"
+				"    delta_10_max = %es, delta_100_max = %es, delta_100_bar = %es\n"
+				"    detrended delta_10_max = %es, delta_100_max = %es, delta_100_bar = %es\n",
+				p.name, os.current(), p.drift.get_frequency_ppb(),
+				p.bracket_width.min * 1e9,
+				os.delta_10_max(), os.delta_100_max(), os.delta_100_bar(),
+				rs.delta_10_max(), rs.delta_100_max(), rs.delta_100_bar());
+		lines += 3;
+	}
+
+	fprintf (f, "  read cost [ns] (mean / max):");
+	for (auto &c : costs)
+		fprintf (f, " %s %.0f / %.0f", c.name, c.cost.mean() * 1e9, c.cost.max * 1e9);
+
+	fprintf (f, "\n");
+	lines++;
+
+	return lines;
+}
+
+uint64_t clock_comparison::get_sample_count() const
+{
+	return samples;
+}
+
+const vector<clock_comparison::clock_pair>& clock_comparison::get_pairs() const
+{
+	return pairs;
+}
+
+const vector<clock_comparison::clock_cost>& clock_comparison::get_costs() const
+{
+	return costs;
+}
@@ -0,0 +1,87 @@
+#ifndef __LINUX_CLOCK_COMPARISON_H
+#define __LINUX_CLOCK_COMPARISON_H
+
+/** Comparison of the local clocks against each other, to separate the jitter
+ * which the local clocks add (e.g. by NTP/PTP slewing CLOCK_REALTIME) from the
+ * jitter of the network */
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <time.h>
+#include "statistics.h"
+#include "drift_estimator.h"
+#include "summary.h"
+
+class clock_comparison
+{
+public:
+	/* The offset of a clock relative to the reference clock */
+	struct clock_pair
+	{
+		clockid_t clock;
+		const char *name;
+
+		/* Offset of the first sample; the samples are relative to it to
+		 * keep them representable with ns resolution as double. */
+		int64_t offset0 = 0;
+
+		/* Statistics of the offset like those of the controller's
+		 * deviation; the drift estimator's frequency is the rate at which
+		 * the clock is slewed. */
+		windowed_statistics offset_stats;
+		drift_estimator drift;
+		windowed_statistics residual_stats;
+
+		/* Widths of the narrowest bracket of each sample */
+		deviation_summary bracket_width;
+
+		clock_pair (clockid_t clock, const char *name);
+	};
+
+	/* The cost of reading a clock */
+	struct clock_cost
+	{
+		clockid_t clock;
+		const char *name;
+		deviation_summary cost;
+	};
+
+protected:
+	clockid_t ref_clock;
+	unsigned brackets;
+
+	std::vector<clock_pair> pairs;
+	std::vector<clock_cost> costs;
+
+	uint64_t samples = 0;
+	int64_t t0 = 0;
+
+	static int64_t read_clock (clockid_t clock);
+
+	/** Read the clock between two reads of the reference clock several times
+	 * and keep the narrowest bracket.
+	 * @param offset Set to the clock's time minus the bracket's midpoint
+	 * @returns The bracket's width in ns */
+	int64_t bracketed_read (clockid_t clock, int64_t &offset);
+
+	/** @returns The mean time of one read of the clock in ns */
+	double measure_cost (clockid_t clock);
+
+public:
+	/** @param brackets Number of bracketed reads per sample, of which the
+	 * 		narrowest one is used */
+	clock_comparison (unsigned brackets = 16);
+
+	/** Take one sample of each clock pair and of the reading costs */
+	void sample();
+
+	/** Print the current statistics, returns the number of lines printed */
+	unsigned print (FILE *f) const;
+
+	uint64_t get_sample_count() const;
+	const std::vector<clock_pair>& get_pairs() const;
+	const std::vector<clock_cost>& get_costs() const;
+};
+
+#endif /* __LINUX_CLOCK_COMPARISON_H */
@@ -0,0 +1,303 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <time.h>
+#include "errno_exception.h"
+#include "linux_flood_provider.h"
+#include "protocol.h"
+
+using namespace std;
+
+/* Options without short form */
+enum
+{
+	OPT_TX_RING = 256
+};
+
+void print_usage (const char *name)
+{
+	printf ("Usage: %s [options] <interface name>\n\n"
+			"Send time signal pulses or other frames of the protocol's ethertype\n"
+			"at a given rate, to stress-test receivers.\n\n"
+			"Options:\n"
+			"  -m, --mode <mode>           Send pulses (pulse, default) or frames with\n"
+			"                              an unknown message type (noise)\n"
+			"  -r, --rate <frames/s>       Total rate, 0 for as fast as possible\n"
+			"                              (default: 1000)\n"
+			"  -n, --sources <n>           Number of source addresses (default: 1)\n"
+			"  -a, --source <address>      First source address; the others follow\n"
+			"                              it (default: 02:ff:00:00:00:00)\n"
+			"  -s, --size <bytes>          Payload size of noise frames (default: 46)\n"
+			"  -d, --duration <seconds>    Stop after <seconds> (default: run until\n"
+			"                              interrupted)\n"
+			"  -b, --batch <n>             Frames per system call (default: 64)\n"
+			"      --tx-ring               Send through a PACKET_TX_RING instead of\n"
+			"                              with sendmmsg\n"
+			"  -h, --help                  Show this help\n",
+			name);
+}
+
+bool parse_mac (const char *s, mac_addr_t &mac)
+{
+	unsigned b[6];
+	char end;
+
+	if (sscanf (s, "%x:%x:%x:%x:%x:%x%c", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end) != 6)
+		return false;
+
+	for (int i = 0; i < 6; i++)
+	{
+		if (b[i] > 0xff)
+			return false;
+
+		mac[i] = b[i];
+	}
+
+	return true;
+}
+
+double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+	try
+	{
+		static const struct option long_options[] = {
+			{ "mode", required_argument, nullptr, 'm' },
+			{ "rate", required_argument, nullptr, 'r' },
+			{ "sources", required_argument, nullptr, 'n' },
+			{ "source", required_argument, nullptr, 'a' },
+			{ "size", required_argument, nullptr, 's' },
+			{ "duration", required_argument, nullptr, 'd' },
+			{ "batch", required_argument, nullptr, 'b' },
+			{ "tx-ring", no_argument, nullptr, OPT_TX_RING },
+			{ "help", no_argument, nullptr, 'h' },
+			{ nullptr, 0, nullptr, 0 }
+		};
+
+		bool noise = false;
+		double rate = 1000;
+		unsigned sources = 1;
+		mac_addr_t first_source = { 0x02, 0xff, 0, 0, 0, 0 };
+		size_t noise_size = 46;
+		double duration = 0;
+		system_services::flood_config config;
+
+		int opt;
+		while ((opt = getopt_long (argc, argv, "m:r:n:a:s:d:b:h", long_options, nullptr)) != -1)
+		{
+			switch (opt)
+			{
+			case 'm':
+				if (strcmp (optarg, "pulse") == 0)
+					noise = false;
+				else if (strcmp (optarg, "noise") == 0)
+					noise = true;
+				else
+				{
+					fprintf (stderr, "Invalid mode: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'r':
+				rate = atof (optarg);
+				break;
+
+			case 'n':
+				sources = atoi (optarg);
+				if (sources == 0)
+				{
+					fprintf (stderr, "Invalid number of sources: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'a':
+				if (!parse_mac (optarg, first_source))
+				{
+					fprintf (stderr, "Invalid address: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 's':
+				noise_size = atoi (optarg);
+				if (noise_size < 2 || noise_size > 1500)
+				{
+					fprintf (stderr, "Invalid size: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'd':
+				duration = atof (optarg);
+				break;
+
+			case 'b':
+				config.batch = atoi (optarg);
+				if (config.batch == 0)
+				{
+					fprintf (stderr, "Invalid batch size: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case OPT_TX_RING:
+				config.tx_ring = true;
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return EXIT_SUCCESS;
+
+			default:
+				print_usage (argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (argc - optind != 1)
+		{
+			print_usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		auto prov = system_services::linux_flood_provider::create(argv[optind], config);
+
+		/* The frame of each source; pulses get their time and sequence
+		 * number when they are sent. */
+		vector<ethernet_frame> frames(sources);
+		vector<uint64_t> sequences(sources);
+		uint64_t base = mac_to_uint64 (first_source);
+
+		time_signal_pulse pulse;
+		if (rate > 0)
+			pulse.pulse_period_us = sources * 1e6 / rate;
+
+		for (unsigned i = 0; i < sources; i++)
+		{
+			auto &frame = frames[i];
+
+			if (noise)
+			{
+				memset (frame.dst, 0xff, sizeof(frame.dst));
+				frame.ether_type = ETHER_TYPE_CLOCK_JITTER;
+				memset (frame.data, 0, noise_size);
+				write_be16 (frame.data, 0xffff);
+				frame.data_size = noise_size;
+			}
+
+			uint64_t src = base + i;
+			write_be16 (frame.src, src >> 32);
+			write_be32 (frame.src + 2, src);
+		}
+
+		int16_t utc_offset = prov->get_utc_offset();
+
+		double start = monotonic_seconds();
+		double last_report = start;
+		uint64_t sent = 0;
+		uint64_t last_sent = 0;
+		uint64_t last_syscalls = 0;
+
+		for (;;)
+		{
+			double now = monotonic_seconds();
+			double elapsed = now - start;
+
+			if (duration > 0 && elapsed >= duration)
+				break;
+
+			if (now - last_report >= 1)
+			{
+				prov->flush_frames();
+
+				auto &stats = prov->get_loop_statistics();
+				uint64_t frames = sent - last_sent;
+
+				printf ("%.0f frames/s, %.2f system calls per frame, %llu dropped\n",
+						frames / (now - last_report),
+						frames ? (double) (stats.syscalls - last_syscalls) / frames : 0.,
+						(unsigned long long) prov->get_frames_dropped());
+				fflush (stdout);
+
+				last_report = now;
+				last_sent = sent;
+				last_syscalls = stats.syscalls;
+			}
+
+			/* Frames that are due now */
+			uint64_t due = rate > 0 ? (uint64_t) (rate * elapsed) + 1 : sent + config.batch;
+			if (due <= sent)
+			{
+				/* Sleep if the next frame is far enough in the future,
+				 * otherwise spin */
+				prov->flush_frames();
+
+				double wait = (sent + 1) / rate - elapsed;
+				if (wait > 100e-6)
+				{
+					struct timespec ts = { 0, (long) ((wait - 50e-6) * 1e9) };
+					nanosleep (&ts, nullptr);
+				}
+
+				continue;
+			}
+
+			uint64_t cnt = due - sent;
+			if (cnt > config.batch)
+				cnt = config.batch;
+
+			for (uint64_t i = 0; i < cnt; i++, sent++)
+			{
+				unsigned s = sent % sources;
+
+				if (!noise)
+				{
+					auto tai = prov->get_tai();
+
+					pulse.sequence = sequences[s]++;
+					pulse.tai_timestamp = tai.seconds * 1000000000 + tai.nanoseconds;
+					pulse.utc_offset = utc_offset;
+
+					auto frame = pulse.to_frame();
+					memcpy (frame.src, frames[s].src, sizeof(frame.src));
+					prov->send_frame (frame);
+				}
+				else
+				{
+					prov->send_frame (frames[s]);
+				}
+			}
+
+			/* Send what is due right away; frames are batched when the
+			 * rate is too high to send them one by one. */
+			prov->flush_frames();
+		}
+
+		prov->flush_frames();
+
+		auto &stats = prov->get_loop_statistics();
+		printf ("%llu frames sent, %llu dropped, %llu system calls\n",
+				(unsigned long long) stats.frames_sent,
+				(unsigned long long) prov->get_frames_dropped(),
+				(unsigned long long) stats.syscalls);
+
+		return EXIT_SUCCESS;
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "Error: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
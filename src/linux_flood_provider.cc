@@ -0,0 +1,263 @@
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "linux_flood_provider.h"
+
+using namespace std;
+
+namespace system_services
+{
+
+class linux_flood_provider_pi : public linux_flood_provider
+{
+public:
+	linux_flood_provider_pi(const string &if_name, const flood_config &config)
+		: linux_flood_provider(if_name, config)
+	{}
+};
+
+shared_ptr<linux_flood_provider> linux_flood_provider::create(
+		const string &if_name, const flood_config &config)
+{
+	return make_shared<linux_flood_provider_pi>(if_name, config);
+}
+
+linux_flood_provider::linux_flood_provider(const string &if_name, const flood_config &config)
+	: linux_provider(if_name), config(config)
+{
+	if (this->config.batch == 0)
+		this->config.batch = 1;
+
+	/* The base class' packet socket would receive a copy of each frame we
+	 * send; let it drop everything. */
+	filter_program = { BPF_STMT(BPF_RET | BPF_K, 0) };
+	attach_filter (frame_socket);
+
+	try
+	{
+		/* Protocol 0: the socket does not receive any frames */
+		raw_socket = socket (AF_PACKET, SOCK_RAW, 0);
+		if (raw_socket < 0)
+			throw errno_exception("socket(AF_PACKET, SOCK_RAW)", errno);
+
+		if (this->config.tx_ring)
+		{
+			setup_tx_ring();
+		}
+		else
+		{
+			batch_buf.resize (this->config.batch * FRAME_SIZE);
+			iovs.resize (this->config.batch);
+			msgs.resize (this->config.batch);
+
+			for (unsigned i = 0; i < this->config.batch; i++)
+			{
+				iovs[i].iov_base = batch_buf.data() + i * FRAME_SIZE;
+				msgs[i] = {};
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+		}
+
+		struct sockaddr_ll addr = {
+			.sll_family = AF_PACKET,
+			.sll_protocol = 0,
+			.sll_ifindex = if_index,
+			.sll_hatype = 0,
+			.sll_pkttype = 0,
+			.sll_halen = 0
+		};
+
+		if (bind (raw_socket, (const sockaddr*) &addr, sizeof(addr)) < 0)
+			throw errno_exception("bind", errno);
+
+		/* Hand the frames to the driver directly; this is not supported by
+		 * all kernels, hence failing is not fatal. */
+		int one = 1;
+		setsockopt (raw_socket, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+	}
+	catch (...)
+	{
+		cleanup();
+		throw;
+	}
+}
+
+linux_flood_provider::~linux_flood_provider()
+{
+	cleanup();
+}
+
+void linux_flood_provider::setup_tx_ring()
+{
+	int version = TPACKET_V2;
+	if (setsockopt (raw_socket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+		throw errno_exception("setsockopt(PACKET_VERSION)", errno);
+
+	struct tpacket_req req = {
+		.tp_block_size = 16 * FRAME_SIZE,
+		.tp_block_nr = RING_FRAMES / 16,
+		.tp_frame_size = FRAME_SIZE,
+		.tp_frame_nr = RING_FRAMES
+	};
+
+	if (setsockopt (raw_socket, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+		throw errno_exception("setsockopt(PACKET_TX_RING)", errno);
+
+	ring_size = (size_t) RING_FRAMES * FRAME_SIZE;
+
+	void *map = mmap (nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, raw_socket, 0);
+	if (map == MAP_FAILED)
+		throw errno_exception("mmap(PACKET_TX_RING)", errno);
+
+	ring = (unsigned char*) map;
+}
+
+void linux_flood_provider::cleanup()
+{
+	if (ring)
+	{
+		munmap (ring, ring_size);
+		ring = nullptr;
+	}
+
+	if (raw_socket >= 0)
+	{
+		close (raw_socket);
+		raw_socket = -1;
+	}
+}
+
+size_t linux_flood_provider::serialize (unsigned char *p, const ethernet_frame &frame)
+{
+	static const mac_addr_t zero_mac = {};
+
+	size_t len = 14 + frame.data_size;
+
+	memcpy (p, frame.dst, 6);
+	memcpy (p + 6, memcmp (frame.src, zero_mac, 6) ? frame.src : own_mac_address, 6);
+	write_be16 (p + 12, frame.ether_type);
+	memcpy (p + 14, frame.data, frame.data_size);
+
+	if (len < 60)
+	{
+		memset (p + len, 0, 60 - len);
+		len = 60;
+	}
+
+	return len;
+}
+
+unsigned char *linux_flood_provider::next_ring_frame()
+{
+	auto hdr = (struct tpacket2_hdr*) (ring + (size_t) ring_pos * FRAME_SIZE);
+
+	for (;;)
+	{
+		auto status = __atomic_load_n (&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+		if (status == TP_STATUS_AVAILABLE)
+			return (unsigned char*) hdr;
+
+		if (status == TP_STATUS_WRONG_FORMAT)
+			throw errno_exception("PACKET_TX_RING", EINVAL);
+
+		/* The ring is full; let the kernel send the pending frames and wait
+		 * for them to complete. */
+		flush_frames();
+
+		struct pollfd pfd = { raw_socket, POLLOUT, 0 };
+		loop_stats.syscalls++;
+
+		if (poll (&pfd, 1, 100) < 0 && errno != EINTR)
+			throw errno_exception("poll", errno);
+	}
+}
+
+void linux_flood_provider::send_frame(const ethernet_frame &frame)
+{
+	if (ring)
+	{
+		auto hdr = next_ring_frame();
+		auto data = hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+
+		auto th = (struct tpacket2_hdr*) hdr;
+		th->tp_len = serialize (data, frame);
+		__atomic_store_n (&th->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+		ring_pos = (ring_pos + 1) % RING_FRAMES;
+	}
+	else
+	{
+		iovs[queued].iov_len = serialize (batch_buf.data() + queued * FRAME_SIZE, frame);
+	}
+
+	if (++queued >= config.batch)
+		flush_frames();
+}
+
+void linux_flood_provider::flush_frames()
+{
+	if (queued == 0)
+		return;
+
+	if (ring)
+	{
+		/* Blocks until the frames were sent. If the interface's queue is
+		 * full, a frame is dropped and the call fails; the remaining frames
+		 * are sent by the next one. */
+		unsigned dropped = 0;
+
+		for (;;)
+		{
+			loop_stats.syscalls++;
+
+			if (send (raw_socket, nullptr, 0, 0) >= 0)
+				break;
+
+			if (errno != ENOBUFS)
+				throw errno_exception("send(PACKET_TX_RING)", errno);
+
+			dropped++;
+		}
+
+		frames_dropped += dropped;
+		loop_stats.frames_sent += queued > dropped ? queued - dropped : 0;
+		queued = 0;
+		return;
+	}
+
+	unsigned done = 0;
+	while (done < queued)
+	{
+		loop_stats.syscalls++;
+
+		int ret = sendmmsg (raw_socket, msgs.data() + done, queued - done, 0);
+		if (ret < 0)
+		{
+			/* The first of the remaining frames was dropped */
+			if (errno != ENOBUFS)
+				throw errno_exception("sendmmsg", errno);
+
+			frames_dropped++;
+			done++;
+			continue;
+		}
+
+		loop_stats.frames_sent += ret;
+		done += ret;
+	}
+
+	queued = 0;
+}
+
+uint64_t linux_flood_provider::get_frames_dropped() const
+{
+	return frames_dropped;
+}
+
+}
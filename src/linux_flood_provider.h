@@ -0,0 +1,83 @@
+#ifndef __LINUX_FLOOD_PROVIDER_H
+#define __LINUX_FLOOD_PROVIDER_H
+
+/** A linux provider for load generation, which sends frames with arbitrary
+ * source addresses in batches */
+
+#include <vector>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "linux_system_services.h"
+
+namespace system_services
+{
+
+struct flood_config
+{
+	/* Frames handed to the kernel with one system call */
+	unsigned batch = 64;
+
+	/* Send through a PACKET_TX_RING instead of with sendmmsg */
+	bool tx_ring = false;
+};
+
+class linux_flood_provider : public linux_provider
+{
+protected:
+	/* Size of a serialized frame's buffer, and number of frames in the TX
+	 * ring */
+	static constexpr unsigned FRAME_SIZE = 2048;
+	static constexpr unsigned RING_FRAMES = 1024;
+
+	flood_config config;
+
+	/* A SOCK_RAW packet socket, through which the ethernet header including
+	 * the source address is sent as given */
+	int raw_socket = -1;
+
+	/* sendmmsg: the frames of the current batch */
+	std::vector<unsigned char> batch_buf;
+	std::vector<struct iovec> iovs;
+	std::vector<struct mmsghdr> msgs;
+	unsigned queued = 0;
+
+	/* PACKET_TX_RING */
+	unsigned char *ring = nullptr;
+	size_t ring_size = 0;
+	unsigned ring_pos = 0;
+
+	/* Frames the interface's queue did not accept */
+	uint64_t frames_dropped = 0;
+
+	void setup_tx_ring();
+	void cleanup();
+
+	/* Write the ethernet header and the payload, padded to the minimum frame
+	 * size. @returns The frame's length */
+	size_t serialize (unsigned char *p, const ethernet_frame &frame);
+
+	/* Wait until the TX ring's next frame is available */
+	unsigned char *next_ring_frame();
+
+	linux_flood_provider(const std::string &if_name, const flood_config &config);
+
+public:
+	static std::shared_ptr<linux_flood_provider> create(
+			const std::string &if_name, const flood_config &config = flood_config());
+
+	virtual ~linux_flood_provider();
+
+	/** Queue a frame, which is sent once a batch is complete. Unlike with
+	 * the other providers the frame's source address is used, unless it is
+	 * 00:00:00:00:00:00. */
+	void send_frame(const ethernet_frame &frame) override;
+
+	/** Send all queued frames */
+	void flush_frames();
+
+	uint64_t get_frames_dropped() const;
+};
+
+}
+
+#endif /* __LINUX_FLOOD_PROVIDER_H */
@@ -1,30 +1,870 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <cstring>
 #include <exception>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "errno_exception.h"
 #include "linux_system_services.h"
+#include "linux_xdp_provider.h"
+#include "linux_uring_provider.h"
+#include "linux_udp_provider.h"
+#include "pcap_replay_provider.h"
 #include "controller.h"
+#include "collector.h"
+#include "stability_analysis.h"
+#include "alloc_audit.h"
+#include "linux_clock_comparison.h"
+#include "timeseries_store.h"
 
 using namespace std;
 
+/* Options without short form */
+enum
+{
+	OPT_FILTER_WINDOW = 256,
+	OPT_REJECT_OUTLIERS,
+	OPT_FILTER_BY_MASTER,
+	OPT_RX_THREADS,
+	OPT_BACKEND,
+	OPT_XDP_NATIVE,
+	OPT_XDP_QUEUE,
+	OPT_BUSY_POLL,
+	OPT_BENCHMARK,
+	OPT_AUDIT_ALLOCATIONS,
+	OPT_COMPARE_CLOCKS,
+	OPT_DISCOVERY_WINDOW,
+	OPT_SNAPSHOT,
+	OPT_SNAPSHOT_INTERVAL,
+	OPT_SNAPSHOT_MAX_AGE,
+	OPT_HISTORY,
+	OPT_HISTORY_RAW_SIZE,
+	OPT_SHOW_HISTORY,
+	OPT_SHM,
+	OPT_SPECTRUM,
+	OPT_SPECTRUM_INTERVAL,
+	OPT_UDP_GROUP,
+	OPT_UDP_TTL,
+	OPT_ADAPTIVE_RATE,
+	OPT_ADAPTIVE_BUDGET,
+	OPT_ADAPTIVE_HOLD,
+	OPT_ADAPTIVE_THRESHOLD,
+	OPT_ADAPTIVE_DRIFT,
+	OPT_LATENCY_PROBE,
+	OPT_LATENCY_PRIORITY,
+	OPT_LATENCY_THRESHOLD,
+	OPT_LAUNCH_LEAD
+};
+
+void print_usage (const char *name)
+{
+	printf ("Usage: %s [options] <interface name>\n"
+			"       %s --replay <capture file>\n"
+			"       %s --analyze <deviation log> [--tau0 <seconds>]\n"
+			"       %s --compare-clocks[=<seconds>] [-p <ms>]\n"
+			"       %s --history <path> --show-history[=<seconds>]\n\n"
+			"Options:\n"
+			"  -l, --deviation-log <file>  Append each deviation sample to <file>\n"
+			"  -p, --pulse-period <ms>     Pulse period in master mode (default: 1000)\n"
+			"  -s, --summary-interval <ms> Interval of the deviation summaries sent to\n"
+			"                              collectors, up to a day, 0 to disable\n"
+			"                              (default: 10000)\n"
+			"  -c, --collector             Collect the summaries of all nodes instead\n"
+			"                              of measuring\n"
+			"  -f, --filter <estimator>    Filter samples before computing a second\n"
+			"                              set of statistics: none, median or lucky\n"
+			"                              (maximum deviation = least delay)\n"
+			"      --filter-window <n>     Window of the filter (default: 16)\n"
+			"      --reject-outliers[=<k>] Reject samples more than k (default: 3)\n"
+			"                              MADs away from the window's median\n"
+			"      --filter-by-master      Drop pulses from nodes with higher addresses\n"
+			"                              than the current master in the kernel\n"
+			"      --discovery-window <ms> Time to wait for the master's answer to the\n"
+			"                              discovery request at startup (default: 10)\n"
+			"      --rx-threads <n>        Receive frames with n threads (PACKET_FANOUT),\n"
+			"                              at most one per CPU\n"
+			"      --backend <backend>     Send and receive frames with a packet socket\n"
+			"                              and epoll (packet, default), a packet socket\n"
+			"                              and io_uring (io_uring), an AF_XDP socket\n"
+			"                              (xdp) or in UDP multicast datagrams (udp)\n"
+			"      --xdp-native            Attach the XDP program in the driver instead\n"
+			"                              of in generic (SKB) mode\n"
+			"      --xdp-queue <n>         Receive queue of the AF_XDP socket (default: 0)\n"
+			"      --busy-poll <us>        Busy poll the AF_XDP socket instead of sleeping\n"
+			"      --udp-group <address>[:<port>]\n"
+			"                              Multicast group of the udp backend\n"
+			"                              (default: 239.255.136.182:34998)\n"
+			"      --udp-ttl <n>           Routers the datagrams may pass (default: 16)\n"
+			"      --benchmark <seconds>   Exit after <seconds> and print the system calls\n"
+			"                              per frame and the timer latency of the backend\n"
+			"      --audit-allocations[=<n>]\n"
+			"                              Count heap allocations per pulse period and\n"
+			"                              fail if any occur after n (default: 100)\n"
+			"                              periods\n"
+			"      --snapshot <file>       Save the statistics to <file> periodically\n"
+			"                              and on exit, and restore them on startup\n"
+			"      --snapshot-interval <ms>\n"
+			"                              Interval of the snapshots (default: 10000)\n"
+			"      --snapshot-max-age <s>  Ignore older snapshots on startup\n"
+			"                              (default: 300)\n"
+			"      --history <path>        Store the deviation history compressed, with\n"
+			"                              1 s, 1 min and 1 h rollups, in <path>.raw,\n"
+			"                              <path>.1s, <path>.1min and <path>.1h\n"
+			"      --history-raw-size <MiB>\n"
+			"                              Size of the raw samples' file (default: 16)\n"
+			"      --show-history[=<seconds>]\n"
+			"                              Print the stored history of the last\n"
+			"                              <seconds> (default: 86400) and exit\n"
+			"      --shm[=<name>]          Publish the state in a shared memory segment\n"
+			"                              (default: /distributed_clock_jitter), see\n"
+			"                              jitter_stat\n"
+			"      --spectrum[=<n>]        Report the dominant periods of the deviation\n"
+			"                              from the spectrum of the last n (a power of\n"
+			"                              two, default: 4096) samples\n"
+			"      --spectrum-interval <n> Samples between two spectra, at most n\n"
+			"                              (default: n / 4)\n"
+			"      --adaptive-rate[=<ms>]  Let slaves report instability and overload,\n"
+			"                              and as master shorten the pulse period down\n"
+			"                              to <ms> (default: 10) while slaves are\n"
+			"                              unstable\n"
+			"      --adaptive-budget <n>   Send at most n pulses per second on average\n"
+			"                              over 10 minutes (default: no limit)\n"
+			"      --adaptive-hold <s>     Stable time before the master backs off\n"
+			"                              (up to 86400, default: 60)\n"
+			"      --adaptive-threshold <k>\n"
+			"                              Slaves are unstable if the jitter of the last\n"
+			"                              10 samples exceeds that of the last 100\n"
+			"                              k-fold (default: 3)\n"
+			"      --adaptive-drift <ppb>  Slaves are also unstable if their frequency\n"
+			"                              error changes by more than <ppb> within a\n"
+			"                              second\n"
+			"                              (default: off)\n"
+			"      --latency-probe[=<us>]  Measure the host's wakeup latency every <us>\n"
+			"                              (up to 1000000, default: 1000) in a separate\n"
+			"                              thread, and correlate it with the deviation's\n"
+			"                              outliers\n"
+			"      --latency-priority <n>  Run the probe with SCHED_FIFO priority n\n"
+			"                              (1 to 99, 0 for SCHED_OTHER)\n"
+			"      --latency-threshold <us>\n"
+			"                              Host latency above which outliers are\n"
+			"                              attributed to the host (default: 100)\n"
+			"      --launch-lead[=<us>]    As master, let the kernel launch each pulse\n"
+			"                              at the first boundary of the pulse period at\n"
+			"                              least <us> (default: 1000) ahead (SO_TXTIME;\n"
+			"                              needs an ETF qdisc with clockid CLOCK_TAI)\n"
+			"  -w, --capture <file>        Write all received frames to a pcap file\n"
+			"  -r, --replay <file>         Feed the frames of a pcap file to the\n"
+			"                              controller as fast as possible, using\n"
+			"                              their timestamps as clock\n"
+			"  -a, --analyze <file>        Compute the Allan deviation and TDEV of a\n"
+			"                              deviation log and exit\n"
+			"  -t, --tau0 <seconds>        Sampling interval of the analyzed log\n"
+			"                              (default: 1)\n"
+			"      --compare-clocks[=<seconds>]\n"
+			"                              Compare the local clocks against\n"
+			"                              CLOCK_MONOTONIC_RAW every pulse period\n"
+			"                              (for <seconds> or until interrupted)\n"
+			"  -h, --help                  Show this help\n",
+			name, name, name, name, name);
+}
+
+/** Parse a decimal number in [min, max]. Unlike atoi, signs, trailing
+ * characters and values out of range are rejected.
+ * @returns false if `arg` is no such number */
+bool parse_number (const char *arg, unsigned long min, unsigned long max,
+		unsigned long &value)
+{
+	char *end;
+	errno = 0;
+	unsigned long v = strtoul (arg, &end, 10);
+
+	if (errno || !isdigit ((unsigned char) arg[0]) || *end || v < min || v > max)
+		return false;
+
+	value = v;
+	return true;
+}
+
+/* Batch analysis of a deviation log as written by the controller */
+int analyze_deviation_log (const string &path, double tau0)
+{
+	FILE *f = fopen (path.c_str(), "rb");
+	if (!f)
+		throw errno_exception ("fopen(" + path + ")", errno);
+
+	/* Analyze all averaging times for which the log has enough samples, but
+	 * bound the memory needed for the history to a few hundred MiB. */
+	fseek (f, 0, SEEK_END);
+	uint64_t samples = ftell (f) / sizeof(double);
+	rewind (f);
+
+	unsigned octaves = 1;
+	while (octaves < 22 && 3 * ((uint64_t) 1 << octaves) <= samples)
+		octaves++;
+
+	stability_analyzer stability (tau0, octaves);
+	vector<double> buf(1 << 20);
+
+	size_t cnt;
+	while ((cnt = fread (buf.data(), sizeof(double), buf.size(), f)) > 0)
+		stability.update_block (buf.data(), cnt);
+
+	bool failed = ferror (f);
+	fclose (f);
+
+	if (failed)
+		throw errno_exception ("fread(" + path + ")", EIO);
+
+	printf ("%llu samples\n\n%14s %14s %14s\n",
+			(unsigned long long) stability.get_count(), "tau [s]", "adev", "tdev [s]");
+
+	for (unsigned k = 0; k < stability.get_octaves(); k++)
+	{
+		printf ("%14g %14e %14e\n", stability.get_tau(k),
+				stability.get_adev(k), stability.get_tdev(k));
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Print the deviation history of the last `seconds` at the finest level
+ * with at most a few hundred records */
+int show_history (const string &path, unsigned seconds)
+{
+	timeseries_store store (path, timeseries_store_config(), true);
+
+	struct timespec tai, utc;
+	clock_gettime (CLOCK_TAI, &tai);
+	clock_gettime (CLOCK_REALTIME, &utc);
+
+	int64_t utc_offset = llround (tai.tv_sec - utc.tv_sec + (tai.tv_nsec - utc.tv_nsec) * 1e-9);
+	int64_t to = (int64_t) tai.tv_sec * 1000000 + tai.tv_nsec / 1000 + 1;
+	int64_t from = to - (int64_t) seconds * 1000000;
+
+	vector<timeseries_rollup> records;
+	unsigned level = store.query (from, to, 500, records);
+
+	static const char *const level_names[] = { "raw samples", "1 s", "1 min", "1 h" };
+	printf ("%zu records (%s)\n\n%-26s %10s %14s %14s %14s\n", records.size(),
+			level_names[level], "time (UTC)", "samples", "min [s]", "mean [s]", "max [s]");
+
+	for (auto &r : records)
+	{
+		time_t t = r.time_us / 1000000 - utc_offset;
+		struct tm tm;
+		char buf[32];
+
+		gmtime_r (&t, &tm);
+		strftime (buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+
+		printf ("%s.%06d %10llu %14e %14e %14e\n", buf, (int) (r.time_us % 1000000),
+				(unsigned long long) r.count, r.min, r.mean, r.max);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Local clock comparison, one sample per period */
+int compare_clocks (uint32_t period_ms, unsigned duration_s)
+{
+	clock_comparison comparison;
+
+	struct timespec next;
+	clock_gettime (CLOCK_MONOTONIC, &next);
+
+	uint64_t max_samples = (uint64_t) duration_s * 1000 / period_ms;
+	unsigned lines = 0;
+
+	while (!duration_s || comparison.get_sample_count() < max_samples)
+	{
+		next.tv_nsec += (long) (period_ms % 1000) * 1000000;
+		next.tv_sec += period_ms / 1000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+
+		int ret = clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+		if (ret != 0)
+			throw errno_exception ("clock_nanosleep", ret);
+
+		comparison.sample();
+
+		/* Redraw in place */
+		for (unsigned i = 0; i < lines; i++)
+			printf ("\033[1F\033[2K");
+
+		lines = comparison.print (stdout);
+		fflush (stdout);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Checks that no heap allocations occur in the steady state, which would add
+ * the allocator's latency to the measured jitter */
+struct allocation_audit
+{
+	bool enabled = false;
+	uint64_t warmup = 100;
+
+	shared_ptr<system_services::linux_provider> prov;
+	uint64_t periods = 0;
+	uint64_t last_count = 0;
+	bool failed = false;
+
+	/* Called once per pulse period */
+	void check()
+	{
+		auto count = get_allocation_count();
+		auto allocations = count - last_count;
+		last_count = count;
+
+		if (periods++ < warmup || allocations == 0)
+			return;
+
+		fprintf (stderr, "\n%llu heap allocations in pulse period %llu\n",
+				(unsigned long long) allocations, (unsigned long long) periods);
+
+		failed = true;
+		prov->stop();
+	}
+};
+
+void print_loop_statistics (const string &backend, const system_services::loop_statistics &stats)
+{
+	auto frames = stats.frames_received + stats.frames_sent;
+	auto &lat = stats.timer_latency;
+
+	printf ("\n%s backend: %llu frames received, %llu sent, %llu system calls "
+			"(%.2f per frame)\n"
+			"timer latency [us]: %llu calls, mean %.1f, median %.1f, p90 %.1f, "
+			"p99 %.1f, max %.1f\n",
+			backend.c_str(),
+			(unsigned long long) stats.frames_received,
+			(unsigned long long) stats.frames_sent,
+			(unsigned long long) stats.syscalls,
+			frames ? (double) stats.syscalls / frames : 0.,
+			(unsigned long long) lat.count,
+			lat.mean() * 1e6, lat.quantile(0.5) * 1e6, lat.quantile(0.9) * 1e6,
+			lat.quantile(0.99) * 1e6, lat.max * 1e6);
+}
+
 int main(int argc, char **argv)
 {
 	try
 	{
-		if (argc != 2)
+		static const struct option long_options[] = {
+			{ "deviation-log", required_argument, nullptr, 'l' },
+			{ "pulse-period", required_argument, nullptr, 'p' },
+			{ "summary-interval", required_argument, nullptr, 's' },
+			{ "collector", no_argument, nullptr, 'c' },
+			{ "filter", required_argument, nullptr, 'f' },
+			{ "filter-window", required_argument, nullptr, OPT_FILTER_WINDOW },
+			{ "reject-outliers", optional_argument, nullptr, OPT_REJECT_OUTLIERS },
+			{ "filter-by-master", no_argument, nullptr, OPT_FILTER_BY_MASTER },
+			{ "discovery-window", required_argument, nullptr, OPT_DISCOVERY_WINDOW },
+			{ "rx-threads", required_argument, nullptr, OPT_RX_THREADS },
+			{ "backend", required_argument, nullptr, OPT_BACKEND },
+			{ "xdp-native", no_argument, nullptr, OPT_XDP_NATIVE },
+			{ "xdp-queue", required_argument, nullptr, OPT_XDP_QUEUE },
+			{ "busy-poll", required_argument, nullptr, OPT_BUSY_POLL },
+			{ "udp-group", required_argument, nullptr, OPT_UDP_GROUP },
+			{ "udp-ttl", required_argument, nullptr, OPT_UDP_TTL },
+			{ "adaptive-rate", optional_argument, nullptr, OPT_ADAPTIVE_RATE },
+			{ "adaptive-budget", required_argument, nullptr, OPT_ADAPTIVE_BUDGET },
+			{ "adaptive-hold", required_argument, nullptr, OPT_ADAPTIVE_HOLD },
+			{ "adaptive-threshold", required_argument, nullptr, OPT_ADAPTIVE_THRESHOLD },
+			{ "adaptive-drift", required_argument, nullptr, OPT_ADAPTIVE_DRIFT },
+			{ "latency-probe", optional_argument, nullptr, OPT_LATENCY_PROBE },
+			{ "latency-priority", required_argument, nullptr, OPT_LATENCY_PRIORITY },
+			{ "latency-threshold", required_argument, nullptr, OPT_LATENCY_THRESHOLD },
+			{ "launch-lead", optional_argument, nullptr, OPT_LAUNCH_LEAD },
+			{ "benchmark", required_argument, nullptr, OPT_BENCHMARK },
+			{ "audit-allocations", optional_argument, nullptr, OPT_AUDIT_ALLOCATIONS },
+			{ "snapshot", required_argument, nullptr, OPT_SNAPSHOT },
+			{ "snapshot-interval", required_argument, nullptr, OPT_SNAPSHOT_INTERVAL },
+			{ "snapshot-max-age", required_argument, nullptr, OPT_SNAPSHOT_MAX_AGE },
+			{ "history", required_argument, nullptr, OPT_HISTORY },
+			{ "history-raw-size", required_argument, nullptr, OPT_HISTORY_RAW_SIZE },
+			{ "show-history", optional_argument, nullptr, OPT_SHOW_HISTORY },
+			{ "shm", optional_argument, nullptr, OPT_SHM },
+			{ "spectrum", optional_argument, nullptr, OPT_SPECTRUM },
+			{ "spectrum-interval", required_argument, nullptr, OPT_SPECTRUM_INTERVAL },
+			{ "capture", required_argument, nullptr, 'w' },
+			{ "replay", required_argument, nullptr, 'r' },
+			{ "analyze", required_argument, nullptr, 'a' },
+			{ "tau0", required_argument, nullptr, 't' },
+			{ "compare-clocks", optional_argument, nullptr, OPT_COMPARE_CLOCKS },
+			{ "help", no_argument, nullptr, 'h' },
+			{ nullptr, 0, nullptr, 0 }
+		};
+
+		controller_config config;
+		bool collector_mode = false;
+		unsigned rx_threads = 1;
+		string backend = "packet";
+		unsigned benchmark_s = 0;
+		allocation_audit audit;
+		system_services::xdp_config xdp;
+		system_services::udp_config udp;
+		string capture_path;
+		string replay_path;
+		string analyze_path;
+		double tau0 = 1;
+		bool clock_comparison_mode = false;
+		unsigned clock_comparison_s = 0;
+		bool show_history_mode = false;
+		unsigned show_history_s = 86400;
+
+		int opt;
+		while ((opt = getopt_long (argc, argv, "l:p:s:cf:w:r:a:t:h", long_options, nullptr)) != -1)
+		{
+			switch (opt)
+			{
+			case 'l':
+				config.deviation_log = optarg;
+				break;
+
+			case 'p':
+			{
+				/* Pulses carry the period in us in 32 bits */
+				unsigned long period;
+				if (!parse_number (optarg, 1, UINT32_MAX / 1000, period))
+				{
+					fprintf (stderr, "Invalid pulse period: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.pulse_period_ms = period;
+				break;
+			}
+
+			case 's':
+			{
+				/* Up to a day, 0 disables the summaries */
+				unsigned long interval;
+				if (!parse_number (optarg, 0, 86400000, interval))
+				{
+					fprintf (stderr, "Invalid summary interval: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.summary_interval_ms = interval;
+				break;
+			}
+
+			case 'c':
+				collector_mode = true;
+				break;
+
+			case 'f':
+				if (strcmp (optarg, "none") == 0)
+					config.filter.est = sample_estimator::none;
+				else if (strcmp (optarg, "median") == 0)
+					config.filter.est = sample_estimator::median;
+				else if (strcmp (optarg, "lucky") == 0)
+					config.filter.est = sample_estimator::lucky;
+				else
+				{
+					fprintf (stderr, "Invalid filter: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case OPT_FILTER_WINDOW:
+				config.filter.window = atoi (optarg);
+				if (config.filter.window == 0)
+				{
+					fprintf (stderr, "Invalid filter window: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case OPT_REJECT_OUTLIERS:
+				config.filter.reject_outliers = true;
+				if (optarg)
+					config.filter.outlier_threshold = atof (optarg);
+				break;
+
+			case OPT_FILTER_BY_MASTER:
+				config.filter_by_master = true;
+				break;
+
+			case OPT_DISCOVERY_WINDOW:
+			{
+				int window = atoi (optarg);
+				if (window <= 0)
+				{
+					fprintf (stderr, "Invalid discovery window: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.discovery_window_ms = window;
+				break;
+			}
+
+			case OPT_RX_THREADS:
+			{
+				/* The fanout group spreads frames by CPU, more threads
+				 * than CPUs would stay idle */
+				unsigned long threads, cpus = max (sysconf (_SC_NPROCESSORS_ONLN), 1L);
+				if (!parse_number (optarg, 1, cpus, threads))
+				{
+					fprintf (stderr, "Invalid number of receive threads: %s (1 to %lu)\n",
+							optarg, cpus);
+					return EXIT_FAILURE;
+				}
+
+				rx_threads = threads;
+				break;
+			}
+
+			case OPT_BACKEND:
+				backend = optarg;
+				if (backend != "packet" && backend != "io_uring" && backend != "xdp" &&
+						backend != "udp")
+				{
+					fprintf (stderr, "Invalid backend: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case OPT_XDP_NATIVE:
+				xdp.skb_mode = false;
+				break;
+
+			case OPT_XDP_QUEUE:
+				xdp.queue = atoi (optarg);
+				break;
+
+			case OPT_BUSY_POLL:
+				xdp.busy_poll_us = atoi (optarg);
+				break;
+
+			case OPT_UDP_GROUP:
+			{
+				const char *colon = strchr (optarg, ':');
+				udp.group = colon ? string (optarg, colon - optarg) : optarg;
+				if (colon)
+				{
+					udp.port = atoi (colon + 1);
+					if (udp.port == 0)
+					{
+						fprintf (stderr, "Invalid port: %s\n", colon + 1);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+			}
+
+			case OPT_UDP_TTL:
+				udp.ttl = atoi (optarg);
+				break;
+
+			case OPT_BENCHMARK:
+				benchmark_s = atoi (optarg);
+				break;
+
+			case OPT_AUDIT_ALLOCATIONS:
+				audit.enabled = true;
+				if (optarg)
+					audit.warmup = atoi (optarg);
+				break;
+
+			case OPT_SNAPSHOT:
+				config.snapshot_path = optarg;
+				break;
+
+			case OPT_SNAPSHOT_INTERVAL:
+				config.snapshot_interval_ms = atoi (optarg);
+				if (config.snapshot_interval_ms == 0)
+				{
+					fprintf (stderr, "Invalid snapshot interval: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case OPT_SNAPSHOT_MAX_AGE:
+				config.snapshot_max_age_s = atoi (optarg);
+				break;
+
+			case OPT_HISTORY:
+				config.history_path = optarg;
+				break;
+
+			case OPT_HISTORY_RAW_SIZE:
+			{
+				/* Up to 1 TiB */
+				int mib = atoi (optarg);
+				if (mib <= 0 || mib > (1 << 20))
+				{
+					fprintf (stderr, "Invalid history size: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.history.raw_size = (uint64_t) mib << 20;
+				break;
+			}
+
+			case OPT_SHOW_HISTORY:
+				show_history_mode = true;
+				if (optarg)
+					show_history_s = atoi (optarg);
+				break;
+
+			case OPT_SHM:
+				config.shm_name = optarg ? optarg : "/distributed_clock_jitter";
+				break;
+
+			case OPT_SPECTRUM:
+				config.spectrum.window = optarg ? atoi (optarg) : 4096;
+				if (config.spectrum.window < 16 ||
+						(config.spectrum.window & (config.spectrum.window - 1)))
+				{
+					fprintf (stderr, "Invalid spectrum window: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case OPT_SPECTRUM_INTERVAL:
+			{
+				int interval = atoi (optarg);
+				if (interval <= 0)
+				{
+					fprintf (stderr, "Invalid spectrum interval: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.spectrum.interval = interval;
+				break;
+			}
+
+			case OPT_ADAPTIVE_RATE:
+				config.adaptive.enabled = true;
+				if (optarg)
+				{
+					config.adaptive.min_period_ms = atoi (optarg);
+					if (config.adaptive.min_period_ms == 0)
+					{
+						fprintf (stderr, "Invalid minimum pulse period: %s\n", optarg);
+						return EXIT_FAILURE;
+					}
+				}
+				break;
+
+			case OPT_ADAPTIVE_BUDGET:
+				config.adaptive.budget = atof (optarg);
+				break;
+
+			case OPT_ADAPTIVE_HOLD:
+			{
+				/* Up to a day */
+				unsigned long hold;
+				if (!parse_number (optarg, 0, 86400, hold))
+				{
+					fprintf (stderr, "Invalid hold time: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.adaptive.hold_ms = hold * 1000;
+				break;
+			}
+
+			case OPT_ADAPTIVE_THRESHOLD:
+				config.adaptive.jitter_threshold = atof (optarg);
+				break;
+
+			case OPT_ADAPTIVE_DRIFT:
+				config.adaptive.drift_threshold_ppb = atof (optarg);
+				break;
+
+			case OPT_LATENCY_PROBE:
+			{
+				/* Up to a second */
+				unsigned long interval = 1000;
+				if (optarg && !parse_number (optarg, 1, 1000000, interval))
+				{
+					fprintf (stderr, "Invalid probe interval: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.probe.interval_us = interval;
+				break;
+			}
+
+			case OPT_LATENCY_PRIORITY:
+			{
+				unsigned long priority;
+				if (!parse_number (optarg, 0, sched_get_priority_max (SCHED_FIFO), priority))
+				{
+					fprintf (stderr, "Invalid probe priority: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				config.probe.priority = priority;
+				break;
+			}
+
+			case OPT_LATENCY_THRESHOLD:
+				config.probe.threshold_us = atof (optarg);
+				break;
+
+			case OPT_LAUNCH_LEAD:
+				config.launch_lead_us = optarg ? atoi (optarg) : 1000;
+				if (config.launch_lead_us == 0)
+				{
+					fprintf (stderr, "Invalid launch lead time: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'w':
+				capture_path = optarg;
+				break;
+
+			case 'r':
+				replay_path = optarg;
+				break;
+
+			case 'a':
+				analyze_path = optarg;
+				break;
+
+			case 't':
+				tau0 = atof (optarg);
+				break;
+
+			case OPT_COMPARE_CLOCKS:
+				clock_comparison_mode = true;
+				if (optarg)
+					clock_comparison_s = atoi (optarg);
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return EXIT_SUCCESS;
+
+			default:
+				print_usage (argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (config.spectrum.window && config.spectrum.interval > config.spectrum.window)
+		{
+			fprintf (stderr, "--spectrum-interval must not exceed the spectrum window (%u)\n",
+					config.spectrum.window);
+			return EXIT_FAILURE;
+		}
+
+		if (analyze_path.size())
+			return analyze_deviation_log (analyze_path, tau0);
+
+		if (show_history_mode)
+		{
+			if (config.history_path.empty())
+			{
+				fprintf (stderr, "--show-history requires --history\n");
+				return EXIT_FAILURE;
+			}
+
+			return show_history (config.history_path, show_history_s);
+		}
+
+		if (clock_comparison_mode)
+			return compare_clocks (config.pulse_period_ms, clock_comparison_s);
+
+		if (replay_path.size())
+		{
+			/* Use the highest address so that the controller follows the
+			 * recorded masters. */
+			auto prov = system_services::pcap_replay_provider::create(
+					replay_path, BROADCAST_MAC_ADDR);
+			controller contr (prov, config);
+			prov->main_loop ();
+
+			return EXIT_SUCCESS;
+		}
+
+		if (argc - optind != 1)
+		{
+			print_usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		if (backend != "packet" && rx_threads > 1)
 		{
-			printf ("Usage: %s <interface name>\n", argv[0]);
+			fprintf (stderr, "--rx-threads is only supported with the packet backend\n");
 			return EXIT_FAILURE;
 		}
 
-		auto prov = system_services::linux_provider::create(argv[1]);
+		shared_ptr<system_services::linux_provider> prov;
+
+		if (backend == "xdp")
+			prov = system_services::linux_xdp_provider::create(argv[optind], xdp);
+		else if (backend == "io_uring")
+			prov = system_services::linux_uring_provider::create(argv[optind]);
+		else if (backend == "udp")
+			prov = system_services::linux_udp_provider::create(argv[optind], udp);
+		else
+			prov = system_services::linux_provider::create(argv[optind]);
 
 		auto mac = prov->get_own_mac_address ();
 		printf ("Own mac address: %02x:%02x:%02x:%02x:%02x:%02x\n",
 				(int) mac[0], (int) mac[1], (int) mac[2],
 				(int) mac[3], (int) mac[4], (int) mac[5]);
 
-		controller contr (prov);
-		prov->main_loop ();
+		if (capture_path.size())
+			prov->start_capture (capture_path);
+
+		prov->enable_fanout (rx_threads);
+
+		system_services::provider::timer_registration benchmark_timer;
+		if (benchmark_s)
+			benchmark_timer = prov->register_timer ([&prov]() { prov->stop(); }, benchmark_s * 1000);
+
+		system_services::provider::timer_registration audit_timer;
+		if (audit.enabled)
+		{
+			audit.prov = prov;
+			audit.last_count = get_allocation_count();
+			audit_timer = prov->register_timer ([&audit]() { audit.check(); }, config.pulse_period_ms);
+		}
+
+		if (collector_mode)
+		{
+			collector coll (prov);
+			prov->main_loop ();
+		}
+		else
+		{
+			controller contr (prov, config);
+			prov->main_loop ();
+		}
+
+		if (benchmark_s)
+			print_loop_statistics (backend, prov->get_loop_statistics());
+
+		if (audit.enabled)
+		{
+			if (audit.failed)
+				return EXIT_FAILURE;
+
+			if (audit.periods <= audit.warmup)
+			{
+				fprintf (stderr, "Stopped during the allocation audit's warmup\n");
+				return EXIT_FAILURE;
+			}
+
+			printf ("No heap allocations in %llu pulse periods after the warmup\n",
+					(unsigned long long) (audit.periods - audit.warmup));
+		}
 
 		return EXIT_SUCCESS;
 	}
@@ -0,0 +1,155 @@
+#include <stdexcept>
+#include "linux_socket_filter.h"
+
+using namespace std;
+
+namespace system_services
+{
+
+/* Jump targets which are resolved after the program has been emitted.
+ * LABEL_NONE is the next instruction (offset 0) and marks resolved jumps. */
+enum jump_label
+{
+	LABEL_NONE,
+	LABEL_NEXT_TYPE,
+	LABEL_DROP,
+	LABEL_ACCEPT,
+	LABEL_SRC_LOW
+};
+
+namespace {
+
+class bpf_assembler
+{
+protected:
+	struct fixup
+	{
+		size_t index;
+		jump_label jt;
+		jump_label jf;
+	};
+
+	vector<sock_filter> prog;
+	vector<fixup> fixups;
+
+public:
+	void stmt (uint16_t code, uint32_t k)
+	{
+		prog.push_back (BPF_STMT(code, k));
+	}
+
+	void jump (uint16_t code, uint32_t k, jump_label jt, jump_label jf)
+	{
+		fixups.push_back ({ prog.size(), jt, jf });
+		prog.push_back (BPF_JUMP(code, k, 0, 0));
+	}
+
+	/* Resolve all jumps to `label` emitted so far to the next instruction */
+	void place (jump_label label)
+	{
+		size_t target = prog.size();
+
+		/* Would move the resolved jumps */
+		if (label == LABEL_NONE)
+			throw logic_error ("LABEL_NONE cannot be placed");
+
+		for (auto &f : fixups)
+		{
+			if (f.jt == label)
+			{
+				prog[f.index].jt = target - f.index - 1;
+				f.jt = LABEL_NONE;
+			}
+
+			if (f.jf == label)
+			{
+				prog[f.index].jf = target - f.index - 1;
+				f.jf = LABEL_NONE;
+			}
+		}
+	}
+
+	vector<sock_filter> finish()
+	{
+		for (auto &f : fixups)
+		{
+			if (f.jt != LABEL_NONE || f.jf != LABEL_NONE)
+				throw logic_error ("BPF program has unresolved jumps");
+		}
+
+		if (prog.size() > 255)
+			throw runtime_error ("BPF program too long");
+
+		return prog;
+	}
+};
+
+}
+
+vector<sock_filter> compile_frame_filter (const frame_filter &filter,
+		const frame_filter_layout &layout)
+{
+	if (filter.message_types.empty())
+		return vector<sock_filter>();
+
+	bpf_assembler a;
+
+	/* M[0] = payload length */
+	a.stmt (BPF_LD | BPF_W | BPF_LEN, 0);
+	if (layout.payload)
+		a.stmt (BPF_ALU | BPF_SUB | BPF_K, layout.payload);
+	a.stmt (BPF_ST, 0);
+
+	/* Offsets are relative to the payload on SOCK_DGRAM packet sockets; the
+	 * ethertype is an ancillary field in host byte order there. Loads beyond
+	 * the frame drop it. */
+	if (layout.ether_type)
+		a.stmt (BPF_LD | BPF_H | BPF_ABS, *layout.ether_type);
+	else
+		a.stmt (BPF_LD | BPF_H | BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL);
+
+	a.jump (BPF_JMP | BPF_JEQ | BPF_K, 0x88b6, LABEL_NONE, LABEL_DROP);
+
+	/* A = message type */
+	a.stmt (BPF_LD | BPF_H | BPF_ABS, layout.payload);
+
+	for (auto &t : filter.message_types)
+	{
+		a.jump (BPF_JMP | BPF_JEQ | BPF_K, t.type, LABEL_NONE, LABEL_NEXT_TYPE);
+
+		a.stmt (BPF_LD | BPF_MEM, 0);
+		a.jump (BPF_JMP | BPF_JGE | BPF_K, t.min_size, LABEL_NONE, LABEL_DROP);
+
+		if (t.max_src)
+		{
+			/* Loads are in network byte order, so comparing the upper 4 and
+			 * the lower 2 bytes as integers compares the addresses. */
+			uint32_t hi = *t.max_src >> 16;
+			uint32_t lo = *t.max_src & 0xffff;
+
+			a.stmt (BPF_LD | BPF_W | BPF_ABS, layout.src);
+			a.jump (BPF_JMP | BPF_JGT | BPF_K, hi, LABEL_DROP, LABEL_NONE);
+			a.jump (BPF_JMP | BPF_JEQ | BPF_K, hi, LABEL_SRC_LOW, LABEL_ACCEPT);
+			a.place (LABEL_SRC_LOW);
+
+			a.stmt (BPF_LD | BPF_H | BPF_ABS, layout.src + 4);
+			a.jump (BPF_JMP | BPF_JGT | BPF_K, lo, LABEL_DROP, LABEL_ACCEPT);
+		}
+		else
+		{
+			a.stmt (BPF_RET | BPF_K, 0xffffffff);
+		}
+
+		a.place (LABEL_NEXT_TYPE);
+	}
+
+	a.place (LABEL_DROP);
+	a.stmt (BPF_RET | BPF_K, 0);
+
+	a.place (LABEL_ACCEPT);
+	a.stmt (BPF_RET | BPF_K, 0xffffffff);
+
+	return a.finish();
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef __LINUX_SOCKET_FILTER_H
+#define __LINUX_SOCKET_FILTER_H
+
+/** Compilation of frame filters to classic BPF programs for packet sockets */
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include <linux/filter.h>
+#include "system_services.h"
+
+namespace system_services
+{
+
+/* Where the filtered socket sees the fields of a frame. The defaults are
+ * those of a SOCK_DGRAM packet socket bound to our ethertype. */
+struct frame_filter_layout
+{
+	/* Offset of the payload, i.e. of the message type */
+	uint32_t payload = 0;
+
+	/* Offset of the source address */
+	uint32_t src = SKF_LL_OFF + 6;
+
+	/* Offset of the ethertype, if the socket does not only receive frames
+	 * of our ethertype */
+	std::optional<uint32_t> ether_type;
+};
+
+/** Compile a filter for a socket with the given layout.
+ * @returns The BPF program or an empty vector if the filter accepts all
+ * 		frames. */
+std::vector<sock_filter> compile_frame_filter (const frame_filter &filter,
+		const frame_filter_layout &layout = frame_filter_layout());
+
+}
+
+#endif /* __LINUX_SOCKET_FILTER_H */
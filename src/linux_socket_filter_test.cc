@@ -0,0 +1,245 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include "linux_socket_filter.h"
+#include "protocol.h"
+
+using namespace std;
+using namespace system_services;
+
+/* Runs the compiled programs the way the kernel runs them on a packet
+ * socket, for the instructions which compile_frame_filter emits. */
+class bpf_machine
+{
+protected:
+	const vector<sock_filter> &prog;
+
+	/* The data the socket sees, and the link layer header before it */
+	const vector<uint8_t> &data;
+	const vector<uint8_t> &link_layer;
+	uint16_t protocol;
+
+	bool load (uint32_t k, unsigned size, uint32_t &value) const
+	{
+		const vector<uint8_t> *v = &data;
+
+		if (k == (uint32_t) (SKF_AD_OFF + SKF_AD_PROTOCOL))
+		{
+			value = protocol;
+			return true;
+		}
+
+		if (k >= (uint32_t) SKF_LL_OFF)
+		{
+			v = &link_layer;
+			k -= SKF_LL_OFF;
+		}
+
+		if (k + size > v->size())
+			return false;
+
+		value = 0;
+		for (unsigned i = 0; i < size; i++)
+			value = value << 8 | (*v)[k + i];
+
+		return true;
+	}
+
+public:
+	bpf_machine (const vector<sock_filter> &prog, const vector<uint8_t> &data,
+			const vector<uint8_t> &link_layer, uint16_t protocol)
+		: prog(prog), data(data), link_layer(link_layer), protocol(protocol)
+	{}
+
+	/** @returns The number of bytes to accept, 0 drops the frame */
+	uint32_t run() const
+	{
+		uint32_t a = 0, mem[BPF_MEMWORDS] = {};
+
+		for (size_t pc = 0; pc < prog.size(); pc++)
+		{
+			auto &i = prog[pc];
+
+			switch (i.code)
+			{
+			case BPF_LD | BPF_W | BPF_ABS:
+			case BPF_LD | BPF_H | BPF_ABS:
+			case BPF_LD | BPF_B | BPF_ABS:
+			{
+				unsigned size = BPF_SIZE(i.code) == BPF_W ? 4 : BPF_SIZE(i.code) == BPF_H ? 2 : 1;
+				if (!load (i.k, size, a))
+					return 0;
+				break;
+			}
+
+			case BPF_LD | BPF_W | BPF_LEN:
+				a = data.size();
+				break;
+
+			case BPF_LD | BPF_MEM:
+				a = mem[i.k];
+				break;
+
+			case BPF_ST:
+				mem[i.k] = a;
+				break;
+
+			case BPF_ALU | BPF_SUB | BPF_K:
+				a -= i.k;
+				break;
+
+			case BPF_JMP | BPF_JEQ | BPF_K:
+				pc += a == i.k ? i.jt : i.jf;
+				break;
+
+			case BPF_JMP | BPF_JGT | BPF_K:
+				pc += a > i.k ? i.jt : i.jf;
+				break;
+
+			case BPF_JMP | BPF_JGE | BPF_K:
+				pc += a >= i.k ? i.jt : i.jf;
+				break;
+
+			case BPF_RET | BPF_K:
+				return i.k;
+
+			default:
+				fprintf (stderr, "Unexpected instruction 0x%04x at %zu\n", i.code, pc);
+				exit (EXIT_FAILURE);
+			}
+		}
+
+		fprintf (stderr, "Program does not return\n");
+		exit (EXIT_FAILURE);
+	}
+};
+
+unsigned failures = 0;
+
+/* A frame as the packet socket or, with `udp`, as the UDP socket sees it */
+bool accepts (const vector<sock_filter> &prog, bool udp, uint64_t src,
+		uint16_t type, size_t payload_size, uint16_t ether_type = 0x88b6)
+{
+	vector<uint8_t> header (14), payload (payload_size);
+
+	mac_addr_t src_mac;
+	uint64_to_mac (src, src_mac);
+
+	memset (header.data(), 0xff, 6);
+	memcpy (header.data() + 6, src_mac, 6);
+	write_be16 (header.data() + 12, ether_type);
+
+	if (payload_size >= 2)
+		write_be16 (payload.data(), type);
+
+	if (!udp)
+		return bpf_machine (prog, payload, header, ether_type).run() != 0;
+
+	/* UDP header, then the frame's header and payload */
+	vector<uint8_t> datagram (8);
+	datagram.insert (datagram.end(), header.begin(), header.end());
+	datagram.insert (datagram.end(), payload.begin(), payload.end());
+
+	return bpf_machine (prog, datagram, vector<uint8_t>(), 0x0800).run() != 0;
+}
+
+void check (bool condition, const char *what, bool udp)
+{
+	if (!condition)
+	{
+		fprintf (stderr, "FAILED (%s socket): %s\n", udp ? "UDP" : "packet", what);
+		failures++;
+	}
+}
+
+/* The filter of controller::update_frame_filter */
+frame_filter controller_filter (optional<uint64_t> max_src)
+{
+	frame_filter filter;
+	filter.message_types.push_back ({ MSG_TIME_SIGNAL_PULSE_V1, PULSE_V1_SIZE, max_src });
+	filter.message_types.push_back ({ MSG_TIME_SIGNAL_PULSE_V2, PULSE_V2_HEADER_SIZE, max_src });
+	filter.message_types.push_back ({ MSG_DISCOVERY_REQUEST, DISCOVERY_SIZE, nullopt });
+	filter.message_types.push_back ({ MSG_DISCOVERY_ANNOUNCE, DISCOVERY_SIZE, nullopt });
+	return filter;
+}
+
+void test_types (bool udp, const frame_filter_layout &layout)
+{
+	auto prog = compile_frame_filter (controller_filter (nullopt), layout);
+	uint64_t src = 0x020000001234;
+
+	check (!prog.empty(), "program for message types", udp);
+	check (accepts (prog, udp, src, MSG_TIME_SIGNAL_PULSE_V1, PULSE_V1_SIZE), "v1 pulse accepted", udp);
+	check (accepts (prog, udp, src, MSG_TIME_SIGNAL_PULSE_V2, PULSE_V2_HEADER_SIZE + 10), "v2 pulse with TLVs accepted", udp);
+	check (accepts (prog, udp, src, MSG_DISCOVERY_ANNOUNCE, DISCOVERY_SIZE), "discovery accepted", udp);
+	check (!accepts (prog, udp, src, MSG_TIME_SIGNAL_PULSE_V2, PULSE_V2_HEADER_SIZE - 1), "short v2 pulse dropped", udp);
+	check (!accepts (prog, udp, src, MSG_DISCOVERY_REQUEST, DISCOVERY_SIZE - 1), "short discovery dropped", udp);
+	check (!accepts (prog, udp, src, MSG_DEVIATION_SUMMARY, DEVIATION_SUMMARY_SIZE), "unknown type dropped", udp);
+	check (!accepts (prog, udp, src, 0, 1), "truncated type dropped", udp);
+
+	if (layout.ether_type)
+		check (!accepts (prog, udp, src, MSG_TIME_SIGNAL_PULSE_V1, PULSE_V1_SIZE, 0x0800), "other ethertype dropped", udp);
+}
+
+void test_filter_by_master (bool udp, const frame_filter_layout &layout)
+{
+	/* Upper 4 and lower 2 bytes are compared separately */
+	uint64_t master = 0x02000000a000;
+	auto prog = compile_frame_filter (controller_filter (master), layout);
+
+	for (auto type : { MSG_TIME_SIGNAL_PULSE_V1, MSG_TIME_SIGNAL_PULSE_V2 })
+	{
+		size_t size = type == MSG_TIME_SIGNAL_PULSE_V1 ? PULSE_V1_SIZE : PULSE_V2_HEADER_SIZE;
+
+		check (accepts (prog, udp, master, type, size), "pulse of the master accepted", udp);
+		check (accepts (prog, udp, master - 1, type, size), "pulse of a lower address accepted", udp);
+		check (accepts (prog, udp, 0x01ffffffffff, type, size), "pulse of a lower upper part accepted", udp);
+		check (!accepts (prog, udp, master + 1, type, size), "pulse of a higher address dropped", udp);
+		check (!accepts (prog, udp, 0x020100000000, type, size), "pulse of a higher upper part dropped", udp);
+		check (!accepts (prog, udp, master - 1, type, size - 1), "short pulse of a lower address dropped", udp);
+	}
+
+	/* Discoveries are accepted from everyone */
+	check (accepts (prog, udp, master + 1, MSG_DISCOVERY_REQUEST, DISCOVERY_SIZE), "discovery of a higher address accepted", udp);
+	check (!accepts (prog, udp, master + 1, MSG_DEVIATION_SUMMARY, DEVIATION_SUMMARY_SIZE), "unknown type dropped", udp);
+}
+
+int main()
+{
+	try
+	{
+		/* The UDP provider's layout: UDP header, then an Ethernet header */
+		frame_filter_layout udp_layout;
+		udp_layout.payload = 8 + 14;
+		udp_layout.src = 8 + 6;
+		udp_layout.ether_type = 8 + 12;
+
+		if (!compile_frame_filter (frame_filter()).empty())
+		{
+			fprintf (stderr, "FAILED: empty filter compiles to a program\n");
+			failures++;
+		}
+
+		for (bool udp : { false, true })
+		{
+			auto layout = udp ? udp_layout : frame_filter_layout();
+			test_types (udp, layout);
+			test_filter_by_master (udp, layout);
+		}
+
+		if (failures)
+		{
+			fprintf (stderr, "%u checks failed\n", failures);
+			return EXIT_FAILURE;
+		}
+
+		printf ("All checks passed\n");
+		return EXIT_SUCCESS;
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "%s\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
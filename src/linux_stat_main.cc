@@ -0,0 +1,200 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <string>
+#include <getopt.h>
+#include <time.h>
+#include "shared_statistics.h"
+
+using namespace std;
+
+void print_usage (const char *name)
+{
+	printf ("Usage: %s [options] [segment name]\n\n"
+			"Print the state which distributed_clock_jitter --shm publishes in the\n"
+			"shared memory segment (default: /distributed_clock_jitter), one\n"
+			"\"<name> <value>\" line per value.\n\n"
+			"Options:\n"
+			"  -w, --watch <ms>            Print the state every <ms> in place\n"
+			"  -h, --help                  Show this help\n",
+			name);
+}
+
+/* Prints a line and counts it, for redrawing in place */
+class printer
+{
+public:
+	unsigned lines = 0;
+
+	void mac (const char *name, const mac_addr_t &m)
+	{
+		printf ("%s %02x:%02x:%02x:%02x:%02x:%02x\n", name,
+				(int) m[0], (int) m[1], (int) m[2], (int) m[3], (int) m[4], (int) m[5]);
+		lines++;
+	}
+
+	void value (const char *name, double v)
+	{
+		printf ("%s %.9g\n", name, v);
+		lines++;
+	}
+
+	void counter (const char *name, uint64_t v)
+	{
+		printf ("%s %llu\n", name, (unsigned long long) v);
+		lines++;
+	}
+
+	void window (const char *prefix, const windowed_statistics &w)
+	{
+		static const char *const names[] = {
+			"current", "mu_10", "mu_100", "delta_10_max", "delta_100_max",
+			"delta_10_bar", "delta_100_bar"
+		};
+
+		const double values[] = {
+			w.current(), w.mu_10(), w.mu_100(), w.delta_10_max(), w.delta_100_max(),
+			w.delta_10_bar(), w.delta_100_bar()
+		};
+
+		for (unsigned i = 0; i < sizeof(values) / sizeof(*values); i++)
+		{
+			printf ("%s.%s %.9g\n", prefix, names[i], values[i]);
+			lines++;
+		}
+	}
+};
+
+unsigned print_statistics (const shared_statistics &s, pid_t writer_pid)
+{
+	printer p;
+
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	p.counter ("writer_pid", writer_pid);
+	printf ("role %s\n", s.is_master ? "master" : "slave");
+	p.lines++;
+
+	p.value ("age", (now.tv_sec * 1000000000ll + now.tv_nsec - (int64_t) s.monotonic_ns) * 1e-9);
+	p.counter ("tai_ns", s.tai_ns);
+	p.mac ("own_mac", s.own_mac);
+	p.mac ("master_mac", s.master_mac);
+	p.value ("master_period", s.master_period);
+
+	p.window ("deviation", s.deviation);
+	if (s.filter_active)
+		p.window ("filtered", s.filtered);
+	p.window ("residual", s.residual);
+
+	p.value ("offset", s.offset);
+	p.value ("frequency_ppb", s.frequency_ppb);
+
+	for (unsigned k = 0; k < s.octaves && k < shared_statistics::MAX_OCTAVES; k++)
+	{
+		printf ("adev.%g %.9g\ntdev.%g %.9g\n", ldexp (s.tau0, k), s.adev[k],
+				ldexp (s.tau0, k), s.tdev[k]);
+		p.lines += 2;
+	}
+
+	p.counter ("pulses_sent", s.pulses_sent);
+	p.counter ("pulses_received", s.pulses_received);
+	p.counter ("pulses_lost", s.pulses_lost);
+	p.counter ("pulses_duplicated", s.pulses_duplicated);
+	p.counter ("pulses_reordered", s.pulses_reordered);
+	p.counter ("utc_offset_mismatches", s.utc_offset_mismatches);
+	p.counter ("outliers_rejected", s.outliers_rejected);
+	p.counter ("failovers", s.failovers);
+	p.value ("last_failover_gap", s.last_failover_gap);
+	p.value ("max_failover_gap", s.max_failover_gap);
+	p.value ("startup_latency", s.startup_latency);
+
+	return p.lines;
+}
+
+int main (int argc, char **argv)
+{
+	try
+	{
+		static const struct option long_options[] = {
+			{ "watch", required_argument, nullptr, 'w' },
+			{ "help", no_argument, nullptr, 'h' },
+			{ nullptr, 0, nullptr, 0 }
+		};
+
+		unsigned watch_ms = 0;
+
+		int opt;
+		while ((opt = getopt_long (argc, argv, "w:h", long_options, nullptr)) != -1)
+		{
+			switch (opt)
+			{
+			case 'w':
+				watch_ms = atoi (optarg);
+				if (watch_ms == 0)
+				{
+					fprintf (stderr, "Invalid interval: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+
+			case 'h':
+				print_usage (argv[0]);
+				return EXIT_SUCCESS;
+
+			default:
+				print_usage (argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (argc - optind > 1)
+		{
+			print_usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		shared_statistics_reader reader (optind < argc ? argv[optind] : "/distributed_clock_jitter");
+		shared_statistics s;
+		unsigned lines = 0;
+
+		for (;;)
+		{
+			/* The writer may be preempted while updating; wait for it a
+			 * little. */
+			bool ok = false;
+			for (int i = 0; i < 100 && !(ok = reader.read (s)); i++)
+			{
+				struct timespec ts = { 0, 1000000 };
+				nanosleep (&ts, nullptr);
+			}
+
+			if (!ok && !watch_ms)
+			{
+				fprintf (stderr, "No consistent state published\n");
+				return EXIT_FAILURE;
+			}
+
+			if (ok)
+			{
+				for (unsigned i = 0; i < lines; i++)
+					printf ("\033[1F\033[2K");
+
+				lines = print_statistics (s, reader.get_writer_pid());
+				fflush (stdout);
+			}
+
+			if (!watch_ms)
+				return EXIT_SUCCESS;
+
+			struct timespec ts = { (time_t) (watch_ms / 1000), (long) (watch_ms % 1000) * 1000000 };
+			nanosleep (&ts, nullptr);
+		}
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "Error: %s\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
@@ -3,16 +3,26 @@
 #include <cstdarg>
 #include <time.h>
 #include <sys/types.h>
+#include <sys/timex.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <linux/if_packet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/pkt_sched.h>
 #include <net/ethernet.h>
 #include <net/if.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include "errno_exception.h"
 #include "linux_system_services.h"
+#include "linux_socket_filter.h"
 
 using namespace std;
 
@@ -37,12 +47,21 @@ void linux_provider::unregister_timer(timer *token)
 	remove_timer(token);
 }
 
-linux_provider::linux_provider(const std::string &if_name)
-	: provider()
+linux_provider::linux_provider(const std::string &if_name, int domain)
+	: provider(), if_name(if_name)
 {
-	frame_socket = socket(AF_PACKET, SOCK_DGRAM, htons(0x88b6));
-	if (frame_socket < 0)
-		throw errno_exception("socket(AF_PACKET, SOCK_DGRAM, 0x88b6", errno);
+	if (domain == AF_PACKET)
+	{
+		frame_socket = socket(AF_PACKET, SOCK_DGRAM, htons(0x88b6));
+		if (frame_socket < 0)
+			throw errno_exception("socket(AF_PACKET, SOCK_DGRAM, 0x88b6", errno);
+	}
+	else
+	{
+		frame_socket = socket(domain, SOCK_DGRAM, 0);
+		if (frame_socket < 0)
+			throw errno_exception("socket(SOCK_DGRAM)", errno);
+	}
 
 	struct ifreq req;
 	strncpy (req.ifr_name, if_name.c_str(), IFNAMSIZ);
@@ -67,10 +86,60 @@ linux_provider::linux_provider(const std::string &if_name)
 	}
 
 	memcpy (own_mac_address, req.ifr_hwaddr.sa_data, 6);
+
+	if (domain != AF_PACKET)
+		return;
+
+	try
+	{
+		setup_frame_socket (frame_socket);
+	}
+	catch (...)
+	{
+		close (frame_socket);
+		throw;
+	}
+}
+
+/* Bind a frame socket to the interface and enable timestamps */
+void linux_provider::setup_frame_socket(int fd)
+{
+	/* Only receive frames from the chosen interface */
+	struct sockaddr_ll addr = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(0x88b6),
+		.sll_ifindex = if_index,
+		.sll_hatype = 0,
+		.sll_pkttype = 0,
+		.sll_halen = 0
+	};
+
+	if (bind (fd, (const sockaddr*) &addr, sizeof(addr)) < 0)
+		throw errno_exception("bind", errno);
+
+	/* Let the kernel timestamp received frames */
+	int one = 1;
+	if (setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) < 0)
+		throw errno_exception("setsockopt(SO_TIMESTAMPNS)", errno);
 }
 
 linux_provider::~linux_provider()
 {
+	if (stop_fd >= 0)
+	{
+		uint64_t v = 1;
+		if (write (stop_fd, &v, sizeof(v)) < 0)
+			fprintf (stderr, "Failed to stop the receive threads.\n");
+
+		for (auto &t : fanout_threads)
+			t.join();
+
+		close (stop_fd);
+	}
+
+	for (auto fd : fanout_sockets)
+		close (fd);
+
 	close(frame_socket);
 }
 
@@ -118,6 +187,26 @@ calendar_time linux_provider::get_utc()
 	return ct;
 }
 
+linear_time linux_provider::get_tai()
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_TAI, &ts) < 0)
+		throw errno_exception("clock_gettime", errno);
+
+	return linear_time(ts.tv_sec, ts.tv_nsec);
+}
+
+int16_t linux_provider::get_utc_offset()
+{
+	struct timex tx = {};
+
+	if (adjtimex (&tx) < 0)
+		throw errno_exception("adjtimex", errno);
+
+	return tx.tai;
+}
+
 linux_provider::timer_registration linux_provider::register_timer(
 		timer_handler_t handler, uint32_t period)
 {
@@ -144,11 +233,454 @@ void linux_provider::send_frame(const ethernet_frame &frame)
 
 	memcpy (addr.sll_addr, frame.dst, 6);
 
-	auto ret = sendto (frame_socket, frame.data, frame.data_size, 0,
-			(const sockaddr*) &addr, sizeof(addr));
+	send_datagram (frame.data, frame.data_size, (const sockaddr*) &addr,
+			sizeof(addr), frame.launch_time);
+}
 
-	if (ret < 0)
-		throw errno_exception("sendto", errno);
+void linux_provider::send_datagram(const void *data, size_t size,
+		const sockaddr *addr, socklen_t addr_len, uint64_t launch_time)
+{
+	if (!launch_time)
+	{
+		if (sendto (frame_socket, data, size, 0, addr, addr_len) < 0)
+			throw errno_exception("sendto", errno);
+	}
+	else
+	{
+		struct iovec iov = {
+			.iov_base = const_cast<void*>(data),
+			.iov_len = size
+		};
+
+		char control[CMSG_SPACE(sizeof(launch_time))] = {};
+
+		struct msghdr msg = {};
+		msg.msg_name = const_cast<sockaddr*>(addr);
+		msg.msg_namelen = addr_len;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(launch_time));
+		memcpy (CMSG_DATA(cmsg), &launch_time, sizeof(launch_time));
+
+		if (sendmsg (frame_socket, &msg, 0) < 0)
+			throw errno_exception("sendmsg", errno);
+	}
+
+	loop_stats.syscalls++;
+	loop_stats.frames_sent++;
+}
+
+/* Find an ETF qdisc with clockid CLOCK_TAI on the interface by dumping all
+ * qdiscs with rtnetlink; ETF is usually the child of an mqprio or taprio
+ * qdisc rather than the root. */
+static bool has_etf_qdisc(int if_index)
+{
+	int fd = socket (AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		throw errno_exception("socket(AF_NETLINK)", errno);
+
+	try
+	{
+		struct {
+			nlmsghdr nh;
+			tcmsg tc;
+		} req = {};
+
+		req.nh.nlmsg_len = sizeof(req);
+		req.nh.nlmsg_type = RTM_GETQDISC;
+		req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+		req.nh.nlmsg_seq = 1;
+		req.tc.tcm_family = AF_UNSPEC;
+
+		if (send (fd, &req, sizeof(req), 0) < 0)
+			throw errno_exception("send(RTM_GETQDISC)", errno);
+
+		bool found = false;
+		alignas(nlmsghdr) char buf[32768];
+
+		for (;;)
+		{
+			auto len = recv (fd, buf, sizeof(buf), 0);
+			if (len < 0)
+				throw errno_exception("recv(RTM_GETQDISC)", errno);
+
+			for (auto nh = (nlmsghdr*) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+			{
+				if (nh->nlmsg_type == NLMSG_DONE)
+				{
+					close (fd);
+					return found;
+				}
+
+				if (nh->nlmsg_type == NLMSG_ERROR)
+				{
+					auto err = (nlmsgerr*) NLMSG_DATA(nh);
+					throw errno_exception("RTM_GETQDISC", -err->error);
+				}
+
+				auto tc = (tcmsg*) NLMSG_DATA(nh);
+				if (nh->nlmsg_type != RTM_NEWQDISC || tc->tcm_ifindex != if_index)
+					continue;
+
+				bool etf = false;
+				const tc_etf_qopt *qopt = nullptr;
+
+				int attr_len = NLMSG_PAYLOAD(nh, sizeof(*tc));
+				for (auto rta = TCA_RTA(tc); RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len))
+				{
+					if (rta->rta_type == TCA_KIND)
+					{
+						etf = strncmp ((const char*) RTA_DATA(rta), "etf", RTA_PAYLOAD(rta)) == 0;
+					}
+					else if (rta->rta_type == TCA_OPTIONS)
+					{
+						int opt_len = RTA_PAYLOAD(rta);
+						for (auto opt = (rtattr*) RTA_DATA(rta); RTA_OK(opt, opt_len); opt = RTA_NEXT(opt, opt_len))
+						{
+							if (opt->rta_type == TCA_ETF_PARMS && RTA_PAYLOAD(opt) >= sizeof(*qopt))
+								qopt = (const tc_etf_qopt*) RTA_DATA(opt);
+						}
+					}
+				}
+
+				if (etf && qopt && qopt->clockid == CLOCK_TAI)
+					found = true;
+			}
+		}
+	}
+	catch (...)
+	{
+		close (fd);
+		throw;
+	}
+}
+
+bool linux_provider::enable_launch_time()
+{
+	/* Other qdiscs ignore the launch time and send the frames immediately,
+	 * which would offset each pulse by the time it was queued early. */
+	if (!has_etf_qdisc (if_index))
+		throw errno_exception("SO_TXTIME: no ETF qdisc with clockid CLOCK_TAI on " + if_name, EOPNOTSUPP);
+
+	/* Frames which miss their launch time are dropped by the qdisc and
+	 * reported on the socket's error queue. */
+	struct sock_txtime txtime = {
+		.clockid = CLOCK_TAI,
+		.flags = SOF_TXTIME_REPORT_ERRORS
+	};
+
+	if (setsockopt (frame_socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0)
+		throw errno_exception("setsockopt(SO_TXTIME)", errno);
+
+	return true;
+}
+
+uint64_t linux_provider::get_dropped_launches()
+{
+	return dropped_launches;
+}
+
+void linux_provider::receive_errors(int fd)
+{
+	for (;;)
+	{
+		char data[64];
+		struct iovec iov = {
+			.iov_base = data,
+			.iov_len = sizeof (data)
+		};
+
+		/* Extended error and, on IP sockets, the offender's address */
+		char control[256];
+
+		struct msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
+
+		auto cnt = recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (cnt < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+
+			throw errno_exception("recvmsg(MSG_ERRQUEUE)", errno);
+		}
+
+		unique_lock dlk(dispatch_m);
+		loop_stats.syscalls++;
+
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			bool is_error =
+				(cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP) ||
+				(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR);
+
+			if (!is_error || cmsg->cmsg_len < CMSG_LEN(sizeof (sock_extended_err)))
+				continue;
+
+			struct sock_extended_err ee;
+			memcpy (&ee, CMSG_DATA(cmsg), sizeof (ee));
+
+			if (ee.ee_origin == SO_EE_ORIGIN_TXTIME)
+				dropped_launches++;
+		}
+	}
+}
+
+void linux_provider::attach_filter(int fd)
+{
+	if (filter_program.empty())
+	{
+		/* Fails if no filter was attached */
+		setsockopt (fd, SOL_SOCKET, SO_DETACH_FILTER, nullptr, 0);
+		return;
+	}
+
+	struct sock_fprog prog = {
+		.len = (unsigned short) filter_program.size(),
+		.filter = filter_program.data()
+	};
+
+	if (setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		throw errno_exception("setsockopt(SO_ATTACH_FILTER)", errno);
+}
+
+void linux_provider::set_frame_filter(const frame_filter &filter)
+{
+	filter_program = compile_frame_filter (filter, filter_layout);
+
+	/* Attaching a new filter replaces the old one atomically. */
+	attach_filter (frame_socket);
+
+	for (auto fd : fanout_sockets)
+		attach_filter (fd);
+}
+
+void linux_provider::enable_fanout(unsigned threads)
+{
+	if (threads <= 1 || fanout_sockets.size())
+		return;
+
+	/* The group id only needs to be unique among the processes that use
+	 * fanout on this interface. */
+	int fanout_arg = (getpid() & 0xffff) | PACKET_FANOUT_CPU << 16;
+
+	if (setsockopt (frame_socket, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0)
+		throw errno_exception("setsockopt(PACKET_FANOUT)", errno);
+
+	stop_fd = eventfd (0, EFD_CLOEXEC);
+	if (stop_fd < 0)
+		throw errno_exception("eventfd", errno);
+
+	for (unsigned i = 1; i < threads; i++)
+	{
+		int fd = socket(AF_PACKET, SOCK_DGRAM, htons(0x88b6));
+		if (fd < 0)
+			throw errno_exception("socket(AF_PACKET, SOCK_DGRAM, 0x88b6", errno);
+
+		fanout_sockets.push_back (fd);
+
+		setup_frame_socket (fd);
+		attach_filter (fd);
+
+		if (setsockopt (fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0)
+			throw errno_exception("setsockopt(PACKET_FANOUT)", errno);
+	}
+
+	for (auto fd : fanout_sockets)
+		fanout_threads.emplace_back (&linux_provider::fanout_receiver, this, fd);
+}
+
+void linux_provider::fanout_receiver(int fd)
+{
+	struct pollfd fds[2] = {
+		{ .fd = fd, .events = POLLIN, .revents = 0 },
+		{ .fd = stop_fd, .events = POLLIN, .revents = 0 }
+	};
+
+	try
+	{
+		for (;;)
+		{
+			if (poll (fds, 2, -1) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+
+				throw errno_exception("poll", errno);
+			}
+
+			if (fds[1].revents)
+				return;
+
+			if (fds[0].revents & POLLIN)
+				receive_frame (fd);
+		}
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "Error in receive thread: %s\n", e.what());
+		abort();
+	}
+}
+
+void linux_provider::start_capture(const string &path)
+{
+	capture = make_unique<pcap_writer>(path);
+}
+
+void linux_provider::receive_frame(int fd)
+{
+	ethernet_frame frame;
+
+	struct sockaddr_ll addr;
+	struct iovec iov = {
+		.iov_base = frame.data,
+		.iov_len = sizeof (frame.data)
+	};
+
+	char control[CMSG_SPACE(sizeof (struct timespec))];
+
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof (addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof (control),
+		.msg_flags = 0
+	};
+
+	auto cnt = recvmsg (fd, &msg, 0);
+	if (cnt < 0)
+		throw errno_exception("recvmsg", errno);
+
+	frame.data_size = cnt;
+	parse_received_frame (frame, addr, msg);
+
+	unique_lock dlk(dispatch_m);
+	loop_stats.syscalls++;
+
+	/* Our own frames are looped back to packet sockets, too; they are not
+	 * received ones. */
+	deliver_frame (frame, addr.sll_pkttype == PACKET_OUTGOING);
+}
+
+void linux_provider::parse_received_frame(ethernet_frame &frame,
+		const sockaddr_ll &addr, msghdr &msg)
+{
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec ts;
+			memcpy (&ts, CMSG_DATA(cmsg), sizeof (ts));
+			frame.rx_timestamp = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+		}
+	}
+
+	/* The destination address is not reported by packet sockets, however it
+	 * can be inferred from the packet type for the common cases. */
+	if (addr.sll_pkttype == PACKET_BROADCAST)
+		memset (frame.dst, 0xff, sizeof (frame.dst));
+	else if (addr.sll_pkttype == PACKET_HOST)
+		memcpy (frame.dst, own_mac_address, sizeof (frame.dst));
+	else
+		memset (frame.dst, 0, sizeof (frame.dst));
+
+	memcpy (frame.src, addr.sll_addr, 6);
+	frame.ether_type = ntohs(addr.sll_protocol);
+}
+
+void linux_provider::deliver_frame(const ethernet_frame &frame, bool outgoing)
+{
+	if (!outgoing)
+		loop_stats.frames_received++;
+
+	if (capture && !outgoing)
+		capture->write (frame);
+
+	shared_lock lk(frame_subscribers_m);
+
+	for (auto &subs : frame_subscribers)
+		subs.handler (frame);
+}
+
+double linux_provider::run_timers(linear_time *next_expiry)
+{
+	double delay = 60;
+	timer *next = nullptr;
+
+	bool finished = false;
+	while (!finished)
+	{
+		finished = true;
+
+		for (auto &tim : timers)
+		{
+			auto now = get_monotonic_time();
+			auto remaining = tim.get_remaining_time(now);
+
+			if (remaining <= 0)
+			{
+				loop_stats.timer_latency.add (-remaining);
+
+				/* Keep the timer's phase, also if it is late by whole
+				 * periods; those are skipped. */
+				linear_time period(tim.period / 1000, tim.period % 1000 * 1000000);
+
+				do
+					tim.last_called = tim.last_called + period;
+				while (tim.period && tim.get_remaining_time (now) <= 0);
+
+				tim.handler();
+
+				/* Assuming that only one timer expires within a round.
+				 * */
+				finished = false;
+				break;
+			}
+
+			if (remaining < delay)
+			{
+				delay = remaining;
+				next = &tim;
+			}
+		}
+	}
+
+	if (next_expiry)
+	{
+		if (next)
+		{
+			*next_expiry = next->last_called + linear_time(
+					next->period / 1000, next->period % 1000 * 1000000);
+		}
+		else
+		{
+			*next_expiry = get_monotonic_time() + linear_time(delay, 0);
+		}
+	}
+
+	return delay;
+}
+
+void linux_provider::stop()
+{
+	stop_requested = true;
+}
+
+const loop_statistics& linux_provider::get_loop_statistics() const
+{
+	return loop_stats;
 }
 
 void linux_provider::main_loop()
@@ -167,34 +699,14 @@ void linux_provider::main_loop()
 		if (epoll_ctl (epfd, EPOLL_CTL_ADD, frame_socket, &tmp_event) < 0)
 			throw errno_exception("epoll_ctl (add frame_socket)", errno);
 
-		while (true)
+		while (!stop_requested)
 		{
-			double delay = 60;
+			unique_lock dlk(dispatch_m);
+			double delay = run_timers();
+			dlk.unlock();
 
-			bool finished = false;
-			while (!finished)
-			{
-				finished = true;
-
-				for (auto &tim : timers)
-				{
-					auto now = get_monotonic_time();
-					auto remaining = tim.get_remaining_time(now);
-
-					if (remaining <= 0)
-					{
-						tim.last_called = now;
-						tim.handler();
-
-						/* Assuming that only one timer expires within a round.
-						 * */
-						finished = false;
-						break;
-					}
-
-					delay = remaining < delay ? remaining : delay;
-				}
-			}
+			if (stop_requested)
+				break;
 
 			/* Sleep at most `delay` time. */
 			int ep_delay = floor (delay * 1000);
@@ -204,6 +716,7 @@ void linux_provider::main_loop()
 			struct epoll_event event;
 
 			int num = epoll_wait (epfd, &event, 1, ep_delay);
+			loop_stats.syscalls++;
 
 			if (num < 0)
 			{
@@ -213,32 +726,22 @@ void linux_provider::main_loop()
 			{
 				if (event.data.fd == frame_socket)
 				{
-					ethernet_frame frame;
-
-					struct sockaddr_ll addr;
-					socklen_t len = sizeof (addr);
-
-					auto cnt = recvfrom (frame_socket, frame.data, sizeof (frame.data),
-							0, (sockaddr*) &addr, &len);
-
-					if (cnt < 0)
-						throw errno_exception("recvfrom", errno);
-
-					frame.data_size = cnt;
-
-					memset (frame.dst, 0, sizeof (frame.dst));
-					memcpy (frame.src, addr.sll_addr, 6);
-					frame.ether_type = ntohs(addr.sll_protocol);
+					if (event.events & EPOLLERR)
+						receive_errors(frame_socket);
 
-					{
-						shared_lock lk(frame_subscribers_m);
-
-						for (auto &subs : frame_subscribers)
-							subs.handler ((const ethernet_frame) frame);
-					}
+					if (event.events & EPOLLIN)
+						receive_frame(frame_socket);
 				}
 			}
+			else if (capture)
+			{
+				/* Write the capture out while idle */
+				unique_lock dlk(dispatch_m);
+				capture->flush();
+			}
 		}
+
+		close (epfd);
 	}
 	catch(...)
 	{
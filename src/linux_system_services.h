@@ -1,11 +1,32 @@
 #ifndef __LINUX_SYSTEM_SERVICES_H
 #define __LINUX_SYSTEM_SERVICES_H
 
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
 #include "system_services.h"
+#include "summary.h"
+#include "pcap.h"
+#include "linux_socket_filter.h"
 
 namespace system_services
 {
 
+/* Counters of a main loop, for comparing backends */
+struct loop_statistics
+{
+	uint64_t syscalls = 0;
+	uint64_t frames_received = 0;
+	uint64_t frames_sent = 0;
+
+	/* Time from the expiry of timers to calling them in seconds */
+	deviation_summary timer_latency;
+};
+
 class linux_provider : public provider
 {
 protected:
@@ -17,7 +38,62 @@ protected:
 	int frame_socket = -1;
 	mac_addr_t own_mac_address;
 
-	linux_provider(const std::string &if_name);
+	/* Optional capture of all received frames */
+	std::unique_ptr<pcap_writer> capture;
+
+	/* Kernel-side filter attached to all frame sockets */
+	frame_filter_layout filter_layout;
+	std::vector<sock_filter> filter_program;
+	void attach_filter(int fd);
+
+	/* Additional sockets in a PACKET_FANOUT group with the frame socket, each
+	 * served by its own thread. Subscribers and timers are only ever called
+	 * with `dispatch_m` held, hence they need not be thread safe. */
+	std::vector<int> fanout_sockets;
+	std::vector<std::thread> fanout_threads;
+	int stop_fd = -1;
+	std::mutex dispatch_m;
+
+	void setup_frame_socket(int fd);
+	void fanout_receiver(int fd);
+
+	loop_statistics loop_stats;
+	bool stop_requested = false;
+
+	/* Receive a frame from a frame socket and dispatch it to the
+	 * subscribers */
+	virtual void receive_frame(int fd);
+
+	/* Fill in the addresses, ethertype and timestamp of a frame received
+	 * from a frame socket with recvmsg */
+	void parse_received_frame(ethernet_frame &frame, const sockaddr_ll &addr, msghdr &msg);
+
+	/* Frames with a launch time which the qdisc dropped */
+	uint64_t dropped_launches = 0;
+
+	/* Count the frames reported as dropped on the error queue of a frame
+	 * socket */
+	void receive_errors(int fd);
+
+	/* Send a datagram on the frame socket; with SCM_TXTIME if a launch time
+	 * is given */
+	void send_datagram(const void *data, size_t size, const sockaddr *addr,
+			socklen_t addr_len, uint64_t launch_time);
+
+	/* Capture a frame unless it is an outgoing one and pass it to the
+	 * subscribers; must be called with `dispatch_m` held. */
+	void deliver_frame(const ethernet_frame &frame, bool outgoing);
+
+	/* Call the expired timers; must be called with `dispatch_m` held.
+	 * @param next_expiry If not null, set to the monotonic time at which the
+	 * 		next timer expires
+	 * @returns The time until the next timer expires in seconds */
+	double run_timers(linear_time *next_expiry = nullptr);
+
+	/* Opens the frame socket as a datagram socket of the address family
+	 * `domain` on the interface. Only packet sockets are bound and set up
+	 * here; other transports set up the socket themselves. */
+	linux_provider(const std::string &if_name, int domain = AF_PACKET);
 
 public:
 	static std::shared_ptr<linux_provider> create(const std::string &if_name);
@@ -29,6 +105,8 @@ public:
 
 	linear_time get_monotonic_time() override;
 	calendar_time get_utc() override;
+	linear_time get_tai() override;
+	int16_t get_utc_offset() override;
 
 	timer_registration register_timer(timer_handler_t handler, uint32_t period) override;
 
@@ -36,7 +114,34 @@ public:
 
 	void send_frame(const ethernet_frame &frame) override;
 
-	void main_loop();
+	/** Passes launch times to the kernel with SO_TXTIME. They are TAI, which
+	 * the ETF qdisc must use as clock (`clockid CLOCK_TAI`), and the socket's
+	 * frames must be queued to it. Needs CAP_NET_ADMIN.
+	 * @raises errno_exception if the interface has no such qdisc; others
+	 * 		would send the frames immediately. */
+	bool enable_launch_time() override;
+	uint64_t get_dropped_launches() override;
+
+	/** Compiles the filter to a classic BPF program which is attached to the
+	 * packet sockets, such that other frames do not wake us up. */
+	void set_frame_filter(const frame_filter &filter) override;
+
+	/** Distribute received frames over `threads` sockets in a PACKET_FANOUT
+	 * group by the CPU they were received on. The frame socket, which is
+	 * served by `main_loop`, is one of them. */
+	void enable_fanout(unsigned threads);
+
+	/** Write all received frames along with their reception timestamp to a
+	 * pcap file. */
+	void start_capture(const std::string &path);
+
+	virtual void main_loop();
+
+	/** Let `main_loop` return; to be called from a timer or frame
+	 * subscriber. */
+	void stop();
+
+	const loop_statistics& get_loop_statistics() const;
 };
 
 }
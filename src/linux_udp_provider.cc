@@ -0,0 +1,227 @@
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "linux_udp_provider.h"
+
+using namespace std;
+
+namespace system_services
+{
+
+class linux_udp_provider_pi : public linux_udp_provider
+{
+public:
+	linux_udp_provider_pi(const string &if_name, const udp_config &config)
+		: linux_udp_provider(if_name, config)
+	{}
+};
+
+shared_ptr<linux_udp_provider> linux_udp_provider::create(
+		const string &if_name, const udp_config &config)
+{
+	return make_shared<linux_udp_provider_pi>(if_name, config);
+}
+
+linux_udp_provider::linux_udp_provider(const string &if_name, const udp_config &config)
+	: linux_provider(if_name, AF_INET), config(config)
+{
+	/* Interfaces without a hardware address (loopback) would give all nodes
+	 * the same identity; use a locally administered one per process. */
+	static const mac_addr_t zero_mac = {};
+	if (memcmp (own_mac_address, zero_mac, sizeof (zero_mac)) == 0)
+	{
+		own_mac_address[0] = 0x02;
+		own_mac_address[1] = 0x00;
+		write_be32 (own_mac_address + 2, getpid());
+	}
+
+	/* Filters see the datagram from the UDP header on */
+	filter_layout.payload = 8 + HEADER_SIZE;
+	filter_layout.src = 8 + 6;
+	filter_layout.ether_type = 8 + 12;
+
+	try
+	{
+		claim_identity();
+		setup_socket();
+	}
+	catch (...)
+	{
+		if (identity_socket >= 0)
+			close (identity_socket);
+
+		close (frame_socket);
+		throw;
+	}
+}
+
+linux_udp_provider::~linux_udp_provider()
+{
+	if (identity_socket >= 0)
+		close (identity_socket);
+}
+
+void linux_udp_provider::claim_identity()
+{
+	/* Unlike on the link layer, all nodes of this host share the interface's
+	 * address and would take each other's frames for their own. The first
+	 * node binds an abstract socket named after the address; the kernel
+	 * releases it when the node exits. */
+	identity_socket = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (identity_socket < 0)
+		throw errno_exception("socket(AF_UNIX)", errno);
+
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	int len = snprintf (addr.sun_path + 1, sizeof (addr.sun_path) - 1,
+			"distributed_clock_jitter/udp/%02x:%02x:%02x:%02x:%02x:%02x",
+			own_mac_address[0], own_mac_address[1], own_mac_address[2],
+			own_mac_address[3], own_mac_address[4], own_mac_address[5]);
+
+	if (bind (identity_socket, (const sockaddr*) &addr,
+				offsetof (struct sockaddr_un, sun_path) + 1 + len) < 0)
+	{
+		if (errno == EADDRINUSE)
+			throw errno_exception("another node on this host uses the address of " +
+					if_name + "; use a loopback interface to test several nodes", errno);
+
+		throw errno_exception("bind(AF_UNIX)", errno);
+	}
+}
+
+void linux_udp_provider::setup_socket()
+{
+	group_addr.sin_family = AF_INET;
+	group_addr.sin_port = htons(config.port);
+
+	if (inet_pton (AF_INET, config.group.c_str(), &group_addr.sin_addr) != 1 ||
+			!IN_MULTICAST(ntohl(group_addr.sin_addr.s_addr)))
+		throw errno_exception("multicast group " + config.group, EINVAL);
+
+	/* Several nodes may run on one host. Binding to the group's address only
+	 * receives datagrams sent to the group. */
+	int one = 1;
+	if (setsockopt (frame_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0)
+		throw errno_exception("setsockopt(SO_REUSEADDR)", errno);
+
+	if (bind (frame_socket, (const sockaddr*) &group_addr, sizeof(group_addr)) < 0)
+		throw errno_exception("bind", errno);
+
+	struct ip_mreqn mreq = {};
+	mreq.imr_multiaddr = group_addr.sin_addr;
+	mreq.imr_ifindex = if_index;
+
+	if (setsockopt (frame_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+		throw errno_exception("setsockopt(IP_ADD_MEMBERSHIP)", errno);
+
+	if (setsockopt (frame_socket, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0)
+		throw errno_exception("setsockopt(IP_MULTICAST_IF)", errno);
+
+	if (setsockopt (frame_socket, IPPROTO_IP, IP_MULTICAST_TTL, &config.ttl, sizeof(config.ttl)) < 0)
+		throw errno_exception("setsockopt(IP_MULTICAST_TTL)", errno);
+
+	/* Other nodes on this host receive our datagrams, as do we; packet
+	 * sockets see their own frames, too. */
+	if (setsockopt (frame_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &one, sizeof(one)) < 0)
+		throw errno_exception("setsockopt(IP_MULTICAST_LOOP)", errno);
+
+	/* Software receive timestamps are taken when the driver hands the
+	 * datagram to the network stack, at the same point as the packet
+	 * sockets' SO_TIMESTAMPNS. */
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt (frame_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+		throw errno_exception("setsockopt(SO_TIMESTAMPING)", errno);
+
+	for (unsigned i = 0; i < RECV_BATCH; i++)
+	{
+		auto &slot = recv_slots[i];
+		slot.iov = {
+			.iov_base = slot.data,
+			.iov_len = sizeof (slot.data)
+		};
+
+		memset (&recv_msgs[i], 0, sizeof (recv_msgs[i]));
+		recv_msgs[i].msg_hdr.msg_iov = &slot.iov;
+		recv_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+void linux_udp_provider::send_frame(const ethernet_frame &frame)
+{
+	/* Like a packet socket, fill in our address as source */
+	memcpy (send_buffer, frame.dst, 6);
+	memcpy (send_buffer + 6, own_mac_address, 6);
+	write_be16 (send_buffer + 12, frame.ether_type);
+	memcpy (send_buffer + HEADER_SIZE, frame.data, frame.data_size);
+
+	send_datagram (send_buffer, HEADER_SIZE + frame.data_size,
+			(const sockaddr*) &group_addr, sizeof(group_addr), frame.launch_time);
+}
+
+void linux_udp_provider::receive_frame(int fd)
+{
+	for (unsigned i = 0; i < RECV_BATCH; i++)
+	{
+		recv_msgs[i].msg_hdr.msg_control = recv_slots[i].control;
+		recv_msgs[i].msg_hdr.msg_controllen = sizeof (recv_slots[i].control);
+	}
+
+	int cnt = recvmmsg (fd, recv_msgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+	if (cnt < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+
+		throw errno_exception("recvmmsg", errno);
+	}
+
+	unique_lock dlk(dispatch_m);
+	loop_stats.syscalls++;
+
+	for (int i = 0; i < cnt; i++)
+	{
+		auto &msg = recv_msgs[i].msg_hdr;
+		auto data = recv_slots[i].data;
+		size_t size = recv_msgs[i].msg_len;
+
+		if (size < HEADER_SIZE || (msg.msg_flags & MSG_TRUNC))
+			continue;
+
+		ethernet_frame frame;
+		memcpy (frame.dst, data, 6);
+		memcpy (frame.src, data + 6, 6);
+		frame.ether_type = read_be16 (data + 12);
+		frame.data_size = size - HEADER_SIZE;
+		memcpy (frame.data, data + HEADER_SIZE, frame.data_size);
+
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+			{
+				/* Software, (deprecated) and hardware timestamp */
+				struct scm_timestamping ts;
+				memcpy (&ts, CMSG_DATA(cmsg), sizeof (ts));
+				frame.rx_timestamp = (uint64_t) ts.ts[0].tv_sec * 1000000000 + ts.ts[0].tv_nsec;
+			}
+		}
+
+		/* All nodes receive all datagrams; drop frames to other nodes like
+		 * the link layer would. */
+		if (!(frame.dst[0] & 1) &&
+				memcmp (frame.dst, own_mac_address, sizeof (frame.dst)) != 0)
+			continue;
+
+		deliver_frame (frame, memcmp (frame.src, own_mac_address, sizeof (frame.src)) == 0);
+	}
+}
+
+}
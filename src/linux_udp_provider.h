@@ -0,0 +1,74 @@
+#ifndef __LINUX_UDP_PROVIDER_H
+#define __LINUX_UDP_PROVIDER_H
+
+/** A linux provider which carries the frames in UDP datagrams to an IPv4
+ * multicast group instead of on the link layer. This needs neither root nor
+ * CAP_NET_RAW, and reaches all subnets the group is routed to. Each datagram
+ * holds the frame's Ethernet header (destination, source, ethertype) followed
+ * by its payload, hence nodes keep their identity across routers. */
+
+#include <string>
+#include <netinet/in.h>
+#include "linux_system_services.h"
+
+namespace system_services
+{
+
+struct udp_config
+{
+	/* Multicast group and port; the default port is our ethertype */
+	std::string group = "239.255.136.182";
+	uint16_t port = 0x88b6;
+
+	/* Time to live of sent datagrams, i.e. number of routers they may pass */
+	int ttl = 16;
+};
+
+class linux_udp_provider : public linux_provider
+{
+protected:
+	/* Destination, source and ethertype in front of the payload */
+	static constexpr size_t HEADER_SIZE = 14;
+
+	/* Datagrams received with a single system call */
+	static constexpr unsigned RECV_BATCH = 16;
+
+	udp_config config;
+	sockaddr_in group_addr {};
+
+	struct recv_slot
+	{
+		unsigned char data[HEADER_SIZE + 1500];
+		char control[CMSG_SPACE(3 * sizeof (struct timespec))];
+		iovec iov;
+	};
+
+	recv_slot recv_slots[RECV_BATCH];
+	mmsghdr recv_msgs[RECV_BATCH];
+
+	unsigned char send_buffer[HEADER_SIZE + 1500];
+
+	/* Held while this process uses its identity on this host */
+	int identity_socket = -1;
+
+	void claim_identity();
+	void setup_socket();
+
+	/* Receive all pending datagrams, up to RECV_BATCH with one system call,
+	 * and dispatch the frames in them */
+	void receive_frame(int fd) override;
+
+	linux_udp_provider(const std::string &if_name, const udp_config &config);
+
+public:
+	static std::shared_ptr<linux_udp_provider> create(
+			const std::string &if_name, const udp_config &config = udp_config());
+
+	~linux_udp_provider() override;
+
+	void send_frame(const ethernet_frame &frame) override;
+};
+
+}
+
+#endif /* __LINUX_UDP_PROVIDER_H */
@@ -0,0 +1,441 @@
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "linux_uring_provider.h"
+
+using namespace std;
+
+namespace system_services
+{
+
+class linux_uring_provider_pi : public linux_uring_provider
+{
+public:
+	linux_uring_provider_pi(const string &if_name)
+		: linux_uring_provider(if_name)
+	{}
+};
+
+shared_ptr<linux_uring_provider> linux_uring_provider::create(const string &if_name)
+{
+	return make_shared<linux_uring_provider_pi>(if_name);
+}
+
+linux_uring_provider::linux_uring_provider(const string &if_name)
+	: linux_provider(if_name), send_slots(SEND_SLOTS)
+{
+	for (unsigned i = 0; i < SEND_SLOTS; i++)
+		free_send_slots.push_back (i);
+
+	try
+	{
+		setup_ring();
+	}
+	catch (...)
+	{
+		cleanup();
+		throw;
+	}
+}
+
+linux_uring_provider::~linux_uring_provider()
+{
+	cleanup();
+}
+
+static void *map_ring (int fd, size_t size, uint64_t offset)
+{
+	void *map = mmap (nullptr, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	if (map == MAP_FAILED)
+		throw errno_exception("mmap(io_uring)", errno);
+
+	return map;
+}
+
+void linux_uring_provider::setup_ring()
+{
+	/* Deferring the completion work to io_uring_enter avoids interrupting
+	 * us while we process frames; fall back if the kernel is older than
+	 * 6.1. */
+	io_uring_params params;
+	memset (&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+
+	ring_fd = syscall (__NR_io_uring_setup, QUEUE_DEPTH, &params);
+	if (ring_fd < 0 && errno == EINVAL)
+	{
+		memset (&params, 0, sizeof(params));
+		ring_fd = syscall (__NR_io_uring_setup, QUEUE_DEPTH, &params);
+	}
+
+	if (ring_fd < 0)
+		throw errno_exception("io_uring_setup", errno);
+
+	sq_map_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		sq_map_size = cq_map_size = max (sq_map_size, cq_map_size);
+		sq_map = map_ring (ring_fd, sq_map_size, IORING_OFF_SQ_RING);
+		cq_map = sq_map;
+	}
+	else
+	{
+		sq_map = map_ring (ring_fd, sq_map_size, IORING_OFF_SQ_RING);
+		cq_map = map_ring (ring_fd, cq_map_size, IORING_OFF_CQ_RING);
+	}
+
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = (io_uring_sqe*) map_ring (ring_fd, sqes_size, IORING_OFF_SQES);
+
+	auto sq = (unsigned char*) sq_map;
+	sq_head = (uint32_t*) (sq + params.sq_off.head);
+	sq_tail = (uint32_t*) (sq + params.sq_off.tail);
+	sq_array = (uint32_t*) (sq + params.sq_off.array);
+	sq_mask = *(uint32_t*) (sq + params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	sq_local_tail = *sq_tail;
+
+	auto cq = (unsigned char*) cq_map;
+	cq_head = (uint32_t*) (cq + params.cq_off.head);
+	cq_tail = (uint32_t*) (cq + params.cq_off.tail);
+	cq_mask = *(uint32_t*) (cq + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	void *mem = mmap (nullptr, RECV_BUFFERS * RECV_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw errno_exception("mmap(receive buffers)", errno);
+
+	recv_buffers = (unsigned char*) mem;
+
+	/* Provided along with the first submission */
+	auto sqe = get_sqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = RECV_BUFFERS;
+	sqe->addr = (uintptr_t) recv_buffers;
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->off = 0;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = UD_PROVIDE;
+
+	recv_msg.msg_namelen = RECV_NAME_SIZE;
+	recv_msg.msg_controllen = CMSG_SPACE(sizeof (struct timespec));
+
+	/* Kernels before 6.0 reject the multishot recvmsg when it is submitted,
+	 * hence submitting it right away reports them on startup. */
+	checking_receive = true;
+	arm_receive();
+	enter (0);
+	process_completions();
+	checking_receive = false;
+}
+
+void linux_uring_provider::cleanup()
+{
+	/* Closing the ring cancels all requests */
+	if (ring_fd >= 0)
+		close (ring_fd);
+
+	ring_fd = -1;
+
+	if (sqes)
+		munmap (sqes, sqes_size);
+
+	if (cq_map && cq_map != sq_map)
+		munmap (cq_map, cq_map_size);
+
+	if (sq_map)
+		munmap (sq_map, sq_map_size);
+
+	sqes = nullptr;
+	sq_map = cq_map = nullptr;
+
+	if (recv_buffers)
+		munmap (recv_buffers, RECV_BUFFERS * RECV_BUFFER_SIZE);
+
+	recv_buffers = nullptr;
+}
+
+io_uring_sqe *linux_uring_provider::get_sqe()
+{
+	if (sq_local_tail - __atomic_load_n (sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+		enter (0);
+
+	uint32_t index = sq_local_tail & sq_mask;
+	sq_array[index] = index;
+	sq_local_tail++;
+
+	auto sqe = &sqes[index];
+	memset (sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void linux_uring_provider::enter(unsigned wait_nr)
+{
+	__atomic_store_n (sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+	uint32_t to_submit = sq_local_tail - __atomic_load_n (sq_head, __ATOMIC_ACQUIRE);
+
+	loop_stats.syscalls++;
+
+	int ret = syscall (__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+	/* Entries which were not submitted are retried with the next call */
+	if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		throw errno_exception("io_uring_enter", errno);
+}
+
+void linux_uring_provider::arm_receive()
+{
+	auto sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = frame_socket;
+	sqe->addr = (uintptr_t) &recv_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = UD_RECV;
+
+	recv_armed = true;
+}
+
+void linux_uring_provider::recycle_buffer(unsigned bid)
+{
+	/* Submitted along with the next system call */
+	auto sqe = get_sqe();
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = 1;
+	sqe->addr = (uintptr_t) (recv_buffers + bid * RECV_BUFFER_SIZE);
+	sqe->len = RECV_BUFFER_SIZE;
+	sqe->off = bid;
+	sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = UD_PROVIDE;
+}
+
+void linux_uring_provider::set_timeout(const linear_time &deadline)
+{
+	__kernel_timespec ts = {
+		.tv_sec = (int64_t) deadline.seconds,
+		.tv_nsec = deadline.nanoseconds
+	};
+
+	if (timeout_armed && ts.tv_sec == timeout_ts.tv_sec && ts.tv_nsec == timeout_ts.tv_nsec)
+		return;
+
+	/* The kernel reads the time when the entry is submitted */
+	timeout_ts = ts;
+
+	auto sqe = get_sqe();
+	sqe->addr2 = 0;
+
+	if (!timeout_armed)
+	{
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t) &timeout_ts;
+		sqe->len = 1;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		sqe->user_data = UD_TIMEOUT;
+
+		timeout_armed = true;
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->addr = UD_TIMEOUT;
+		sqe->addr2 = (uintptr_t) &timeout_ts;
+		sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+		sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+		sqe->user_data = UD_TIMEOUT_UPDATE;
+	}
+}
+
+void linux_uring_provider::send_frame(const ethernet_frame &frame)
+{
+	if (free_send_slots.empty())
+		throw errno_exception("io_uring send", ENOBUFS);
+
+	unsigned index = free_send_slots.back();
+	free_send_slots.pop_back();
+
+	auto &slot = send_slots[index];
+	memcpy (slot.data, frame.data, frame.data_size);
+
+	slot.addr = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(frame.ether_type),
+		.sll_ifindex = if_index,
+		.sll_hatype = 0,
+		.sll_pkttype = 0,
+		.sll_halen = 6
+	};
+
+	memcpy (slot.addr.sll_addr, frame.dst, 6);
+
+	slot.iov = {
+		.iov_base = slot.data,
+		.iov_len = frame.data_size
+	};
+
+	memset (&slot.msg, 0, sizeof(slot.msg));
+	slot.msg.msg_name = &slot.addr;
+	slot.msg.msg_namelen = sizeof(slot.addr);
+	slot.msg.msg_iov = &slot.iov;
+	slot.msg.msg_iovlen = 1;
+
+	auto sqe = get_sqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = frame_socket;
+	sqe->addr = (uintptr_t) &slot.msg;
+	sqe->len = 1;
+	sqe->user_data = UD_SEND_BASE + index;
+
+	loop_stats.frames_sent++;
+}
+
+bool linux_uring_provider::enable_launch_time()
+{
+	return false;
+}
+
+void linux_uring_provider::handle_receive(const io_uring_cqe &cqe)
+{
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+		recv_armed = false;
+
+	/* The receive ends if we run out of buffers; it is armed again by the
+	 * main loop. */
+	if (cqe.res == -ENOBUFS)
+		return;
+
+	if (cqe.res == -EINVAL && checking_receive)
+		throw errno_exception("io_uring multishot recvmsg (requires Linux 6.0)", EINVAL);
+
+	if (cqe.res < 0)
+		throw errno_exception("io_uring recvmsg", -cqe.res);
+
+	if (!(cqe.flags & IORING_CQE_F_BUFFER))
+		return;
+
+	unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+	auto buf = recv_buffers + bid * RECV_BUFFER_SIZE;
+
+	io_uring_recvmsg_out out;
+	memcpy (&out, buf, sizeof(out));
+
+	auto name = buf + sizeof(out);
+	auto control = name + RECV_NAME_SIZE;
+	auto payload = control + recv_msg.msg_controllen;
+
+	ethernet_frame frame;
+	size_t header_size = payload - buf;
+	size_t available = (size_t) cqe.res > header_size ? cqe.res - header_size : 0;
+	frame.data_size = min ({ (size_t) out.payloadlen, available, sizeof(frame.data) });
+	memcpy (frame.data, payload, frame.data_size);
+
+	sockaddr_ll addr;
+	memset (&addr, 0, sizeof(addr));
+	memcpy (&addr, name, min ((size_t) out.namelen, sizeof(addr)));
+
+	msghdr msg;
+	memset (&msg, 0, sizeof(msg));
+	msg.msg_control = control;
+	msg.msg_controllen = out.controllen;
+
+	parse_received_frame (frame, addr, msg);
+	recycle_buffer (bid);
+
+	deliver_frame (frame, addr.sll_pkttype == PACKET_OUTGOING);
+}
+
+void linux_uring_provider::process_completions()
+{
+	uint32_t head = *cq_head;
+	uint32_t tail = __atomic_load_n (cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return;
+
+	unique_lock dlk(dispatch_m);
+
+	for (; head != tail; head++)
+	{
+		auto cqe = cqes[head & cq_mask];
+		__atomic_store_n (cq_head, head + 1, __ATOMIC_RELEASE);
+
+		switch (cqe.user_data)
+		{
+		case UD_RECV:
+			handle_receive (cqe);
+			break;
+
+		case UD_TIMEOUT:
+			timeout_armed = false;
+			break;
+
+		case UD_TIMEOUT_UPDATE:
+			/* Fails if the timeout expired in the meantime */
+			break;
+
+		case UD_PROVIDE:
+			if (cqe.res < 0)
+				throw errno_exception("io_uring provide buffers", -cqe.res);
+
+			break;
+
+		default:
+			free_send_slots.push_back (cqe.user_data - UD_SEND_BASE);
+
+			if (cqe.res < 0)
+				throw errno_exception("io_uring sendmsg", -cqe.res);
+
+			break;
+		}
+	}
+}
+
+void linux_uring_provider::main_loop()
+{
+	while (!stop_requested)
+	{
+		if (!recv_armed)
+			arm_receive();
+
+		unique_lock dlk(dispatch_m);
+		linear_time next_expiry;
+		run_timers (&next_expiry);
+		dlk.unlock();
+
+		if (stop_requested)
+			break;
+
+		/* The timeout has nanosecond resolution, and submitting it, the
+		 * queued sends and waiting takes a single system call. Sends to
+		 * packet sockets complete immediately; waiting for them, too, saves
+		 * a wakeup. */
+		set_timeout (next_expiry);
+
+		uint64_t received = loop_stats.frames_received;
+
+		enter (1 + SEND_SLOTS - free_send_slots.size());
+		process_completions();
+
+		if (capture && received == loop_stats.frames_received)
+		{
+			/* Write the capture out while idle */
+			unique_lock dlk(dispatch_m);
+			capture->flush();
+		}
+	}
+}
+
+}
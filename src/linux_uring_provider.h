@@ -0,0 +1,124 @@
+#ifndef __LINUX_URING_PROVIDER_H
+#define __LINUX_URING_PROVIDER_H
+
+/** A linux provider whose main loop is built on io_uring instead of epoll */
+
+#include <vector>
+#include <linux/io_uring.h>
+#include "linux_system_services.h"
+
+namespace system_services
+{
+
+class linux_uring_provider : public linux_provider
+{
+protected:
+	static constexpr unsigned QUEUE_DEPTH = 64;
+
+	/* Buffers provided to the multishot receive with
+	 * IORING_OP_PROVIDE_BUFFERS; a buffer holds an io_uring_recvmsg_out
+	 * header, the address, the control messages and the frame. */
+	static constexpr unsigned RECV_BUFFERS = 64;
+	static constexpr unsigned RECV_BUFFER_SIZE = 2048;
+	static constexpr unsigned RECV_BUFFER_GROUP = 0;
+
+	/* Sends in flight */
+	static constexpr unsigned SEND_SLOTS = 32;
+
+	/* The address is padded such that the control messages are aligned */
+	static constexpr unsigned RECV_NAME_SIZE = (sizeof(sockaddr_ll) + 7) & ~7;
+
+	/* user_data of the requests; sends use SEND_BASE + their slot */
+	enum : uint64_t
+	{
+		UD_RECV = 1,
+		UD_TIMEOUT,
+		UD_TIMEOUT_UPDATE,
+		UD_PROVIDE,
+		UD_SEND_BASE = 16
+	};
+
+	int ring_fd = -1;
+
+	void *sq_map = nullptr;
+	size_t sq_map_size = 0;
+	void *cq_map = nullptr;
+	size_t cq_map_size = 0;
+	io_uring_sqe *sqes = nullptr;
+	size_t sqes_size = 0;
+
+	uint32_t *sq_head = nullptr;
+	uint32_t *sq_tail = nullptr;
+	uint32_t *sq_array = nullptr;
+	uint32_t sq_mask = 0;
+	uint32_t sq_entries = 0;
+
+	/* Tail including the entries which were not yet submitted */
+	uint32_t sq_local_tail = 0;
+
+	uint32_t *cq_head = nullptr;
+	uint32_t *cq_tail = nullptr;
+	uint32_t cq_mask = 0;
+	io_uring_cqe *cqes = nullptr;
+
+	unsigned char *recv_buffers = nullptr;
+
+	/* Template of the multishot receive, and whether its first submission
+	 * is checked for kernel support */
+	msghdr recv_msg {};
+	bool recv_armed = false;
+	bool checking_receive = false;
+
+	/* The absolute CLOCK_MONOTONIC deadline of the pending timeout */
+	__kernel_timespec timeout_ts {};
+	bool timeout_armed = false;
+
+	struct send_slot
+	{
+		unsigned char data[1500];
+		sockaddr_ll addr;
+		iovec iov;
+		msghdr msg;
+	};
+
+	std::vector<send_slot> send_slots;
+	std::vector<unsigned> free_send_slots;
+
+	void setup_ring();
+	void cleanup();
+
+	/* @returns A zeroed submission queue entry. If the queue is full, the
+	 * pending entries are submitted first. */
+	io_uring_sqe *get_sqe();
+
+	/* Submit the pending entries and wait for `wait_nr` completions */
+	void enter(unsigned wait_nr);
+
+	void arm_receive();
+	void recycle_buffer(unsigned bid);
+	void set_timeout(const linear_time &deadline);
+
+	/* Process all completion queue entries */
+	void process_completions();
+	void handle_receive(const io_uring_cqe &cqe);
+
+	linux_uring_provider(const std::string &if_name);
+
+public:
+	static std::shared_ptr<linux_uring_provider> create(const std::string &if_name);
+
+	virtual ~linux_uring_provider();
+
+	/** Queues the frame; it is sent along with the next submission, at the
+	 * latest when the main loop waits for events. */
+	void send_frame(const ethernet_frame &frame) override;
+
+	/** Launch times are not passed to the kernel */
+	bool enable_launch_time() override;
+
+	void main_loop() override;
+};
+
+}
+
+#endif /* __LINUX_URING_PROVIDER_H */
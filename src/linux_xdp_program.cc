@@ -0,0 +1,157 @@
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include "errno_exception.h"
+#include "linux_xdp_program.h"
+
+using namespace std;
+
+namespace system_services
+{
+
+static int sys_bpf (int cmd, union bpf_attr *attr)
+{
+	return syscall (__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* eBPF registers */
+enum : uint8_t
+{
+	R0 = BPF_REG_0,
+	R1 = BPF_REG_1,
+	R2 = BPF_REG_2,
+	R3 = BPF_REG_3,
+	R4 = BPF_REG_4
+};
+
+static bpf_insn insn (uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+	bpf_insn i;
+	memset (&i, 0, sizeof(i));
+
+	i.code = code;
+	i.dst_reg = dst;
+	i.src_reg = src;
+	i.off = off;
+	i.imm = imm;
+	return i;
+}
+
+
+int create_xsk_map (unsigned entries)
+{
+	union bpf_attr attr;
+	memset (&attr, 0, sizeof(attr));
+
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(int);
+	attr.max_entries = entries;
+	strncpy (attr.map_name, "dcj_xsks", sizeof(attr.map_name) - 1);
+
+	int fd = sys_bpf (BPF_MAP_CREATE, &attr);
+	if (fd < 0)
+		throw errno_exception("bpf(BPF_MAP_CREATE)", errno);
+
+	return fd;
+}
+
+void update_xsk_map (int map_fd, uint32_t queue, int xsk_fd)
+{
+	union bpf_attr attr;
+	memset (&attr, 0, sizeof(attr));
+
+	attr.map_fd = map_fd;
+	attr.key = (uintptr_t) &queue;
+	attr.value = (uintptr_t) &xsk_fd;
+	attr.flags = BPF_ANY;
+
+	if (sys_bpf (BPF_MAP_UPDATE_ELEM, &attr) < 0)
+		throw errno_exception("bpf(BPF_MAP_UPDATE_ELEM)", errno);
+}
+
+int load_xdp_redirect_program (int map_fd)
+{
+	/* Jump offsets are relative to the next instruction; the frame is passed
+	 * by the last two instructions. */
+	const vector<bpf_insn> prog = {
+		/* r2 = ctx->data, r3 = ctx->data_end */
+		insn (BPF_LDX | BPF_MEM | BPF_W, R2, R1, offsetof(xdp_md, data), 0),
+		insn (BPF_LDX | BPF_MEM | BPF_W, R3, R1, offsetof(xdp_md, data_end), 0),
+
+		/* Pass frames shorter than an ethernet header */
+		insn (BPF_ALU64 | BPF_MOV | BPF_X, R4, R2, 0, 0),
+		insn (BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, 14),
+		insn (BPF_JMP | BPF_JGT | BPF_X, R4, R3, 8, 0),
+
+		/* Pass other ethertypes; the load yields network byte order */
+		insn (BPF_LDX | BPF_MEM | BPF_H, R4, R2, 12, 0),
+		insn (BPF_JMP | BPF_JNE | BPF_K, R4, 0, 6, htons(0x88b6)),
+
+		/* return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS); the
+		 * flags are the action if the queue has no socket. */
+		insn (BPF_LDX | BPF_MEM | BPF_W, R2, R1, offsetof(xdp_md, rx_queue_index), 0),
+		insn (BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		insn (0, 0, 0, 0, 0),
+		insn (BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, XDP_PASS),
+		insn (BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		insn (BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+
+		insn (BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS),
+		insn (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+	};
+
+	char log[4096] = "";
+
+	union bpf_attr attr;
+	memset (&attr, 0, sizeof(attr));
+
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.expected_attach_type = BPF_XDP;
+	attr.insns = (uintptr_t) prog.data();
+	attr.insn_cnt = prog.size();
+	attr.license = (uintptr_t) "GPL";
+	attr.log_buf = (uintptr_t) log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	strncpy (attr.prog_name, "dcj_redirect", sizeof(attr.prog_name) - 1);
+
+	int fd = sys_bpf (BPF_PROG_LOAD, &attr);
+	if (fd < 0)
+	{
+		int err = errno;
+		string msg = "bpf(BPF_PROG_LOAD)";
+
+		if (log[0])
+			msg += " (verifier log: " + string(log) + ")";
+
+		throw errno_exception(msg, err);
+	}
+
+	return fd;
+}
+
+int attach_xdp_program (int prog_fd, int if_index, bool skb_mode)
+{
+	union bpf_attr attr;
+	memset (&attr, 0, sizeof(attr));
+
+	attr.link_create.prog_fd = prog_fd;
+	attr.link_create.target_ifindex = if_index;
+	attr.link_create.attach_type = BPF_XDP;
+	attr.link_create.flags = skb_mode ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE;
+
+	int fd = sys_bpf (BPF_LINK_CREATE, &attr);
+	if (fd < 0)
+		throw errno_exception("bpf(BPF_LINK_CREATE)", errno);
+
+	return fd;
+}
+
+}
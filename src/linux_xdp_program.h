@@ -0,0 +1,32 @@
+#ifndef __LINUX_XDP_PROGRAM_H
+#define __LINUX_XDP_PROGRAM_H
+
+/** Loading of the XDP program that steers our frames to an AF_XDP socket,
+ * using the bpf() system call directly. */
+
+#include <cstdint>
+
+namespace system_services
+{
+
+/** Create an XSKMAP, which maps receive queues to AF_XDP sockets.
+ * @returns The map's file descriptor */
+int create_xsk_map (unsigned entries);
+
+/** Let the socket receive the frames of a receive queue */
+void update_xsk_map (int map_fd, uint32_t queue, int xsk_fd);
+
+/** Load an XDP program which redirects frames with ethertype 0x88b6 to the
+ * socket in the map's slot of their receive queue and passes all other frames
+ * on to the network stack.
+ * @returns The program's file descriptor */
+int load_xdp_redirect_program (int map_fd);
+
+/** Attach an XDP program to an interface through a bpf link, in generic (SKB)
+ * mode or in the driver. Closing the link detaches the program.
+ * @returns The link's file descriptor */
+int attach_xdp_program (int prog_fd, int if_index, bool skb_mode);
+
+}
+
+#endif /* __LINUX_XDP_PROGRAM_H */
@@ -0,0 +1,370 @@
+#include <cmath>
+#include <cstring>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "linux_xdp_program.h"
+#include "linux_xdp_provider.h"
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+using namespace std;
+
+namespace system_services
+{
+
+class linux_xdp_provider_pi : public linux_xdp_provider
+{
+public:
+	linux_xdp_provider_pi(const string &if_name, const xdp_config &config)
+		: linux_xdp_provider(if_name, config)
+	{}
+};
+
+shared_ptr<linux_xdp_provider> linux_xdp_provider::create(
+		const string &if_name, const xdp_config &config)
+{
+	return make_shared<linux_xdp_provider_pi>(if_name, config);
+}
+
+linux_xdp_provider::linux_xdp_provider(const string &if_name, const xdp_config &config)
+	: linux_provider(if_name), config(config)
+{
+	/* The base class' packet socket only serves to look up the interface;
+	 * let it drop everything. */
+	filter_program = { BPF_STMT(BPF_RET | BPF_K, 0) };
+	attach_filter (frame_socket);
+
+	try
+	{
+		setup_socket();
+	}
+	catch (...)
+	{
+		cleanup();
+		throw;
+	}
+}
+
+linux_xdp_provider::~linux_xdp_provider()
+{
+	cleanup();
+}
+
+void linux_xdp_provider::map_ring(ring &r, uint64_t offset,
+		const struct xdp_ring_offset &offs, size_t desc_size)
+{
+	r.map_size = offs.desc + RING_SIZE * desc_size;
+
+	void *map = mmap (nullptr, r.map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, xsk, offset);
+
+	if (map == MAP_FAILED)
+		throw errno_exception("mmap(AF_XDP ring)", errno);
+
+	r.map = map;
+
+	auto base = (unsigned char*) map;
+	r.producer = (uint32_t*) (base + offs.producer);
+	r.consumer = (uint32_t*) (base + offs.consumer);
+	r.flags = (uint32_t*) (base + offs.flags);
+	r.descs = base + offs.desc;
+}
+
+void linux_xdp_provider::setup_socket()
+{
+	void *mem = mmap (nullptr, (size_t) UMEM_FRAMES * FRAME_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED)
+		throw errno_exception("mmap(UMEM)", errno);
+
+	umem = (unsigned char*) mem;
+
+	xsk = socket (AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (xsk < 0)
+		throw errno_exception("socket(AF_XDP)", errno);
+
+	struct xdp_umem_reg reg;
+	memset (&reg, 0, sizeof(reg));
+	reg.addr = (uintptr_t) umem;
+	reg.len = (uint64_t) UMEM_FRAMES * FRAME_SIZE;
+	reg.chunk_size = FRAME_SIZE;
+	reg.headroom = 0;
+
+	if (setsockopt (xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0)
+		throw errno_exception("setsockopt(XDP_UMEM_REG)", errno);
+
+	uint32_t ring_size = RING_SIZE;
+	for (int opt : { XDP_UMEM_FILL_RING, XDP_UMEM_COMPLETION_RING, XDP_RX_RING, XDP_TX_RING })
+	{
+		if (setsockopt (xsk, SOL_XDP, opt, &ring_size, sizeof(ring_size)) < 0)
+			throw errno_exception("setsockopt(SOL_XDP, ring size)", errno);
+	}
+
+	struct xdp_mmap_offsets offs;
+	socklen_t offs_len = sizeof(offs);
+	if (getsockopt (xsk, SOL_XDP, XDP_MMAP_OFFSETS, &offs, &offs_len) < 0)
+		throw errno_exception("getsockopt(XDP_MMAP_OFFSETS)", errno);
+
+	map_ring (rx_ring, XDP_PGOFF_RX_RING, offs.rx, sizeof(struct xdp_desc));
+	map_ring (tx_ring, XDP_PGOFF_TX_RING, offs.tx, sizeof(struct xdp_desc));
+	map_ring (fill_ring, XDP_UMEM_PGOFF_FILL_RING, offs.fr, sizeof(uint64_t));
+	map_ring (completion_ring, XDP_UMEM_PGOFF_COMPLETION_RING, offs.cr, sizeof(uint64_t));
+
+	/* Hand the reception half of the UMEM to the kernel */
+	auto fill = (uint64_t*) fill_ring.descs;
+	for (uint32_t i = 0; i < RING_SIZE; i++)
+		fill[i] = (uint64_t) i * FRAME_SIZE;
+
+	__atomic_store_n (fill_ring.producer, RING_SIZE, __ATOMIC_RELEASE);
+
+	tx_free_frames.reserve (UMEM_FRAMES - RING_SIZE);
+	for (uint32_t i = RING_SIZE; i < UMEM_FRAMES; i++)
+		tx_free_frames.push_back ((uint64_t) i * FRAME_SIZE);
+
+	/* Zero copy needs driver support, generic mode always copies. */
+	struct sockaddr_xdp addr;
+	memset (&addr, 0, sizeof(addr));
+	addr.sxdp_family = AF_XDP;
+	addr.sxdp_flags = XDP_USE_NEED_WAKEUP | (config.skb_mode ? XDP_COPY : 0);
+	addr.sxdp_ifindex = if_index;
+	addr.sxdp_queue_id = config.queue;
+
+	if (bind (xsk, (const sockaddr*) &addr, sizeof(addr)) < 0)
+		throw errno_exception("bind(AF_XDP)", errno);
+
+	if (config.busy_poll_us)
+	{
+		int one = 1;
+		int usecs = config.busy_poll_us;
+		int budget = 64;
+
+		if (setsockopt (xsk, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0)
+			throw errno_exception("setsockopt(SO_PREFER_BUSY_POLL)", errno);
+
+		if (setsockopt (xsk, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+			throw errno_exception("setsockopt(SO_BUSY_POLL)", errno);
+
+		if (setsockopt (xsk, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0)
+			throw errno_exception("setsockopt(SO_BUSY_POLL_BUDGET)", errno);
+	}
+
+	/* Steer our frames to the socket only once it can receive them */
+	xsk_map = create_xsk_map (config.queue + 1);
+	update_xsk_map (xsk_map, config.queue, xsk);
+
+	xdp_prog = load_xdp_redirect_program (xsk_map);
+	xdp_link = attach_xdp_program (xdp_prog, if_index, config.skb_mode);
+}
+
+void linux_xdp_provider::cleanup()
+{
+	/* Detach the program first such that frames go to the stack again */
+	for (int *fd : { &xdp_link, &xdp_prog, &xsk_map })
+	{
+		if (*fd >= 0)
+			close (*fd);
+
+		*fd = -1;
+	}
+
+	for (ring *r : { &rx_ring, &tx_ring, &fill_ring, &completion_ring })
+	{
+		if (r->map)
+			munmap (r->map, r->map_size);
+
+		*r = ring();
+	}
+
+	if (xsk >= 0)
+		close (xsk);
+
+	xsk = -1;
+
+	if (umem)
+		munmap (umem, (size_t) UMEM_FRAMES * FRAME_SIZE);
+
+	umem = nullptr;
+}
+
+void linux_xdp_provider::send_frame(const ethernet_frame &frame)
+{
+	reclaim_tx_frames();
+
+	/* The TX ring has room for all transmission buffers */
+	if (tx_free_frames.empty())
+		throw errno_exception("AF_XDP send", ENOBUFS);
+
+	uint64_t addr = tx_free_frames.back();
+	tx_free_frames.pop_back();
+
+	/* Pad to the minimum frame size, as the kernel does for packet
+	 * sockets */
+	size_t len = 14 + frame.data_size;
+	auto p = umem + addr;
+
+	memcpy (p, frame.dst, 6);
+	memcpy (p + 6, own_mac_address, 6);
+	write_be16 (p + 12, frame.ether_type);
+	memcpy (p + 14, frame.data, frame.data_size);
+
+	if (len < 60)
+	{
+		memset (p + len, 0, 60 - len);
+		len = 60;
+	}
+
+	uint32_t prod = *tx_ring.producer;
+	auto &desc = ((struct xdp_desc*) tx_ring.descs)[prod & (RING_SIZE - 1)];
+	desc.addr = addr;
+	desc.len = len;
+	desc.options = 0;
+
+	__atomic_store_n (tx_ring.producer, prod + 1, __ATOMIC_RELEASE);
+
+	loop_stats.frames_sent++;
+
+	/* In copy mode, the frame is sent during the system call. */
+	if (__atomic_load_n (tx_ring.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)
+	{
+		loop_stats.syscalls++;
+
+		if (sendto (xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 &&
+				errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+		{
+			throw errno_exception("sendto(AF_XDP)", errno);
+		}
+	}
+}
+
+bool linux_xdp_provider::enable_launch_time()
+{
+	return false;
+}
+
+void linux_xdp_provider::reclaim_tx_frames()
+{
+	uint32_t cons = *completion_ring.consumer;
+	uint32_t prod = __atomic_load_n (completion_ring.producer, __ATOMIC_ACQUIRE);
+
+	auto addrs = (uint64_t*) completion_ring.descs;
+
+	for (; cons != prod; cons++)
+		tx_free_frames.push_back (addrs[cons & (RING_SIZE - 1)]);
+
+	__atomic_store_n (completion_ring.consumer, cons, __ATOMIC_RELEASE);
+}
+
+void linux_xdp_provider::set_frame_filter(const frame_filter &filter)
+{
+}
+
+bool linux_xdp_provider::receive_frames()
+{
+	uint32_t cons = *rx_ring.consumer;
+	uint32_t prod = __atomic_load_n (rx_ring.producer, __ATOMIC_ACQUIRE);
+
+	if (cons == prod)
+		return false;
+
+	/* There are no kernel timestamps for AF_XDP sockets, use the time the
+	 * frames were taken from the ring instead. */
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	uint64_t rx_timestamp = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	auto descs = (struct xdp_desc*) rx_ring.descs;
+	auto fill = (uint64_t*) fill_ring.descs;
+
+	unique_lock dlk(dispatch_m);
+
+	for (; cons != prod; cons++)
+	{
+		auto &desc = descs[cons & (RING_SIZE - 1)];
+		auto p = umem + desc.addr;
+
+		ethernet_frame frame;
+		bool valid = desc.len >= 14;
+
+		if (valid)
+		{
+			memcpy (frame.dst, p, 6);
+			memcpy (frame.src, p + 6, 6);
+			frame.ether_type = read_be16 (p + 12);
+			frame.data_size = min ((size_t) desc.len - 14, sizeof(frame.data));
+			memcpy (frame.data, p + 14, frame.data_size);
+			frame.rx_timestamp = rx_timestamp;
+		}
+
+		/* Give the buffer back before dispatching. The fill ring always has
+		 * room since the RX and fill rings share the same buffers. */
+		uint32_t fill_prod = *fill_ring.producer;
+		fill[fill_prod & (RING_SIZE - 1)] = desc.addr & ~(uint64_t) (FRAME_SIZE - 1);
+
+		__atomic_store_n (fill_ring.producer, fill_prod + 1, __ATOMIC_RELEASE);
+		__atomic_store_n (rx_ring.consumer, cons + 1, __ATOMIC_RELEASE);
+
+		if (valid)
+			deliver_frame (frame, false);
+	}
+
+	return true;
+}
+
+void linux_xdp_provider::main_loop()
+{
+	struct pollfd pfd = { .fd = xsk, .events = POLLIN, .revents = 0 };
+
+	while (!stop_requested)
+	{
+		unique_lock dlk(dispatch_m);
+		double delay = run_timers();
+		dlk.unlock();
+
+		if (stop_requested)
+			break;
+
+		if (config.busy_poll_us)
+		{
+			/* Let the kernel poll the device for us instead of sleeping */
+			loop_stats.syscalls++;
+
+			if (recvfrom (xsk, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr) < 0 &&
+					errno != EAGAIN && errno != EBUSY && errno != ENOBUFS)
+			{
+				throw errno_exception("recvfrom(AF_XDP)", errno);
+			}
+		}
+		else
+		{
+			/* Sleep at most `delay` time. */
+			int timeout = floor (delay * 1000);
+			if (timeout == 0)
+				timeout = 1;
+
+			loop_stats.syscalls++;
+
+			if (poll (&pfd, 1, timeout) < 0 && errno != EINTR)
+				throw errno_exception("poll", errno);
+		}
+
+		if (!receive_frames() && capture)
+		{
+			/* Write the capture out while idle */
+			unique_lock dlk(dispatch_m);
+			capture->flush();
+		}
+	}
+}
+
+}
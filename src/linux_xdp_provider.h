@@ -0,0 +1,103 @@
+#ifndef __LINUX_XDP_PROVIDER_H
+#define __LINUX_XDP_PROVIDER_H
+
+/** A linux provider which sends and receives frames through an AF_XDP socket
+ * instead of a packet socket */
+
+#include <vector>
+#include <linux/if_xdp.h>
+#include "linux_system_services.h"
+
+namespace system_services
+{
+
+struct xdp_config
+{
+	/* Attach the XDP program in generic (SKB) mode, which works with every
+	 * driver (e.g. veth), or in the driver. */
+	bool skb_mode = true;
+
+	/* The receive queue to bind to; frames of our ethertype arriving on
+	 * other queues are passed to the network stack. */
+	uint32_t queue = 0;
+
+	/* If not 0, set SO_BUSY_POLL to this many microseconds and poll the
+	 * socket from the main loop instead of sleeping. */
+	unsigned busy_poll_us = 0;
+};
+
+class linux_xdp_provider : public linux_provider
+{
+protected:
+	/* A single producer / single consumer ring shared with the kernel */
+	struct ring
+	{
+		uint32_t *producer = nullptr;
+		uint32_t *consumer = nullptr;
+		uint32_t *flags = nullptr;
+		void *descs = nullptr;
+
+		void *map = nullptr;
+		size_t map_size = 0;
+	};
+
+	/* Number of entries in each ring, and size of a UMEM frame. The first
+	 * half of the UMEM frames is used for reception, the second half for
+	 * transmission. */
+	static constexpr uint32_t RING_SIZE = 1024;
+	static constexpr uint32_t FRAME_SIZE = 2048;
+	static constexpr uint32_t UMEM_FRAMES = 2 * RING_SIZE;
+
+	xdp_config config;
+
+	int xsk = -1;
+	int xsk_map = -1;
+	int xdp_prog = -1;
+	int xdp_link = -1;
+
+	unsigned char *umem = nullptr;
+
+	ring rx_ring;
+	ring tx_ring;
+	ring fill_ring;
+	ring completion_ring;
+
+	/* UMEM frames currently not owned by the kernel's TX path */
+	std::vector<uint64_t> tx_free_frames;
+
+	void map_ring (ring &r, uint64_t offset, const struct xdp_ring_offset &offs, size_t desc_size);
+	void setup_socket();
+	void cleanup();
+
+	/* Take all frames from the RX ring, refill the fill ring with their
+	 * buffers and dispatch them.
+	 * @returns False if the RX ring was empty */
+	bool receive_frames();
+
+	/* Return the buffers of sent frames to `tx_free_frames` */
+	void reclaim_tx_frames();
+
+	linux_xdp_provider(const std::string &if_name, const xdp_config &config);
+
+public:
+	static std::shared_ptr<linux_xdp_provider> create(
+			const std::string &if_name, const xdp_config &config = xdp_config());
+
+	virtual ~linux_xdp_provider();
+
+	void send_frame(const ethernet_frame &frame) override;
+
+	/** Frames on the XDP socket bypass the qdiscs, hence are sent
+	 * immediately */
+	bool enable_launch_time() override;
+
+	/** The XDP program only steers our ethertype to the socket; frames are
+	 * not filtered further. */
+	void set_frame_filter(const frame_filter &filter) override;
+
+	void main_loop() override;
+};
+
+}
+
+#endif /* __LINUX_XDP_PROVIDER_H */
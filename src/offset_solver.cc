@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include "offset_solver.h"
+
+using namespace std;
+
+offset_solver::offset_solver (const offset_solver_config &config)
+	: config(config)
+{
+}
+
+uint32_t offset_solver::get_node (uint64_t id)
+{
+	auto i = node_index.find (id);
+	if (i != node_index.end())
+		return i->second;
+
+	uint32_t index = node_ids.size();
+	node_index.emplace (id, index);
+	node_ids.push_back (id);
+	offsets.push_back (0);
+
+	return index;
+}
+
+void offset_solver::add_measurement (uint64_t a_id, uint64_t b_id, double value,
+		double sigma, double now)
+{
+	if (a_id == b_id)
+		return;
+
+	bool new_a = !node_index.count (a_id);
+	bool new_b = !node_index.count (b_id);
+	uint32_t a = get_node (a_id);
+	uint32_t b = get_node (b_id);
+
+	/* Start new nodes next to their neighbor */
+	if (new_a && !new_b)
+		offsets[a] = offsets[b] - value;
+	else if (new_b && !new_a)
+		offsets[b] = offsets[a] + value;
+
+	if (a > b)
+	{
+		swap (a, b);
+		value = -value;
+	}
+
+	uint64_t key = (uint64_t) a << 32 | b;
+	auto i = link_index.find (key);
+
+	if (i == link_index.end())
+	{
+		link_index.emplace (key, links.size());
+		links.push_back ({ a, b, value, sigma, now, 1 });
+	}
+	else
+	{
+		auto &l = links[i->second];
+		l.value = value;
+		l.sigma = sigma;
+		l.time = now;
+	}
+}
+
+double offset_solver::sigma (const link &l) const
+{
+	return sqrt (l.sigma * l.sigma + config.sigma_floor * config.sigma_floor);
+}
+
+double offset_solver::weight (const link &l) const
+{
+	double s = sigma (l);
+	return l.robust_weight / (s * s);
+}
+
+void offset_solver::drop_old_links (double now)
+{
+	auto end = remove_if (links.begin(), links.end(),
+			[&](const link &l) { return now - l.time > config.max_age; });
+
+	if (end == links.end())
+		return;
+
+	links.erase (end, links.end());
+
+	link_index.clear();
+	for (size_t i = 0; i < links.size(); i++)
+		link_index.emplace ((uint64_t) links[i].a << 32 | links[i].b, i);
+}
+
+void offset_solver::find_components()
+{
+	size_t n = node_ids.size();
+
+	component.resize (n);
+	iota (component.begin(), component.end(), 0);
+
+	auto find = [this](uint32_t i) {
+		while (component[i] != i)
+			i = component[i] = component[component[i]];
+
+		return i;
+	};
+
+	for (auto &l : links)
+		component[find (l.a)] = find (l.b);
+
+	component_size.assign (n, 0);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		component[i] = find (i);
+		component_size[component[i]]++;
+	}
+}
+
+void offset_solver::multiply (const vector<double> &x, vector<double> &y) const
+{
+	fill (y.begin(), y.end(), 0);
+
+	for (auto &l : links)
+	{
+		double d = weight (l) * (x[l.b] - x[l.a]);
+
+		y[l.b] += d;
+		y[l.a] -= d;
+	}
+}
+
+unsigned offset_solver::conjugate_gradient()
+{
+	size_t n = offsets.size();
+
+	auto dot = [n](const vector<double> &u, const vector<double> &v) {
+		double s = 0;
+		for (size_t i = 0; i < n; i++)
+			s += u[i] * v[i];
+
+		return s;
+	};
+
+	auto precondition = [&]() {
+		for (size_t i = 0; i < n; i++)
+			z[i] = diag[i] > 0 ? r[i] / diag[i] : 0;
+	};
+
+	double rhs_norm = sqrt (dot (rhs, rhs));
+	if (rhs_norm == 0)
+	{
+		fill (offsets.begin(), offsets.end(), 0);
+		return 0;
+	}
+
+	multiply (offsets, q);
+	for (size_t i = 0; i < n; i++)
+		r[i] = rhs[i] - q[i];
+
+	precondition();
+	p = z;
+	double rz = dot (r, z);
+
+	unsigned it;
+	for (it = 0; it < config.max_iterations; it++)
+	{
+		if (sqrt (dot (r, r)) <= config.tolerance * rhs_norm)
+			break;
+
+		multiply (p, q);
+
+		/* p is in the Laplacian's null space (constant per connected part)
+		 * only if the residual vanished */
+		double pq = dot (p, q);
+		if (pq <= 0)
+			break;
+
+		double alpha = rz / pq;
+		for (size_t i = 0; i < n; i++)
+		{
+			offsets[i] += alpha * p[i];
+			r[i] -= alpha * q[i];
+		}
+
+		precondition();
+		double rz_next = dot (r, z);
+		double beta = rz_next / rz;
+		rz = rz_next;
+
+		for (size_t i = 0; i < n; i++)
+			p[i] = z[i] + beta * p[i];
+	}
+
+	return it;
+}
+
+void offset_solver::remove_gauge()
+{
+	size_t n = offsets.size();
+	vector<double> &sum = q;
+
+	fill (sum.begin(), sum.end(), 0);
+	for (size_t i = 0; i < n; i++)
+		sum[component[i]] += offsets[i];
+
+	for (size_t i = 0; i < n; i++)
+		offsets[i] -= sum[component[i]] / component_size[component[i]];
+}
+
+void offset_solver::solve (double now)
+{
+	drop_old_links (now);
+
+	size_t n = node_ids.size();
+	for (auto v : { &rhs, &diag, &r, &z, &p, &q })
+		v->resize (n);
+
+	find_components();
+	last_iterations = 0;
+
+	for (unsigned step = 0; step < config.irls_iterations; step++)
+	{
+		fill (rhs.begin(), rhs.end(), 0);
+		fill (diag.begin(), diag.end(), 0);
+
+		for (auto &l : links)
+		{
+			double w = weight (l);
+
+			rhs[l.b] += w * l.value;
+			rhs[l.a] -= w * l.value;
+			diag[l.a] += w;
+			diag[l.b] += w;
+		}
+
+		last_iterations += conjugate_gradient();
+		remove_gauge();
+
+		/* Huber weights from the residuals in standard deviations */
+		double change = 0;
+
+		for (auto &l : links)
+		{
+			double residual = fabs (l.value - (offsets[l.b] - offsets[l.a])) / sigma (l);
+			double w = residual <= config.huber_k ? 1 : config.huber_k / residual;
+
+			change = max (change, fabs (w - l.robust_weight));
+			l.robust_weight = w;
+		}
+
+		if (change < 0.01)
+			break;
+	}
+
+	last_outliers = 0;
+	double sum_sq = 0;
+
+	for (auto &l : links)
+	{
+		double residual = (l.value - (offsets[l.b] - offsets[l.a])) / sigma (l);
+
+		sum_sq += residual * residual;
+		if (l.robust_weight < 1)
+			last_outliers++;
+	}
+
+	last_rms = links.size() ? sqrt (sum_sq / links.size()) : 0;
+}
+
+optional<double> offset_solver::get_offset (uint64_t node) const
+{
+	auto i = node_index.find (node);
+	if (i == node_index.end() || i->second >= diag.size() || diag[i->second] == 0)
+		return nullopt;
+
+	return offsets[i->second];
+}
+
+optional<pair<uint64_t, double>> offset_solver::get_largest_offset() const
+{
+	optional<pair<uint64_t, double>> largest;
+
+	for (size_t i = 0; i < diag.size(); i++)
+	{
+		if (diag[i] > 0 && (!largest || fabs (offsets[i]) > fabs (largest->second)))
+			largest = make_pair (node_ids[i], offsets[i]);
+	}
+
+	return largest;
+}
+
+optional<double> offset_solver::get_robust_weight (uint64_t a_id, uint64_t b_id) const
+{
+	auto a = node_index.find (a_id);
+	auto b = node_index.find (b_id);
+	if (a == node_index.end() || b == node_index.end())
+		return nullopt;
+
+	uint64_t key = (uint64_t) min (a->second, b->second) << 32 | max (a->second, b->second);
+	auto i = link_index.find (key);
+	if (i == link_index.end())
+		return nullopt;
+
+	return links[i->second].robust_weight;
+}
+
+size_t offset_solver::get_node_count() const
+{
+	return node_ids.size();
+}
+
+size_t offset_solver::get_link_count() const
+{
+	return links.size();
+}
+
+unsigned offset_solver::get_iterations() const
+{
+	return last_iterations;
+}
+
+size_t offset_solver::get_outliers() const
+{
+	return last_outliers;
+}
+
+double offset_solver::get_rms() const
+{
+	return last_rms;
+}
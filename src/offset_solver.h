@@ -0,0 +1,120 @@
+#ifndef __OFFSET_SOLVER_H
+#define __OFFSET_SOLVER_H
+
+/** A fleet-wide consistent offset for every node from pairwise measurements
+ * (a slave's mean deviation from its master, and a collector's deviation from
+ * the slave). Where the links form cycles the graph is overdetermined; the
+ * offsets are its weighted least squares solution, relative to the mean of all nodes of a connected part, so that
+ * no single master is trusted. The normal equations are the graph's
+ * Laplacian, which is solved with Jacobi preconditioned conjugate gradients
+ * starting from the previous solution. Outlier links are down-weighted with
+ * Huber weights by iteratively reweighted least squares. */
+
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct offset_solver_config
+{
+	/* Links whose residual exceeds k standard deviations are down-weighted */
+	double huber_k = 3;
+
+	/* Added to the links' standard deviation, which bounds the weight of
+	 * links with many samples */
+	double sigma_floor = 1e-6;
+
+	/* Links without a measurement for this long are dropped */
+	double max_age = 600;
+
+	unsigned max_iterations = 500;
+	unsigned irls_iterations = 5;
+
+	/* Relative residual at which conjugate gradients stop */
+	double tolerance = 1e-9;
+};
+
+class offset_solver
+{
+protected:
+	offset_solver_config config;
+
+	std::unordered_map<uint64_t, uint32_t> node_index;
+	std::vector<uint64_t> node_ids;
+
+	/* The solution, and the connected part of each node */
+	std::vector<double> offsets;
+	std::vector<uint32_t> component;
+	std::vector<uint32_t> component_size;
+
+	/* Measurement: offset(b) - offset(a) = value */
+	struct link
+	{
+		uint32_t a;
+		uint32_t b;
+		double value;
+		double sigma;
+		double time;
+		double robust_weight;
+	};
+
+	std::vector<link> links;
+	std::unordered_map<uint64_t, size_t> link_index;
+
+	/* Conjugate gradient work vectors */
+	std::vector<double> rhs, diag, r, z, p, q;
+
+	unsigned last_iterations = 0;
+	size_t last_outliers = 0;
+	double last_rms = 0;
+
+	/* Standard deviation including the floor, and weight of a link */
+	double sigma (const link &l) const;
+	double weight (const link &l) const;
+
+	uint32_t get_node (uint64_t id);
+	void drop_old_links (double now);
+	void find_components();
+
+	/* y = L x with the current weights */
+	void multiply (const std::vector<double> &x, std::vector<double> &y) const;
+	unsigned conjugate_gradient();
+
+	/* Make the mean offset of each connected part 0 */
+	void remove_gauge();
+
+public:
+	offset_solver (const offset_solver_config &config = offset_solver_config());
+
+	/** Add or replace the measurement between nodes `a` and `b`:
+	 * offset(b) - offset(a) = value, with standard deviation `sigma`, at time
+	 * `now` in seconds */
+	void add_measurement (uint64_t a, uint64_t b, double value, double sigma, double now);
+
+	/** Solve for the offsets, starting from the previous solution */
+	void solve (double now);
+
+	/** @returns The node's offset or nullopt if it has no links */
+	std::optional<double> get_offset (uint64_t node) const;
+
+	/** @returns The node with the largest offset magnitude and its offset */
+	std::optional<std::pair<uint64_t, double>> get_largest_offset() const;
+
+	/** @returns The Huber weight (1 if not down-weighted) of the link
+	 * between nodes `a` and `b` in the last solution, or nullopt if there is
+	 * no such link */
+	std::optional<double> get_robust_weight (uint64_t a, uint64_t b) const;
+
+	size_t get_node_count() const;
+	size_t get_link_count() const;
+
+	/** Statistics of the last solution: conjugate gradient iterations (of all
+	 * reweighting steps), down-weighted links and the RMS of the residuals
+	 * in standard deviations */
+	unsigned get_iterations() const;
+	size_t get_outliers() const;
+	double get_rms() const;
+};
+
+#endif /* __OFFSET_SOLVER_H */
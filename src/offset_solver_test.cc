@@ -0,0 +1,147 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <vector>
+#include "offset_solver.h"
+
+using namespace std;
+
+unsigned failures = 0;
+
+void check (bool condition, const char *what)
+{
+	if (!condition)
+	{
+		fprintf (stderr, "FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+/* Offsets relative to their mean, as the solver reports them */
+vector<double> remove_mean (vector<double> offsets)
+{
+	double mean = 0;
+	for (auto o : offsets)
+		mean += o;
+
+	mean /= offsets.size();
+	for (auto &o : offsets)
+		o -= mean;
+
+	return offsets;
+}
+
+bool offsets_match (const offset_solver &solver, const vector<double> &expected,
+		double tolerance)
+{
+	for (size_t i = 0; i < expected.size(); i++)
+	{
+		auto o = solver.get_offset (i);
+		if (!o || fabs (*o - expected[i]) > tolerance)
+			return false;
+	}
+
+	return true;
+}
+
+/* A collector (node 0) and a master (node 1) with three slaves: every slave
+ * has a link to the master and one to the collector, which forms cycles
+ * through the master. Consistent measurements are reproduced exactly. */
+void test_consistent_cycles()
+{
+	vector<double> truth = { -7e-6, 0, 10e-6, -20e-6, 5e-6 };
+	offset_solver solver;
+
+	for (size_t s = 2; s < truth.size(); s++)
+	{
+		solver.add_measurement (s, 1, truth[1] - truth[s], 1e-6, 0);
+		solver.add_measurement (0, s, truth[s] - truth[0], 5e-6, 0);
+	}
+
+	solver.solve (0);
+
+	check (solver.get_node_count() == 5, "consistent: node count");
+	check (solver.get_link_count() == 6, "consistent: link count");
+	check (solver.get_outliers() == 0, "consistent: no outliers");
+	check (solver.get_rms() < 1e-3, "consistent: zero residual");
+	check (offsets_match (solver, remove_mean (truth), 1e-9), "consistent: offsets");
+}
+
+/* Five nodes which all measure each other, one link off by 100 standard
+ * deviations: the link is down-weighted, the others are not, and the
+ * offsets stay close to the true ones. */
+void test_outlier_link()
+{
+	vector<double> truth = { 0, 12e-6, -3e-6, 40e-6, -25e-6 };
+	const double sigma = 1e-6;
+	const double error = 100 * sigma;
+
+	offset_solver_config config;
+	config.sigma_floor = 0;
+
+	offset_solver solver (config);
+
+	/* Deterministic noise of less than a standard deviation */
+	unsigned k = 0;
+	for (size_t a = 0; a < truth.size(); a++)
+	{
+		for (size_t b = a + 1; b < truth.size(); b++)
+		{
+			double noise = ((k++ * 7) % 11 / 10. - 0.5) * sigma;
+			double value = truth[b] - truth[a] + noise;
+
+			if (a == 1 && b == 3)
+				value += error;
+
+			solver.add_measurement (a, b, value, sigma, 0);
+		}
+	}
+
+	solver.solve (0);
+
+	auto outlier = solver.get_robust_weight (3, 1);
+	check (outlier && *outlier < 0.1, "outlier: link down-weighted");
+	check (solver.get_outliers() == 1, "outlier: only one link down-weighted");
+	check (offsets_match (solver, remove_mean (truth), 2 * sigma),
+			"outlier: offsets within 2 standard deviations");
+	check (!solver.get_robust_weight (1, 7), "outlier: no weight of a missing link");
+}
+
+/* Links without a measurement for max_age are dropped */
+void test_max_age()
+{
+	offset_solver solver;
+
+	solver.add_measurement (1, 2, 1e-6, 1e-6, 0);
+	solver.add_measurement (2, 3, 1e-6, 1e-6, 500);
+	solver.solve (700);
+
+	check (solver.get_link_count() == 1, "max age: old link dropped");
+	check (!solver.get_offset (1), "max age: no offset without links");
+	check (solver.get_offset (3).has_value(), "max age: offset of a linked node");
+}
+
+int main()
+{
+	try
+	{
+		test_consistent_cycles();
+		test_outlier_link();
+		test_max_age();
+
+		if (failures)
+		{
+			fprintf (stderr, "%u checks failed\n", failures);
+			return EXIT_FAILURE;
+		}
+
+		printf ("All checks passed\n");
+		return EXIT_SUCCESS;
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "%s\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
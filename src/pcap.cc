@@ -0,0 +1,176 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include "errno_exception.h"
+#include "pcap.h"
+
+using namespace std;
+
+static constexpr uint32_t PCAP_MAGIC_US = 0xa1b2c3d4;
+static constexpr uint32_t PCAP_MAGIC_NS = 0xa1b23c4d;
+static constexpr uint32_t LINKTYPE_ETHERNET = 1;
+static constexpr size_t ETHERNET_HEADER_SIZE = 14;
+
+/* The file header and record headers are in the byte order of the writer */
+struct pcap_file_header
+{
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header
+{
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+
+pcap_writer::pcap_writer (const string &path)
+{
+	f = fopen (path.c_str(), "wb");
+	if (!f)
+		throw errno_exception ("fopen(" + path + ")", errno);
+
+	pcap_file_header hdr = {
+		.magic = PCAP_MAGIC_NS,
+		.version_major = 2,
+		.version_minor = 4,
+		.thiszone = 0,
+		.sigfigs = 0,
+		.snaplen = ETHERNET_HEADER_SIZE + sizeof(ethernet_frame::data),
+		.linktype = LINKTYPE_ETHERNET
+	};
+
+	if (fwrite (&hdr, sizeof(hdr), 1, f) != 1)
+	{
+		int err = errno;
+		fclose (f);
+		throw errno_exception ("fwrite(" + path + ")", err);
+	}
+}
+
+pcap_writer::~pcap_writer()
+{
+	fclose (f);
+}
+
+void pcap_writer::write (const ethernet_frame &frame)
+{
+	unsigned char eth[ETHERNET_HEADER_SIZE];
+	memcpy (eth, frame.dst, 6);
+	memcpy (eth + 6, frame.src, 6);
+	write_be16 (eth + 12, frame.ether_type);
+
+	uint32_t len = ETHERNET_HEADER_SIZE + frame.data_size;
+
+	pcap_record_header rec = {
+		.ts_sec = (uint32_t) (frame.rx_timestamp / 1000000000),
+		.ts_frac = (uint32_t) (frame.rx_timestamp % 1000000000),
+		.incl_len = len,
+		.orig_len = len
+	};
+
+	if (fwrite (&rec, sizeof(rec), 1, f) != 1 ||
+			fwrite (eth, sizeof(eth), 1, f) != 1 ||
+			fwrite (frame.data, 1, frame.data_size, f) != frame.data_size)
+	{
+		throw errno_exception ("fwrite(pcap)", errno);
+	}
+}
+
+void pcap_writer::flush()
+{
+	fflush (f);
+}
+
+
+pcap_reader::pcap_reader (const string &path)
+	: path(path)
+{
+	f = fopen (path.c_str(), "rb");
+	if (!f)
+		throw errno_exception ("fopen(" + path + ")", errno);
+
+	unsigned char hdr[sizeof(pcap_file_header)];
+	if (fread (hdr, sizeof(hdr), 1, f) != 1)
+	{
+		fclose (f);
+		throw runtime_error (path + ": Not a pcap file");
+	}
+
+	uint32_t magic;
+	memcpy (&magic, hdr, sizeof(magic));
+
+	if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS)
+		swapped = false;
+	else if (__builtin_bswap32(magic) == PCAP_MAGIC_US || __builtin_bswap32(magic) == PCAP_MAGIC_NS)
+		swapped = true;
+	else
+	{
+		fclose (f);
+		throw runtime_error (path + ": Not a pcap file");
+	}
+
+	nanoseconds = read_u32 (hdr) == PCAP_MAGIC_NS;
+
+	if (read_u32 (hdr + offsetof(pcap_file_header, linktype)) != LINKTYPE_ETHERNET)
+	{
+		fclose (f);
+		throw runtime_error (path + ": Link type is not ethernet");
+	}
+}
+
+pcap_reader::~pcap_reader()
+{
+	fclose (f);
+}
+
+uint32_t pcap_reader::read_u32 (const unsigned char *p) const
+{
+	uint32_t v;
+	memcpy (&v, p, sizeof(v));
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+optional<ethernet_frame> pcap_reader::read()
+{
+	for (;;)
+	{
+		unsigned char hdr[sizeof(pcap_record_header)];
+		if (fread (hdr, sizeof(hdr), 1, f) != 1)
+			return nullopt;
+
+		uint64_t ts_sec = read_u32 (hdr + offsetof(pcap_record_header, ts_sec));
+		uint64_t ts_frac = read_u32 (hdr + offsetof(pcap_record_header, ts_frac));
+		uint32_t incl_len = read_u32 (hdr + offsetof(pcap_record_header, incl_len));
+
+		unsigned char buf[ETHERNET_HEADER_SIZE + sizeof(ethernet_frame::data)];
+		size_t len = incl_len < sizeof(buf) ? incl_len : sizeof(buf);
+
+		if (fread (buf, 1, len, f) != len)
+			return nullopt;
+
+		if (incl_len > len && fseek (f, incl_len - len, SEEK_CUR) < 0)
+			throw errno_exception ("fseek(" + path + ")", errno);
+
+		if (len < ETHERNET_HEADER_SIZE)
+			continue;
+
+		ethernet_frame frame;
+		memcpy (frame.dst, buf, 6);
+		memcpy (frame.src, buf + 6, 6);
+		frame.ether_type = read_be16 (buf + 12);
+		frame.data_size = len - ETHERNET_HEADER_SIZE;
+		memcpy (frame.data, buf + ETHERNET_HEADER_SIZE, frame.data_size);
+		frame.rx_timestamp = ts_sec * 1000000000 + (nanoseconds ? ts_frac : ts_frac * 1000);
+
+		return frame;
+	}
+}
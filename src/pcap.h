@@ -0,0 +1,57 @@
+#ifndef __PCAP_H
+#define __PCAP_H
+
+/** Reading and writing of ethernet frames in the classic pcap file format with
+ * nanosecond resolution timestamps */
+
+#include <cstdio>
+#include <optional>
+#include <string>
+#include "protocol.h"
+
+class pcap_writer
+{
+protected:
+	FILE *f = nullptr;
+
+public:
+	/** Create a new capture file, truncating an existing one. */
+	pcap_writer (const std::string &path);
+	~pcap_writer();
+
+	pcap_writer (const pcap_writer&) = delete;
+	pcap_writer& operator=(const pcap_writer&) = delete;
+
+	/** Append a frame; `frame.rx_timestamp` is used as the record's
+	 * timestamp. The data is buffered, call `flush` to write it out. */
+	void write (const ethernet_frame &frame);
+	void flush();
+};
+
+class pcap_reader
+{
+protected:
+	std::string path;
+	FILE *f = nullptr;
+	bool swapped = false;
+	bool nanoseconds = false;
+
+	uint32_t read_u32 (const unsigned char *p) const;
+
+public:
+	/** Open a capture file; both byte orders and micro- and nanosecond
+	 * timestamps are accepted, but only ethernet as link type. */
+	pcap_reader (const std::string &path);
+	~pcap_reader();
+
+	pcap_reader (const pcap_reader&) = delete;
+	pcap_reader& operator=(const pcap_reader&) = delete;
+
+	/** Read the next frame. Frames shorter than an ethernet header are
+	 * skipped, payload beyond the size of `ethernet_frame::data` is
+	 * truncated.
+	 * @returns The frame or nullopt at the end of the file */
+	std::optional<ethernet_frame> read();
+};
+
+#endif /* __PCAP_H */
@@ -0,0 +1,206 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <cinttypes>
+#include <ctime>
+#include <mutex>
+#include "pcap_replay_provider.h"
+
+using namespace std;
+
+namespace system_services
+{
+
+class pcap_replay_provider_pi : public pcap_replay_provider
+{
+public:
+	pcap_replay_provider_pi(const string &path, const mac_addr_t &own_mac_address)
+		: pcap_replay_provider(path, own_mac_address)
+	{}
+};
+
+shared_ptr<pcap_replay_provider> pcap_replay_provider::create(
+		const string &path, const mac_addr_t &own_mac_address)
+{
+	return make_shared<pcap_replay_provider_pi>(path, own_mac_address);
+}
+
+void pcap_replay_provider::unregister_timer(timer *token)
+{
+	remove_timer(token);
+}
+
+pcap_replay_provider::pcap_replay_provider(const string &path, const mac_addr_t &own_mac_address)
+	: provider(), reader(path)
+{
+	memcpy (this->own_mac_address, own_mac_address, sizeof (this->own_mac_address));
+
+	/* Start the virtual clock at the first frame, such that timers registered
+	 * before the replay do not expire for the whole time span up to it. */
+	next_frame = reader.read();
+	if (next_frame)
+		now = next_frame->rx_timestamp;
+}
+
+pcap_replay_provider::~pcap_replay_provider()
+{
+}
+
+void pcap_replay_provider::printf(const char *fmt, ...)
+{
+	char buf[1024];
+
+	va_list ap;
+	va_start (ap, fmt);
+	int len = vsnprintf (buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		output.append (buf, min<size_t> (len, sizeof(buf) - 1));
+}
+
+void pcap_replay_provider::flush()
+{
+	/* Each flush completes a screen, only the last one is kept. */
+	screen.swap (output);
+	output.clear();
+
+	auto t = chrono::steady_clock::now();
+	if (t - last_output >= chrono::seconds(1))
+	{
+		fwrite (screen.data(), 1, screen.size(), stdout);
+		fflush (stdout);
+
+		screen.clear();
+		last_output = t;
+	}
+}
+
+linear_time pcap_replay_provider::get_monotonic_time()
+{
+	return linear_time(now / 1000000000, now % 1000000000);
+}
+
+calendar_time pcap_replay_provider::get_utc()
+{
+	time_t seconds = now / 1000000000;
+
+	struct tm gct;
+	gmtime_r (&seconds, &gct);
+
+	calendar_time ct;
+	ct.year          = gct.tm_year + 1900;
+	ct.day_of_year   = gct.tm_yday;
+	ct.second_of_day = (uint32_t) gct.tm_hour * 3600 +
+		               (uint32_t) gct.tm_min * 60 +
+					   (uint32_t) gct.tm_sec;
+	ct.nanosecond    = now % 1000000000;
+
+	return ct;
+}
+
+/* The capture does not record the TAI - UTC offset, hence the virtual clock
+ * takes that of the last replayed pulse. */
+linear_time pcap_replay_provider::get_tai()
+{
+	uint64_t tai = now + (int64_t) utc_offset * 1000000000;
+	return linear_time(tai / 1000000000, tai % 1000000000);
+}
+
+int16_t pcap_replay_provider::get_utc_offset()
+{
+	return utc_offset;
+}
+
+pcap_replay_provider::timer_registration pcap_replay_provider::register_timer(
+		timer_handler_t handler, uint32_t period)
+{
+	auto tim = add_timer(handler, period);
+	tim->last_called = get_monotonic_time();
+	return create_timer_registration (tim);
+}
+
+const mac_addr_t& pcap_replay_provider::get_own_mac_address()
+{
+	return own_mac_address;
+}
+
+void pcap_replay_provider::send_frame(const ethernet_frame &frame)
+{
+	frames_sent++;
+}
+
+void pcap_replay_provider::run_timers (uint64_t until)
+{
+	for (;;)
+	{
+		/* Find the timer that expires first */
+		timer *next = nullptr;
+		uint64_t next_due = 0;
+
+		for (auto &tim : timers)
+		{
+			uint64_t due = tim.last_called.seconds * 1000000000 +
+				tim.last_called.nanoseconds + (uint64_t) tim.period * 1000000;
+
+			if (!next || due < next_due)
+			{
+				next = &tim;
+				next_due = due;
+			}
+		}
+
+		if (!next || next_due > until)
+			return;
+
+		/* The virtual clock never goes backwards */
+		if (next_due > now)
+			now = next_due;
+
+		/* Handlers may add or remove timers, hence search again afterwards. */
+		next->last_called = get_monotonic_time();
+		next->handler();
+	}
+}
+
+void pcap_replay_provider::main_loop()
+{
+	auto start = chrono::steady_clock::now();
+
+	for (; next_frame; next_frame = reader.read())
+	{
+		auto &frame = next_frame;
+		uint64_t ts = frame->rx_timestamp;
+
+		run_timers (ts);
+
+		if (ts > now)
+			now = ts;
+
+		frames_replayed++;
+
+		if (frame->ether_type == ETHER_TYPE_CLOCK_JITTER &&
+				frame->data_size >= PULSE_V2_HEADER_SIZE &&
+				read_be16 (frame->data) == MSG_TIME_SIGNAL_PULSE_V2)
+		{
+			utc_offset = (int16_t) read_be16 (frame->data + 20);
+		}
+
+		shared_lock lk(frame_subscribers_m);
+
+		for (auto &subs : frame_subscribers)
+			subs.handler (*frame);
+	}
+
+	fwrite (screen.data(), 1, screen.size(), stdout);
+
+	double duration = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	::printf ("\n\nReplayed %" PRIu64 " frames in %.3fs (%.0f frames/s), "
+			"%" PRIu64 " frames sent were discarded.\n",
+			frames_replayed, duration, frames_replayed / duration, frames_sent);
+
+	fflush (stdout);
+}
+
+}
@@ -0,0 +1,72 @@
+#ifndef __PCAP_REPLAY_PROVIDER_H
+#define __PCAP_REPLAY_PROVIDER_H
+
+/** A provider that feeds the frames of a capture file to its subscribers as
+ * fast as possible. The capture's timestamps serve as virtual clock, hence
+ * timers and all time measurements behave as they did when the frames were
+ * received. */
+
+#include <chrono>
+#include <string>
+#include "system_services.h"
+#include "pcap.h"
+
+namespace system_services
+{
+
+class pcap_replay_provider : public provider
+{
+protected:
+	void unregister_timer(timer *token) override;
+
+	pcap_reader reader;
+	std::optional<ethernet_frame> next_frame;
+	mac_addr_t own_mac_address;
+
+	/* Virtual time in ns since 1970-01-01 00:00:00 UTC, and the TAI - UTC
+	 * offset of the last replayed version 2 pulse */
+	uint64_t now = 0;
+	int16_t utc_offset = 0;
+
+	uint64_t frames_replayed = 0;
+	uint64_t frames_sent = 0;
+
+	/* Output is only written once per second of wall clock time, formatting
+	 * it to the terminal would dominate the replay otherwise. */
+	std::string output;
+	std::string screen;
+	std::chrono::steady_clock::time_point last_output;
+
+	/* Run all timers that expire up to and including `until` */
+	void run_timers (uint64_t until);
+
+	pcap_replay_provider(const std::string &path, const mac_addr_t &own_mac_address);
+
+public:
+	static std::shared_ptr<pcap_replay_provider> create(
+			const std::string &path, const mac_addr_t &own_mac_address);
+
+	virtual ~pcap_replay_provider();
+
+	void printf(const char *fmt, ...) override;
+	void flush() override;
+
+	linear_time get_monotonic_time() override;
+	calendar_time get_utc() override;
+	linear_time get_tai() override;
+	int16_t get_utc_offset() override;
+
+	timer_registration register_timer(timer_handler_t handler, uint32_t period) override;
+
+	const mac_addr_t& get_own_mac_address () override;
+
+	/* Frames sent during a replay are discarded. */
+	void send_frame(const ethernet_frame &frame) override;
+
+	/** Replay the whole capture and print the final output and a summary */
+	void main_loop();
+};
+
+}
+
+#endif /* __PCAP_REPLAY_PROVIDER_H */
@@ -0,0 +1,90 @@
+#ifndef __POOL_ALLOCATOR_H
+#define __POOL_ALLOCATOR_H
+
+/** An allocator for node based containers which keeps freed nodes in a free
+ * list for reuse instead of returning them to the heap, such that a container
+ * of bounded size stops allocating once it reached its largest size. The
+ * allocator is stateless (some containers use static allocator instances),
+ * hence the free lists are per type and thread. Their memory is never
+ * released. */
+
+#include <cstddef>
+#include <new>
+
+template <typename T>
+class pool_allocator
+{
+protected:
+	struct free_node
+	{
+		free_node *next;
+	};
+
+	static constexpr size_t node_size = sizeof(T) > sizeof(free_node) ? sizeof(T) : sizeof(free_node);
+
+	inline static thread_local free_node *free_list = nullptr;
+
+public:
+	using value_type = T;
+	using pointer = T*;
+	using const_pointer = const T*;
+	using reference = T&;
+	using const_reference = const T&;
+	using size_type = size_t;
+	using difference_type = ptrdiff_t;
+
+	template <typename U>
+	struct rebind
+	{
+		using other = pool_allocator<U>;
+	};
+
+	pool_allocator()
+	{}
+
+	template <typename U>
+	pool_allocator (const pool_allocator<U>&)
+	{}
+
+	T *allocate (size_t n)
+	{
+		if (n != 1)
+			return static_cast<T*>(::operator new (n * sizeof(T)));
+
+		if (free_list)
+		{
+			auto node = free_list;
+			free_list = node->next;
+			return reinterpret_cast<T*>(node);
+		}
+
+		return static_cast<T*>(::operator new (node_size));
+	}
+
+	void deallocate (T *p, size_t n)
+	{
+		if (n != 1)
+		{
+			::operator delete (p);
+			return;
+		}
+
+		auto node = reinterpret_cast<free_node*>(p);
+		node->next = free_list;
+		free_list = node;
+	}
+
+	template <typename U>
+	bool operator== (const pool_allocator<U>&) const
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator!= (const pool_allocator<U>&) const
+	{
+		return false;
+	}
+};
+
+#endif /* __POOL_ALLOCATOR_H */
@@ -1,43 +1,359 @@
 #include <cstring>
-#include <arpa/inet.h>
+#include <ctime>
 #include "protocol.h"
 
 using namespace std;
 
+/* Version 2 layout: 2 byte type, 2 byte message length (including TLVs), 8
+ * byte sequence number, 8 byte TAI timestamp, 2 byte utc offset, TLVs. */
+
+/* Deviation summary layout: 2 byte type, 2 byte message length, 6 byte master
+ * address, 4 byte interval, 8 byte count, 4 * 8 byte sum, sum of squares, min
+ * and max as IEEE 754 doubles, 4 byte counts of the histogram buckets,
+ * optionally followed by an 8 byte TAI timestamp and 2 byte utc offset. */
+static constexpr size_t SUMMARY_BUCKETS_OFFSET = 54;
+static_assert (DEVIATION_SUMMARY_SIZE == SUMMARY_BUCKETS_OFFSET + 4 * deviation_summary::BUCKETS);
+static constexpr size_t SUMMARY_TIMESTAMP_SIZE = DEVIATION_SUMMARY_SIZE + 10;
+
+/* Discovery layout: 2 byte type, 2 byte message length, 1 byte flags, 1
+ * reserved byte, 4 byte pulse period in us, 8 byte TAI timestamp, 2 byte utc
+ * offset. */
+static constexpr uint8_t DISCOVERY_FLAG_MASTER = 0x01;
+
+/* Pulse feedback layout: 2 byte type, 2 byte message length, 6 byte master
+ * address, 1 byte flags, 1 reserved byte, 3 * 8 byte jitter, baseline jitter
+ * and frequency change as IEEE 754 doubles. */
+
+/* TLV types; each TLV is a 1 byte type, a 1 byte value length and the
+ * value. */
+enum pulse_tlv_type : uint8_t
+{
+	TLV_PULSE_PERIOD = 1,
+	TLV_MASTER_UPTIME = 2,
+	TLV_PRIORITY = 3,
+	TLV_BASE_PERIOD = 4
+};
+
+static void write_double (unsigned char *p, double v)
+{
+	uint64_t bits;
+	memcpy (&bits, &v, sizeof(bits));
+	write_be64 (p, bits);
+}
+
+static double read_double (const unsigned char *p)
+{
+	uint64_t bits = read_be64 (p);
+
+	double v;
+	memcpy (&v, &bits, sizeof(v));
+	return v;
+}
+
 
 ethernet_frame time_signal_pulse::to_frame() const
 {
 	ethernet_frame frame;
-	memset (frame.dst, 0xff, sizeof(frame.dst));
+	memcpy (frame.dst, BROADCAST_MAC_ADDR, sizeof(frame.dst));
 	memset (frame.src, 0, sizeof(frame.dst));
-	frame.ether_type = 0x88b6;
+	frame.ether_type = ETHER_TYPE_CLOCK_JITTER;
+
+	if (version == 1)
+	{
+		write_be16 (frame.data + 0, MSG_TIME_SIGNAL_PULSE_V1);
+		write_be16 (frame.data + 2, year);
+		write_be16 (frame.data + 4, day);
+		write_be32 (frame.data + 6, second);
+		write_be32 (frame.data + 10, nanosecond);
+
+		frame.data_size = PULSE_V1_SIZE;
+		return frame;
+	}
+
+	write_be16 (frame.data + 0, MSG_TIME_SIGNAL_PULSE_V2);
+	write_be64 (frame.data + 4, sequence);
+	write_be64 (frame.data + 12, tai_timestamp);
+	write_be16 (frame.data + 20, utc_offset);
+
+	auto p = frame.data + PULSE_V2_HEADER_SIZE;
+
+	if (pulse_period_us)
+	{
+		p[0] = TLV_PULSE_PERIOD;
+		p[1] = 4;
+		write_be32 (p + 2, *pulse_period_us);
+		p += 6;
+	}
 
-	*(uint16_t*) (frame.data + 0) = htons(0x0133);
-	*(uint16_t*) (frame.data + 2) = htons(year);
-	*(uint16_t*) (frame.data + 4) = htons(day);
-	*(uint32_t*) (frame.data + 6) = htonl(second);
-	*(uint32_t*) (frame.data + 10) = htonl(nanosecond);
+	if (master_uptime_ns)
+	{
+		p[0] = TLV_MASTER_UPTIME;
+		p[1] = 8;
+		write_be64 (p + 2, *master_uptime_ns);
+		p += 10;
+	}
 
-	frame.data_size = 14;
+	if (priority)
+	{
+		p[0] = TLV_PRIORITY;
+		p[1] = 1;
+		p[2] = *priority;
+		p += 3;
+	}
+
+	if (base_period_us)
+	{
+		p[0] = TLV_BASE_PERIOD;
+		p[1] = 4;
+		write_be32 (p + 2, *base_period_us);
+		p += 6;
+	}
+
+	frame.data_size = p - frame.data;
+	write_be16 (frame.data + 2, frame.data_size);
 
 	return frame;
 }
 
 optional<time_signal_pulse> time_signal_pulse::from_frame (const ethernet_frame &frame)
 {
-	if (frame.data_size < 14 || frame.ether_type != 0x88b6)
+	if (frame.ether_type != ETHER_TYPE_CLOCK_JITTER)
 		return nullopt;
 
-	if (ntohs(*(uint16_t*)  (frame.data + 0)) != 0x0133)
+	time_signal_pulse pulse;
+	memcpy (pulse.src, frame.src, sizeof(frame.src));
+
+	switch (get_message_type (frame))
+	{
+	case MSG_TIME_SIGNAL_PULSE_V1:
+		if (frame.data_size < PULSE_V1_SIZE)
+			return nullopt;
+
+		pulse.version = 1;
+		pulse.year = read_be16 (frame.data + 2);
+		pulse.day = read_be16 (frame.data + 4);
+		pulse.second = read_be32 (frame.data + 6);
+		pulse.nanosecond = read_be32 (frame.data + 10);
+		return pulse;
+
+	case MSG_TIME_SIGNAL_PULSE_V2:
+		break;
+
+	default:
 		return nullopt;
+	}
 
-	time_signal_pulse pulse;
+	if (frame.data_size < PULSE_V2_HEADER_SIZE)
+		return nullopt;
 
-	memcpy (pulse.src, frame.src, sizeof(frame.src));
-	pulse.year = ntohs (*(uint16_t*) (frame.data + 2));
-	pulse.day = ntohs (*(uint16_t*) (frame.data + 4));
-	pulse.second = ntohl (*(uint32_t*) (frame.data + 6));
-	pulse.nanosecond = ntohl (*(uint32_t*) (frame.data + 10));
+	/* The frame may have been padded to the minimum ethernet payload size, the
+	 * message length tells where the TLVs end. */
+	size_t size = read_be16 (frame.data + 2);
+	if (size < PULSE_V2_HEADER_SIZE || size > frame.data_size)
+		return nullopt;
+
+	pulse.version = 2;
+	pulse.sequence = read_be64 (frame.data + 4);
+	pulse.tai_timestamp = read_be64 (frame.data + 12);
+	pulse.utc_offset = (int16_t) read_be16 (frame.data + 20);
+
+	auto p = frame.data + PULSE_V2_HEADER_SIZE;
+	auto end = frame.data + size;
+
+	while (end - p >= 2)
+	{
+		uint8_t type = p[0];
+		uint8_t len = p[1];
+		p += 2;
+
+		if (end - p < len)
+			return nullopt;
+
+		if (type == TLV_PULSE_PERIOD && len == 4)
+			pulse.pulse_period_us = read_be32 (p);
+		else if (type == TLV_MASTER_UPTIME && len == 8)
+			pulse.master_uptime_ns = read_be64 (p);
+		else if (type == TLV_PRIORITY && len == 1)
+			pulse.priority = p[0];
+		else if (type == TLV_BASE_PERIOD && len == 4)
+			pulse.base_period_us = read_be32 (p);
+
+		p += len;
+	}
+
+	/* Derive the calendar representation of the master's UTC time */
+	int64_t utc = (int64_t) pulse.tai_timestamp - (int64_t) pulse.utc_offset * 1000000000;
+	time_t utc_seconds = utc / 1000000000;
+
+	struct tm gct;
+	gmtime_r (&utc_seconds, &gct);
+
+	pulse.year = gct.tm_year + 1900;
+	pulse.day = gct.tm_yday;
+	pulse.second = (uint32_t) gct.tm_hour * 3600 +
+		           (uint32_t) gct.tm_min * 60 +
+				   (uint32_t) gct.tm_sec;
+	pulse.nanosecond = utc % 1000000000;
 
 	return pulse;
 }
+
+
+ethernet_frame deviation_summary_message::to_frame() const
+{
+	ethernet_frame frame;
+	memcpy (frame.dst, BROADCAST_MAC_ADDR, sizeof(frame.dst));
+	memset (frame.src, 0, sizeof(frame.dst));
+	frame.ether_type = ETHER_TYPE_CLOCK_JITTER;
+
+	write_be16 (frame.data + 0, MSG_DEVIATION_SUMMARY);
+	write_be16 (frame.data + 2, DEVIATION_SUMMARY_SIZE);
+	memcpy (frame.data + 4, master, sizeof(master));
+	write_be32 (frame.data + 10, interval_ms);
+	write_be64 (frame.data + 14, summary.count);
+	write_double (frame.data + 22, summary.sum);
+	write_double (frame.data + 30, summary.sum_sq);
+	write_double (frame.data + 38, summary.min);
+	write_double (frame.data + 46, summary.max);
+
+	for (unsigned i = 0; i < deviation_summary::BUCKETS; i++)
+	{
+		auto cnt = summary.buckets[i];
+		write_be32 (frame.data + SUMMARY_BUCKETS_OFFSET + 4 * i,
+				cnt <= UINT32_MAX ? cnt : UINT32_MAX);
+	}
+
+	frame.data_size = DEVIATION_SUMMARY_SIZE;
+
+	if (tai_timestamp)
+	{
+		write_be64 (frame.data + DEVIATION_SUMMARY_SIZE, *tai_timestamp);
+		write_be16 (frame.data + DEVIATION_SUMMARY_SIZE + 8, utc_offset);
+		frame.data_size = SUMMARY_TIMESTAMP_SIZE;
+		write_be16 (frame.data + 2, SUMMARY_TIMESTAMP_SIZE);
+	}
+
+	return frame;
+}
+
+optional<deviation_summary_message> deviation_summary_message::from_frame (
+		const ethernet_frame &frame)
+{
+	if (frame.ether_type != ETHER_TYPE_CLOCK_JITTER ||
+			get_message_type (frame) != MSG_DEVIATION_SUMMARY ||
+			frame.data_size < DEVIATION_SUMMARY_SIZE ||
+			read_be16 (frame.data + 2) < DEVIATION_SUMMARY_SIZE)
+	{
+		return nullopt;
+	}
+
+	deviation_summary_message msg;
+
+	memcpy (msg.src, frame.src, sizeof(frame.src));
+	memcpy (msg.master, frame.data + 4, sizeof(msg.master));
+	msg.interval_ms = read_be32 (frame.data + 10);
+	msg.summary.count = read_be64 (frame.data + 14);
+	msg.summary.sum = read_double (frame.data + 22);
+	msg.summary.sum_sq = read_double (frame.data + 30);
+	msg.summary.min = read_double (frame.data + 38);
+	msg.summary.max = read_double (frame.data + 46);
+
+	for (unsigned i = 0; i < deviation_summary::BUCKETS; i++)
+		msg.summary.buckets[i] = read_be32 (frame.data + SUMMARY_BUCKETS_OFFSET + 4 * i);
+
+	if (frame.data_size >= SUMMARY_TIMESTAMP_SIZE &&
+			read_be16 (frame.data + 2) >= SUMMARY_TIMESTAMP_SIZE)
+	{
+		msg.tai_timestamp = read_be64 (frame.data + DEVIATION_SUMMARY_SIZE);
+		msg.utc_offset = (int16_t) read_be16 (frame.data + DEVIATION_SUMMARY_SIZE + 8);
+	}
+
+	return msg;
+}
+
+
+ethernet_frame discovery_message::to_frame() const
+{
+	ethernet_frame frame;
+	memcpy (frame.dst, BROADCAST_MAC_ADDR, sizeof(frame.dst));
+	memset (frame.src, 0, sizeof(frame.dst));
+	frame.ether_type = ETHER_TYPE_CLOCK_JITTER;
+
+	write_be16 (frame.data + 0, type);
+	write_be16 (frame.data + 2, DISCOVERY_SIZE);
+	frame.data[4] = is_master ? DISCOVERY_FLAG_MASTER : 0;
+	frame.data[5] = 0;
+	write_be32 (frame.data + 6, pulse_period_us);
+	write_be64 (frame.data + 10, tai_timestamp);
+	write_be16 (frame.data + 18, utc_offset);
+
+	frame.data_size = DISCOVERY_SIZE;
+	return frame;
+}
+
+optional<discovery_message> discovery_message::from_frame (const ethernet_frame &frame)
+{
+	auto type = get_message_type (frame);
+
+	if (frame.ether_type != ETHER_TYPE_CLOCK_JITTER ||
+			(type != MSG_DISCOVERY_REQUEST && type != MSG_DISCOVERY_ANNOUNCE) ||
+			frame.data_size < DISCOVERY_SIZE ||
+			read_be16 (frame.data + 2) < DISCOVERY_SIZE)
+	{
+		return nullopt;
+	}
+
+	discovery_message msg;
+
+	memcpy (msg.src, frame.src, sizeof(frame.src));
+	msg.type = type;
+	msg.is_master = frame.data[4] & DISCOVERY_FLAG_MASTER;
+	msg.pulse_period_us = read_be32 (frame.data + 6);
+	msg.tai_timestamp = read_be64 (frame.data + 10);
+	msg.utc_offset = (int16_t) read_be16 (frame.data + 18);
+
+	return msg;
+}
+
+
+ethernet_frame pulse_feedback_message::to_frame() const
+{
+	ethernet_frame frame;
+	memcpy (frame.dst, master, sizeof(frame.dst));
+	memset (frame.src, 0, sizeof(frame.dst));
+	frame.ether_type = ETHER_TYPE_CLOCK_JITTER;
+
+	write_be16 (frame.data + 0, MSG_PULSE_FEEDBACK);
+	write_be16 (frame.data + 2, PULSE_FEEDBACK_SIZE);
+	memcpy (frame.data + 4, master, sizeof(master));
+	frame.data[10] = flags;
+	frame.data[11] = 0;
+	write_double (frame.data + 12, jitter);
+	write_double (frame.data + 20, baseline_jitter);
+	write_double (frame.data + 28, frequency_change);
+
+	frame.data_size = PULSE_FEEDBACK_SIZE;
+	return frame;
+}
+
+optional<pulse_feedback_message> pulse_feedback_message::from_frame (const ethernet_frame &frame)
+{
+	if (frame.ether_type != ETHER_TYPE_CLOCK_JITTER ||
+			get_message_type (frame) != MSG_PULSE_FEEDBACK ||
+			frame.data_size < PULSE_FEEDBACK_SIZE ||
+			read_be16 (frame.data + 2) < PULSE_FEEDBACK_SIZE)
+	{
+		return nullopt;
+	}
+
+	pulse_feedback_message msg;
+
+	memcpy (msg.src, frame.src, sizeof(frame.src));
+	memcpy (msg.master, frame.data + 4, sizeof(msg.master));
+	msg.flags = frame.data[10];
+	msg.jitter = read_double (frame.data + 12);
+	msg.baseline_jitter = read_double (frame.data + 20);
+	msg.frequency_change = read_double (frame.data + 28);
+
+	return msg;
+}
@@ -3,9 +3,37 @@
 
 #include <optional>
 #include <cstdint>
+#include <cstddef>
+#include "summary.h"
 
 using mac_addr_t = unsigned char[6];
 
+/* Destination of all messages; as the highest address it also stands for
+ * "none" where the lowest address seen is tracked */
+constexpr mac_addr_t BROADCAST_MAC_ADDR = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+/* Ethertype used by all messages of the protocol */
+constexpr uint16_t ETHER_TYPE_CLOCK_JITTER = 0x88b6;
+
+/* Message types, carried in the first two bytes of the payload */
+constexpr uint16_t MSG_TIME_SIGNAL_PULSE_V1 = 0x0133;
+constexpr uint16_t MSG_TIME_SIGNAL_PULSE_V2 = 0x0134;
+constexpr uint16_t MSG_DEVIATION_SUMMARY = 0x0135;
+constexpr uint16_t MSG_DISCOVERY_REQUEST = 0x0136;
+constexpr uint16_t MSG_DISCOVERY_ANNOUNCE = 0x0137;
+constexpr uint16_t MSG_PULSE_FEEDBACK = 0x0138;
+
+/* Minimum payload sizes of the messages */
+constexpr size_t PULSE_V1_SIZE = 14;
+constexpr size_t PULSE_V2_HEADER_SIZE = 22;
+constexpr size_t DEVIATION_SUMMARY_SIZE = 310;
+constexpr size_t DISCOVERY_SIZE = 20;
+constexpr size_t PULSE_FEEDBACK_SIZE = 36;
+
+/* Flags of the pulse feedback message */
+constexpr uint8_t FEEDBACK_FLAG_UNSTABLE = 0x01;
+constexpr uint8_t FEEDBACK_FLAG_OVERLOADED = 0x02;
+
 /** An Ethernet II (IEEE 802.3) frame along with metadata */
 class ethernet_frame
 {
@@ -13,27 +41,219 @@ public:
 	mac_addr_t dst;
 	mac_addr_t src;
 	uint16_t ether_type;
-	unsigned char data[46];
+	unsigned char data[1500];
 	size_t data_size = 0;
+
+	/* Reception time in ns since 1970-01-01 00:00:00 UTC as reported by the
+	 * kernel, or 0 if unknown */
+	uint64_t rx_timestamp = 0;
+
+	/* Transmission time in ns since 1970-01-01 00:00:00 TAI for providers
+	 * with scheduled launch, or 0 to send the frame immediately */
+	uint64_t launch_time = 0;
 };
 
+
+/* Alignment-safe access to big endian (network byte order) integers that are
+ * located anywhere in a frame buffer. These compile to plain (byte swapping)
+ * loads and stores, and avoid the undefined behavior of casting `data + n` to
+ * a wider integer pointer. */
+inline uint16_t read_be16 (const unsigned char *p)
+{
+	return (uint16_t) p[0] << 8 | p[1];
+}
+
+inline uint32_t read_be32 (const unsigned char *p)
+{
+	return (uint32_t) read_be16(p) << 16 | read_be16(p + 2);
+}
+
+inline uint64_t read_be64 (const unsigned char *p)
+{
+	return (uint64_t) read_be32(p) << 32 | read_be32(p + 4);
+}
+
+inline void write_be16 (unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+inline void write_be32 (unsigned char *p, uint32_t v)
+{
+	write_be16 (p, v >> 16);
+	write_be16 (p + 2, v);
+}
+
+inline void write_be64 (unsigned char *p, uint64_t v)
+{
+	write_be32 (p, v >> 32);
+	write_be32 (p + 4, v);
+}
+
+/** @returns The address as integer; the order of integers equals the
+ * order of addresses compared byte by byte. */
+inline uint64_t mac_to_uint64 (const mac_addr_t &mac)
+{
+	return (uint64_t) read_be16 (mac) << 32 | read_be32 (mac + 2);
+}
+
+inline void uint64_to_mac (uint64_t v, mac_addr_t &mac)
+{
+	write_be16 (mac, v >> 32);
+	write_be32 (mac + 2, v);
+}
+
+/** @returns The message type of a frame of our ethertype or 0 if the frame is
+ * too short to carry one. */
+inline uint16_t get_message_type (const ethernet_frame &frame)
+{
+	if (frame.data_size < 2)
+		return 0;
+
+	return read_be16 (frame.data);
+}
+
+
 class time_signal_pulse
 {
 public:
 	mac_addr_t src {};
+
+	/* Version of the wire format, 1 or 2. Determines which of the fields below
+	 * are serialized by `to_frame`. */
+	uint8_t version = 2;
+
+	/* Calendar representation of the master's UTC time. Version 1 carries only
+	 * these, for version 2 pulses `from_frame` derives them from
+	 * `tai_timestamp` and `utc_offset`. */
 	uint16_t year {};
 	uint16_t day {};
 	uint32_t second {};
 	uint32_t nanosecond {};
 
+	/* Version 2 only */
+	/* Incremented by one for each pulse a master sends */
+	uint64_t sequence {};
+
+	/* Nanoseconds since 1970-01-01 00:00:00 TAI */
+	uint64_t tai_timestamp {};
+
+	/* TAI - UTC in seconds as known to the master */
+	int16_t utc_offset {};
+
+	/* Optional TLV extensions */
+	std::optional<uint32_t> pulse_period_us;
+	std::optional<uint64_t> master_uptime_ns;
+	std::optional<uint8_t> priority;
+
+	/* The configured period, which an adaptive rate returns to */
+	std::optional<uint32_t> base_period_us;
+
 	/** Serialize the attributes into an ethernet frame. The source address is
 	 * left as 00:00:00:00:00:00.
 	 * @returns The serialized ethernet_frame */
 	ethernet_frame to_frame() const;
 
-	/** De-serialize a time signal pulse captured from 'the wire'
+	/** De-serialize a time signal pulse captured from 'the wire'. Both
+	 * versions are accepted; unknown TLVs are skipped.
 	 * @returns A time_signal_pulse or nullopt if deserializing failed. */
 	static std::optional<time_signal_pulse> from_frame(const ethernet_frame &frame);
 };
 
+
+/** A summary of the deviation samples a slave took during an interval, sent
+ * to collectors */
+class deviation_summary_message
+{
+public:
+	mac_addr_t src {};
+
+	/* The master the deviations were measured against */
+	mac_addr_t master {};
+
+	/* Length of the interval in ms */
+	uint32_t interval_ms {};
+
+	/* Histogram counts are transmitted with 32 bits and saturate. */
+	deviation_summary summary;
+
+	/* Send time, which lets a collector measure the sender itself. Absent
+	 * in summaries of older nodes. */
+	std::optional<uint64_t> tai_timestamp;
+	int16_t utc_offset {};
+
+	/** Serialize the attributes into an ethernet frame. The source address is
+	 * left as 00:00:00:00:00:00.
+	 * @returns The serialized ethernet_frame */
+	ethernet_frame to_frame() const;
+
+	/** @returns A deviation_summary_message or nullopt if deserializing
+	 * failed. */
+	static std::optional<deviation_summary_message> from_frame(const ethernet_frame &frame);
+};
+
+
+/** Discovery of the master by starting nodes. A starting node broadcasts a
+ * request; the master answers with an announce carrying its pulse period and
+ * current time, and other starting nodes answer with an announce, too, such
+ * that they know of each other for the election. */
+class discovery_message
+{
+public:
+	mac_addr_t src {};
+
+	/* MSG_DISCOVERY_REQUEST or MSG_DISCOVERY_ANNOUNCE */
+	uint16_t type = MSG_DISCOVERY_REQUEST;
+
+	/* Announce only: Whether the sender is master, otherwise it is a starting
+	 * node itself. */
+	bool is_master = false;
+
+	/* Announces of masters only: The pulse period, and the master's time
+	 * like in a version 2 pulse */
+	uint32_t pulse_period_us {};
+	uint64_t tai_timestamp {};
+	int16_t utc_offset {};
+
+	/** Serialize the attributes into an ethernet frame. The source address is
+	 * left as 00:00:00:00:00:00.
+	 * @returns The serialized ethernet_frame */
+	ethernet_frame to_frame() const;
+
+	/** @returns A discovery_message or nullopt if deserializing failed. */
+	static std::optional<discovery_message> from_frame(const ethernet_frame &frame);
+};
+
+
+/** A slave's condition, sent to its master if the slave needs a different
+ * pulse rate */
+class pulse_feedback_message
+{
+public:
+	mac_addr_t src {};
+
+	/* The master the feedback is for; the message is sent to it */
+	mac_addr_t master {};
+
+	/* FEEDBACK_FLAG_* */
+	uint8_t flags {};
+
+	/* Jitter of the last 10 resp. 100 detrended samples in seconds */
+	double jitter {};
+	double baseline_jitter {};
+
+	/* Change of the frequency error within the last interval in ppb */
+	double frequency_change {};
+
+	/** Serialize the attributes into an ethernet frame. The source address is
+	 * left as 00:00:00:00:00:00.
+	 * @returns The serialized ethernet_frame */
+	ethernet_frame to_frame() const;
+
+	/** @returns A pulse_feedback_message or nullopt if deserializing
+	 * failed. */
+	static std::optional<pulse_feedback_message> from_frame(const ethernet_frame &frame);
+};
+
 #endif /* __PROTOCOL_H */
@@ -0,0 +1,255 @@
+#include <cmath>
+#include "sample_filter.h"
+
+using namespace std;
+
+/* Scale factor which makes the MAD a consistent estimator of the standard
+ * deviation for normally distributed samples */
+static constexpr double MAD_SCALE = 1.4826;
+
+sample_filter::sample_filter (const sample_filter_config &cfg)
+	: cfg(cfg), ring(cfg.window), max_queue(cfg.window)
+{
+	if (this->cfg.window == 0)
+	{
+		this->cfg.window = 1;
+		ring.resize (1);
+		max_queue.resize (1);
+	}
+
+	/* Populate the node pool with a window's worth of nodes, such that
+	 * filling the window does not allocate either. */
+	for (size_t i = 0; i < this->cfg.window; i++)
+		ordered.insert (sample_t(0, i));
+
+	ordered.clear();
+}
+
+double sample_filter::value_at_rank (size_t r) const
+{
+	return ordered.find_by_order(r)->first;
+}
+
+double sample_filter::median() const
+{
+	size_t size = ordered.size();
+
+	if (size % 2)
+		return value_at_rank (size / 2);
+	else
+		return (value_at_rank (size / 2 - 1) + value_at_rank (size / 2)) / 2;
+}
+
+size_t sample_filter::subtree_size (ordered_window_t::node_const_iterator node) const
+{
+	return node == ordered.node_end() ? 0 : node.get_metadata();
+}
+
+/* Move the range's node down to the root of the smallest subtree which holds
+ * the range, which must not be empty.
+ * @returns The node's rank */
+size_t sample_filter::descend (rank_range &r) const
+{
+	for (;;)
+	{
+		size_t rank = r.first + subtree_size (r.node.get_l_child());
+
+		if (rank < r.lo)
+		{
+			r.first = rank + 1;
+			r.node = r.node.get_r_child();
+		}
+		else if (rank >= r.hi)
+		{
+			r.node = r.node.get_l_child();
+		}
+		else
+		{
+			return rank;
+		}
+	}
+}
+
+/* The k-th smallest (from 0) of the distances to `m`, which is the window's
+ * median. The distances of the samples below the median (ranks [0, p) in
+ * reverse) and above it (ranks [p, size)) form two sorted sequences. Both are
+ * descended at once: each step compares the roots of their subtrees and
+ * drops one root along with all samples on its far side, which moves that
+ * sequence's node down a level. Hence O(log n) like a single rank query. */
+double sample_filter::abs_deviation_at_rank (double m, size_t k) const
+{
+	size_t size = ordered.size();
+	size_t p = size / 2;
+
+	rank_range a = { ordered.node_begin(), 0, 0, p };
+	rank_range b = { ordered.node_begin(), 0, p, size };
+
+	for (;;)
+	{
+		if (a.lo == a.hi)
+			return value_at_rank (b.lo + k) - m;
+
+		if (b.lo == b.hi)
+			return m - value_at_rank (a.hi - 1 - k);
+
+		size_t ra = descend (a);
+		size_t rb = descend (b);
+
+		/* Distances of the roots and the number of distances before them in
+		 * their sequences. On ties the one below the median comes first. */
+		double da = m - (*a.node)->first;
+		double db = (*b.node)->first - m;
+		size_t before_a = a.hi - 1 - ra;
+		size_t before_b = rb - b.lo;
+
+		if (da > db)
+		{
+			/* b and its predecessors come before a */
+			if (k <= before_a + before_b)
+			{
+				a.lo = ra + 1;
+			}
+			else
+			{
+				k -= before_b + 1;
+				b.lo = rb + 1;
+			}
+		}
+		else
+		{
+			if (k <= before_a + before_b)
+			{
+				b.hi = rb;
+			}
+			else
+			{
+				k -= before_a + 1;
+				a.hi = ra;
+			}
+		}
+	}
+}
+
+/* The median of the distances to `m`, which is the window's median */
+double sample_filter::mad (double m) const
+{
+	size_t size = ordered.size();
+
+	if (size % 2)
+		return abs_deviation_at_rank (m, size / 2);
+	else
+		return (abs_deviation_at_rank (m, size / 2 - 1) + abs_deviation_at_rank (m, size / 2)) / 2;
+}
+
+void sample_filter::push_max (double x)
+{
+	size_t w = cfg.window;
+
+	/* Drop the sample that leaves the window */
+	if (max_size > 0 && max_queue[max_head] + w <= n)
+	{
+		max_head = (max_head + 1) % w;
+		max_size--;
+	}
+
+	/* Drop samples which can never be the maximum again */
+	while (max_size > 0 && ring[max_queue[(max_head + max_size - 1) % w] % w] <= x)
+		max_size--;
+
+	max_queue[(max_head + max_size) % w] = n;
+	max_size++;
+}
+
+double sample_filter::get_max() const
+{
+	return ring[max_queue[max_head] % cfg.window];
+}
+
+optional<double> sample_filter::update (double x)
+{
+	size_t w = cfg.window;
+	bool reject = false;
+
+	/* Test the sample against the window before it is added. The window needs
+	 * to be populated reasonably for the test to be meaningful. */
+	if (cfg.reject_outliers && ordered.size() >= 5 && ordered.size() * 2 >= w)
+	{
+		double m = median();
+		double d = mad (m) * MAD_SCALE;
+
+		if (fabs(x - m) > cfg.outlier_threshold * d)
+			reject = true;
+	}
+
+	/* The window follows all samples, such that a lasting change of the
+	 * deviation is accepted after half a window. */
+	if (n >= w)
+		ordered.erase (sample_t(ring[n % w], n - w));
+
+	ordered.insert (sample_t(x, n));
+	ring[n % w] = x;
+	push_max (x);
+	n++;
+
+	if (reject)
+	{
+		rejected++;
+		return nullopt;
+	}
+
+	switch (cfg.est)
+	{
+	case sample_estimator::median:
+		return median();
+
+	case sample_estimator::lucky:
+		return get_max();
+
+	default:
+		return x;
+	}
+}
+
+void sample_filter::save (snapshot_writer &w) const
+{
+	w.put (n);
+	w.put (rejected);
+	w.put_vector (ring);
+	w.put_vector (max_queue);
+	w.put (max_head);
+	w.put (max_size);
+}
+
+bool sample_filter::load (snapshot_reader &r)
+{
+	if (!r.get (n) || !r.get (rejected) || !r.get_vector (ring) ||
+			!r.get_vector (max_queue) || !r.get (max_head) || !r.get (max_size))
+	{
+		return false;
+	}
+
+	if (max_head >= cfg.window || max_size > cfg.window)
+		return false;
+
+	/* The tree is rebuilt from the window */
+	ordered.clear();
+	for (uint64_t i = n > cfg.window ? n - cfg.window : 0; i < n; i++)
+		ordered.insert (sample_t(ring[i % cfg.window], i));
+
+	return true;
+}
+
+bool sample_filter::is_active() const
+{
+	return cfg.est != sample_estimator::none || cfg.reject_outliers;
+}
+
+const sample_filter_config& sample_filter::get_config() const
+{
+	return cfg;
+}
+
+uint64_t sample_filter::get_rejected() const
+{
+	return rejected;
+}
@@ -0,0 +1,111 @@
+#ifndef __SAMPLE_FILTER_H
+#define __SAMPLE_FILTER_H
+
+/** Robust filtering of deviation samples before they enter the statistics. It
+ * separates the clock's behavior from noise added by the hosts, like
+ * interrupt- or scheduling-delayed packets. */
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#include "pool_allocator.h"
+#include "snapshot.h"
+
+enum class sample_estimator
+{
+	/* Pass samples through */
+	none,
+
+	/* Median of the last `window` samples */
+	median,
+
+	/* The sample with the least delay of the last `window` samples. Delays
+	 * only ever decrease the deviation, hence this is the largest one. */
+	lucky
+};
+
+/* Configuration of a sample filter */
+struct sample_filter_config
+{
+	sample_estimator est = sample_estimator::none;
+	size_t window = 16;
+
+	/* Reject samples which are more than `outlier_threshold` times the
+	 * (normal-consistent) median absolute deviation away from the median of
+	 * the window */
+	bool reject_outliers = false;
+	double outlier_threshold = 3;
+};
+
+class sample_filter
+{
+protected:
+	sample_filter_config cfg;
+
+	/* Order statistic tree of the samples in the window, keys are made unique
+	 * by the samples' numbers. O(log n) insertion, removal and rank queries.
+	 * Its nodes are recycled and preallocated by the constructor, so
+	 * updates do not allocate. */
+	using sample_t = std::pair<double, uint64_t>;
+	using ordered_window_t = __gnu_pbds::tree<
+		sample_t, __gnu_pbds::null_type, std::less<sample_t>,
+		__gnu_pbds::rb_tree_tag, __gnu_pbds::tree_order_statistics_node_update,
+		pool_allocator<char>>;
+
+	ordered_window_t ordered;
+
+	/* The window in arrival order */
+	std::vector<double> ring;
+	uint64_t n = 0;
+
+	/* Monotonic queue (decreasing values) of the window's samples for the
+	 * sliding maximum; ring buffer of sample numbers. */
+	std::vector<uint64_t> max_queue;
+	size_t max_head = 0;
+	size_t max_size = 0;
+
+	uint64_t rejected = 0;
+
+	/* A range [lo, hi) of ranks and the root of the smallest subtree which
+	 * holds it, along with the rank of the subtree's first sample */
+	struct rank_range
+	{
+		ordered_window_t::node_const_iterator node;
+		size_t first;
+		size_t lo, hi;
+	};
+
+	size_t subtree_size (ordered_window_t::node_const_iterator node) const;
+	size_t descend (rank_range &r) const;
+
+	double value_at_rank (size_t r) const;
+	double median() const;
+	double abs_deviation_at_rank (double m, size_t k) const;
+	double mad (double m) const;
+
+	void push_max (double x);
+	double get_max() const;
+
+public:
+	sample_filter (const sample_filter_config &cfg = sample_filter_config());
+
+	/** Add a sample.
+	 * @returns The filtered value or nullopt if the sample was rejected as
+	 * 		outlier */
+	std::optional<double> update (double x);
+
+	/** Save resp. restore the window. Loading fails if the window size
+	 * differs. */
+	void save (snapshot_writer &w) const;
+	bool load (snapshot_reader &r);
+
+	bool is_active() const;
+	const sample_filter_config& get_config() const;
+	uint64_t get_rejected() const;
+};
+
+#endif /* __SAMPLE_FILTER_H */
@@ -0,0 +1,42 @@
+#include <cstdio>
+#include <cstdarg>
+#include "screen.h"
+
+using namespace std;
+
+screen::screen (shared_ptr<system_services::provider> prov)
+	: prov(prov)
+{
+}
+
+void screen::begin()
+{
+	for (unsigned i = 1; i < lines; i++)
+		prov->printf ("\033[2K\033[1F");
+
+	prov->printf ("\033[0K");
+	lines = 1;
+}
+
+void screen::printf (const char *fmt, ...)
+{
+	char buf[1024];
+
+	va_list ap;
+	va_start (ap, fmt);
+	vsnprintf (buf, sizeof(buf), fmt, ap);
+	va_end (ap);
+
+	for (auto c = buf; *c; c++)
+	{
+		if (*c == '\n')
+			lines++;
+	}
+
+	prov->printf ("%s", buf);
+}
+
+void screen::end()
+{
+	prov->flush();
+}
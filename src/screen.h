@@ -0,0 +1,29 @@
+#ifndef __SCREEN_H
+#define __SCREEN_H
+
+/** A block of lines on the terminal which is redrawn in place */
+
+#include <memory>
+#include "system_services.h"
+
+class screen
+{
+protected:
+	std::shared_ptr<system_services::provider> prov;
+	unsigned lines = 1;
+
+public:
+	screen (std::shared_ptr<system_services::provider> prov);
+
+	/** Clear the previously drawn lines and move the cursor to the first one
+	 * */
+	void begin();
+
+	/** Print to the screen; the number of lines is counted. */
+	void printf (const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+	/** Finish drawing */
+	void end();
+};
+
+#endif /* __SCREEN_H */
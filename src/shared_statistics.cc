@@ -0,0 +1,169 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "shared_statistics.h"
+
+using namespace std;
+
+shared_statistics_writer::shared_statistics_writer (const string &name)
+	: name(name)
+{
+	int fd = shm_open (name.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		throw errno_exception ("shm_open(" + name + ")", errno);
+
+	/* Resizing the segment of a running writer would crash it */
+	struct
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t size;
+		int32_t writer_pid;
+	} header;
+
+	if (pread (fd, &header, sizeof(header), 0) == sizeof(header) &&
+			header.magic == shared_statistics_segment::MAGIC &&
+			header.writer_pid != getpid() &&
+			(kill (header.writer_pid, 0) == 0 || errno == EPERM))
+	{
+		close (fd);
+		throw errno_exception ("shm_open(" + name + "): in use by process " +
+				to_string (header.writer_pid), EBUSY);
+	}
+
+	if (ftruncate (fd, sizeof(shared_statistics_segment)) < 0)
+	{
+		int err = errno;
+		close (fd);
+		throw errno_exception ("ftruncate(" + name + ")", err);
+	}
+
+	void *map = mmap (nullptr, sizeof(shared_statistics_segment),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	int err = errno;
+	close (fd);
+
+	if (map == MAP_FAILED)
+		throw errno_exception ("mmap(" + name + ")", err);
+
+	segment = static_cast<shared_statistics_segment*>(map);
+
+	/* Readers recognize the segment by its magic, which is written last */
+	segment->magic = 0;
+	atomic_thread_fence (memory_order_release);
+
+	segment->data = shared_statistics();
+	segment->version = shared_statistics_segment::VERSION;
+	segment->size = sizeof(shared_statistics_segment);
+	segment->writer_pid = getpid();
+	segment->sequence.store (0, memory_order_relaxed);
+
+	atomic_thread_fence (memory_order_release);
+	segment->magic = shared_statistics_segment::MAGIC;
+}
+
+shared_statistics_writer::~shared_statistics_writer()
+{
+	munmap (segment, sizeof(shared_statistics_segment));
+	shm_unlink (name.c_str());
+}
+
+shared_statistics &shared_statistics_writer::begin()
+{
+	auto seq = segment->sequence.load (memory_order_relaxed);
+	segment->sequence.store (seq + 1, memory_order_relaxed);
+
+	/* The data must not be written before the sequence is odd */
+	atomic_thread_fence (memory_order_release);
+
+	return segment->data;
+}
+
+void shared_statistics_writer::end()
+{
+	auto seq = segment->sequence.load (memory_order_relaxed);
+	segment->sequence.store (seq + 1, memory_order_release);
+}
+
+
+shared_statistics_reader::shared_statistics_reader (const string &name)
+{
+	int fd = shm_open (name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		throw errno_exception ("shm_open(" + name + ")", errno);
+
+	struct stat st;
+	if (fstat (fd, &st) < 0)
+	{
+		int err = errno;
+		close (fd);
+		throw errno_exception ("fstat(" + name + ")", err);
+	}
+
+	if (st.st_size != sizeof(shared_statistics_segment))
+	{
+		close (fd);
+		throw runtime_error (name + " is not a statistics segment of this version");
+	}
+
+	void *map = mmap (nullptr, sizeof(shared_statistics_segment), PROT_READ, MAP_SHARED, fd, 0);
+
+	int err = errno;
+	close (fd);
+
+	if (map == MAP_FAILED)
+		throw errno_exception ("mmap(" + name + ")", err);
+
+	segment = static_cast<const shared_statistics_segment*>(map);
+
+	if (segment->magic != shared_statistics_segment::MAGIC ||
+			segment->version != shared_statistics_segment::VERSION ||
+			segment->size != sizeof(shared_statistics_segment))
+	{
+		munmap (const_cast<shared_statistics_segment*>(segment), sizeof(shared_statistics_segment));
+		throw runtime_error (name + " is not a statistics segment of this version");
+	}
+}
+
+shared_statistics_reader::~shared_statistics_reader()
+{
+	munmap (const_cast<shared_statistics_segment*>(segment), sizeof(shared_statistics_segment));
+}
+
+bool shared_statistics_reader::read (shared_statistics &s, unsigned max_retries) const
+{
+	for (unsigned i = 0; i < max_retries; i++)
+	{
+		auto seq = segment->sequence.load (memory_order_acquire);
+
+		/* Not written yet */
+		if (seq == 0)
+			return false;
+
+		/* Being written */
+		if (seq & 1)
+			continue;
+
+		memcpy (&s, &segment->data, sizeof(s));
+
+		/* The copy must be complete before the sequence is checked again */
+		atomic_thread_fence (memory_order_acquire);
+
+		if (segment->sequence.load (memory_order_relaxed) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+pid_t shared_statistics_reader::get_writer_pid() const
+{
+	return segment->writer_pid;
+}
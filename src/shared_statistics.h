@@ -0,0 +1,125 @@
+#ifndef __SHARED_STATISTICS_H
+#define __SHARED_STATISTICS_H
+
+/** Publication of the controller's state in a POSIX shared memory segment
+ * for local monitoring agents. The segment is protected by a seqlock: the
+ * writer never waits for readers, readers copy the state without system
+ * calls and retry if the writer changed it meanwhile. */
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include "protocol.h"
+#include "statistics.h"
+
+/* The published state */
+struct shared_statistics
+{
+	static constexpr unsigned MAX_OCTAVES = 16;
+
+	mac_addr_t own_mac;
+	mac_addr_t master_mac;
+	uint8_t is_master;
+	uint8_t filter_active;
+
+	/* Time of the update */
+	uint64_t tai_ns;
+	uint64_t monotonic_ns;
+
+	/* Of the current master, in seconds */
+	double master_period;
+
+	/* Raw, filtered and detrended deviation */
+	windowed_statistics deviation;
+	windowed_statistics filtered;
+	windowed_statistics residual;
+
+	double offset;
+	double frequency_ppb;
+
+	double tau0;
+	uint32_t octaves;
+	double adev[MAX_OCTAVES];
+	double tdev[MAX_OCTAVES];
+
+	uint64_t pulses_sent;
+	uint64_t pulses_received;
+	uint64_t pulses_lost;
+	uint64_t pulses_duplicated;
+	uint64_t pulses_reordered;
+	uint64_t utc_offset_mismatches;
+	uint64_t outliers_rejected;
+
+	uint64_t failovers;
+	double last_failover_gap;
+	double max_failover_gap;
+
+	/* NaN while starting */
+	double startup_latency;
+};
+
+struct shared_statistics_segment
+{
+	static constexpr uint32_t MAGIC = 0x534a4353;
+	static constexpr uint32_t VERSION = 2;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int32_t writer_pid;
+
+	/* Odd while the writer updates `data` */
+	std::atomic<uint64_t> sequence;
+
+	shared_statistics data;
+};
+
+static_assert (std::atomic<uint64_t>::is_always_lock_free);
+
+class shared_statistics_writer
+{
+protected:
+	std::string name;
+	shared_statistics_segment *segment = nullptr;
+
+public:
+	/** Create the segment `name` (e.g. /distributed_clock_jitter). A stale
+	 * segment is reused; one whose writer is still running is not. */
+	shared_statistics_writer (const std::string &name);
+
+	/** Unlinks the segment */
+	~shared_statistics_writer();
+
+	shared_statistics_writer (const shared_statistics_writer&) = delete;
+	shared_statistics_writer &operator= (const shared_statistics_writer&) = delete;
+
+	/** Start an update; the returned state is only consistent for readers
+	 * once `end` is called. */
+	shared_statistics &begin();
+	void end();
+};
+
+class shared_statistics_reader
+{
+protected:
+	const shared_statistics_segment *segment = nullptr;
+
+public:
+	/** Map the segment `name`, which must have been created by the same
+	 * version of the writer. */
+	shared_statistics_reader (const std::string &name);
+	~shared_statistics_reader();
+
+	shared_statistics_reader (const shared_statistics_reader&) = delete;
+	shared_statistics_reader &operator= (const shared_statistics_reader&) = delete;
+
+	/** Copy a consistent state; this never blocks the writer.
+	 * @returns false if no consistent copy was obtained after `max_retries`
+	 * 		attempts, or before the first update */
+	bool read (shared_statistics &s, unsigned max_retries = 1000) const;
+
+	pid_t get_writer_pid() const;
+};
+
+#endif /* __SHARED_STATISTICS_H */
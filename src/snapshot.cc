@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "snapshot.h"
+
+using namespace std;
+
+void snapshot_writer::clear()
+{
+	buf.clear();
+}
+
+void snapshot_writer::put (const void *p, size_t size)
+{
+	auto c = static_cast<const unsigned char*>(p);
+	buf.insert (buf.end(), c, c + size);
+}
+
+static void write_buffer (const vector<unsigned char> &buf,
+		const string &path, const string &tmp_path)
+{
+	FILE *f = fopen (tmp_path.c_str(), "wb");
+	if (!f)
+		throw errno_exception ("fopen(" + tmp_path + ")", errno);
+
+	bool failed = fwrite (buf.data(), 1, buf.size(), f) != buf.size() ||
+		fflush (f) != 0 || fsync (fileno (f)) < 0;
+
+	int err = errno;
+	if (fclose (f) != 0 && !failed)
+	{
+		failed = true;
+		err = errno;
+	}
+
+	if (failed)
+	{
+		unlink (tmp_path.c_str());
+		throw errno_exception ("write(" + tmp_path + ")", err);
+	}
+
+	if (rename (tmp_path.c_str(), path.c_str()) < 0)
+		throw errno_exception ("rename(" + tmp_path + ", " + path + ")", errno);
+}
+
+snapshot_writer::~snapshot_writer()
+{
+	stop_worker();
+}
+
+void snapshot_writer::stop_worker()
+{
+	if (!worker.joinable())
+		return;
+
+	{
+		lock_guard<mutex> l(handoff_m);
+		stopping = true;
+	}
+
+	handoff_cv.notify_one();
+	worker.join();
+}
+
+void snapshot_writer::write_file (const string &path, const string &tmp_path)
+{
+	lock_guard<mutex> l(file_m);
+	write_buffer (buf, path, tmp_path);
+}
+
+void snapshot_writer::start_worker (const string &path, const string &tmp_path)
+{
+	worker_path = path;
+	worker_tmp_path = tmp_path;
+	worker = thread ([this]() { run(); });
+}
+
+bool snapshot_writer::write_async()
+{
+	unique_lock<mutex> l(handoff_m, try_to_lock);
+	if (!l.owns_lock() || queued)
+		return false;
+
+	swap (buf, taken);
+	queued = true;
+	size_t capacity = taken.capacity();
+	l.unlock();
+
+	handoff_cv.notify_one();
+
+	/* Only the first snapshot allocates */
+	buf.reserve (capacity);
+	return true;
+}
+
+bool snapshot_writer::take_error (string &msg)
+{
+	lock_guard<mutex> l(handoff_m);
+	if (error.empty())
+		return false;
+
+	msg = error;
+	error.clear();
+	return true;
+}
+
+void snapshot_writer::run()
+{
+	unique_lock<mutex> l(handoff_m);
+
+	for (;;)
+	{
+		handoff_cv.wait (l, [this]() { return stopping || queued; });
+		if (stopping)
+			return;
+
+		l.unlock();
+
+		string err;
+		try
+		{
+			lock_guard<mutex> fl(file_m);
+			write_buffer (taken, worker_path, worker_tmp_path);
+		}
+		catch (exception &e)
+		{
+			err = e.what();
+		}
+
+		taken.clear();
+
+		l.lock();
+		queued = false;
+
+		if (err.size())
+			error = err;
+	}
+}
+
+
+bool snapshot_reader::read_file (const string &path)
+{
+	FILE *f = fopen (path.c_str(), "rb");
+	if (!f)
+	{
+		if (errno == ENOENT)
+			return false;
+
+		throw errno_exception ("fopen(" + path + ")", errno);
+	}
+
+	buf.clear();
+	pos = 0;
+
+	unsigned char chunk[4096];
+	size_t cnt;
+	while ((cnt = fread (chunk, 1, sizeof(chunk), f)) > 0)
+		buf.insert (buf.end(), chunk, chunk + cnt);
+
+	bool failed = ferror (f);
+	fclose (f);
+
+	if (failed)
+		throw errno_exception ("fread(" + path + ")", EIO);
+
+	return true;
+}
+
+bool snapshot_reader::get (void *p, size_t size)
+{
+	if (buf.size() - pos < size)
+		return false;
+
+	memcpy (p, buf.data() + pos, size);
+	pos += size;
+	return true;
+}
+
+bool snapshot_reader::at_end() const
+{
+	return pos == buf.size();
+}
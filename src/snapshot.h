@@ -0,0 +1,121 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+/** Compact binary snapshots of the measurement state, such that restarts do
+ * not wipe out the long window statistics. Values are stored in native byte
+ * order, snapshots are only meant to be read by the host which wrote them. */
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class snapshot_writer
+{
+protected:
+	std::vector<unsigned char> buf;
+
+	/* Background writing: the worker writes `taken` while `queued` is set;
+	 * the lock is only held to swap buffers and to pass errors. */
+	std::string worker_path, worker_tmp_path;
+	std::mutex handoff_m;
+	std::condition_variable handoff_cv;
+	std::vector<unsigned char> taken;
+	bool queued = false;
+	bool stopping = false;
+	std::string error;
+	std::thread worker;
+
+	/* Serializes writes of the worker and of `write_file` */
+	std::mutex file_m;
+
+	void run();
+
+public:
+	snapshot_writer() = default;
+	~snapshot_writer();
+
+	snapshot_writer (const snapshot_writer&) = delete;
+	snapshot_writer &operator= (const snapshot_writer&) = delete;
+
+	/** Start a new snapshot; the buffer is kept. */
+	void clear();
+
+	void put (const void *p, size_t size);
+
+	template <typename T>
+	void put (const T &v)
+	{
+		static_assert (std::is_trivially_copyable_v<T>);
+		put (&v, sizeof(v));
+	}
+
+	template <typename T>
+	void put_vector (const std::vector<T> &v)
+	{
+		put<uint64_t> (v.size());
+		put (v.data(), v.size() * sizeof(T));
+	}
+
+	/** Write the snapshot to a file atomically: it is written to `tmp_path`
+	 * and renamed to `path` once it is complete and synced. */
+	void write_file (const std::string &path, const std::string &tmp_path);
+
+	/** Let `write_async` write snapshots like `write_file` in a worker
+	 * thread */
+	void start_worker (const std::string &path, const std::string &tmp_path);
+
+	/** Wait for the worker's current write and stop it; a snapshot it did
+	 * not start to write yet is dropped. */
+	void stop_worker();
+
+	/** Hand the snapshot to the worker, which leaves an empty one. Neither
+	 * blocks nor allocates once both buffers have grown.
+	 * @returns false if the worker is still writing the previous one */
+	bool write_async();
+
+	/** Take the message of the worker's last failure.
+	 * @returns false if there was none */
+	bool take_error (std::string &msg);
+};
+
+class snapshot_reader
+{
+protected:
+	std::vector<unsigned char> buf;
+	size_t pos = 0;
+
+public:
+	/** Read a snapshot file.
+	 * @returns false if the file does not exist */
+	bool read_file (const std::string &path);
+
+	/** Read values; all of them return false if the snapshot is too short. */
+	bool get (void *p, size_t size);
+
+	template <typename T>
+	bool get (T &v)
+	{
+		static_assert (std::is_trivially_copyable_v<T>);
+		return get (&v, sizeof(v));
+	}
+
+	/** Read a vector, which must have the vector's current size */
+	template <typename T>
+	bool get_vector (std::vector<T> &v)
+	{
+		uint64_t size;
+		if (!get (size) || size != v.size())
+			return false;
+
+		return get (v.data(), size * sizeof(T));
+	}
+
+	bool at_end() const;
+};
+
+#endif /* __SNAPSHOT_H */
@@ -0,0 +1,338 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include "spectral_analysis.h"
+
+using namespace std;
+
+namespace {
+
+/* The butterflies of a group of 2h points, which combine the transforms of
+ * its halves a and b. They run over contiguous points and twiddles without
+ * aliasing, hence the compiler vectorizes them; it does not if they are
+ * inlined into the loop nest by hand. */
+void butterflies (double *__restrict ar, double *__restrict ai,
+		double *__restrict br, double *__restrict bi,
+		const double *__restrict wr, const double *__restrict wi, size_t h)
+{
+	for (size_t j = 0; j < h; j++)
+	{
+		double tr = br[j] * wr[j] - bi[j] * wi[j];
+		double ti = br[j] * wi[j] + bi[j] * wr[j];
+
+		br[j] = ar[j] - tr;
+		bi[j] = ai[j] - ti;
+		ar[j] += tr;
+		ai[j] += ti;
+	}
+}
+
+}
+
+spectral_analyzer::spectral_analyzer (const spectral_config &config)
+	: config(config)
+{
+	if (!is_active())
+		return;
+
+	size_t n = config.window;
+	size_t m = n / 2;
+
+	/* Pending samples are discarded at a window, hence a longer interval
+	 * would never hand any over */
+	if (this->config.interval == 0)
+		this->config.interval = max<size_t> (n / 4, 1);
+	else if (this->config.interval > n)
+		this->config.interval = n;
+
+	/* The buffers are swapped between the receive path and the worker, and
+	 * may hold up to a window each */
+	pending.reserve (n);
+	handoff.reserve (n);
+	taken.reserve (n);
+	ring.resize (n);
+
+	x.resize (n);
+	re.resize (m);
+	im.resize (m);
+	amplitude.resize (m + 1);
+	scratch.resize (m + 1);
+
+	/* Twiddles of the stage with half size h at [h, 2h) */
+	tw_re.resize (m);
+	tw_im.resize (m);
+
+	for (size_t h = 1; h < m; h <<= 1)
+	{
+		for (size_t j = 0; j < h; j++)
+		{
+			tw_re[h + j] = cos (-M_PI * j / h);
+			tw_im[h + j] = sin (-M_PI * j / h);
+		}
+	}
+
+	/* Separation of the spectra of even and odd samples */
+	post_re.resize (m + 1);
+	post_im.resize (m + 1);
+
+	for (size_t k = 0; k <= m; k++)
+	{
+		post_re[k] = cos (-2 * M_PI * k / n);
+		post_im[k] = sin (-2 * M_PI * k / n);
+	}
+
+	unsigned bits = 0;
+	while (((size_t) 1 << bits) < m)
+		bits++;
+
+	bit_reverse.resize (m);
+	for (size_t i = 0; i < m; i++)
+	{
+		uint32_t r = 0;
+		for (unsigned b = 0; b < bits; b++)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+
+		bit_reverse[i] = r;
+	}
+
+	hann.resize (n);
+	for (size_t i = 0; i < n; i++)
+	{
+		hann[i] = 0.5 - 0.5 * cos (2 * M_PI * i / n);
+		hann_sum += hann[i];
+	}
+
+	worker = thread ([this]() { run(); });
+}
+
+spectral_analyzer::~spectral_analyzer()
+{
+	if (!worker.joinable())
+		return;
+
+	{
+		lock_guard<mutex> l(handoff_m);
+		stopping = true;
+	}
+
+	handoff_cv.notify_one();
+	worker.join();
+}
+
+bool spectral_analyzer::is_active() const
+{
+	return config.window >= 4;
+}
+
+const spectral_config &spectral_analyzer::get_config() const
+{
+	return config;
+}
+
+void spectral_analyzer::update (double sample, double tau0)
+{
+	if (!is_active())
+		return;
+
+	/* A new sampling interval invalidates the window; the worker notices it
+	 * from the handed over interval. */
+	if (tau0 != pending_tau0)
+	{
+		pending.clear();
+		pending_tau0 = tau0;
+	}
+
+	/* The worker fell behind by a whole window: drop the samples, and have
+	 * it start over, as its window would have a gap otherwise. */
+	if (pending.size() == pending.capacity())
+	{
+		pending.clear();
+		pending_gap = true;
+	}
+
+	pending.push_back (sample);
+
+	if (pending.size() < config.interval)
+		return;
+
+	/* Hand over if the worker took the previous chunk, otherwise try again
+	 * with the next sample */
+	unique_lock<mutex> l(handoff_m, try_to_lock);
+	if (!l.owns_lock() || !handoff.empty())
+		return;
+
+	swap (pending, handoff);
+	handoff_tau0 = pending_tau0;
+	handoff_gap = pending_gap;
+	pending_gap = false;
+	l.unlock();
+
+	handoff_cv.notify_one();
+}
+
+bool spectral_analyzer::get_result (spectral_result &r)
+{
+	unique_lock<mutex> l(result_m, try_to_lock);
+	if (!l.owns_lock())
+		return false;
+
+	r = result;
+	return true;
+}
+
+void spectral_analyzer::run()
+{
+	unique_lock<mutex> l(handoff_m);
+
+	for (;;)
+	{
+		handoff_cv.wait (l, [this]() { return stopping || !handoff.empty(); });
+		if (stopping)
+			return;
+
+		swap (handoff, taken);
+		double tau0 = handoff_tau0;
+		bool gap = handoff_gap;
+		l.unlock();
+
+		add_samples (taken, tau0, gap);
+		taken.clear();
+
+		if (ring_count == ring.size())
+			analyze();
+
+		l.lock();
+	}
+}
+
+void spectral_analyzer::add_samples (const vector<double> &samples, double tau0, bool gap)
+{
+	if (gap || tau0 != ring_tau0)
+	{
+		ring_pos = 0;
+		ring_count = 0;
+		ring_tau0 = tau0;
+	}
+
+	for (double s : samples)
+	{
+		ring[ring_pos] = s;
+		ring_pos = (ring_pos + 1) % ring.size();
+		ring_count = min (ring_count + 1, ring.size());
+	}
+}
+
+void spectral_analyzer::compute_spectrum()
+{
+	size_t n = x.size();
+	size_t m = n / 2;
+
+	/* Pack the even and odd samples into the real and imaginary parts of
+	 * n / 2 complex points, in bit reversed order */
+	for (size_t i = 0; i < m; i++)
+	{
+		re[bit_reverse[i]] = x[2 * i];
+		im[bit_reverse[i]] = x[2 * i + 1];
+	}
+
+	/* Radix-2 decimation in time */
+	double *pr = re.data(), *pi = im.data();
+
+	for (size_t h = 1; h < m; h <<= 1)
+	{
+		for (size_t k = 0; k < m; k += 2 * h)
+		{
+			butterflies (pr + k, pi + k, pr + k + h, pi + k + h,
+					tw_re.data() + h, tw_im.data() + h, h);
+		}
+	}
+
+	/* X[k] = E[k] + W^k O[k], with E and O the spectra of the even and odd
+	 * samples: E[k] = (Z[k] + Z*[m - k]) / 2, O[k] = (Z[k] - Z*[m - k]) / 2i */
+	double scale = 2 / hann_sum;
+
+	for (size_t k = 0; k <= m; k++)
+	{
+		size_t a = k % m, b = (m - k) % m;
+
+		double er = (pr[a] + pr[b]) / 2, ei = (pi[a] - pi[b]) / 2;
+		double or_ = (pi[a] + pi[b]) / 2, oi = -(pr[a] - pr[b]) / 2;
+
+		double xr = er + post_re[k] * or_ - post_im[k] * oi;
+		double xi = ei + post_re[k] * oi + post_im[k] * or_;
+
+		amplitude[k] = hypot (xr, xi) * scale;
+	}
+}
+
+void spectral_analyzer::analyze()
+{
+	auto start = chrono::steady_clock::now();
+
+	size_t n = ring.size();
+	size_t m = n / 2;
+
+	/* Oldest first, with the linear trend (the clocks' frequency error)
+	 * removed, as it would leak into all lines */
+	double sum_y = 0, sum_iy = 0;
+	for (size_t i = 0; i < n; i++)
+	{
+		x[i] = ring[(ring_pos + i) % n];
+		sum_y += x[i];
+		sum_iy += i * x[i];
+	}
+
+	double mean_i = (n - 1) / 2.;
+	double var_i = ((double) n * n - 1) / 12.;
+	double slope = (sum_iy / n - mean_i * sum_y / n) / var_i;
+	double intercept = sum_y / n - slope * mean_i;
+
+	for (size_t i = 0; i < n; i++)
+		x[i] = (x[i] - intercept - slope * i) * hann[i];
+
+	compute_spectrum();
+
+	/* Noise floor */
+	copy (amplitude.begin() + 1, amplitude.end(), scratch.begin());
+	nth_element (scratch.begin(), scratch.begin() + m / 2, scratch.begin() + m);
+	double noise_floor = scratch[m / 2];
+
+	/* The strongest local maxima above the threshold. The lowest lines are
+	 * skipped, they hold the leakage of the remaining trend. */
+	spectral_result r;
+	r.noise_floor = noise_floor;
+
+	for (size_t k = 3; k < m; k++)
+	{
+		double a = amplitude[k - 1], b = amplitude[k], c = amplitude[k + 1];
+		if (b <= a || b < c || b < config.threshold * noise_floor)
+			continue;
+
+		/* Parabolic interpolation between the lines */
+		double d = a - 2 * b + c;
+		double delta = d != 0 ? 0.5 * (a - c) / d : 0;
+
+		spectral_peak p;
+		p.period = n * ring_tau0 / (k + delta);
+		p.amplitude = b - 0.25 * (a - c) * delta;
+
+		/* Insert sorted by amplitude */
+		unsigned i = min (r.peak_count, spectral_result::MAX_PEAKS - 1);
+		if (r.peak_count == spectral_result::MAX_PEAKS && p.amplitude <= r.peaks[i].amplitude)
+			continue;
+
+		for (; i > 0 && r.peaks[i - 1].amplitude < p.amplitude; i--)
+			r.peaks[i] = r.peaks[i - 1];
+
+		r.peaks[i] = p;
+		r.peak_count = min (r.peak_count + 1, spectral_result::MAX_PEAKS);
+	}
+
+	r.samples = n;
+	r.duration = n * ring_tau0;
+	r.compute_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	lock_guard<mutex> l(result_m);
+	r.analyses = result.analyses + 1;
+	result = r;
+}
@@ -0,0 +1,131 @@
+#ifndef __SPECTRAL_ANALYSIS_H
+#define __SPECTRAL_ANALYSIS_H
+
+/** Spectral analysis of the deviation series, which reveals periodic
+ * disturbances (cron jobs, SMIs, power management ticks) that the windowed
+ * statistics hide. The samples are handed to a worker thread in chunks; it
+ * keeps a power-of-two window of them and computes its amplitude spectrum
+ * with a real FFT at a fixed interval, reporting the dominant periods. */
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct spectral_config
+{
+	/* Number of samples analyzed, a power of two; 0 disables the analysis */
+	unsigned window = 0;
+
+	/* Samples between two analyses, at most the window; 0 for a quarter of
+	 * the window */
+	unsigned interval = 0;
+
+	/* Spectral lines must exceed the median amplitude by this factor to be
+	 * reported */
+	double threshold = 8;
+};
+
+struct spectral_peak
+{
+	/* Period in seconds and amplitude of the sinusoid in seconds */
+	double period;
+	double amplitude;
+};
+
+struct spectral_result
+{
+	static constexpr unsigned MAX_PEAKS = 5;
+
+	/* Number of analyses done, 0 while the first window is being filled */
+	uint64_t analyses = 0;
+
+	/* Samples in the window */
+	uint64_t samples = 0;
+
+	/* Duration of the window in seconds */
+	double duration = 0;
+
+	/* Median amplitude of the spectral lines in seconds */
+	double noise_floor = 0;
+
+	/* Dominant periods, strongest first */
+	unsigned peak_count = 0;
+	spectral_peak peaks[MAX_PEAKS];
+
+	/* Time the worker needed for the last analysis in seconds */
+	double compute_time = 0;
+};
+
+class spectral_analyzer
+{
+protected:
+	spectral_config config;
+
+	/* Receive path: samples not handed over yet, and whether samples were
+	 * dropped before them */
+	std::vector<double> pending;
+	double pending_tau0 = 0;
+	bool pending_gap = false;
+
+	/* Handover to the worker; the lock is only held to swap buffers. */
+	std::mutex handoff_m;
+	std::condition_variable handoff_cv;
+	std::vector<double> handoff;
+	double handoff_tau0 = 0;
+	bool handoff_gap = false;
+	bool stopping = false;
+
+	/* Worker: the window as ring buffer */
+	std::vector<double> taken;
+	std::vector<double> ring;
+	size_t ring_pos = 0;
+	size_t ring_count = 0;
+	double ring_tau0 = 0;
+
+	/* Worker: the FFT of window / 2 complex points, and its tables */
+	std::vector<double> x;
+	std::vector<double> re, im;
+	std::vector<double> tw_re, tw_im;
+	std::vector<double> post_re, post_im;
+	std::vector<uint32_t> bit_reverse;
+	std::vector<double> hann;
+	double hann_sum = 0;
+	std::vector<double> amplitude;
+	std::vector<double> scratch;
+
+	/* The last result */
+	std::mutex result_m;
+	spectral_result result;
+
+	std::thread worker;
+
+	void run();
+	void add_samples (const std::vector<double> &samples, double tau0, bool gap);
+	void analyze();
+
+	/* The spectrum of x in `amplitude` */
+	void compute_spectrum();
+
+public:
+	spectral_analyzer (const spectral_config &config = spectral_config());
+	~spectral_analyzer();
+
+	spectral_analyzer (const spectral_analyzer&) = delete;
+	spectral_analyzer &operator= (const spectral_analyzer&) = delete;
+
+	bool is_active() const;
+	const spectral_config &get_config() const;
+
+	/** Add a sample taken `tau0` seconds after the previous one. Does not
+	 * block or allocate; if the worker falls behind by a whole window, the
+	 * window starts over. */
+	void update (double sample, double tau0);
+
+	/** Copy the last result.
+	 * @returns false if the worker is publishing one right now */
+	bool get_result (spectral_result &r);
+};
+
+#endif /* __SPECTRAL_ANALYSIS_H */
@@ -0,0 +1,321 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "stability_analysis.h"
+
+using namespace std;
+
+/* Samples processed at once by `update_block` */
+static constexpr size_t BLOCK_CHUNK = 65536;
+
+/* Sums of squares of linear combinations of shifted sample sequences. These
+ * are the hot loops of the block interface; they are written with GCC vector
+ * extensions (SSE2 on x86-64) and several independent accumulators to hide the
+ * latency of the additions. */
+typedef double v2d __attribute__((vector_size(16)));
+
+static inline v2d load2 (const double *p)
+{
+	v2d v;
+	memcpy (&v, p, sizeof(v));
+	return v;
+}
+
+static inline double hsum (v2d a, v2d b, v2d c, v2d d)
+{
+	v2d v = (a + b) + (c + d);
+	return v[0] + v[1];
+}
+
+/* sum over i of (a_i - 2 b_i + c_i)^2 */
+static double sum_sq_second_diff (const double *a, const double *b, const double *c, size_t cnt)
+{
+	v2d acc[4] = {};
+	size_t i = 0;
+
+	for (; i + 8 <= cnt; i += 8)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			v2d e = load2(a + i + 2*j) - 2 * load2(b + i + 2*j) + load2(c + i + 2*j);
+			acc[j] += e * e;
+		}
+	}
+
+	double sum = hsum (acc[0], acc[1], acc[2], acc[3]);
+
+	for (; i < cnt; i++)
+	{
+		double d = a[i] - 2 * b[i] + c[i];
+		sum += d * d;
+	}
+
+	return sum;
+}
+
+/* sum over i of (a_i - 3 b_i + 3 c_i - d_i)^2 */
+static double sum_sq_third_diff (const double *a, const double *b,
+		const double *c, const double *d, size_t cnt)
+{
+	v2d acc[4] = {};
+	size_t i = 0;
+
+	for (; i + 8 <= cnt; i += 8)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			v2d e = load2(a + i + 2*j) - 3 * (load2(b + i + 2*j) - load2(c + i + 2*j)) -
+				load2(d + i + 2*j);
+			acc[j] += e * e;
+		}
+	}
+
+	double sum = hsum (acc[0], acc[1], acc[2], acc[3]);
+
+	for (; i < cnt; i++)
+	{
+		double e = a[i] - 3 * (b[i] - c[i]) - d[i];
+		sum += e * e;
+	}
+
+	return sum;
+}
+
+
+stability_analyzer::stability_analyzer (double tau0, unsigned octaves)
+	:
+		tau0(tau0),
+		octaves(octaves),
+		m_max((size_t) 1 << (octaves - 1)),
+		history(3 * m_max),
+		adev_sums(octaves), adev_terms(octaves),
+		tdev_sums(octaves), tdev_terms(octaves)
+{
+	size_t size = 1;
+	while (size < history + 1)
+		size <<= 1;
+
+	mask = size - 1;
+	ring_x.resize (size);
+	ring_s.resize (size);
+
+	/* Room for the history and at least half of it in new samples, such that
+	 * rebuilding the buffer costs O(1) per sample */
+	size_t capacity = history + max (BLOCK_CHUNK, history / 2);
+	work.resize (capacity);
+	prefix.resize (capacity + 1);
+}
+
+void stability_analyzer::reset (double tau0)
+{
+	this->tau0 = tau0;
+	n = 0;
+	x_ref = 0;
+
+	fill (ring_s.begin(), ring_s.end(), 0);
+	fill (adev_sums.begin(), adev_sums.end(), 0);
+	fill (adev_terms.begin(), adev_terms.end(), 0);
+	fill (tdev_sums.begin(), tdev_sums.end(), 0);
+	fill (tdev_terms.begin(), tdev_terms.end(), 0);
+
+	work_valid = false;
+}
+
+void stability_analyzer::update (double x)
+{
+	if (n == 0)
+		x_ref = x;
+
+	double v = x - x_ref;
+	work_valid = false;
+
+	ring_x[n & mask] = v;
+	ring_s[(n + 1) & mask] = ring_s[n & mask] + v;
+	n++;
+
+	for (unsigned k = 0; k < octaves; k++)
+	{
+		uint64_t m = (uint64_t) 1 << k;
+
+		/* Second difference of the samples n-1-2m, n-1-m and n-1 */
+		if (n < 2 * m + 1)
+			break;
+
+		double d = ring_x[(n - 1) & mask] - 2 * ring_x[(n - 1 - m) & mask] +
+			ring_x[(n - 1 - 2 * m) & mask];
+
+		adev_sums[k] += d * d;
+		adev_terms[k]++;
+
+		/* Sum of the last m second differences, from prefix sums */
+		if (n < 3 * m)
+			continue;
+
+		double e = (double) (
+				ring_s[n & mask] - 3 * (ring_s[(n - m) & mask] - ring_s[(n - 2 * m) & mask]) -
+				ring_s[(n - 3 * m) & mask]);
+
+		tdev_sums[k] += e * e;
+		tdev_terms[k]++;
+	}
+}
+
+void stability_analyzer::update_block (const double *x, size_t cnt)
+{
+	while (cnt > 0)
+	{
+		size_t c = min (cnt, BLOCK_CHUNK);
+		update_chunk (x, c);
+
+		x += c;
+		cnt -= c;
+	}
+}
+
+void stability_analyzer::update_chunk (const double *x, size_t cnt)
+{
+	if (n == 0)
+		x_ref = x[0];
+
+	/* Position q in the work buffer is sample number n - h + q. If it is
+	 * stale or cannot take the new samples, it is rebuilt with only the
+	 * history still needed, which is taken from the buffer if possible. */
+	size_t h = min<uint64_t> (n, history);
+
+	if (!work_valid || work_count + cnt > work.size())
+	{
+		if (work_valid)
+		{
+			memmove (work.data(), work.data() + work_count - h, h * sizeof(double));
+		}
+		else
+		{
+			for (size_t q = 0; q < h; q++)
+				work[q] = ring_x[(n - h + q) & mask];
+		}
+
+		/* Prefix sums local to the work buffer; only differences of them
+		 * are used, hence the offset to the global prefix sums does not
+		 * matter. */
+		prefix[0] = 0;
+		for (size_t q = 0; q < h; q++)
+			prefix[q + 1] = prefix[q] + work[q];
+
+		work_count = h;
+		work_valid = true;
+	}
+
+	h = work_count;
+	size_t end = h + cnt;
+
+	for (size_t q = h; q < end; q++)
+	{
+		work[q] = x[q - h] - x_ref;
+		prefix[q + 1] = prefix[q] + work[q];
+	}
+
+	const double *w = work.data();
+	const double *p = prefix.data();
+
+	for (unsigned k = 0; k < octaves; k++)
+	{
+		size_t m = (size_t) 1 << k;
+
+		/* Terms which end at one of the new samples */
+		size_t start = max (h, 2 * m);
+		if (start < end)
+		{
+			adev_sums[k] += sum_sq_second_diff (
+					w + start, w + start - m, w + start - 2 * m, end - start);
+			adev_terms[k] += end - start;
+		}
+
+		start = max (h, 3 * m - 1);
+		if (start < end)
+		{
+			tdev_sums[k] += sum_sq_third_diff (
+					p + start + 1, p + start + 1 - m, p + start + 1 - 2 * m,
+					p + start + 1 - 3 * m, end - start);
+			tdev_terms[k] += end - start;
+		}
+	}
+
+	/* Carry the end of the buffer over to the ring buffers */
+	long double s_base = ring_s[n & mask];
+	size_t first = end > history + 1 ? end - history - 1 : 0;
+	first = max (first, h);
+
+	for (size_t q = first; q < end; q++)
+	{
+		uint64_t g = n - h + q;
+		ring_x[g & mask] = work[q];
+		ring_s[(g + 1) & mask] = s_base + (prefix[q + 1] - prefix[h]);
+	}
+
+	work_count = end;
+	n += cnt;
+}
+
+void stability_analyzer::save (snapshot_writer &w) const
+{
+	w.put (tau0);
+	w.put (octaves);
+	w.put (n);
+	w.put (x_ref);
+	w.put_vector (ring_x);
+	w.put_vector (ring_s);
+	w.put_vector (adev_sums);
+	w.put_vector (adev_terms);
+	w.put_vector (tdev_sums);
+	w.put_vector (tdev_terms);
+}
+
+bool stability_analyzer::load (snapshot_reader &r)
+{
+	double saved_tau0;
+	unsigned saved_octaves;
+
+	if (!r.get (saved_tau0) || !r.get (saved_octaves) || saved_octaves != octaves)
+		return false;
+
+	tau0 = saved_tau0;
+	work_valid = false;
+
+	return r.get (n) && r.get (x_ref) &&
+		r.get_vector (ring_x) && r.get_vector (ring_s) &&
+		r.get_vector (adev_sums) && r.get_vector (adev_terms) &&
+		r.get_vector (tdev_sums) && r.get_vector (tdev_terms);
+}
+
+unsigned stability_analyzer::get_octaves() const
+{
+	return octaves;
+}
+
+uint64_t stability_analyzer::get_count() const
+{
+	return n;
+}
+
+double stability_analyzer::get_tau (unsigned k) const
+{
+	return tau0 * ((uint64_t) 1 << k);
+}
+
+double stability_analyzer::get_adev (unsigned k) const
+{
+	if (k >= octaves || adev_terms[k] == 0)
+		return NAN;
+
+	double m = (uint64_t) 1 << k;
+	return sqrt (adev_sums[k] / (2 * m * m * tau0 * tau0 * adev_terms[k]));
+}
+
+double stability_analyzer::get_tdev (unsigned k) const
+{
+	if (k >= octaves || tdev_terms[k] == 0)
+		return NAN;
+
+	double m = (uint64_t) 1 << k;
+	return sqrt (tdev_sums[k] / (6 * m * m * tdev_terms[k]));
+}
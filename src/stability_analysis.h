@@ -0,0 +1,90 @@
+#ifndef __STABILITY_ANALYSIS_H
+#define __STABILITY_ANALYSIS_H
+
+/** Frequency stability analysis of a time error (deviation) series: the
+ * overlapping Allan deviation and the time deviation (TDEV) for averaging
+ * times tau = 2^k * tau0 */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "snapshot.h"
+
+class stability_analyzer
+{
+protected:
+	double tau0;
+	unsigned octaves;
+
+	/* The largest averaging factor, 2^(octaves - 1). TDEV needs the last
+	 * 3 * m_max samples and the prefix sums up to them. */
+	size_t m_max;
+	size_t history;
+
+	/* Ring buffers of the last samples and of the prefix sums
+	 * S(k) = x_0 + ... + x_{k-1}, indexed by the sample number masked with
+	 * `mask`. Samples are stored relative to the first sample, which does not
+	 * change any of the results but keeps the prefix sums small. */
+	size_t mask;
+	std::vector<double> ring_x;
+	std::vector<long double> ring_s;
+
+	uint64_t n = 0;
+	double x_ref = 0;
+
+	/* Per octave sums of the squared second differences resp. of the squared
+	 * sums of m second differences, and the number of terms in each */
+	std::vector<double> adev_sums;
+	std::vector<uint64_t> adev_terms;
+	std::vector<double> tdev_sums;
+	std::vector<uint64_t> tdev_terms;
+
+	/* Work buffers of the block interface: the samples still needed from the
+	 * history followed by those of the blocks, and their prefix sums. They
+	 * are kept across blocks and only rebuilt from the ring buffers when
+	 * they are full or `update` added samples meanwhile, hence the history
+	 * is not copied for each block. */
+	std::vector<double> work;
+	std::vector<double> prefix;
+	size_t work_count = 0;
+	bool work_valid = false;
+
+	void update_chunk (const double *x, size_t cnt);
+
+public:
+	/** @param tau0 The sampling interval in seconds
+	 * @param octaves Number of averaging times, tau0 up to
+	 * 		2^(octaves - 1) * tau0. Memory usage is O(2^octaves). */
+	stability_analyzer (double tau0 = 1, unsigned octaves = 10);
+
+	/** Drop all samples and continue with the sampling interval `tau0` */
+	void reset (double tau0);
+
+	/** Add a single sample, O(octaves) */
+	void update (double x);
+
+	/** Add a block of consecutive samples, e.g. from a stored log. Equivalent
+	 * to calling `update` for each sample but much faster; both may be mixed
+	 * freely. */
+	void update_block (const double *x, size_t cnt);
+
+	/** Save resp. restore the state. Loading fails if the number of octaves
+	 * differs; the sampling interval is taken from the snapshot. */
+	void save (snapshot_writer &w) const;
+	bool load (snapshot_reader &r);
+
+	unsigned get_octaves() const;
+	uint64_t get_count() const;
+
+	double get_tau (unsigned k) const;
+
+	/** @returns The overlapping Allan deviation at tau = 2^k * tau0 or NaN if
+	 * there are not enough samples yet */
+	double get_adev (unsigned k) const;
+
+	/** @returns The time deviation at tau = 2^k * tau0 in seconds or NaN if
+	 * there are not enough samples yet */
+	double get_tdev (unsigned k) const;
+};
+
+#endif /* __STABILITY_ANALYSIS_H */
@@ -0,0 +1,443 @@
+#include <climits>
+#include <cmath>
+#include "statistics.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+using namespace std;
+
+namespace
+{
+
+/* Deviations d = x - m of integer samples from an integer m: their sum, the
+ * sum and number of the positive ones, and their extremes */
+struct int64_deviation
+{
+	int64_t sum;
+	int64_t sum_positive;
+	int64_t positive;
+	int64_t min;
+	int64_t max;
+};
+
+struct kernel_table
+{
+	double (*sum_double) (const double *x, size_t n);
+	int64_t (*sum_int64) (const int64_t *x, size_t n);
+	abs_deviation (*abs_deviation_double) (const double *x, size_t n, double mean);
+	int64_deviation (*deviation_int64) (const int64_t *x, size_t n, int64_t m);
+};
+
+/* Scalar kernels, which the vector ones use for the last samples */
+double sum_scalar (const double *x, size_t n)
+{
+	double s = 0;
+
+	for (size_t i = 0; i < n; i++)
+		s += x[i];
+
+	return s;
+}
+
+int64_t sum_scalar (const int64_t *x, size_t n)
+{
+	int64_t s = 0;
+
+	for (size_t i = 0; i < n; i++)
+		s += x[i];
+
+	return s;
+}
+
+abs_deviation abs_deviation_scalar (const double *x, size_t n, double mean)
+{
+	abs_deviation r = { 0, 0 };
+
+	for (size_t i = 0; i < n; i++)
+	{
+		auto delta = fabs (x[i] - mean);
+		r.max = r.max > delta ? r.max : delta;
+		r.sum += delta;
+	}
+
+	return r;
+}
+
+int64_deviation deviation_scalar (const int64_t *x, size_t n, int64_t m)
+{
+	int64_deviation r = { 0, 0, 0, INT64_MAX, INT64_MIN };
+
+	for (size_t i = 0; i < n; i++)
+	{
+		int64_t d = x[i] - m;
+
+		r.sum += d;
+		if (d > 0)
+		{
+			r.sum_positive += d;
+			r.positive++;
+		}
+
+		r.min = min (r.min, d);
+		r.max = max (r.max, d);
+	}
+
+	return r;
+}
+
+const kernel_table scalar_kernels = {
+	sum_scalar,
+	sum_scalar,
+	abs_deviation_scalar,
+	deviation_scalar
+};
+
+#ifdef X86_KERNELS
+
+/* Merge the lanes of vector accumulators into the result of the scalar tail */
+template <unsigned LANES>
+abs_deviation merge_lanes (const double *max, const double *sum, abs_deviation r)
+{
+	for (unsigned i = 0; i < LANES; i++)
+	{
+		r.max = r.max > max[i] ? r.max : max[i];
+		r.sum += sum[i];
+	}
+
+	return r;
+}
+
+template <unsigned LANES>
+int64_deviation merge_lanes (const int64_t *sum, const int64_t *sum_positive,
+		const int64_t *positive, const int64_t *min_d, const int64_t *max_d,
+		int64_deviation r)
+{
+	for (unsigned i = 0; i < LANES; i++)
+	{
+		r.sum += sum[i];
+		r.sum_positive += sum_positive[i];
+		r.positive -= positive[i];
+		r.min = min (r.min, min_d[i]);
+		r.max = max (r.max, max_d[i]);
+	}
+
+	return r;
+}
+
+/* SSE4.2: 2 lanes; two accumulators hide the latency of the additions */
+__attribute__((target("sse4.2")))
+double sum_sse (const double *x, size_t n)
+{
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		s0 = _mm_add_pd (s0, _mm_loadu_pd (x + i));
+		s1 = _mm_add_pd (s1, _mm_loadu_pd (x + i + 2));
+	}
+
+	double s[2];
+	_mm_storeu_pd (s, _mm_add_pd (s0, s1));
+
+	return s[0] + s[1] + sum_scalar (x + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+int64_t sum_sse (const int64_t *x, size_t n)
+{
+	__m128i s0 = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+		s0 = _mm_add_epi64 (s0, _mm_loadu_si128 ((const __m128i*) (x + i)));
+
+	int64_t s[2];
+	_mm_storeu_si128 ((__m128i*) s, s0);
+
+	return s[0] + s[1] + sum_scalar (x + i, n - i);
+}
+
+__attribute__((target("sse4.2")))
+abs_deviation abs_deviation_sse (const double *x, size_t n, double mean)
+{
+	const __m128d mu = _mm_set1_pd (mean);
+	const __m128d sign = _mm_set1_pd (-0.);
+	__m128d m0 = _mm_setzero_pd(), m1 = _mm_setzero_pd();
+	__m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		auto d0 = _mm_andnot_pd (sign, _mm_sub_pd (_mm_loadu_pd (x + i), mu));
+		auto d1 = _mm_andnot_pd (sign, _mm_sub_pd (_mm_loadu_pd (x + i + 2), mu));
+
+		m0 = _mm_max_pd (m0, d0);
+		m1 = _mm_max_pd (m1, d1);
+		s0 = _mm_add_pd (s0, d0);
+		s1 = _mm_add_pd (s1, d1);
+	}
+
+	double m[2], s[2];
+	_mm_storeu_pd (m, _mm_max_pd (m0, m1));
+	_mm_storeu_pd (s, _mm_add_pd (s0, s1));
+
+	return merge_lanes<2> (m, s, abs_deviation_scalar (x + i, n - i, mean));
+}
+
+__attribute__((target("sse4.2")))
+int64_deviation deviation_sse (const int64_t *x, size_t n, int64_t m)
+{
+	const __m128i mv = _mm_set1_epi64x (m);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i sum = zero, sum_positive = zero, positive = zero;
+	__m128i min_d = _mm_set1_epi64x (INT64_MAX), max_d = _mm_set1_epi64x (INT64_MIN);
+	size_t i = 0;
+
+	for (; i + 2 <= n; i += 2)
+	{
+		auto d = _mm_sub_epi64 (_mm_loadu_si128 ((const __m128i*) (x + i)), mv);
+		auto gt = _mm_cmpgt_epi64 (d, zero);
+
+		/* The mask is -1 for positive deviations */
+		sum = _mm_add_epi64 (sum, d);
+		sum_positive = _mm_add_epi64 (sum_positive, _mm_and_si128 (d, gt));
+		positive = _mm_add_epi64 (positive, gt);
+
+		min_d = _mm_blendv_epi8 (min_d, d, _mm_cmpgt_epi64 (min_d, d));
+		max_d = _mm_blendv_epi8 (max_d, d, _mm_cmpgt_epi64 (d, max_d));
+	}
+
+	int64_t s[2], sp[2], p[2], lo[2], hi[2];
+	_mm_storeu_si128 ((__m128i*) s, sum);
+	_mm_storeu_si128 ((__m128i*) sp, sum_positive);
+	_mm_storeu_si128 ((__m128i*) p, positive);
+	_mm_storeu_si128 ((__m128i*) lo, min_d);
+	_mm_storeu_si128 ((__m128i*) hi, max_d);
+
+	return merge_lanes<2> (s, sp, p, lo, hi, deviation_scalar (x + i, n - i, m));
+}
+
+/* AVX2: 4 lanes */
+__attribute__((target("avx2")))
+double sum_avx2 (const double *x, size_t n)
+{
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		s0 = _mm256_add_pd (s0, _mm256_loadu_pd (x + i));
+		s1 = _mm256_add_pd (s1, _mm256_loadu_pd (x + i + 4));
+	}
+
+	double s[4];
+	_mm256_storeu_pd (s, _mm256_add_pd (s0, s1));
+
+	return s[0] + s[1] + s[2] + s[3] + sum_scalar (x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+int64_t sum_avx2 (const int64_t *x, size_t n)
+{
+	__m256i s0 = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		s0 = _mm256_add_epi64 (s0, _mm256_loadu_si256 ((const __m256i*) (x + i)));
+
+	int64_t s[4];
+	_mm256_storeu_si256 ((__m256i*) s, s0);
+
+	return s[0] + s[1] + s[2] + s[3] + sum_scalar (x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+abs_deviation abs_deviation_avx2 (const double *x, size_t n, double mean)
+{
+	const __m256d mu = _mm256_set1_pd (mean);
+	const __m256d sign = _mm256_set1_pd (-0.);
+	__m256d m0 = _mm256_setzero_pd(), m1 = _mm256_setzero_pd();
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8)
+	{
+		auto d0 = _mm256_andnot_pd (sign, _mm256_sub_pd (_mm256_loadu_pd (x + i), mu));
+		auto d1 = _mm256_andnot_pd (sign, _mm256_sub_pd (_mm256_loadu_pd (x + i + 4), mu));
+
+		m0 = _mm256_max_pd (m0, d0);
+		m1 = _mm256_max_pd (m1, d1);
+		s0 = _mm256_add_pd (s0, d0);
+		s1 = _mm256_add_pd (s1, d1);
+	}
+
+	double m[4], s[4];
+	_mm256_storeu_pd (m, _mm256_max_pd (m0, m1));
+	_mm256_storeu_pd (s, _mm256_add_pd (s0, s1));
+
+	return merge_lanes<4> (m, s, abs_deviation_scalar (x + i, n - i, mean));
+}
+
+__attribute__((target("avx2")))
+int64_deviation deviation_avx2 (const int64_t *x, size_t n, int64_t m)
+{
+	const __m256i mv = _mm256_set1_epi64x (m);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sum = zero, sum_positive = zero, positive = zero;
+	__m256i min_d = _mm256_set1_epi64x (INT64_MAX), max_d = _mm256_set1_epi64x (INT64_MIN);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		auto d = _mm256_sub_epi64 (_mm256_loadu_si256 ((const __m256i*) (x + i)), mv);
+		auto gt = _mm256_cmpgt_epi64 (d, zero);
+
+		sum = _mm256_add_epi64 (sum, d);
+		sum_positive = _mm256_add_epi64 (sum_positive, _mm256_and_si256 (d, gt));
+		positive = _mm256_add_epi64 (positive, gt);
+
+		min_d = _mm256_blendv_epi8 (min_d, d, _mm256_cmpgt_epi64 (min_d, d));
+		max_d = _mm256_blendv_epi8 (max_d, d, _mm256_cmpgt_epi64 (d, max_d));
+	}
+
+	int64_t s[4], sp[4], p[4], lo[4], hi[4];
+	_mm256_storeu_si256 ((__m256i*) s, sum);
+	_mm256_storeu_si256 ((__m256i*) sp, sum_positive);
+	_mm256_storeu_si256 ((__m256i*) p, positive);
+	_mm256_storeu_si256 ((__m256i*) lo, min_d);
+	_mm256_storeu_si256 ((__m256i*) hi, max_d);
+
+	return merge_lanes<4> (s, sp, p, lo, hi, deviation_scalar (x + i, n - i, m));
+}
+
+const kernel_table sse_kernels = {
+	sum_sse,
+	sum_sse,
+	abs_deviation_sse,
+	deviation_sse
+};
+
+const kernel_table avx2_kernels = {
+	sum_avx2,
+	sum_avx2,
+	abs_deviation_avx2,
+	deviation_avx2
+};
+
+#endif
+
+const kernel_table &kernels_of (simd_level level)
+{
+#ifdef X86_KERNELS
+	switch (level)
+	{
+		case simd_level::avx2:
+			return avx2_kernels;
+
+		case simd_level::sse4_2:
+			return sse_kernels;
+
+		default:
+			break;
+	}
+#endif
+
+	return scalar_kernels;
+}
+
+/* The selected kernels, the best ones until set_simd_level() */
+struct kernel_selection
+{
+	simd_level level;
+	const kernel_table *kernels;
+};
+
+kernel_selection &selected()
+{
+	static kernel_selection s = {
+		get_supported_simd_level(),
+		&kernels_of (get_supported_simd_level())
+	};
+
+	return s;
+}
+
+}
+
+simd_level get_supported_simd_level()
+{
+#ifdef X86_KERNELS
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports ("avx2"))
+		return simd_level::avx2;
+
+	if (__builtin_cpu_supports ("sse4.2"))
+		return simd_level::sse4_2;
+#endif
+
+	return simd_level::scalar;
+}
+
+simd_level get_simd_level()
+{
+	return selected().level;
+}
+
+const char *simd_level_name (simd_level level)
+{
+	switch (level)
+	{
+		case simd_level::avx2:
+			return "avx2";
+
+		case simd_level::sse4_2:
+			return "sse4.2";
+
+		default:
+			return "scalar";
+	}
+}
+
+void set_simd_level (simd_level level)
+{
+	level = min (level, get_supported_simd_level());
+	selected() = { level, &kernels_of (level) };
+}
+
+double window_sum (const double *x, size_t n)
+{
+	return selected().kernels->sum_double (x, n);
+}
+
+int64_t window_sum (const int64_t *x, size_t n)
+{
+	return selected().kernels->sum_int64 (x, n);
+}
+
+abs_deviation window_abs_deviation (const double *x, size_t n, double mean)
+{
+	return selected().kernels->abs_deviation_double (x, n, mean);
+}
+
+abs_deviation window_abs_deviation (const int64_t *x, size_t n, double mean)
+{
+	if (n == 0)
+		return { 0, 0 };
+
+	/* Deviations from m = floor(mean) are exact. With f = mean - m in [0, 1),
+	 * samples above m deviate from the mean by d - f, the others by f - d. */
+	int64_t m = (int64_t) floor (mean);
+	double f = mean - (double) m;
+
+	auto d = selected().kernels->deviation_int64 (x, n, m);
+
+	return {
+		max ((double) d.max - f, f - (double) d.min),
+		(double) (2 * d.sum_positive - d.sum) + f * ((double) n - 2. * (double) d.positive)
+	};
+}
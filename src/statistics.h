@@ -0,0 +1,151 @@
+#ifndef __STATISTICS_H
+#define __STATISTICS_H
+
+/** Moving window statistics over a time series */
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/** Reductions over a window of samples. They use AVX2 or SSE4.2 if the CPU
+ * supports them, which is determined at runtime, and scalar code otherwise. */
+enum class simd_level
+{
+	scalar,
+	sse4_2,
+	avx2
+};
+
+/** @returns The best level the CPU supports */
+simd_level get_supported_simd_level();
+
+simd_level get_simd_level();
+const char *simd_level_name (simd_level level);
+
+/** Use the kernels of `level`, at most the supported one; for benchmarks */
+void set_simd_level (simd_level level);
+
+struct abs_deviation
+{
+	double max;
+	double sum;
+};
+
+double window_sum (const double *x, size_t n);
+int64_t window_sum (const int64_t *x, size_t n);
+
+/** Maximum and sum of the absolute deviations |x[i] - mean|. Those of integer
+ * samples are exact up to the rounding of the result. */
+abs_deviation window_abs_deviation (const double *x, size_t n, double mean);
+abs_deviation window_abs_deviation (const int64_t *x, size_t n, double mean);
+
+/** Statistics over the last N... samples of type T, which is double or int64_t
+ * (e.g. nanoseconds). The windows share one ring buffer of the largest one.
+ * As long as fewer samples were added, the windows are padded with zeros. */
+template <typename T, size_t... N>
+class window_statistics
+{
+	static_assert (std::is_same_v<T, double> || std::is_same_v<T, int64_t>);
+	static_assert (sizeof...(N) > 0 && ((N > 0) && ...));
+
+public:
+	static constexpr size_t WINDOWS = sizeof...(N);
+	static constexpr size_t SIZES[WINDOWS] = { N... };
+	static constexpr size_t CAPACITY = std::max ({ N... });
+
+	struct window
+	{
+		/* Moving window average */
+		double mean = 0;
+
+		/* Maximum resp. average deviation (jitter) from the average */
+		double max_abs_dev = 0;
+		double mean_abs_dev = 0;
+	};
+
+protected:
+	using sum_type = std::conditional_t<std::is_same_v<T, double>, double, int64_t>;
+
+	/* Each sample is stored at i and i + CAPACITY, hence the last n samples
+	 * are contiguous and end at ring + pos + CAPACITY */
+	T ring[2 * CAPACITY] = {};
+	size_t pos = 0;
+
+	/* Running sums of the windows. Those of doubles accumulate rounding
+	 * errors and are recomputed once the ring buffer wrapped around. */
+	sum_type sums[WINDOWS] = {};
+
+	window windows[WINDOWS] = {};
+
+	const T *last (size_t n) const
+	{
+		return ring + pos + CAPACITY - n;
+	}
+
+public:
+	void update (T new_sample)
+	{
+		for (size_t i = 0; i < WINDOWS; i++)
+			sums[i] += (sum_type) new_sample - (sum_type) *last (SIZES[i]);
+
+		ring[pos] = ring[pos + CAPACITY] = new_sample;
+
+		if (++pos == CAPACITY)
+		{
+			pos = 0;
+
+			if constexpr (std::is_same_v<T, double>)
+			{
+				for (size_t i = 0; i < WINDOWS; i++)
+					sums[i] = window_sum (last (SIZES[i]), SIZES[i]);
+			}
+		}
+
+		for (size_t i = 0; i < WINDOWS; i++)
+		{
+			auto &w = windows[i];
+			auto n = SIZES[i];
+
+			w.mean = (double) sums[i] / n;
+
+			auto dev = window_abs_deviation (last (n), n, w.mean);
+			w.max_abs_dev = dev.max;
+			w.mean_abs_dev = dev.sum / n;
+		}
+	}
+
+	/** @returns The newest sample */
+	T current() const
+	{
+		return *last (1);
+	}
+
+	/** @returns The statistics of the i-th window, of SIZES[i] samples */
+	const window &get (size_t i) const
+	{
+		return windows[i];
+	}
+};
+
+/** The last 10 and 100 samples */
+class windowed_statistics : public window_statistics<double, 10, 100>
+{
+public:
+	/* Moving window average over the last 10 resp. 100 samples */
+	double mu_10() const { return windows[0].mean; }
+	double mu_100() const { return windows[1].mean; }
+
+	/* Maximum deviation (jitter, deviation from average deviation ;-)) from the
+	 * corresponding moving window average over the last 10 resp. 100
+	 * samples */
+	double delta_10_max() const { return windows[0].max_abs_dev; }
+	double delta_100_max() const { return windows[1].max_abs_dev; }
+
+	/* Moving window average deviation (jitter) from the corresponding moving
+	 * window average over the last 10 resp. 100 samples */
+	double delta_10_bar() const { return windows[0].mean_abs_dev; }
+	double delta_100_bar() const { return windows[1].mean_abs_dev; }
+};
+
+#endif /* __STATISTICS_H */
@@ -0,0 +1,191 @@
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <getopt.h>
+#include <time.h>
+#include "statistics.h"
+
+using namespace std;
+
+void print_usage (const char *name)
+{
+	printf ("Usage: %s [options]\n\n"
+			"Measure the throughput of the moving window statistics for windows of\n"
+			"10 to 1M samples, of doubles and of int64_t, with each set of kernels\n"
+			"the CPU supports.\n\n"
+			"Options:\n"
+			"  -t, --time <ms>             Duration of each measurement (default: 200)\n"
+			"  -k, --kernels <name>        Only measure scalar, sse4.2 or avx2 kernels\n"
+			"  -h, --help                  Show this help\n",
+			name);
+}
+
+double now()
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Deviations of some 10 us, in seconds resp. nanoseconds */
+uint64_t noise_state = 1;
+
+template <typename T>
+T noise()
+{
+	noise_state = noise_state * 6364136223846793005ULL + 1442695040888963407ULL;
+	int64_t ns = (int64_t) (noise_state >> 40) % 20000 - 10000;
+
+	if constexpr (std::is_same_v<T, double>)
+		return ns * 1e-9;
+	else
+		return ns;
+}
+
+volatile double sink;
+
+/** @returns Updates per second of a window of N samples */
+template <typename T, size_t N>
+double measure (double duration)
+{
+	/* Windows are padded with zeros, which costs the same as samples */
+	auto w = make_unique<window_statistics<T, N>>();
+	uint64_t updates = 0;
+
+	double start = now(), end;
+
+	do
+	{
+		for (unsigned i = 0; i < 16; i++)
+			w->update (noise<T>());
+
+		updates += 16;
+		end = now();
+	}
+	while (end - start < duration);
+
+	sink = w->get(0).mean_abs_dev;
+	return updates / (end - start);
+}
+
+struct benchmark
+{
+	size_t size;
+	double (*run_double) (double duration);
+	double (*run_int64) (double duration);
+};
+
+static const benchmark benchmarks[] = {
+	{ 10, measure<double, 10>, measure<int64_t, 10> },
+	{ 100, measure<double, 100>, measure<int64_t, 100> },
+	{ 1000, measure<double, 1000>, measure<int64_t, 1000> },
+	{ 10000, measure<double, 10000>, measure<int64_t, 10000> },
+	{ 100000, measure<double, 100000>, measure<int64_t, 100000> },
+	{ 1000000, measure<double, 1000000>, measure<int64_t, 1000000> }
+};
+
+int main (int argc, char **argv)
+{
+	try
+	{
+		static const struct option long_options[] = {
+			{ "time", required_argument, nullptr, 't' },
+			{ "kernels", required_argument, nullptr, 'k' },
+			{ "help", no_argument, nullptr, 'h' },
+			{ nullptr, 0, nullptr, 0 }
+		};
+
+		unsigned time_ms = 200;
+		auto supported = get_supported_simd_level();
+		auto lowest = simd_level::scalar, highest = supported;
+
+		int opt;
+		while ((opt = getopt_long (argc, argv, "t:k:h", long_options, nullptr)) != -1)
+		{
+			switch (opt)
+			{
+			case 't':
+			{
+				char *end;
+				errno = 0;
+				unsigned long v = strtoul (optarg, &end, 10);
+
+				if (errno || end == optarg || *end || optarg[0] == '-' ||
+						v == 0 || v > UINT_MAX)
+				{
+					fprintf (stderr, "Invalid duration: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+
+				time_ms = v;
+				break;
+			}
+
+			case 'k':
+			{
+				bool found = false;
+				for (auto l : { simd_level::scalar, simd_level::sse4_2, simd_level::avx2 })
+				{
+					if (strcmp (optarg, simd_level_name (l)) == 0)
+					{
+						lowest = highest = l;
+						found = true;
+					}
+				}
+
+				if (!found || highest > supported)
+				{
+					fprintf (stderr, "Kernels not supported: %s\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			}
+
+			case 'h':
+				print_usage (argv[0]);
+				return EXIT_SUCCESS;
+
+			default:
+				print_usage (argv[0]);
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (optind != argc)
+		{
+			print_usage (argv[0]);
+			return EXIT_FAILURE;
+		}
+
+		printf ("supported kernels: %s\n\n", simd_level_name (supported));
+		printf ("%8s  %-7s %-8s %12s %12s\n", "window", "type", "kernels", "updates/s", "samples/s");
+
+		for (auto &b : benchmarks)
+		{
+			for (unsigned type = 0; type < 2; type++)
+			{
+				for (int l = (int) lowest; l <= (int) highest; l++)
+				{
+					set_simd_level ((simd_level) l);
+
+					double rate = (type == 0 ? b.run_double : b.run_int64) (time_ms / 1000.);
+
+					printf ("%8zu  %-7s %-8s %12.4g %12.4g\n", b.size,
+							type == 0 ? "double" : "int64",
+							simd_level_name ((simd_level) l), rate, rate * b.size);
+				}
+			}
+		}
+
+		return EXIT_SUCCESS;
+	}
+	catch (exception &e)
+	{
+		fprintf (stderr, "%s\n", e.what());
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,110 @@
+#include <cmath>
+#include "summary.h"
+
+using namespace std;
+
+void deviation_summary::add (double v)
+{
+	if (count == 0)
+	{
+		min = max = v;
+	}
+	else
+	{
+		min = v < min ? v : min;
+		max = v > max ? v : max;
+	}
+
+	count++;
+	sum += v;
+	sum_sq += v * v;
+	buckets[bucket_index(v)]++;
+}
+
+void deviation_summary::merge (const deviation_summary &o)
+{
+	if (o.count == 0)
+		return;
+
+	if (count == 0)
+	{
+		min = o.min;
+		max = o.max;
+	}
+	else
+	{
+		min = o.min < min ? o.min : min;
+		max = o.max > max ? o.max : max;
+	}
+
+	count += o.count;
+	sum += o.sum;
+	sum_sq += o.sum_sq;
+
+	for (unsigned i = 0; i < BUCKETS; i++)
+		buckets[i] += o.buckets[i];
+}
+
+void deviation_summary::clear()
+{
+	*this = deviation_summary();
+}
+
+double deviation_summary::mean() const
+{
+	return count ? sum / count : NAN;
+}
+
+double deviation_summary::stddev() const
+{
+	if (count == 0)
+		return NAN;
+
+	double mu = sum / count;
+	double var = sum_sq / count - mu * mu;
+	return var > 0 ? sqrt(var) : 0;
+}
+
+double deviation_summary::quantile (double q) const
+{
+	if (count == 0)
+		return NAN;
+
+	uint64_t rank = q * (count - 1);
+	uint64_t seen = 0;
+
+	for (unsigned i = 0; i < BUCKETS; i++)
+	{
+		seen += buckets[i];
+		if (seen > rank)
+		{
+			/* Clamp to the exact extremes */
+			double v = bucket_value(i);
+			return v < min ? min : (v > max ? max : v);
+		}
+	}
+
+	return max;
+}
+
+unsigned deviation_summary::bucket_index (double v)
+{
+	double ns = fabs(v) * 1e9;
+	int b = 0;
+
+	if (ns >= 1)
+	{
+		b = ilogb(ns) + 1;
+		b = b < 31 ? b : 31;
+	}
+
+	return v >= 0 ? 32 + b : 31 - b;
+}
+
+double deviation_summary::bucket_value (unsigned i)
+{
+	int b = i >= 32 ? i - 32 : 31 - i;
+
+	double ns = b == 0 ? 0.5 : exp2 (b - 0.5);
+	return (i >= 32 ? ns : -ns) * 1e-9;
+}
@@ -0,0 +1,42 @@
+#ifndef __SUMMARY_H
+#define __SUMMARY_H
+
+/** A compact, mergeable summary of a set of deviation samples */
+
+#include <cstdint>
+
+class deviation_summary
+{
+public:
+	/* The histogram has logarithmic buckets for negative and positive values.
+	 * Bucket 32 + b holds positive values v with 2^(b-1) ns <= v < 2^b ns
+	 * (0 <= v < 1ns for b = 0), bucket 31 - b the corresponding negative ones.
+	 * The outermost buckets also hold all larger magnitudes (> ~1s). */
+	static constexpr unsigned BUCKETS = 64;
+
+	uint64_t count = 0;
+	double sum = 0;
+	double sum_sq = 0;
+	double min = 0;
+	double max = 0;
+	uint64_t buckets[BUCKETS] = {};
+
+	void add (double v);
+	void merge (const deviation_summary &o);
+	void clear();
+
+	double mean() const;
+	double stddev() const;
+
+	/** Estimate a quantile from the histogram
+	 * @param q The quantile, 0 to 1 */
+	double quantile (double q) const;
+
+	static unsigned bucket_index (double v);
+
+	/** @returns A representative value of a bucket (the geometric mean of its
+	 * bounds) */
+	static double bucket_value (unsigned i);
+};
+
+#endif /* __SUMMARY_H */
@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <mutex>
 #include "system_services.h"
 
 using namespace std;
@@ -63,6 +64,21 @@ provider::timer_registration provider::create_timer_registration (timer *token)
 	return timer_registration (shared_from_this(), token);
 }
 
+provider::timer_registration provider::register_delayed_timer(
+		timer_handler_t handler, uint32_t period, uint32_t first_delay_us)
+{
+	auto reg = register_timer(handler, period);
+
+	/* Move the last call back such that the timer expires after the delay */
+	uint64_t shift_ns = (uint64_t) period * 1000000 -
+		min<uint64_t> ((uint64_t) first_delay_us * 1000, (uint64_t) period * 1000000);
+
+	reg.token->last_called = reg.token->last_called -
+		linear_time(shift_ns / 1000000000, shift_ns % 1000000000);
+
+	return reg;
+}
+
 
 provider::timer::timer (timer_handler_t handler, uint32_t period)
 	: handler(handler), period(period)
@@ -76,7 +92,16 @@ double provider::timer::get_remaining_time(const linear_time &now)
 
 provider::timer *provider::add_timer(timer_handler_t handler, uint32_t period)
 {
-	timers.push_back(timer (handler, period));
+	if (free_timers.empty())
+	{
+		timers.push_back(timer (handler, period));
+	}
+	else
+	{
+		timers.splice (timers.end(), free_timers, free_timers.begin());
+		timers.back() = timer (handler, period);
+	}
+
 	return &timers.back();
 }
 
@@ -88,7 +113,10 @@ void provider::remove_timer(timer *token)
 			[token](auto &tim) { return &tim == token; });
 
 	if (i != timers.end())
-		timers.erase(i);
+	{
+		i->handler = nullptr;
+		free_timers.splice (free_timers.end(), timers, i);
+	}
 }
 
 
@@ -169,12 +197,21 @@ void provider::unregister_frame_subscriber(frame_subscriber *token)
 			[token](auto &subs) { return &subs == token; });
 
 	if (i != frame_subscribers.end())
-		frame_subscribers.erase(i);
+	{
+		i->handler = nullptr;
+		free_frame_subscribers.splice (free_frame_subscribers.end(), frame_subscribers, i);
+	}
 }
 
 
 provider::provider()
 {
+	/* Reserve nodes such that role changes do not allocate */
+	for (int i = 0; i < 8; i++)
+		free_timers.emplace_back (nullptr, 0);
+
+	for (int i = 0; i < 4; i++)
+		free_frame_subscribers.emplace_back (nullptr);
 }
 
 provider::~provider()
@@ -187,10 +224,35 @@ provider::frame_subscriber_registration provider::add_frame_subscriber(
 {
 	unique_lock lk(frame_subscribers_m);
 
-	frame_subscribers.push_back (frame_subscriber(handler));
+	if (free_frame_subscribers.empty())
+	{
+		frame_subscribers.push_back (frame_subscriber(handler));
+	}
+	else
+	{
+		frame_subscribers.splice (frame_subscribers.end(), free_frame_subscribers,
+				free_frame_subscribers.begin());
+
+		frame_subscribers.back() = frame_subscriber(handler);
+	}
+
 	return create_frame_subscriber_registration(&frame_subscribers.back());
 }
 
+void provider::set_frame_filter(const frame_filter &filter)
+{
+}
+
+bool provider::enable_launch_time()
+{
+	return false;
+}
+
+uint64_t provider::get_dropped_launches()
+{
+	return 0;
+}
+
 }
 
 
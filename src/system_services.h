@@ -4,12 +4,14 @@
 /** An abstraction of operating system specific services */
 
 #include <cstdint>
-#include <functional>
 #include <list>
 #include <memory>
+#include <optional>
 #include <shared_mutex>
 #include <iostream>
+#include <vector>
 #include "protocol.h"
+#include "inline_function.h"
 
 namespace system_services
 {
@@ -81,6 +83,26 @@ struct calendar_time
 	uint32_t nanosecond = 0;
 };
 
+/* Describes the frames subscribers are interested in. Providers may use it to
+ * drop other frames as early as possible, e.g. in the kernel. */
+struct frame_filter
+{
+	struct message_type
+	{
+		uint16_t type;
+
+		/* Minimum payload size */
+		uint16_t min_size;
+
+		/* If set, only frames from this source address or lower ones are
+		 * accepted. */
+		std::optional<uint64_t> max_src;
+	};
+
+	/* Accepted message types; if empty, all frames are accepted. */
+	std::vector<message_type> message_types;
+};
+
 
 class provider : public std::enable_shared_from_this<provider>
 {
@@ -91,8 +113,10 @@ protected:
 
 	/* Providing timers */
 public:
-	using timer_handler_t = std::function<void()>;
-	using frame_subscriber_handler_t = std::function<void(const ethernet_frame&)>;
+	/* Handlers are stored inline, hence registering them does not
+	 * allocate once the pools below are warmed up. */
+	using timer_handler_t = inline_function<void()>;
+	using frame_subscriber_handler_t = inline_function<void(const ethernet_frame&)>;
 
 	class timer_registration
 	{
@@ -136,6 +160,9 @@ protected:
 
 	std::list<timer> timers;
 
+	/* Nodes of removed timers, which are reused by `add_timer` */
+	std::list<timer> free_timers;
+
 	/* Low level add- and removal of timers (for internal use only) */
 	timer *add_timer(timer_handler_t handler, uint32_t period);
 	void remove_timer(timer *token);
@@ -178,6 +205,7 @@ protected:
 
 	std::shared_mutex frame_subscribers_m;
 	std::list<frame_subscriber> frame_subscribers;
+	std::list<frame_subscriber> free_frame_subscribers;
 
 	virtual void unregister_frame_subscriber(frame_subscriber *token);
 
@@ -196,6 +224,12 @@ public:
 	/** Retrieve UTC */
 	virtual calendar_time get_utc() = 0;
 
+	/** Retrieve the time since 1970-01-01 00:00:00 TAI */
+	virtual linear_time get_tai() = 0;
+
+	/** Retrieve the current TAI - UTC offset in seconds, or 0 if unknown */
+	virtual int16_t get_utc_offset() = 0;
+
 	/** Register a timer. If the returned object is destroyed, the timer is
 	 * automatically unregistered. However it can also be unregistered before by
 	 * calling `unregister()` on the timer_registration object.
@@ -205,6 +239,11 @@ public:
 	 *		registration */
 	virtual timer_registration register_timer(timer_handler_t handler, uint32_t period) = 0;
 
+	/** Register a timer which first expires after `first_delay_us` instead of
+	 * a whole period, e.g. to run at a certain phase */
+	timer_registration register_delayed_timer(timer_handler_t handler, uint32_t period,
+			uint32_t first_delay_us);
+
 	/** Retrieve the mac address of of the chosen interface of this computer. */
 	virtual const mac_addr_t& get_own_mac_address () = 0;
 
@@ -212,12 +251,27 @@ public:
 	 * @raises An implementation specific exception in case of failure. */
 	virtual void send_frame(const ethernet_frame &frame) = 0;
 
+	/** Let frames with a `launch_time` leave at that time, as scheduled by the
+	 * kernel or the network card. The default implementation sends all frames
+	 * immediately.
+	 * @returns false if the provider does not support scheduled launch */
+	virtual bool enable_launch_time();
+
+	/** @returns The number of frames which were dropped instead of launched,
+	 * because they missed their launch time */
+	virtual uint64_t get_dropped_launches();
+
 	/** Add a subscriber to receive frames
 	 * @param handler The frame handler function
 	 * @returns A `frame_subscriber` object that refers to this particular
 	 * 		subscription */
 	virtual frame_subscriber_registration add_frame_subscriber(
 			frame_subscriber_handler_t handler);
+
+	/** Tell the provider which frames are of interest. Other frames may still
+	 * be delivered, subscribers must check them anyway. The default
+	 * implementation ignores the filter. */
+	virtual void set_frame_filter(const frame_filter &filter);
 };
 
 }
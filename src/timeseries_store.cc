@@ -0,0 +1,789 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "errno_exception.h"
+#include "timeseries_store.h"
+
+using namespace std;
+
+void timeseries_rollup::merge (const timeseries_rollup &r)
+{
+	if (r.count == 0)
+		return;
+
+	if (count == 0)
+	{
+		*this = r;
+		return;
+	}
+
+	min = std::min (min, r.min);
+	max = std::max (max, r.max);
+	mean = (mean * count + r.mean * r.count) / (count + r.count);
+	count += r.count;
+}
+
+
+namespace {
+
+/* Sign extension of the time deltas' buckets, which hold
+ * [-(2^(n-1) - 1), 2^(n-1)] */
+int64_t decode_bucket (uint64_t v, unsigned n)
+{
+	return v > ((uint64_t) 1 << (n - 1)) ? (int64_t) v - ((int64_t) 1 << n) : (int64_t) v;
+}
+
+/* The delta of delta buckets: prefix, prefix length, value bits */
+struct time_bucket
+{
+	uint64_t prefix;
+	unsigned prefix_bits;
+	unsigned bits;
+};
+
+const time_bucket time_buckets[] = {
+	{ 0b10, 2, 7 },
+	{ 0b110, 3, 9 },
+	{ 0b1110, 4, 12 },
+	{ 0b1111, 4, 32 }
+};
+
+class bit_reader
+{
+protected:
+	const unsigned char *buf;
+	size_t bits;
+	size_t pos = 0;
+
+public:
+	bit_reader (const unsigned char *buf, size_t bits)
+		: buf(buf), bits(bits)
+	{}
+
+	bool get (uint64_t &v, unsigned n)
+	{
+		if (pos + n > bits)
+			return false;
+
+		v = 0;
+		while (n)
+		{
+			unsigned free = 8 - pos % 8;
+			unsigned take = std::min (free, n);
+
+			v = (v << take) | ((buf[pos / 8] >> (free - take)) & ((1u << take) - 1));
+			pos += take;
+			n -= take;
+		}
+
+		return true;
+	}
+};
+
+}
+
+
+timeseries_block::timeseries_block()
+	: buf(SIZE)
+{
+	reset (0, 1, 0);
+}
+
+timeseries_block::header &timeseries_block::get_header()
+{
+	return *reinterpret_cast<header*>(buf.data());
+}
+
+const timeseries_block::header &timeseries_block::get_header() const
+{
+	return *reinterpret_cast<const header*>(buf.data());
+}
+
+unsigned char *timeseries_block::data()
+{
+	return buf.data();
+}
+
+const unsigned char *timeseries_block::data() const
+{
+	return buf.data();
+}
+
+void timeseries_block::reset (uint16_t level, uint16_t values, uint64_t sequence)
+{
+	fill (buf.begin(), buf.end(), 0);
+
+	auto &h = get_header();
+	h.magic = MAGIC;
+	h.level = level;
+	h.values = values;
+	h.sequence = sequence;
+}
+
+bool timeseries_block::put_bits (uint64_t v, unsigned n)
+{
+	auto &h = get_header();
+	if (h.bits + n > PAYLOAD_BITS)
+		return false;
+
+	auto payload = buf.data() + sizeof(header);
+
+	while (n)
+	{
+		unsigned free = 8 - h.bits % 8;
+		unsigned take = min (free, n);
+		unsigned bits = (v >> (n - take)) & ((1u << take) - 1);
+
+		payload[h.bits / 8] |= bits << (free - take);
+		h.bits += take;
+		n -= take;
+	}
+
+	return true;
+}
+
+bool timeseries_block::put_time (int64_t time)
+{
+	int64_t delta = time - st.time;
+	int64_t dod = delta - st.delta;
+
+	st.time = time;
+	st.delta = delta;
+
+	if (dod == 0)
+		return put_bits (0, 1);
+
+	for (auto &b : time_buckets)
+	{
+		int64_t limit = (int64_t) 1 << (b.bits - 1);
+		if (dod > -limit && dod <= limit)
+		{
+			return put_bits (b.prefix, b.prefix_bits) &&
+				put_bits ((uint64_t) dod & ((limit << 1) - 1), b.bits);
+		}
+	}
+
+	/* Gaps of more than 35 minutes start a new block */
+	return false;
+}
+
+bool timeseries_block::put_value (unsigned i, double value)
+{
+	uint64_t v;
+	memcpy (&v, &value, sizeof(v));
+
+	uint64_t x = v ^ st.value[i];
+	st.value[i] = v;
+
+	if (x == 0)
+		return put_bits (0, 1);
+
+	unsigned leading = min (__builtin_clzll (x), 31);
+	unsigned trailing = __builtin_ctzll (x);
+
+	/* Within the previous window of meaningful bits */
+	if (leading >= st.leading[i] && trailing >= st.trailing[i])
+	{
+		return put_bits (0b10, 2) &&
+			put_bits (x >> st.trailing[i], 64 - st.leading[i] - st.trailing[i]);
+	}
+
+	unsigned length = 64 - leading - trailing;
+	st.leading[i] = leading;
+	st.trailing[i] = trailing;
+
+	return put_bits (0b11, 2) && put_bits (leading, 5) &&
+		put_bits (length & 63, 6) && put_bits (x >> trailing, length);
+}
+
+bool timeseries_block::append (int64_t time, const double *values)
+{
+	auto &h = get_header();
+	state saved = st;
+	uint32_t saved_bits = h.bits;
+	bool fits = true;
+
+	if (h.count == 0)
+	{
+		/* The first time is in the header, the first values are XORed with
+		 * 0 and always open a new window */
+		st = state();
+		st.time = time;
+		fill_n (st.leading, MAX_VALUES, 64);
+		fill_n (st.trailing, MAX_VALUES, 64);
+	}
+	else
+	{
+		fits = put_time (time);
+	}
+
+	for (unsigned i = 0; fits && i < h.values; i++)
+		fits = put_value (i, values[i]);
+
+	if (!fits)
+	{
+		/* Clear the partially written record */
+		auto payload = buf.data() + sizeof(header);
+		size_t first = saved_bits / 8;
+
+		if (saved_bits % 8)
+			payload[first++] &= 0xff << (8 - saved_bits % 8);
+
+		memset (payload + first, 0, (h.bits + 7) / 8 > first ? (h.bits + 7) / 8 - first : 0);
+
+		h.bits = saved_bits;
+		st = saved;
+		return false;
+	}
+
+	if (h.count == 0)
+		h.first_time = time;
+
+	h.last_time = time;
+	h.count++;
+	return true;
+}
+
+bool timeseries_block::decode (const unsigned char *data,
+		vector<timeseries_rollup> &records)
+{
+	header h;
+	memcpy (&h, data, sizeof(h));
+
+	if (h.magic != MAGIC || (h.values != 1 && h.values != MAX_VALUES) ||
+			h.bits > PAYLOAD_BITS)
+		return false;
+
+	bit_reader r (data + sizeof(header), h.bits);
+	int64_t time = h.first_time;
+	int64_t delta = 0;
+	uint64_t value[MAX_VALUES] = {};
+	unsigned leading[MAX_VALUES] = {};
+	unsigned trailing[MAX_VALUES] = {};
+
+	for (uint32_t n = 0; n < h.count; n++)
+	{
+		if (n > 0)
+		{
+			uint64_t bit;
+			if (!r.get (bit, 1))
+				return false;
+
+			int64_t dod = 0;
+			if (bit)
+			{
+				/* Count the prefix' further ones */
+				unsigned ones = 1;
+				while (ones < 4 && r.get (bit, 1) && bit)
+					ones++;
+
+				auto &b = time_buckets[ones - 1];
+				uint64_t v;
+				if (!r.get (v, b.bits))
+					return false;
+
+				dod = decode_bucket (v, b.bits);
+			}
+
+			delta += dod;
+			time += delta;
+		}
+
+		double values[MAX_VALUES];
+
+		for (unsigned i = 0; i < h.values; i++)
+		{
+			uint64_t bit, x = 0;
+
+			if (!r.get (bit, 1))
+				return false;
+
+			if (bit)
+			{
+				if (!r.get (bit, 1))
+					return false;
+
+				if (bit)
+				{
+					uint64_t l, length;
+					if (!r.get (l, 5) || !r.get (length, 6))
+						return false;
+
+					if (length == 0)
+						length = 64;
+
+					if (l + length > 64)
+						return false;
+
+					leading[i] = l;
+					trailing[i] = 64 - l - length;
+				}
+				else if (n == 0)
+				{
+					/* There is no window to reuse in the first record */
+					return false;
+				}
+
+				if (!r.get (x, 64 - leading[i] - trailing[i]))
+					return false;
+
+				x <<= trailing[i];
+			}
+
+			value[i] ^= x;
+			memcpy (&values[i], &value[i], sizeof(double));
+		}
+
+		timeseries_rollup rec;
+		rec.time_us = time;
+
+		if (h.values == 1)
+		{
+			rec.min = rec.max = rec.mean = values[0];
+			rec.count = 1;
+		}
+		else
+		{
+			rec.min = values[0];
+			rec.max = values[1];
+			rec.mean = values[2];
+			rec.count = (uint64_t) values[3];
+		}
+
+		records.push_back (rec);
+	}
+
+	return true;
+}
+
+
+namespace {
+
+const char *const level_suffixes[timeseries_store::LEVELS] = {
+	".raw", ".1s", ".1min", ".1h"
+};
+
+const int64_t level_resolutions[timeseries_store::LEVELS] = {
+	0, 1000000, 60000000, 3600000000
+};
+
+int64_t floor_div (int64_t a, int64_t b)
+{
+	return a / b - (a % b < 0);
+}
+
+}
+
+timeseries_store::timeseries_store (const string &path,
+		const timeseries_store_config &config, bool read_only)
+	:
+		levels(LEVELS),
+		read_only(read_only)
+{
+	const uint64_t sizes[LEVELS] = {
+		config.raw_size, config.rollup_1s_size,
+		config.rollup_1min_size, config.rollup_1h_size
+	};
+
+	try
+	{
+		for (unsigned i = 0; i < LEVELS; i++)
+		{
+			levels[i].path = path + level_suffixes[i];
+			levels[i].resolution_us = level_resolutions[i];
+			open_level (levels[i], i, sizes[i]);
+		}
+
+		if (!read_only)
+		{
+			queued.reserve (QUEUE_SIZE);
+			taken.reserve (QUEUE_SIZE);
+			worker = thread ([this]() { run(); });
+		}
+	}
+	catch (...)
+	{
+		for (auto &l : levels)
+		{
+			if (l.fd >= 0)
+				close (l.fd);
+		}
+
+		throw;
+	}
+}
+
+timeseries_store::~timeseries_store()
+{
+	stop_worker();
+
+	for (auto &l : levels)
+		close (l.fd);
+}
+
+void timeseries_store::stop_worker()
+{
+	if (!worker.joinable())
+		return;
+
+	{
+		lock_guard<mutex> lk(handoff_m);
+		stopping = true;
+	}
+
+	handoff_cv.notify_all();
+	worker.join();
+}
+
+void timeseries_store::run()
+{
+	unique_lock<mutex> lk(handoff_m);
+
+	for (;;)
+	{
+		handoff_cv.wait (lk, [this]() { return stopping || !queued.empty(); });
+
+		/* The queued blocks are written before stopping */
+		if (queued.empty())
+			return;
+
+		swap (queued, taken);
+		writing = true;
+		lk.unlock();
+		handoff_cv.notify_all();
+
+		int err = 0;
+		const string *path = nullptr;
+
+		for (auto &w : taken)
+		{
+			auto &l = levels[w.level];
+
+			if (pwrite (l.fd, w.data, timeseries_block::SIZE, w.offset) !=
+					(ssize_t) timeseries_block::SIZE && !err)
+			{
+				err = errno ? errno : EIO;
+				path = &l.path;
+			}
+		}
+
+		taken.clear();
+
+		lk.lock();
+		writing = false;
+
+		if (err && !error_code)
+		{
+			error_code = err;
+			error_what = "pwrite(" + *path + ")";
+		}
+
+		handoff_cv.notify_all();
+	}
+}
+
+void timeseries_store::open_level (level &l, unsigned index, uint64_t size)
+{
+	l.fd = open (l.path.c_str(), read_only ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if (l.fd < 0)
+		throw errno_exception ("open(" + l.path + ")", errno);
+
+	struct stat st;
+	if (fstat (l.fd, &st) < 0)
+		throw errno_exception ("fstat(" + l.path + ")", errno);
+
+	uint64_t file_slots = st.st_size / timeseries_block::SIZE;
+
+	if (read_only)
+	{
+		l.slots = file_slots;
+		return;
+	}
+
+	l.slots = max<uint64_t> (size / timeseries_block::SIZE, 2);
+
+	/* Drop the blocks beyond a smaller size */
+	if (file_slots > l.slots)
+	{
+		if (ftruncate (l.fd, l.slots * timeseries_block::SIZE) < 0)
+			throw errno_exception ("ftruncate(" + l.path + ")", errno);
+
+		file_slots = l.slots;
+	}
+
+	/* Continue the newest block */
+	uint16_t values = index == 0 ? 1 : 4;
+	optional<uint64_t> newest;
+	timeseries_block::header newest_header;
+
+	for (uint64_t slot = 0; slot < file_slots; slot++)
+	{
+		timeseries_block::header h;
+		ssize_t ret = pread (l.fd, &h, sizeof(h), slot * timeseries_block::SIZE);
+		if (ret < 0)
+			throw errno_exception ("pread(" + l.path + ")", errno);
+
+		if (ret != sizeof(h))
+			continue;
+
+		if (h.magic == timeseries_block::MAGIC && h.level == index &&
+				h.values == values && (!newest || h.sequence > newest_header.sequence))
+		{
+			newest = slot;
+			newest_header = h;
+		}
+	}
+
+	l.current.reset (index, values, 0);
+
+	if (!newest)
+		return;
+
+	vector<unsigned char> data(timeseries_block::SIZE);
+	vector<timeseries_rollup> records;
+
+	if (!read_block (l, *newest, data.data()) ||
+			!timeseries_block::decode (data.data(), records))
+	{
+		l.current.reset (index, values, newest_header.sequence + 1);
+		return;
+	}
+
+	l.current.reset (index, values, newest_header.sequence);
+
+	for (auto &r : records)
+	{
+		const double v[] = { r.min, r.max, r.mean, (double) r.count };
+		l.current.append (r.time_us, index == 0 ? &r.mean : v);
+	}
+}
+
+bool timeseries_store::read_block (const level &l, uint64_t slot, unsigned char *data) const
+{
+	ssize_t ret = pread (l.fd, data, timeseries_block::SIZE, slot * timeseries_block::SIZE);
+	if (ret < 0)
+		throw errno_exception ("pread(" + l.path + ")", errno);
+
+	return ret == (ssize_t) timeseries_block::SIZE;
+}
+
+void timeseries_store::write_block (level &l)
+{
+	auto &h = l.current.get_header();
+	unsigned index = &l - levels.data();
+	uint64_t offset = (h.sequence % l.slots) * timeseries_block::SIZE;
+
+	unique_lock<mutex> lk(handoff_m);
+
+	if (error_code)
+		throw errno_exception (error_what, error_code);
+
+	auto w = find_if (queued.begin(), queued.end(), [&](const block_write &w) {
+			return w.level == index && w.offset == offset; });
+
+	if (w == queued.end())
+	{
+		handoff_cv.wait (lk, [this]() { return queued.size() < QUEUE_SIZE; });
+
+		w = queued.emplace (queued.end());
+		w->level = index;
+		w->offset = offset;
+	}
+
+	memcpy (w->data, l.current.data(), timeseries_block::SIZE);
+	lk.unlock();
+	handoff_cv.notify_all();
+
+	l.dirty = false;
+}
+
+void timeseries_store::write_record (unsigned index, const timeseries_rollup &r)
+{
+	auto &l = levels[index];
+	auto &h = l.current.get_header();
+
+	/* After a restart within a bucket, or a step of the clock */
+	if (index > 0 && h.count > 0 && r.time_us <= h.last_time)
+		return;
+
+	const double v[] = { r.min, r.max, r.mean, (double) r.count };
+	const double *values = index == 0 ? &r.mean : v;
+
+	if (!l.current.append (r.time_us, values))
+	{
+		write_block (l);
+		l.current.reset (index, h.values, h.sequence + 1);
+		l.current.append (r.time_us, values);
+	}
+
+	l.dirty = true;
+}
+
+void timeseries_store::add (unsigned index, const timeseries_rollup &r)
+{
+	auto &l = levels[index];
+	int64_t start = floor_div (r.time_us, l.resolution_us) * l.resolution_us;
+
+	if (l.bucket.count && start != l.bucket.time_us)
+		close_bucket (index);
+
+	if (l.bucket.count == 0)
+	{
+		l.bucket = r;
+		l.bucket.time_us = start;
+	}
+	else
+	{
+		l.bucket.merge (r);
+	}
+}
+
+void timeseries_store::close_bucket (unsigned index)
+{
+	auto bucket = levels[index].bucket;
+	levels[index].bucket.count = 0;
+
+	write_record (index, bucket);
+
+	if (index + 1 < LEVELS)
+		add (index + 1, bucket);
+
+	if (index == 1)
+		flush();
+}
+
+void timeseries_store::append (int64_t time_us, double value)
+{
+	timeseries_rollup r;
+	r.time_us = time_us;
+	r.min = r.max = r.mean = value;
+	r.count = 1;
+
+	write_record (0, r);
+	add (1, r);
+}
+
+void timeseries_store::flush()
+{
+	if (read_only)
+		return;
+
+	for (auto &l : levels)
+	{
+		if (l.dirty)
+			write_block (l);
+	}
+}
+
+void timeseries_store::sync()
+{
+	unique_lock<mutex> lk(handoff_m);
+	handoff_cv.wait (lk, [this]() { return queued.empty() && !writing; });
+
+	if (error_code)
+		throw errno_exception (error_what, error_code);
+}
+
+double timeseries_store::get_resolution (unsigned level) const
+{
+	return levels[level].resolution_us * 1e-6;
+}
+
+unsigned timeseries_store::query (int64_t from_us, int64_t to_us, size_t max_points,
+		vector<timeseries_rollup> &records) const
+{
+	struct block_ref
+	{
+		uint64_t slot;
+		uint64_t sequence;
+	};
+
+	/* Choose the level from the blocks' headers. If all levels have too
+	 * many records, take the coarsest one with records in the range. */
+	optional<unsigned> chosen;
+	unsigned fallback = LEVELS - 1;
+	vector<block_ref> blocks, fallback_blocks;
+
+	for (unsigned i = 0; i < LEVELS; i++)
+	{
+		auto &l = levels[i];
+		uint64_t points = 0;
+		optional<int64_t> oldest;
+		optional<uint64_t> first_sequence;
+		vector<block_ref> overlapping;
+
+		for (uint64_t slot = 0; slot < l.slots; slot++)
+		{
+			timeseries_block::header h;
+			ssize_t ret = pread (l.fd, &h, sizeof(h), slot * timeseries_block::SIZE);
+			if (ret < 0)
+				throw errno_exception ("pread(" + l.path + ")", errno);
+
+			if (ret != sizeof(h) || h.magic != timeseries_block::MAGIC ||
+					h.level != i || h.count == 0)
+				continue;
+
+			if (!oldest || h.first_time < *oldest)
+				oldest = h.first_time;
+
+			if (!first_sequence || h.sequence < *first_sequence)
+				first_sequence = h.sequence;
+
+			if (h.first_time < to_us && h.last_time >= from_us)
+			{
+				points += h.count;
+				overlapping.push_back ({ slot, h.sequence });
+			}
+		}
+
+		/* A level holds the range unless older blocks were overwritten */
+		bool complete = !first_sequence || *first_sequence == 0 || *oldest <= from_us;
+
+		if (complete && points && points <= max_points)
+		{
+			chosen = i;
+			blocks = move (overlapping);
+			break;
+		}
+
+		if (complete && points)
+		{
+			fallback = i;
+			fallback_blocks = move (overlapping);
+		}
+	}
+
+	if (!chosen)
+	{
+		chosen = fallback;
+		blocks = move (fallback_blocks);
+	}
+
+	sort (blocks.begin(), blocks.end(),
+			[](const block_ref &a, const block_ref &b) { return a.sequence < b.sequence; });
+
+	vector<unsigned char> data(timeseries_block::SIZE);
+	vector<timeseries_rollup> block_records;
+
+	for (auto &b : blocks)
+	{
+		block_records.clear();
+
+		if (!read_block (levels[*chosen], b.slot, data.data()) ||
+				!timeseries_block::decode (data.data(), block_records))
+			continue;
+
+		for (auto &r : block_records)
+		{
+			if (r.time_us >= from_us && r.time_us < to_us)
+				records.push_back (r);
+		}
+	}
+
+	return *chosen;
+}
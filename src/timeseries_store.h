@@ -0,0 +1,212 @@
+#ifndef __TIMESERIES_STORE_H
+#define __TIMESERIES_STORE_H
+
+/** Long-term storage of the deviation history. Samples are compressed in
+ * fixed-size blocks as in Facebook's Gorilla: timestamps as the delta of
+ * their deltas, values XORed with their predecessor. Rollups over 1 s, 1 min
+ * and 1 h (min, max, mean, count) are stored next to the raw samples, such
+ * that queries over long ranges only read a coarse level. Each level is a
+ * ring of blocks in a file of its own, in which the oldest block is
+ * overwritten once the file is full. Blocks are in native byte order. */
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* A rollup over [time_us, time_us + resolution), or a raw sample with a
+ * count of 1 */
+struct timeseries_rollup
+{
+	int64_t time_us = 0;
+	double min = 0;
+	double max = 0;
+	double mean = 0;
+	uint64_t count = 0;
+
+	void merge (const timeseries_rollup &r);
+};
+
+/* Sizes of the levels' files, which bound their retention. With about
+ * 9 bytes per raw sample and 20 bytes per rollup the defaults keep
+ * 1.9 million raw samples (32 min at 1 kHz), 19 days of 1 s, 19 months of
+ * 1 min and 24 years of 1 h rollups. */
+struct timeseries_store_config
+{
+	uint64_t raw_size = 16 << 20;
+	uint64_t rollup_1s_size = 32 << 20;
+	uint64_t rollup_1min_size = 16 << 20;
+	uint64_t rollup_1h_size = 4 << 20;
+};
+
+/* A block with a header and the compressed records */
+class timeseries_block
+{
+public:
+	static constexpr size_t SIZE = 4096;
+
+	struct header
+	{
+		uint32_t magic;
+		uint16_t level;
+
+		/* Values per record: 1 for raw samples, 4 for rollups (min, max,
+		 * mean and count) */
+		uint16_t values;
+
+		/* Blocks of a level are numbered consecutively */
+		uint64_t sequence;
+
+		int64_t first_time;
+		int64_t last_time;
+		uint32_t count;
+		uint32_t bits;
+	};
+
+	static constexpr uint32_t MAGIC = 0x53544a44;
+
+protected:
+	static constexpr size_t PAYLOAD_BITS = (SIZE - sizeof(header)) * 8;
+	static constexpr unsigned MAX_VALUES = 4;
+
+	/* header followed by the payload */
+	std::vector<unsigned char> buf;
+
+	/* Encoder state, which is restored if a record does not fit */
+	struct state
+	{
+		int64_t time;
+		int64_t delta;
+		uint64_t value[MAX_VALUES];
+		unsigned leading[MAX_VALUES];
+		unsigned trailing[MAX_VALUES];
+	};
+
+	state st;
+
+	bool put_bits (uint64_t v, unsigned n);
+	bool put_time (int64_t time);
+	bool put_value (unsigned i, double value);
+
+public:
+	timeseries_block();
+
+	header &get_header();
+	const header &get_header() const;
+	unsigned char *data();
+	const unsigned char *data() const;
+
+	/** Start an empty block */
+	void reset (uint16_t level, uint16_t values, uint64_t sequence);
+
+	/** Append a record of `get_header().values` values.
+	 * @returns false if it does not fit, the block is unchanged then. */
+	bool append (int64_t time, const double *values);
+
+	/** Decode the records of a block read from a file.
+	 * @returns false if the block is corrupt */
+	static bool decode (const unsigned char *data,
+			std::vector<timeseries_rollup> &records);
+};
+
+class timeseries_store
+{
+protected:
+	struct level
+	{
+		std::string path;
+		int fd = -1;
+		uint64_t slots = 0;
+
+		/* 0 for raw samples */
+		int64_t resolution_us;
+
+		timeseries_block current;
+		bool dirty = false;
+
+		/* The rollup being accumulated */
+		timeseries_rollup bucket;
+	};
+
+	std::vector<level> levels;
+	bool read_only;
+
+	/* Blocks are written by a worker, such that the caller does not wait for
+	 * the disk. Queued writes of the same block replace each other; the
+	 * caller only waits if the worker falls behind by QUEUE_SIZE blocks. The
+	 * lock is only held to swap the queues and to pass errors. */
+	static constexpr size_t QUEUE_SIZE = 16;
+
+	struct block_write
+	{
+		unsigned level;
+		uint64_t offset;
+		unsigned char data[timeseries_block::SIZE];
+	};
+
+	std::mutex handoff_m;
+	std::condition_variable handoff_cv;
+	std::vector<block_write> queued, taken;
+	bool writing = false;
+	bool stopping = false;
+	std::string error_what;
+	int error_code = 0;
+	std::thread worker;
+
+	void run();
+	void stop_worker();
+
+	void open_level (level &l, unsigned index, uint64_t size);
+
+	/* Queue the level's current block for writing.
+	 * @throws The error of an earlier write */
+	void write_block (level &l);
+
+	void write_record (unsigned index, const timeseries_rollup &r);
+	void add (unsigned index, const timeseries_rollup &r);
+	void close_bucket (unsigned index);
+
+	bool read_block (const level &l, uint64_t slot, unsigned char *data) const;
+
+public:
+	static constexpr unsigned LEVELS = 4;
+
+	/** Open or create the store's files `<path>.raw`, `<path>.1s`,
+	 * `<path>.1min` and `<path>.1h`. A read only store can only be
+	 * queried; its files must exist. */
+	timeseries_store (const std::string &path,
+			const timeseries_store_config &config = timeseries_store_config(),
+			bool read_only = false);
+	~timeseries_store();
+
+	timeseries_store (const timeseries_store&) = delete;
+	timeseries_store &operator= (const timeseries_store&) = delete;
+
+	/** Append a sample; timestamps are TAI in microseconds. Does not
+	 * allocate. */
+	void append (int64_t time_us, double value);
+
+	/** Queue the partially filled blocks for writing. This happens whenever
+	 * a second completes, too. */
+	void flush();
+
+	/** Wait until the queued blocks are written.
+	 * @throws The error of a write */
+	void sync();
+
+	/** Resolution of a level in seconds, 0 for raw samples */
+	double get_resolution (unsigned level) const;
+
+	/** Query the records in [from_us, to_us) at the finest level which
+	 * holds the range and has at most `max_points` records in it, or else at
+	 * the coarsest level with records in it. Only the blocks overlapping the
+	 * range are decoded.
+	 * @returns The level */
+	unsigned query (int64_t from_us, int64_t to_us, size_t max_points,
+			std::vector<timeseries_rollup> &records) const;
+};
+
+#endif /* __TIMESERIES_STORE_H */